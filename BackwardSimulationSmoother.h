@@ -0,0 +1,163 @@
+//
+//  BackwardSimulationSmoother.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+#import "GenericParticleFilter.h"
+#import "GenericSystem.h"
+#import "MathMatrix.h"
+#import "ThreadPool.h"
+
+// default number of candidates drawn for a step of a trajectory before
+// the exact backward kernel is evaluated
+#define BACKWARD_SMOOTHER_DEFAULT_REJECTION_LIMIT	10
+
+// number of trajectories in a chunk of the thread pool
+#define BACKWARD_SMOOTHER_CHUNK_SIZE				16
+
+//
+//  Forward filtering backward simulation smoother
+//
+//  ============================================================================
+//
+//  Draws trajectories x_0, ..., x_T-1 from the joint smoothing
+//  distribution, given the generations stored by a filter which has run
+//  estimateStates in the normal (not streaming) mode.  A trajectory
+//  begins with a particle of the last generation drawn by its weight, and
+//  goes back one step at a time: the particle j at t is drawn with
+//  probability proportional to
+//
+//		w_t^j p(x_t+1 | x_t^j)
+//
+//  where x_t+1 is the state of the trajectory at t + 1 (Godsill, Doucet
+//  and West, 2004).  Evaluating the kernel for all the particles costs
+//  O(N) per trajectory and step, i.e., O(N^2) per step for about N
+//  trajectories.  Instead, a candidate j is drawn by its weight alone and
+//  accepted with probability p(x_t+1 | x_t^j) / B, where B is the bound
+//  of the density given by the system (see GenericSystem.h), which costs
+//  O(1) per trajectory on average if the bound is tight (Douc, Garivier,
+//  Moulines and Olsson, 2011).  After rejectionLimit rejections, the exact
+//  kernel is evaluated, so a loose bound costs at most that many density
+//  evaluations more (Taghavi, Lindsten, Svensson and Schon, 2013).
+//
+//  The system must implement the transition densities.  The trajectories
+//  are independent, so they are drawn at once on the threads of a pool
+//  if the system returns YES for isPropagationThreadSafe.  Each trajectory
+//  draws its random numbers from the counter-based stream of randomSlot
+//  at positions given by its index, so the trajectories do not depend on
+//  the number of threads.
+//
+
+@interface BackwardSimulationSmoother : NSObject {
+@private
+	GenericParticleFilter *filter;	// retained
+	unsigned rejectionLimit;
+	unsigned randomSlot;
+	
+	unsigned trajectoryCount;		// M of the last draw
+	unsigned timeCount;				// T of the last draw
+	unsigned count;					// N of the last draw
+	NSMutableArray *trajectories;	// M matrices, dimX x T
+	MathMatrix *smoothedEstimate;	// dimX x T
+	
+	// workspaces of a draw
+	double **generationStates;		// the particles at each time index
+	unsigned stride;				// stride of the particles
+	double *cumulativeWeights;		// N per time index
+	double *densities;				// N + dimX per chunk
+	unsigned *acceptedCounts;		// per chunk
+	unsigned *fallbackCounts;		// per chunk
+	unsigned acceptedCount;			// steps accepted by rejection
+	unsigned fallbackCount;			// steps drawn by the exact kernel
+	
+	ThreadPool *threadPool;			// NULL if the trajectories are drawn
+									// in order
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init;
+
+// designated initializer
+// Returns nil if the filter has no system or the system has no
+// transition density, or if no slot of its generator is free.  The
+// threads are those of the filter (threadCount).
+- (id) initWithFilter: (GenericParticleFilter *)pf;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (GenericParticleFilter *) filter;
+
+// candidates drawn for a step before the exact kernel is evaluated
+// BACKWARD_SMOOTHER_DEFAULT_REJECTION_LIMIT by default.  With 0, the
+// exact kernel is always evaluated.
+- (unsigned) rejectionLimit;
+- (void) setRejectionLimit: (unsigned)n;
+
+// The slot of the generator of the filter which the smoother draws from.
+// A free slot is occupied when the smoother is created, and is freed
+// when it is deallocated.  Setting a slot which is in use fails, leaving
+// the slot as it is.
+- (unsigned) randomSlot;
+- (void) setRandomSlot: (unsigned)n;
+
+
+// *****************************************************************************
+//
+//  SMOOTHING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Smoothing
+
+// Draws M trajectories from the generations of the last run of the
+// filter.  Each call draws new trajectories.
+// Returns NO if the filter is in streaming mode or has not run.
+- (BOOL) drawTrajectories: (unsigned)M;
+
+
+// *****************************************************************************
+//
+//  RESULTS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Results
+
+- (unsigned) trajectoryCount;
+
+// M matrices (dimX x T), laid out as the estimate of the filter
+- (NSArray *) trajectories;
+- (MathMatrix *) trajectoryAtIndex: (unsigned)m;
+
+// the mean of the trajectories (dimX x T)
+- (MathMatrix *) smoothedEstimate;
+
+// The steps of the trajectories accepted by the rejection sampler and
+// those drawn by the exact kernel in the last draw.
+- (unsigned) acceptedCount;
+- (unsigned) fallbackCount;
+
+// Writes the trajectories (record "trajectories", one matrix each) and
+// their mean (record "smoothed_estimate") to a binary archive (see
+// MatrixArchive.h).  The path is used as it is.
+- (BOOL) writeTrajectoriesToBinaryFile: (NSString *)path;
+
+@end
@@ -0,0 +1,426 @@
+//
+//  BackwardSimulationSmoother.m
+//  GenericParticleFilter
+//
+
+#import "BackwardSimulationSmoother.h"
+#import "MatrixArchive.h"
+
+#import <stdlib.h>
+
+// Private methods
+@interface BackwardSimulationSmoother (Private)
+- (BOOL) prepareWorkspacesWithChunkCount: (unsigned)chunks;
+- (void) drawTrajectoriesFrom: (unsigned)begin
+                           to: (unsigned)end
+                        chunk: (unsigned)chunk;
+@end
+
+// The first j with u < cum[j], for a nondecreasing cum of n elements
+static unsigned SearchCumulative (const double *cum, unsigned n, double u) {
+	unsigned lo = 0, hi = n - 1, mid;
+	
+	while ( lo < hi ) {
+		mid = (lo + hi) / 2;
+		if ( u < cum[mid] ) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+// draws the trajectories in [begin, end)
+static void DrawTrajectoryChunk (void *context,
+                                 unsigned begin, unsigned end, unsigned chunk) {
+	[(BackwardSimulationSmoother *)context drawTrajectoriesFrom:begin
+	                                                         to:end
+	                                                      chunk:chunk];
+}
+
+
+@implementation BackwardSimulationSmoother
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	NSLog(@"Use initWithFilter: to create a smoother.");
+	[self release];
+	return nil;
+}
+
+// designated initializer
+- (id) initWithFilter: (GenericParticleFilter *)pf {
+	GenericSystem *system = [pf system];
+	
+	if ( self = [super init] ) {
+		if ( !system || ![system hasTransitionDensity] ) {
+			NSLog(@"A smoother needs a system with a transition density.");
+			[self release];
+			return nil;
+		}
+		
+		randomSlot = [[pf RNGenerator] suggestEmptySlot];
+		if ( !randomSlot || ![[pf RNGenerator] occupySlot:randomSlot] ) {
+			NSLog(@"No slot of the generator of the filter is free.");
+			randomSlot = 0UL;
+			[self release];
+			return nil;
+		}
+		
+		filter = [pf retain];
+		rejectionLimit = BACKWARD_SMOOTHER_DEFAULT_REJECTION_LIMIT;
+		trajectories = [[NSMutableArray alloc] init];
+		
+		// The trajectories share the threads of the filter.
+		if ( [pf threadCount] > 1 && [system isPropagationThreadSafe] ) {
+			
+			ThreadPoolEnterMultiThreadedMode();
+			threadPool = ThreadPoolCreate([pf threadCount]);
+			if ( !threadPool ) {
+				NSLog(@"Creating %u threads failed. The trajectories are drawn in order.",
+				      [pf threadCount]);
+			}
+		}
+	}
+	return self;
+}
+
+- (void) dealloc {
+	ThreadPoolDestroy(threadPool);
+	
+	free(generationStates);
+	free(cumulativeWeights);
+	free(densities);
+	free(acceptedCounts);
+	free(fallbackCounts);
+	
+	[[filter RNGenerator] freeSlot:randomSlot];
+	[trajectories release];
+	[smoothedEstimate release];
+	[filter release];
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (GenericParticleFilter *) filter {
+	return filter;
+}
+
+- (unsigned) rejectionLimit {
+	return rejectionLimit;
+}
+
+- (void) setRejectionLimit: (unsigned)n {
+	rejectionLimit = n;
+}
+
+- (unsigned) randomSlot {
+	return randomSlot;
+}
+
+- (void) setRandomSlot: (unsigned)n {
+	if ( n == randomSlot ) {
+		return;
+	}
+	if ( [[filter RNGenerator] occupySlot:n] ) {
+		[[filter RNGenerator] freeSlot:randomSlot];
+		randomSlot = n;
+	} else {
+		NSLog(@"Slot %u is in use. The slot of the smoother is not changed.", n);
+	}
+}
+
+
+// *****************************************************************************
+//
+//  SMOOTHING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Smoothing
+
+- (BOOL) drawTrajectories: (unsigned)M {
+	GenericSystem *system = [filter system];
+	ParticlePopulation *pop;
+	MathMatrix *traj;
+	double *w, *cum, *mean, *x;
+	double sum;
+	unsigned t, j, k, m, chunks, dimX;
+	
+	if ( [filter isStreaming] ) {
+		NSLog(@"The smoother needs all the generations; turn off streaming.");
+		return NO;
+	}
+	timeCount = [[system timeSpan] count];
+	count = [filter count];
+	dimX = [system dimX];
+	if ( M == 0 || timeCount == 0 || [[filter estimate] width] != timeCount ) {
+		NSLog(@"There is no run of the filter to smooth.");
+		return NO;
+	}
+	
+	chunks = ThreadPoolChunkCount(M, BACKWARD_SMOOTHER_CHUNK_SIZE);
+	if ( ![self prepareWorkspacesWithChunkCount:chunks] ) {
+		return NO;
+	}
+	
+	// The particles of each generation and the cumulative distribution of
+	// their weights, shared by the trajectories.  The particles which
+	// were resampled are equally weighted.
+	for ( t = 0; t < timeCount; t++ ) {
+		pop = [filter populationAtIndex:t];
+		generationStates[t] = [pop states];
+		stride = [pop leadingDimension];
+		
+		w = [pop weights];
+		cum = cumulativeWeights + t*count;
+		sum = 0.0;
+		for ( j = 0; j < count; j++ ) {
+			sum += [pop isResampled] ? 1.0 : w[j];
+			cum[j] = sum;
+		}
+		for ( j = 0; j < count; j++ ) {
+			cum[j] /= sum;
+		}
+	}
+	
+	// the storage of the trajectories, reused if the sizes are the same
+	if ( M != trajectoryCount || [smoothedEstimate width] != timeCount
+	     || [smoothedEstimate height] != dimX ) {
+		[trajectories removeAllObjects];
+		for ( m = 0; m < M; m++ ) {
+			traj = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                        height:dimX];
+			[trajectories addObject:traj];
+			[traj release];
+		}
+		[smoothedEstimate release];
+		smoothedEstimate = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+		                                                    height:dimX];
+		trajectoryCount = M;
+	}
+	
+	// every draw from new numbers
+	[[filter RNGenerator] advanceSlot:randomSlot];
+	
+	// If the system is not thread-safe, the trajectories are drawn in order
+	// on this thread.
+	ThreadPoolParallelFor(threadPool, M, chunks, DrawTrajectoryChunk, self);
+	
+	acceptedCount = 0UL;
+	fallbackCount = 0UL;
+	for ( k = 0; k < chunks; k++ ) {
+		acceptedCount += acceptedCounts[k];
+		fallbackCount += fallbackCounts[k];
+	}
+	
+	// the mean of the trajectories
+	mean = [smoothedEstimate doubleElements];
+	for ( k = 0; k < dimX*timeCount; k++ ) {
+		mean[k] = 0.0;
+	}
+	for ( m = 0; m < M; m++ ) {
+		x = [[trajectories objectAtIndex:m] doubleElements];
+		for ( k = 0; k < dimX*timeCount; k++ ) {
+			mean[k] += x[k];
+		}
+	}
+	for ( k = 0; k < dimX*timeCount; k++ ) {
+		mean[k] /= (double)M;
+	}
+	return YES;
+}
+
+
+// *****************************************************************************
+//
+//  RESULTS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Results
+
+- (unsigned) trajectoryCount {
+	return trajectoryCount;
+}
+
+- (NSArray *) trajectories {
+	return trajectories;
+}
+
+- (MathMatrix *) trajectoryAtIndex: (unsigned)m {
+	return ( m < [trajectories count] ) ? [trajectories objectAtIndex:m] : nil;
+}
+
+- (MathMatrix *) smoothedEstimate {
+	return smoothedEstimate;
+}
+
+- (unsigned) acceptedCount {
+	return acceptedCount;
+}
+
+- (unsigned) fallbackCount {
+	return fallbackCount;
+}
+
+- (BOOL) writeTrajectoriesToBinaryFile: (NSString *)path {
+	if ( trajectoryCount == 0 ) {
+		NSLog(@"There is no trajectory to write.");
+		return NO;
+	}
+	
+	return [MatrixArchive writeRecords:[NSArray arrayWithObjects:
+	                                    trajectories,
+	                                    [NSArray arrayWithObject:smoothedEstimate],
+	                                    nil]
+	                             names:[NSArray arrayWithObjects:
+	                                    @"trajectories", @"smoothed_estimate", nil]
+	                            toFile:path
+	                        compressed:NO];
+}
+
+@end
+
+
+@implementation BackwardSimulationSmoother (Private)
+
+// (Re-)allocates the workspaces of a draw for the current sizes.
+- (BOOL) prepareWorkspacesWithChunkCount: (unsigned)chunks {
+	unsigned dimX = [[filter system] dimX];
+	
+	free(generationStates);
+	free(cumulativeWeights);
+	free(densities);
+	free(acceptedCounts);
+	free(fallbackCounts);
+	
+	generationStates = (double **)malloc(timeCount * sizeof(double *));
+	cumulativeWeights = (double *)malloc(timeCount * count * sizeof(double));
+	densities = (double *)malloc(chunks * (count + dimX) * sizeof(double));
+	acceptedCounts = (unsigned *)calloc(chunks, sizeof(unsigned));
+	fallbackCounts = (unsigned *)calloc(chunks, sizeof(unsigned));
+	
+	if ( !generationStates || !cumulativeWeights || !densities
+	     || !acceptedCounts || !fallbackCounts ) {
+		NSLog(@"Memory for the smoother cannot be allocated.");
+		return NO;
+	}
+	return YES;
+}
+
+// The backward pass of the trajectories in [begin, end).
+// It touches nothing shared but for reading, so the chunks may run at
+// once.
+- (void) drawTrajectoriesFrom: (unsigned)begin
+                           to: (unsigned)end
+                        chunk: (unsigned)chunk {
+
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	GenericSystem *system = [filter system];
+	RandomNumberGenerator *gen = [filter RNGenerator];
+	unsigned dimX = [system dimX];
+	unsigned last = timeCount - 1;
+	double *p = densities + chunk*(count + dimX);
+	double *next = p + count;	// the state of the trajectory at t
+	double *traj, *x, *cum;
+	double bound, d, sum;
+	unsigned m, t, j, k, r;
+	unsigned long long base;
+	BOOL isAccepted;
+	PhiloxStream stream;
+	
+	for ( m = begin; m < end; m++ ) {
+		traj = [[trajectories objectAtIndex:m] doubleElements];
+		
+		// the end of the trajectory, by the weights at the last index
+		[gen getStream:&stream forSlot:randomSlot substream:last];
+		j = SearchCumulative(cumulativeWeights + last*count, count,
+		                     PhiloxUniformAt(&stream, m));
+		for ( k = 0; k < dimX; k++ ) {
+			traj[k*timeCount + last] = generationStates[last][k*stride + j];
+		}
+		
+		for ( t = last; t > 0; t-- ) {
+			for ( k = 0; k < dimX; k++ ) {
+				next[k] = traj[k*timeCount + t];
+			}
+			x = generationStates[t - 1];
+			cum = cumulativeWeights + (t - 1)*count;
+			
+			// The numbers of the step are at 2*rejectionLimit + 1 positions
+			// of the trajectory in the substream of t - 1.
+			[gen getStream:&stream forSlot:randomSlot substream:(t - 1)];
+			base = (unsigned long long)m * (2*rejectionLimit + 1);
+			
+			//  REJECTION SAMPLING:
+			//  ===================
+			//  A candidate drawn by its weight is accepted with the ratio of
+			//  its density to the bound.
+			isAccepted = NO;
+			bound = [system transitionDensityBoundAtTimeIndex:t];
+			for ( r = 0; bound > 0.0 && r < rejectionLimit; r++ ) {
+				j = SearchCumulative(cum, count,
+				                     PhiloxUniformAt(&stream, base + 2*r));
+				[system transitionDensities: &d
+				                atTimeIndex: t
+				                ofNextState: next
+				          withCurrentStates: x + j
+				                      count: 1UL
+				                     stride: stride];
+				if ( PhiloxUniformAt(&stream, base + 2*r + 1)*bound < d ) {
+					isAccepted = YES;
+					break;
+				}
+			}
+			
+			//  EXACT KERNEL:
+			//  =============
+			//  w_j p(x_t | x_t-1^j) of all the particles.  If they all
+			//  vanish, the weights alone are used.
+			if ( isAccepted ) {
+				acceptedCounts[chunk]++;
+			} else {
+				[system transitionDensities: p
+				                atTimeIndex: t
+				                ofNextState: next
+				          withCurrentStates: x
+				                      count: count
+				                     stride: stride];
+				sum = 0.0;
+				for ( j = 0; j < count; j++ ) {
+					sum += (cum[j] - ( j ? cum[j - 1] : 0.0 ))*p[j];
+					p[j] = sum;
+				}
+				d = PhiloxUniformAt(&stream, base + 2*rejectionLimit);
+				j = ( sum > 0.0 ) ? SearchCumulative(p, count, d*sum)
+				                  : SearchCumulative(cum, count, d);
+				fallbackCounts[chunk]++;
+			}
+			
+			for ( k = 0; k < dimX; k++ ) {
+				traj[k*timeCount + t - 1] = x[k*stride + j];
+			}
+		}
+	}
+	
+	[pool release];
+}
+
+@end
@@ -0,0 +1,497 @@
+//
+//  main.mm
+//  GenericParticleFilter Benchmark
+//
+//  A headless driver which runs the state estimator over a sweep of
+//  models, numbers of particles, horizons, resampling schemes and thread
+//  counts, and prints one JSON object per run on the standard output.
+//
+//  Options (as NSUserDefaults arguments, e.g., -particles 100,1000):
+//
+//		-models		comma separated list of SimpleSystem, SimpleSystem2,
+//					RandomWalk and HullWhiteOne
+//		-particles	numbers of particles
+//		-horizons	numbers of time steps
+//		-schemes	residual, systematic, multinomial and/or stratified
+//		-threads	thread counts
+//		-repeats	runs of each configuration
+//		-seed		seed of the random number generators
+//		-streaming	YES (default) to keep only two generations in memory
+//		-auxiliary	YES to run the auxiliary particle filter (NO by default)
+//
+//  Each line holds the configuration, the wall time, the throughput in
+//  particle steps per second, the percentiles of the latency of a step,
+//  the peak resident set size of the process so far, the RMSE of the
+//  estimates against the simulated states and the mean estimation error
+//  (meanOfEstimationError:).
+//
+//  Before the runs of a model, a copy of the system (copyWithZone:) must
+//  give the same log-likelihood as the system itself under the same random
+//  numbers, since the parameter estimators filter with copies; otherwise
+//  the benchmark reports it and exits with a nonzero status.
+//
+
+#import <Foundation/Foundation.h>
+
+#import <limits.h>
+#import <math.h>
+#import <stdio.h>
+#import <stdlib.h>
+#import <time.h>
+#import <sys/resource.h>
+
+#import "GenericParticleFilter.h"
+#import "RandomNumberGenerator.h"
+#import "MathMatrix.h"
+#import "SimpleSystem.h"
+#import "SimpleSystem2.h"
+#import "RandomWalk.h"
+#ifndef GPF_BENCHMARK_WITHOUT_HULL_WHITE
+#import "HullWhiteOne.h"
+#endif
+
+#define BENCHMARK_DEFAULT_MODELS		@"SimpleSystem,SimpleSystem2,RandomWalk,HullWhiteOne"
+#define BENCHMARK_DEFAULT_PARTICLES		@"100,1000,10000"
+#define BENCHMARK_DEFAULT_HORIZONS		@"100,1000"
+#define BENCHMARK_DEFAULT_SCHEMES		@"residual,systematic,multinomial,stratified"
+#define BENCHMARK_DEFAULT_REPEATS		3
+#define BENCHMARK_DEFAULT_SEED			20041110ULL
+
+// particles of the filters which compare a system with its copy
+#define BENCHMARK_COPY_CHECK_PARTICLES	100
+
+// generator ids (the same as those of Controller)
+enum {
+	CONST_RNG_ID_GPF_RESAMPLER = 1UL,
+	CONST_RNG_ID_GPF_BERNOULLI = 2UL,
+	CONST_RNG_ID_SYSTEM_X = 3UL,
+	CONST_RNG_ID_SYSTEM_Y = 4UL
+};
+
+
+// *****************************************************************************
+//
+//  STEP TIMER
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Step Timer
+
+static double Now (void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1.0e-9 * (double)ts.tv_nsec;
+}
+
+// The delegate of the filter, which records when each step finishes.
+@interface StepTimer : NSObject {
+@private
+	double *stamps;
+	unsigned capacity;
+	unsigned stampCount;
+}
+
+- (id) initWithCapacity: (unsigned)n;
+- (void) reset;
+- (unsigned) stampCount;
+- (double *) stamps;
+
+- (void) particleFilter: (GenericParticleFilter *)pf
+   didFinishStepAtIndex: (unsigned)index;
+
+@end
+
+@implementation StepTimer
+
+- (id) initWithCapacity: (unsigned)n {
+	if ( self = [super init] ) {
+		capacity = n;
+		stamps = (double *)malloc(capacity * sizeof(double));
+	}
+	return self;
+}
+
+- (void) dealloc {
+	free(stamps);
+	[super dealloc];
+}
+
+- (void) reset {
+	stampCount = 0;
+}
+
+- (unsigned) stampCount {
+	return stampCount;
+}
+
+- (double *) stamps {
+	return stamps;
+}
+
+- (void) particleFilter: (GenericParticleFilter *)pf
+   didFinishStepAtIndex: (unsigned)index {
+
+	if ( stampCount < capacity ) {
+		stamps[stampCount++] = Now();
+	}
+}
+
+@end
+
+
+// *****************************************************************************
+//
+//  HELPERS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Helpers
+
+// peak resident set size of the process in KiB
+static long PeakRSS (void) {
+	struct rusage usage;
+	
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (long)(usage.ru_maxrss / 1024);	// bytes on Mac OS X
+#else
+	return (long)usage.ru_maxrss;			// KiB on Linux
+#endif
+}
+
+static int CompareDoubles (const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	
+	return ( x < y ) ? -1 : ( ( x > y ) ? 1 : 0 );
+}
+
+// p'th percentile (0 <= p <= 100) of n sorted values, interpolated
+static double Percentile (const double *sorted, unsigned n, double p) {
+	double r;
+	unsigned k;
+	
+	if ( n == 0 ) {
+		return 0.0;
+	}
+	r = p / 100.0 * (double)(n - 1);
+	k = (unsigned)floor(r);
+	if ( k + 1 >= n ) {
+		return sorted[n - 1];
+	}
+	return sorted[k] + (r - (double)k) * (sorted[k + 1] - sorted[k]);
+}
+
+// comma separated list of an option (or of the default)
+static NSArray *ListForKey (NSString *key, NSString *defaultValue) {
+	NSString *value = [[NSUserDefaults standardUserDefaults] stringForKey:key];
+	
+	return [( value ? value : defaultValue ) componentsSeparatedByString:@","];
+}
+
+// UINT_MAX for an unknown name
+static unsigned SchemeFromName (NSString *name) {
+	if ( [name isEqualToString:@"residual"] ) {
+		return PF_CONST_RESAMPLE_RESIDUAL;
+	} else if ( [name isEqualToString:@"systematic"] ) {
+		return PF_CONST_RESAMPLE_SYSTEMATIC;
+	} else if ( [name isEqualToString:@"multinomial"] ) {
+		return PF_CONST_RESAMPLE_MULTINOMIAL;
+	} else if ( [name isEqualToString:@"stratified"] ) {
+		return PF_CONST_RESAMPLE_STRATIFIED;
+	}
+	return UINT_MAX;
+}
+
+// A new (retained) system of the given model, or nil.
+static GenericSystem *NewSystem (NSString *model) {
+	if ( [model isEqualToString:@"SimpleSystem"] ) {
+		return [[SimpleSystem alloc] init];
+	} else if ( [model isEqualToString:@"SimpleSystem2"] ) {
+		return [[SimpleSystem2 alloc] init];
+	} else if ( [model isEqualToString:@"RandomWalk"] ) {
+		return [[RandomWalk alloc] init];
+#ifndef GPF_BENCHMARK_WITHOUT_HULL_WHITE
+	} else if ( [model isEqualToString:@"HullWhiteOne"] ) {
+		return [[HullWhiteOne alloc] init];
+#endif
+	}
+	return nil;
+}
+
+// Gives the system a time span of the given number of steps with the
+// step size of its default time span (1.0 if it has none).
+static void SetHorizon (GenericSystem *sys, unsigned horizon) {
+	MathMatrix *span = [[MathMatrix alloc] initDoubleWithWidth:horizon
+	                                                    height:1UL];
+	double *t = [span doubleElements];
+	double t0 = 0.0, dt = 1.0;
+	unsigned i;
+	
+	if ( [[sys timeSpan] count] >= 2 ) {
+		t0 = [[sys timeSpan] doubleElements][0];
+		dt = [[sys timeSpan] doubleElements][1] - t0;
+	}
+	for ( i = 0; i < horizon; i++ ) {
+		t[i] = t0 + dt * (double)i;
+	}
+	
+	[sys setTimeSpan:span];
+	[span release];
+}
+
+// root mean square of estimate - X over all the components and times
+static double EstimationRMSE (MathMatrix *estimate, MathMatrix *X) {
+	unsigned i, j, T = [estimate width];
+	double sum = 0.0, e;
+	
+	for ( i = 1; i <= [estimate height]; i++ ) {
+		double *est = [estimate doubleRow:i];
+		double *x = [X doubleRow:i];
+		
+		for ( j = 0; j < T; j++ ) {
+			e = est[j] - x[j];
+			sum += e*e;
+		}
+	}
+	return sqrt(sum / (double)(T * [estimate height]));
+}
+
+
+// log p(y_1:T) estimated by a filter on the system, which draws from a
+// new generator of the given seed (the system gets back its own after).
+static double LogLikelihood (GenericSystem *sys, unsigned long long seed) {
+	RandomNumberGenerator *old = [[sys RNGenerator] retain];
+	RandomNumberGenerator *rng =
+	[[RandomNumberGenerator alloc] initWithStreamSeed:seed];
+	GenericParticleFilter *pf;
+	double logLikelihood;
+	
+	[sys setRNGenerator:rng];
+	pf = [[GenericParticleFilter alloc] initWithCapacity:BENCHMARK_COPY_CHECK_PARTICLES
+	                                           forSystem:sys
+	                                 withSelectionScheme:PF_CONST_RESAMPLE_SYSTEMATIC
+	                                           streaming:YES];
+	[pf setRNGenerator:rng];
+	[pf estimateStates];
+	logLikelihood = [pf logMarginalLikelihood];
+	
+	[pf release];
+	[sys setRNGenerator:old];
+	[old release];
+	[rng release];
+	return logLikelihood;
+}
+
+// Whether a copy of the system scores the measurements as the system does.
+static BOOL CheckCopy (GenericSystem *sys, NSString *model,
+                       unsigned long long seed) {
+	GenericSystem *copy = [sys copy];
+	double original = LogLikelihood(sys, seed);
+	double copied = LogLikelihood(copy, seed);
+	
+	[copy release];
+	if ( !(copied == original) ) {
+		fprintf(stderr, "A copy of %s gives the log-likelihood %.17g "
+		        "instead of %.17g.\n", [model UTF8String], copied, original);
+		return NO;
+	}
+	return YES;
+}
+
+
+// Runs the state estimator once and prints the results as a JSON object.
+// Returns NO if the configuration is invalid.
+static BOOL RunFilter (GenericSystem *sys, RandomNumberGenerator *rng,
+                       StepTimer *timer, MathMatrix *error, NSString *model,
+                       unsigned n, NSString *schemeName, unsigned threads,
+                       unsigned repeat, BOOL isStreaming, BOOL isAuxiliary) {
+	
+	NSAutoreleasePool *pool;
+	GenericParticleFilter *pf;
+	unsigned scheme = SchemeFromName(schemeName);
+	unsigned i, steps;
+	double begin, end, filtering, *latencies;
+	
+	if ( n == 0 || scheme == UINT_MAX || threads == 0 ) {
+		fprintf(stderr, "Skipping %u particles, scheme %s, %u threads.\n",
+		        n, [schemeName UTF8String], threads);
+		return NO;
+	}
+	
+	pool = [[NSAutoreleasePool alloc] init];
+	pf = [[GenericParticleFilter alloc] initWithCapacity:n
+	                                           forSystem:sys
+	                                 withSelectionScheme:scheme
+	                                           streaming:isStreaming];
+	[pf setRNGenerator:rng];
+	[pf setRNGIDForResampler:CONST_RNG_ID_GPF_RESAMPLER];
+	[pf setRNGIDForBernoulli:CONST_RNG_ID_GPF_BERNOULLI];
+	
+	// The runs share the generator, so the slots must have been freed by
+	// the filter of the last run.
+	if ( [pf RNGIDForResampler] != CONST_RNG_ID_GPF_RESAMPLER
+	     || [pf RNGIDForBernoulli] != CONST_RNG_ID_GPF_BERNOULLI ) {
+		fprintf(stderr, "Skipping %u particles, scheme %s, %u threads: "
+		        "the slots of the filter are in use.\n",
+		        n, [schemeName UTF8String], threads);
+		[pf release];
+		[pool release];
+		return NO;
+	}
+	[pf setThreadCount:threads];
+	[pf enableAuxiliaryFilter:isAuxiliary];
+	[pf setDelegate:timer];
+	
+	[timer reset];
+	begin = Now();
+	[pf estimateStates];
+	end = Now();
+	
+	// latency of the steps after the initial one
+	steps = [timer stampCount] - 1;
+	latencies = (double *)malloc((steps ? steps : 1) * sizeof(double));
+	for ( i = 0; i < steps; i++ ) {
+		latencies[i] = [timer stamps][i + 1] - [timer stamps][i];
+	}
+	qsort(latencies, steps, sizeof(double), CompareDoubles);
+	filtering = [timer stamps][steps] - [timer stamps][0];
+	
+	[pf meanOfEstimationError:error];
+	
+	printf("{\"model\":\"%s\",\"particles\":%u,\"horizon\":%u,"
+	       "\"scheme\":\"%s\",\"threads\":%u,\"repeat\":%u,"
+	       "\"streaming\":%s,\"auxiliary\":%s,\"seconds\":%.6f,"
+	       "\"particle_steps_per_sec\":%.1f,"
+	       "\"latency_us\":{\"p50\":%.2f,\"p90\":%.2f,"
+	       "\"p99\":%.2f,\"max\":%.2f},"
+	       "\"peak_rss_kib\":%ld,\"resamples\":%u,"
+	       "\"rmse\":%.6g,\"mean_error\":[",
+	       [model UTF8String], n, [[sys timeSpan] count],
+	       [schemeName UTF8String], threads, repeat,
+	       isStreaming ? "true" : "false", isAuxiliary ? "true" : "false",
+	       end - begin,
+	       filtering > 0.0 ? (double)n * steps / filtering : 0.0,
+	       1.0e6 * Percentile(latencies, steps, 50.0),
+	       1.0e6 * Percentile(latencies, steps, 90.0),
+	       1.0e6 * Percentile(latencies, steps, 99.0),
+	       1.0e6 * Percentile(latencies, steps, 100.0),
+	       PeakRSS(), [pf resampleCount],
+	       EstimationRMSE([pf estimate], [sys X]));
+	for ( i = 1; i <= [sys dimX]; i++ ) {
+		printf("%s%.6g", i > 1 ? "," : "",
+		       [error doubleValueAtRow:i column:1UL]);
+	}
+	printf("]}\n");
+	fflush(stdout);
+	
+	free(latencies);
+	[pf release];
+	[pool release];
+	return YES;
+}
+
+
+// *****************************************************************************
+//
+//  MAIN
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Main
+
+int main (int argc, const char * argv[]) {
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+	NSString *threadDefault =
+	[NSString stringWithFormat:@"1,%u",
+	 (unsigned)[[NSProcessInfo processInfo] activeProcessorCount]];
+	
+	NSArray *models = ListForKey(@"models", BENCHMARK_DEFAULT_MODELS);
+	NSArray *particleCounts = ListForKey(@"particles", BENCHMARK_DEFAULT_PARTICLES);
+	NSArray *horizons = ListForKey(@"horizons", BENCHMARK_DEFAULT_HORIZONS);
+	NSArray *schemes = ListForKey(@"schemes", BENCHMARK_DEFAULT_SCHEMES);
+	NSArray *threadCounts = ListForKey(@"threads", threadDefault);
+	unsigned repeats = [defaults objectForKey:@"repeats"]
+	? (unsigned)[defaults integerForKey:@"repeats"] : BENCHMARK_DEFAULT_REPEATS;
+	unsigned long long seed = [defaults objectForKey:@"seed"]
+	? (unsigned long long)[[defaults stringForKey:@"seed"] longLongValue]
+	: BENCHMARK_DEFAULT_SEED;
+	BOOL isStreaming = [defaults objectForKey:@"streaming"]
+	? [defaults boolForKey:@"streaming"] : YES;
+	BOOL isAuxiliary = [defaults boolForKey:@"auxiliary"];
+	
+	unsigned m, h, p, s, k, r, i;
+	int status = 0;
+	
+	for ( m = 0; m < [models count]; m++ ) {
+		NSString *model = [models objectAtIndex:m];
+		
+		for ( h = 0; h < [horizons count]; h++ ) {
+			NSAutoreleasePool *runPool = [[NSAutoreleasePool alloc] init];
+			unsigned horizon = (unsigned)[[horizons objectAtIndex:h] intValue];
+			RandomNumberGenerator *rng;
+			GenericSystem *sys = NewSystem(model);
+			MathMatrix *xinit, *error;
+			StepTimer *timer;
+			
+			if ( !sys || horizon < 2 ) {
+				fprintf(stderr, "Skipping model %s with horizon %u.\n",
+				        [model UTF8String], horizon);
+				[runPool release];
+				status = 1;
+				continue;
+			}
+			
+			// The same truth for every configuration of a model and a horizon
+			rng = [[RandomNumberGenerator alloc] initWithSeed:seed + h];
+			[sys setRNGenerator:rng];
+			[sys setXNoiseGenID:CONST_RNG_ID_SYSTEM_X];
+			[sys setYNoiseGenID:CONST_RNG_ID_SYSTEM_Y];
+			SetHorizon(sys, horizon);
+			
+			xinit = [[MathMatrix alloc] initDoubleWithWidth:1UL
+			                                         height:[sys dimX]];
+			for ( i = 0; i < [sys dimX]; i++ ) {
+				[xinit doubleElements][i] = 0.0;
+			}
+			[sys simulateWithInitialState:xinit control:nil];
+			if ( !CheckCopy(sys, model, seed + h) ) {
+				status = 1;
+			}
+			
+			error = [[MathMatrix alloc] initDoubleWithWidth:1UL
+			                                         height:[sys dimX]];
+			timer = [[StepTimer alloc] initWithCapacity:horizon];
+			
+			for ( p = 0; p < [particleCounts count]; p++ ) {
+				unsigned n = (unsigned)[[particleCounts objectAtIndex:p] intValue];
+				
+				for ( s = 0; s < [schemes count]; s++ ) {
+					for ( k = 0; k < [threadCounts count]; k++ ) {
+						unsigned threads =
+						(unsigned)[[threadCounts objectAtIndex:k] intValue];
+						
+						for ( r = 0; r < repeats; r++ ) {
+							if ( !RunFilter(sys, rng, timer, error, model, n,
+							                [schemes objectAtIndex:s], threads,
+							                r, isStreaming, isAuxiliary) ) {
+								status = 1;
+							}
+						}
+					}
+				}
+			}
+			
+			[timer release];
+			[error release];
+			[xinit release];
+			[sys release];
+			[rng release];
+			[runPool release];
+		}
+	}
+	
+	[pool release];
+	return status;
+}
@@ -48,7 +48,8 @@ enum {
 	CONST_RNG_ID_SIMPLE_TEST_2_X = 10UL,
 	CONST_RNG_ID_SIMPLE_TEST_2_Y = 11UL,
   CONST_RNG_ID_RANDOM_WALK_X = 12UL,
-  CONST_RNG_ID_RANDOM_WALK_Y = 13UL
+  CONST_RNG_ID_RANDOM_WALK_Y = 13UL,
+	CONST_RNG_ID_GPF_PARAMETERS = 14UL
 };
 
 // Constants: NSTextField IDs
@@ -24,6 +24,7 @@
                  withStepSize: (double) step;
 
 // Parameter estimation methods.
+- (void) estimateParametersUsingEstimationViaFiltering;
 - (void) estimateParametersUsingMeasurementComparison;
 - (void) estimateParametersUsingAuxParticleFilter;
 - (void) estimateParametersUsingSPSA;
@@ -92,6 +93,8 @@
         [pf setRNGenerator: RNGenerator];
         [pf setRNGIDForResampler: CONST_RNG_ID_GPF_RESAMPLER];
         [pf setRNGIDForBernoulli: CONST_RNG_ID_GPF_BERNOULLI];
+        [pf setRNGIDForParameters: CONST_RNG_ID_GPF_PARAMETERS];
+        [pf setThreadCount: [[NSProcessInfo processInfo] activeProcessorCount]];
         
         return self;
     } else {
@@ -305,7 +308,7 @@
         NSLog( @"Particle filtering for parameter estimation begins." );
         switch ( [parameterEstimationMethodPopUpButton indexOfSelectedItem] ) {
         case CONST_PARAM_EST_METHOD_VIA_FILTERING:
-            // [self estimateParametersUsingEstimationViaFiltering];
+            [self estimateParametersUsingEstimationViaFiltering];
             break;
             
         case CONST_PARAM_EST_METHOD_AUX_PARTICLE_FILTER:
@@ -662,6 +665,11 @@
 }
 
 // Parameter estimation methods.
+// 0. Online learning along with the states.
+- (void) estimateParametersUsingEstimationViaFiltering {
+    [pf estimateParametersViaFiltering];
+}
+
 // 1. Estimation by measurement comparison.
 - (void) estimateParametersUsingMeasurementComparison {
     
@@ -669,7 +677,7 @@
 
 // 2. Auxiliary particle filter.
 - (void) estimateParametersUsingAuxParticleFilter {
-    
+    [pf estimateParametersUsingAuxParticleFilter];
 }
 
 // 3. SPSA
@@ -0,0 +1,137 @@
+//
+//  GenerationWriter.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+#import "MathMatrix.h"
+#import "MatrixArchive.h"
+
+// default number of generations which may wait to be written
+#define GENERATION_WRITER_DEFAULT_QUEUE_LENGTH	8
+
+//
+//  A writer which streams generations of particles to an archive on a
+//  background thread
+//
+//  ============================================================================
+//
+//  writeParticles:weights:atIndex:time: copies a generation into a free
+//  slot of a bounded queue and returns at once.  A thread of the writer
+//  appends the queued generations to a MatrixArchive, so filtering and
+//  writing overlap.  When all the slots are taken, i.e., the disk falls
+//  behind, writeParticles:... waits for the thread to free one
+//  (back-pressure), so the memory used is bounded by the queue length.
+//
+//  Together with the streaming mode of GenericParticleFilter, this keeps
+//  the whole history of particles on disk while only two generations are
+//  in memory.  Hand a writer to the filter with setGenerationWriter:, and
+//  close it after the run.
+//
+//  The archive (see MatrixArchive.h) holds the records
+//
+//		generations		(dimX + 1) x count matrices, one per generation:
+//						the states in rows 1 ... dimX and the weights
+//						in row dimX + 1
+//		index			1 x (number of generations), unsigned, the time
+//						index of each generation
+//		time			1 x (number of generations), double
+//
+//  index and time are written when the writer is closed.
+//  writeParticles:... is meant to be called from one thread at a time.
+//
+
+@interface GenerationWriter : NSObject {
+@private
+	MatrixArchiveWriter *archive;
+	unsigned count;				// number of particles
+	unsigned dimX;
+	
+	// queue of generations (a ring of slots)
+	unsigned queueLength;
+	size_t slotSize;			// doubles per slot, (dimX + 1) * count
+	double *slots;
+	unsigned head;				// the oldest queued slot
+	unsigned filled;			// number of queued slots
+	unsigned waitCount;			// number of times the producer waited
+	
+	// index and time of each written generation (writer thread only)
+	unsigned *indices;
+	double *times;
+	unsigned *slotIndices;
+	double *slotTimes;
+	unsigned written;
+	unsigned capacity;
+	
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+	BOOL isRunning;
+	BOOL isClosing;
+	BOOL hasFailed;
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+// designated initializer
+// Returns nil if the archive cannot be created.
+- (id) initWithFile: (NSString *)path
+              count: (unsigned)n
+     stateDimension: (unsigned)xdim
+        queueLength: (unsigned)length
+         compressed: (BOOL)compressed;
+
+// The same as above with GENERATION_WRITER_DEFAULT_QUEUE_LENGTH
+- (id) initWithFile: (NSString *)path
+              count: (unsigned)n
+     stateDimension: (unsigned)xdim;
+
+// closes the writer if it is still open
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  WRITING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing
+
+// Queues a generation.  particles is a dimX x count matrix and weights a
+// 1 x count matrix of doubles; both may be views with padded rows.
+// Blocks while the queue is full.  Returns NO if the writer is closed or
+// a write has failed.
+- (BOOL) writeParticles: (MathMatrix *)particles
+                weights: (MathMatrix *)weights
+                atIndex: (unsigned)index
+                   time: (double)t;
+
+// Writes the queued generations, the index and the time records, and
+// closes the archive.  Returns NO if any write has failed.
+- (BOOL) close;
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) queueLength;
+
+// number of times writeParticles:... had to wait for a free slot
+- (unsigned) waitCount;
+
+@end
@@ -0,0 +1,276 @@
+//
+//  GenerationWriter.m
+//  GenericParticleFilter
+//
+
+#import "GenerationWriter.h"
+#import "ThreadPool.h"
+
+#import <stdlib.h>
+#import <string.h>
+
+// Private methods
+@interface GenerationWriter (Private)
+- (void) drainQueue;
+@end
+
+// the writer thread
+static void *WriterMain (void *arg) {
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	
+	[(GenerationWriter *)arg drainQueue];
+	
+	[pool release];
+	return NULL;
+}
+
+
+@implementation GenerationWriter
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	NSLog(@"Use initWithFile:count:stateDimension: to create a writer.");
+	[self release];
+	return nil;
+}
+
+// designated initializer
+- (id) initWithFile: (NSString *)path
+              count: (unsigned)n
+     stateDimension: (unsigned)xdim
+        queueLength: (unsigned)length
+         compressed: (BOOL)compressed {
+
+	if ( self = [super init] ) {
+		count = n;
+		dimX = xdim;
+		queueLength = length ? length : 1UL;
+		slotSize = (size_t)(dimX + 1) * count;
+		
+		archive = [[MatrixArchiveWriter alloc] initWithFile:path
+		                                         compressed:compressed];
+		if ( !archive ) {
+			[self release];
+			return nil;
+		}
+		[archive beginRecordNamed:@"generations"
+		                     type:@"double"
+		                    width:count
+		                   height:(dimX + 1)];
+		
+		slots = (double *)malloc(queueLength * slotSize * sizeof(double));
+		slotIndices = (unsigned *)malloc(queueLength * sizeof(unsigned));
+		slotTimes = (double *)malloc(queueLength * sizeof(double));
+		
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&notEmpty, NULL);
+		pthread_cond_init(&notFull, NULL);
+		
+		// The thread runs Objective-C code, and it retains nothing; close
+		// joins it before self goes away.
+		ThreadPoolEnterMultiThreadedMode();
+		if ( pthread_create(&thread, NULL, WriterMain, self) != 0 ) {
+			NSLog(@"Cannot start the thread of the generation writer.");
+			[self release];
+			return nil;
+		}
+		isRunning = YES;
+	}
+	return self;
+}
+
+- (id) initWithFile: (NSString *)path
+              count: (unsigned)n
+     stateDimension: (unsigned)xdim {
+
+	return [self initWithFile:path
+	                    count:n
+	           stateDimension:xdim
+	              queueLength:GENERATION_WRITER_DEFAULT_QUEUE_LENGTH
+	               compressed:NO];
+}
+
+- (void) dealloc {
+	[self close];
+	
+	if ( slots ) {	// the synchronization objects were initialized
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&notEmpty);
+		pthread_cond_destroy(&notFull);
+	}
+	
+	free(slots);
+	free(slotIndices);
+	free(slotTimes);
+	free(indices);
+	free(times);
+	[archive release];
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  WRITING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing
+
+- (BOOL) writeParticles: (MathMatrix *)particles
+                weights: (MathMatrix *)weights
+                atIndex: (unsigned)index
+                   time: (double)t {
+
+	unsigned k, slot;
+	double *dst;
+	
+	if ( [particles width] != count || [particles height] != dimX
+	     || [weights count] != count
+	     || ![particles isDouble] || ![weights isDouble] ) {
+		NSLog(@"The generation does not match the generation writer.");
+		return NO;
+	}
+	
+	// wait for a free slot
+	pthread_mutex_lock(&lock);
+	while ( filled == queueLength && !hasFailed ) {
+		waitCount++;
+		pthread_cond_wait(&notFull, &lock);
+	}
+	if ( !isRunning || isClosing || hasFailed ) {
+		pthread_mutex_unlock(&lock);
+		return NO;
+	}
+	slot = (head + filled) % queueLength;
+	pthread_mutex_unlock(&lock);
+	
+	// The writer thread does not touch a free slot, so the copy is done
+	// without the lock.
+	dst = slots + slot*slotSize;
+	for ( k = 1; k <= dimX; k++ ) {
+		memcpy(dst, [particles doubleRow:k], count * sizeof(double));
+		dst += count;
+	}
+	memcpy(dst, [weights doubleElements], count * sizeof(double));
+	slotIndices[slot] = index;
+	slotTimes[slot] = t;
+	
+	pthread_mutex_lock(&lock);
+	filled++;
+	pthread_cond_signal(&notEmpty);
+	pthread_mutex_unlock(&lock);
+	
+	return YES;
+}
+
+- (BOOL) close {
+	BOOL success;
+	
+	if ( !isRunning ) {
+		return !hasFailed;
+	}
+	
+	// let the thread write the rest and finish
+	pthread_mutex_lock(&lock);
+	isClosing = YES;
+	pthread_cond_signal(&notEmpty);
+	pthread_mutex_unlock(&lock);
+	
+	pthread_join(thread, NULL);
+	isRunning = NO;
+	
+	// index and time of the generations
+	success = !hasFailed
+	&& [archive beginRecordNamed:@"index"
+	                        type:@"unsigned"
+	                       width:written
+	                      height:1UL]
+	&& [archive appendElements:indices leadingDimension:written]
+	&& [archive beginRecordNamed:@"time"
+	                        type:@"double"
+	                       width:written
+	                      height:1UL]
+	&& [archive appendElements:times leadingDimension:written];
+	
+	if ( ![archive close] ) {
+		success = NO;
+	}
+	hasFailed = !success;
+	return success;
+}
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) queueLength {
+	return queueLength;
+}
+
+- (unsigned) waitCount {
+	return waitCount;
+}
+
+@end
+
+
+@implementation GenerationWriter (Private)
+
+// The loop of the writer thread.
+// It writes the oldest queued slot without the lock, so the producer can
+// fill other slots meanwhile.
+- (void) drainQueue {
+	unsigned slot;
+	BOOL success;
+	
+	pthread_mutex_lock(&lock);
+	for ( ; ; ) {
+		while ( filled == 0 && !isClosing ) {
+			pthread_cond_wait(&notEmpty, &lock);
+		}
+		if ( filled == 0 ) {	// closing and nothing is left
+			break;
+		}
+		slot = head;
+		pthread_mutex_unlock(&lock);
+		
+		success = !hasFailed
+		&& [archive appendElements:(slots + slot*slotSize)
+		          leadingDimension:count];
+		
+		if ( success ) {
+			if ( written == capacity ) {
+				capacity = capacity ? 2*capacity : 64;
+				indices = (unsigned *)realloc(indices, capacity * sizeof(unsigned));
+				times = (double *)realloc(times, capacity * sizeof(double));
+			}
+			indices[written] = slotIndices[slot];
+			times[written] = slotTimes[slot];
+			written++;
+		}
+		
+		pthread_mutex_lock(&lock);
+		if ( !success ) {
+			hasFailed = YES;
+		}
+		head = (head + 1) % queueLength;
+		filled--;
+		pthread_cond_signal(&notFull);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+@end
@@ -10,12 +10,18 @@
 #import "GenericSystem.h"
 #import "MathMatrix.h"
 #import "RandomNumberGenerator.h"
+#import "ThreadPool.h"
+#import "ParticlePopulation.h"
+#import "GenerationWriter.h"
+#import "ParticleGenealogy.h"
+#import "StepProfiler.h"
 
 //  Enumeration constants for resample scheme
 enum {
 	PF_CONST_RESAMPLE_RESIDUAL = 0,
 	PF_CONST_RESAMPLE_SYSTEMATIC,
-	PF_CONST_RESAMPLE_MULTINOMIAL
+	PF_CONST_RESAMPLE_MULTINOMIAL,
+	PF_CONST_RESAMPLE_STRATIFIED
 };
 
 //
@@ -53,23 +59,69 @@ enum {
 //    The structure of it is similar to that of particles.
 //
 
+//  STORAGE
+//
+//    The generation at each slot is a ParticlePopulation, which holds the
+//    particles, the predicted states and measurements, the weights, the
+//    log-weights and the ancestor indices in one cache-line aligned block.
+//    particles, weights, particlesPredicted and measurementsPredicted hold
+//    MathMatrix views of these blocks.  The rows of a view are
+//    [view leadingDimension] elements apart, which may be more than count.
+
+//  STREAMING MODE
+//
+//    When streaming is enabled, particles, weights, particlesPredicted and
+//    measurementsPredicted hold only two generations, which are used as
+//    double buffers:
+//
+//      particles[t % 2]: particles at time t
+//
+//    Hence the memory used by the particle filter is O(count * dim)
+//    regardless of the length of the time span.  Only estimate and its
+//    moments keep a column per time step.  The histogram is not available
+//    in this mode.  Use the ...AtIndex: accessors below to get the
+//    generation of a given time, and a delegate to receive each
+//    generation as it is completed.
+
 @interface GenericParticleFilter : NSObject {
 @private
 	BOOL isStateEstimator;		// flag which shows whether the particle filter
 								// estimates state
 	BOOL isParameterEstimator;	// flag which shows whether the particle filter
 								// estimates parameters
+	BOOL isStreaming;			// flag which shows whether the particle filter
+								// keeps only the last two generations
+	BOOL isAuxiliaryFilter;		// flag which shows whether the particles are
+								// selected by their look-ahead points
+	
+	id delegate;				// receives particleFilter:didFinishStepAtIndex:
+								// (not retained)
+	GenerationWriter *generationWriter;	// receives every generation
+										// (retained)
+	StepProfiler *profiler;		// receives a record of every step
+								// (retained, nil: no instrumentation)
+	ParticleGenealogy *genealogy;	// receives the ancestors of every
+									// generation (retained)
+	PFStepRecord *stepRecord;	// record of the step in progress (NULL if
+								// there is no profiler or no such step)
+	
+	BOOL isOnline;				// flag which shows whether online filtering
+								// has begun
+	unsigned onlineIndex;		// (0-based) index of the last online step
+	double onlineTime;			// time of the last online step
 	
 	unsigned count;		// number of particles (and weights)
 	
+	NSMutableArray *populations;	// storage of each generation
+	unsigned particleStride;		// leading dimension of the populations
 	NSMutableArray *particles;		// particles (see description above)
 	NSMutableArray *weights;		// weights (see description above)
 	NSMutableArray *particlesPredicted;			// predicted particles
 	NSMutableArray *measurementsPredicted;		// predicted measurements
-
+	
 	NSMutableArray *histogram;  // histogram of particles (see description above)
 	MathMatrix *domain;			// domain of histogram
-
+	
 	// system: the system to estimate (filter) using this particle filter
 	GenericSystem* system;	
 	
@@ -90,15 +142,90 @@ enum {
 	
 	MathMatrix *estimate;
 	
+	// weighted moments of the particles, made while the weights are
+	// normalized, i.e., before resampling
+	MathMatrix *estimateVariance;	// dimX x T, like estimate
+	MathMatrix *estimateCovariance;	// (dimX*dimX) x T
+	MathMatrix *lastCovariance;		// dimX x dimX, of the last step
+	double *lastMean;				// dimX, of the last step, and dimX
+									// for the shift of the moments
+	
+	// fixed-lag smoothing
+	// The last L + 1 generations and their ancestor indices are kept in a
+	// ring, so the particles at t - L are weighted by the weights of
+	// their descendants at t.
+	unsigned smoothingLag;			// L (0: no smoothing)
+	double *lagStates;				// dimX x count per generation
+	unsigned *lagAncestors;			// count per generation
+	unsigned *lagLineages;			// ancestor of each particle at t - L
+	MathMatrix *smoothedEstimate;	// dimX x T, like estimate
+	MathMatrix *lastSmoothedEstimate;	// dimX x 1, at lastSmoothedIndex
+	unsigned lastSmoothedIndex;
+	BOOL hasSmoothedEstimate;		// the filter has made L steps
+	
 	// resample scheme
 	unsigned scheme;
 	
+	// adaptive resampling
+	// The particles are resampled only when the effective sample size,
+	// 1/sum(w_i^2), is less than resampleThreshold * count.
+	// Otherwise, the weights are carried forward to the next step.
+	double resampleThreshold;
+	double lastESS;				// effective sample size of the last step
+	BOOL lastStepResampled;		// whether the last step resampled
+	unsigned resampleCount;		// number of steps which resampled
+	MathMatrix *effectiveSampleSizes;	// ESS history (1 x T)
+	
+	// marginal likelihood
+	// log p(y_t | y_1:t-1) is estimated by the log of the mean of the
+	// (carried forward) weights at each step, and the increments are
+	// summed up in log domain with a compensated summation.
+	double logLikelihood;				// log p(y_1:t) so far
+	double logLikelihoodError;			// compensation of the summation
+	double lastLogLikelihoodIncrement;	// log p(y_t | y_1:t-1) of the last step
+	MathMatrix *logLikelihoodIncrements;	// history of the above (1 x T)
+	
 	// window size
 	unsigned windowSize;
-
+	
 	// maximum number of iterations
 	unsigned iterationLimit;
 	
+	// number of perturbation directions of each iteration of SPSA
+	unsigned SPSADirectionCount;
+	
+	// online parameter learning (Liu & West)
+	// Each particle carries its own parameters, which are moved by a
+	// Gaussian kernel shrunk towards their weighted mean at every step.
+	double parameterDiscount;			// delta of the kernel, in (0, 1]
+	MathMatrix *parameterPriorScales;	// d x 1 (nil: the default)
+	MathMatrix *parameterParticles;		// d x count, of the particles
+	MathMatrix *parameterProposals;		// d x count, moved by the kernel
+	MathMatrix *parameterEstimate;		// d x T, posterior mean
+	double *parameterWorkspace;			// mean, covariance and noise
+	
+	// parallel execution
+	// The particles are split into chunks of a fixed size, which are
+	// propagated and weighted on the threads of threadPool.
+	unsigned threadCount;		// number of threads (1: serial)
+	ThreadPool *threadPool;		// NULL if threadCount is 1
+	unsigned chunkCount;		// number of chunks of particles
+	double *partialSums;		// sum of weights in each chunk
+	unsigned *nanCounts;		// NaN likelihoods in each chunk
+	unsigned *zeroCounts;		// zero likelihoods in each chunk
+	
+	// resampling workspaces
+	// They hold count elements each and are allocated together with the
+	// generations, so that a step does not allocate memory.
+	// The index of the parent of each particle goes to the ancestors of
+	// the population.
+	unsigned *resampleCounts;	// number of children of each particle
+	double *resampleCumDist;	// cumulative sum of the weights
+	double *resampleUniforms;	// uniform random numbers
+	double *resampleScratch;	// working space of the multinomial scheme
+	double *lookAheadLikelihoods;	// likelihoods at the look-ahead points
+									// of the auxiliary particle filter
+	
 	//
 	//  Miscellaneous data structure
 	//
@@ -106,6 +233,8 @@ enum {
 	unsigned RNGIDForResampler;	// random number generator id
 	unsigned RNGIDForBernoulli;	// random number generator id
 								// see http://www.netlib.org/random/index.html
+	unsigned RNGIDForParameters;	// random number generator id of the
+									// kernel of parameter learning
 	
 }
 
@@ -119,11 +248,19 @@ enum {
 
 - (id) init;
 
-// designated initializer
 - (id) initWithCapacity:(unsigned)num
 			  forSystem:(GenericSystem *)theSystem
 	withSelectionScheme:(unsigned)theScheme;
 
+// designated initializer
+// With flag YES, the filter is in streaming mode (see enableStreaming:)
+// from the start, so the generations of the whole time span are never
+// allocated.
+- (id) initWithCapacity:(unsigned)num
+			  forSystem:(GenericSystem *)theSystem
+	withSelectionScheme:(unsigned)theScheme
+			  streaming:(BOOL)flag;
+
 - (void) dealloc;
 
 
@@ -166,13 +303,26 @@ enum {
 
 - (unsigned)scheme;
 - (void) setScheme:(unsigned)theScheme;
-
+	// One of PF_CONST_RESAMPLE_RESIDUAL, PF_CONST_RESAMPLE_SYSTEMATIC,
+	// PF_CONST_RESAMPLE_MULTINOMIAL and PF_CONST_RESAMPLE_STRATIFIED.
+	// Residual, systematic and stratified resampling take O(N) time and
+	// one (residual, systematic) or N (stratified) uniform random numbers.
+
+// The slots of the generator which the resampler, the Bernoulli trials
+// and the parameters draw from.  setRNGenerator: occupies free slots for
+// all three (see -[RandomNumberGenerator suggestEmptySlot]), and they are
+// freed when the filter is deallocated or given another generator.
+// Setting an id moves the draws to that slot if it is free, and frees
+// the one held before.
 - (unsigned)RNGIDForResampler;
 - (void)setRNGIDForResampler: (unsigned)genId;
 
 - (unsigned)RNGIDForBernoulli;
 - (void)setRNGIDForBernoulli: (unsigned)genId;
 
+- (unsigned)RNGIDForParameters;
+- (void)setRNGIDForParameters: (unsigned)genId;
+
 - (RandomNumberGenerator *)RNGenerator;
 - (void)setRNGenerator: (RandomNumberGenerator *)gen;
 
@@ -181,6 +331,39 @@ enum {
 
 - (BOOL)isParameterEstimator;
 - (void)enableParameterEstimator: (BOOL)flag;
+	// Online parameter learning by the kernel shrinkage of Liu & West.
+	// NO by default.  If enabled, the parameters of the system are
+	// carried by each particle: they are drawn around those of the system
+	// at t_0 (see parameterPriorScales), and at each step they are moved
+	// by a Gaussian kernel, a*theta_j + (1 - a)*mean + N(0, h^2 V), with
+	// the weighted mean and covariance V of all the particles, before the
+	// particle is propagated with getNextState:...parameters:control: and
+	// weighted with probabilityOf:given:atTimeIndex:withParameters:.
+	// The parameters follow their particles when resampled.  So the
+	// states and the parameters are estimated in one pass of
+	// estimateStates.  The per-particle methods run on the threads if the
+	// system returns YES for isRolloutThreadSafe.  The mode takes
+	// precedence over the auxiliary particle filter, and online filtering
+	// does not learn the parameters since those methods are driven by the
+	// time index.
+
+- (double) parameterDiscount;
+- (void) setParameterDiscount: (double)delta;
+	// delta in (0, 1] of the kernel, i.e., a = (3*delta - 1)/(2*delta)
+	// and h^2 = 1 - a^2.  0.98 by default.  The closer to 1, the less
+	// the parameters move.
+
+- (MathMatrix *) parameterPriorScales;
+- (void) setParameterPriorScales: (MathMatrix *)scales;
+	// standard deviations (d x 1) of the parameters of the particles
+	// at t_0 around those of the system.  nil, the default, means 0.1 for
+	// every parameter.
+
+- (MathMatrix *) parameterParticles;
+	// the parameters of the particles at the last step (d x count)
+- (MathMatrix *) parameterEstimate;
+	// the weighted mean of the parameters of the particles at each time
+	// index (d x T).  nil unless the parameters have been learned.
 
 - (unsigned) windowSize;
 - (void) setWindowSize: (unsigned)ws;
@@ -188,6 +371,153 @@ enum {
 - (unsigned) iterationLimit;
 - (void) setIterationLimit: (unsigned)il;
 
+- (unsigned) threadCount;
+- (void) setThreadCount: (unsigned)n;
+	// The number of threads including the calling one. 1 (the default)
+	// runs the filter serially.  The predicted measurements and the
+	// weights are evaluated concurrently if the system returns YES for
+	// isWeightingThreadSafe, and the particles are propagated
+	// concurrently if it returns YES for isPropagationThreadSafe.
+	// The results do not depend on the number of threads.
+
+- (unsigned) SPSADirectionCount;
+- (void) setSPSADirectionCount: (unsigned)n;
+	// The number of independent perturbation directions of each iteration
+	// of SPSA, whose gradient estimates are averaged.  1 by default.
+	// The four rollouts of all the directions run concurrently on the
+	// threads of the filter if the system returns YES for
+	// isRolloutThreadSafe.
+
+- (double) resampleThreshold;
+- (void) setResampleThreshold: (double)ratio;
+	// ratio is relative to the number of particles, i.e., the particles
+	// are resampled when ESS < ratio * count.  The value should be in
+	// (0, 1].  1.0, the default, resamples at every step.
+
+- (MathMatrix *) effectiveSampleSizes;
+	// ESS at each time index (1 x T). It is not updated in online
+	// filtering; use lastEffectiveSampleSize after each step instead.
+- (double) lastEffectiveSampleSize;
+- (BOOL) isLastStepResampled;
+- (unsigned) resampleCount;
+	// the number of steps which resampled since the initialization
+
+- (double) logMarginalLikelihood;
+	// The estimate of log p(y_1:t) of the steps since the initialization,
+	// which is unbiased in p (not in log p) for the parameters of the
+	// system.  It is a by-product of the normalization of the weights, so
+	// a single run of the filter scores the parameters.  It is exact only
+	// up to a constant if the importance weights of the system omit the
+	// normalizing constant of the measurement density.
+- (double) lastLogLikelihoodIncrement;
+	// log p(y_t | y_1:t-1) of the last step
+- (MathMatrix *) logLikelihoodIncrements;
+	// log p(y_t | y_1:t-1) at each time index (1 x T, 0 at t_0).  It is not
+	// updated in online filtering, like effectiveSampleSizes.
+
+- (BOOL) isStreaming;
+- (void) enableStreaming: (BOOL)flag;
+	// Enabling or disabling streaming mode reallocates resources.
+
+- (BOOL) isAuxiliaryFilter;
+- (void) enableAuxiliaryFilter: (BOOL)flag;
+	// The auxiliary particle filter (Pitt & Shephard) instead of the
+	// bootstrap filter.  NO by default.  Each step first weights the
+	// particles with the likelihood of the measurement at their look-ahead
+	// points (see -[GenericSystem getPointPredictions:...]), chooses the
+	// parents by these weights, and then propagates them and weights the
+	// children with the ratio of their likelihoods to those of the
+	// look-ahead points.  It pays when the likelihood is sharply peaked,
+	// e.g., with many measurements per step, at the cost of a second
+	// weighting pass.  The particles are selected at every step, so
+	// resampleThreshold is not used.  It applies to online filtering, too.
+
+- (id) delegate;
+- (void) setDelegate: (id)theDelegate;
+
+// A writer which receives every generation as it is completed, before the
+// delegate, and writes it to disk on its own thread.  nil by default.
+// The writer is retained; close it after the run.
+- (GenerationWriter *) generationWriter;
+- (void) setGenerationWriter: (GenerationWriter *)writer;
+
+// A profiler which records the wall time of each phase and the counters
+// of every step (see StepProfiler.h).  nil by default, in which case the
+// steps are not instrumented at all.  The profiler is retained.
+- (StepProfiler *) profiler;
+- (void) setProfiler: (StepProfiler *)theProfiler;
+
+// A genealogy which keeps the ancestral tree of the particles, so the
+// trajectory of every particle can be reconstructed after (or during) the
+// run without keeping all the generations (see ParticleGenealogy.h).
+// It is begun when the filter is initialized and every generation is
+// appended to it, before the generation writer.  nil by default.
+// The genealogy is retained; its state dimension must be that of the
+// system.
+- (ParticleGenealogy *) genealogy;
+- (void) setGenealogy: (ParticleGenealogy *)theGenealogy;
+
+// The generation of particles (weights, etc.) at the given time index.
+// index is 0-based.  These work both in streaming and normal modes.
+// In streaming mode, only the current and the previous generations
+// are available, and the predicted particles of a step which did not
+// resample are not: the buffers are exchanged instead of copied, so
+// particlesPredictedAtIndex: returns the particles of two steps before.
+- (MathMatrix *) particlesAtIndex: (unsigned)index;
+- (MathMatrix *) weightsAtIndex: (unsigned)index;
+- (MathMatrix *) particlesPredictedAtIndex: (unsigned)index;
+- (MathMatrix *) measurementsPredictedAtIndex: (unsigned)index;
+- (ParticlePopulation *) populationAtIndex: (unsigned)index;
+
+- (MathMatrix *) estimate;
+
+// Posterior summaries
+// When the weights of a step are normalized, the weighted mean and
+// covariance of the predicted states are summed along their contiguous
+// rows.  So the estimate at t > 0 is the mean of the weighted particles
+// before resampling, which has lower variance than the mean of the
+// resampled ones, and the resampled particles are not scanned again.
+// A particle whose likelihood is not finite (NaN or infinite) gets a
+// zero weight, so it is left out of the moments and is never resampled.
+//
+// The variances of estimateStates (dimX x T), laid out as estimate.
+- (MathMatrix *) estimateVariance;
+
+// The covariances of estimateStates ((dimX*dimX) x T).  The
+// (k*dimX + l + 1)'th row is the covariance of the (k + 1)'th and the
+// (l + 1)'th components, i.e., each column is a covariance in row-major
+// order.
+- (MathMatrix *) estimateCovariance;
+
+// The covariance (dimX x dimX) of the last step, in any mode, e.g., for
+// a delegate or after filterMeasurement:atTime:intoEstimate:.
+- (MathMatrix *) lastCovariance;
+
+// Fixed-lag smoothing
+// With lag L > 0, each step at t also estimates the states at t - L
+// given the measurements up to t, i.e., the weighted mean of the
+// ancestors at t - L of the particles at t.  The last L + 1 generations
+// and their ancestor indices are kept in a ring apart from the storage
+// of the filter, so a step costs O(count * L) in time and memory however
+// long the time span, and it works in streaming and online modes as well.
+// 0 (no smoothing) by default.
+- (unsigned) smoothingLag;
+- (void) setSmoothingLag: (unsigned)L;
+
+// The smoothed estimates of estimateStates (dimX x T), laid out as
+// estimate.  The last L columns, whose lags run out at the end of the
+// time span, are smoothed with all the measurements.  nil unless
+// smoothing.
+- (MathMatrix *) smoothedEstimate;
+
+// The smoothed estimate (dimX x 1) at lastSmoothedIndex made by the last
+// step, e.g., for a delegate or after filterMeasurement:atTime:
+// intoEstimate:.  nil until the filter has made L steps since it was
+// initialized.  lastSmoothedIndex is the time index (or the online step)
+// of the estimate, i.e., L steps behind.
+- (MathMatrix *) lastSmoothedEstimate;
+- (unsigned) lastSmoothedIndex;
+
 - (MathMatrix *) timeSpan;
 - (void) setTimeSpan: (MathMatrix *)newTimeSpan;
 	// Note that GenericParticleFilter class does NOT have timeSpan as 
@@ -210,12 +540,30 @@ enum {
 - (void) estimateStates;
 
 // parameter estimator (auxiliary particle filter)
+// The measurement comparison method below with auxiliary particle filters.
 - (void) estimateParametersUsingAuxParticleFilter;
 
+// parameter estimator (online learning)
+// Runs estimateStates once with enableParameterEstimator: YES, writes the
+// parameter estimate of each time to the param_est_%d files, and sets the
+// parameters of the system to the estimate at the end of the time span.
+- (void) estimateParametersViaFiltering;
+
 // parameter estimator (measurement comparison method)
+// Minimizes the RMS difference between the measurements and the
+// noise-free measurements of the estimated states over the parameters by
+// the Nelder-Mead simplex algorithm, for at most iterationLimit
+// iterations.  Each vertex is evaluated by an independent filter with a
+// copy of the system (see -[GenericSystem copyWithZone:]); these run on
+// the threads of this filter if the system is thread-safe.  The values
+// are cached by parameters.  Finally, the system gets the best parameters
+// and the states are estimated with them.
 - (void) estimateParametersUsingMeasurementComparison;
 
 // parameter estimator (SPSA)
+// Each iteration rolls the system out over a window with theta +/- c_k*delta
+// for each of SPSADirectionCount directions, and updates theta with the
+// averaged gradient estimate.
 - (void) estimateParametersUsingSPSAWithAlpha: (double) alpha
 										gamma: (double) gamma 
 											a: (double) a
@@ -224,6 +572,34 @@ enum {
 
 - (void) meanOfEstimationError:(MathMatrix *)error;
 
+// online state estimator
+//
+// Measurements are pushed one at a time instead of being read from
+// [system Y] over timeSpan.  beginOnlineFilteringAtTime: enables streaming
+// mode (which allocates all the resources needed) and initializes the
+// particles at t0.  Each call of filterMeasurement:atTime:intoEstimate:
+// propagates the particles from the time of the previous step to t,
+// weights them with y, resamples, and writes the posterior mean to est.
+// The storage of the particles is not reallocated in the steps, so the
+// cost of a step depends only on the number of particles.
+// y must be a dimY x 1 and est a dimX x 1 MathMatrix of type double, and
+// t must be later than the time of the previous step (or t0).
+// The method returns NO if the arguments are not valid.
+- (void) beginOnlineFilteringAtTime: (double)t0;
+- (BOOL) filterMeasurement: (MathMatrix *)y
+                    atTime: (double)t
+              intoEstimate: (MathMatrix *)est;
+- (unsigned) onlineStepCount;
+
+// Replays a measurement file through the online estimator.
+// Each line of the input file holds a time followed by dimY components
+// of a measurement. Each line of the output file holds the time followed
+// by dimX components of the estimate. Lines starting with '#' are skipped.
+// Both files are in /tmp/ as the other file methods.
+// Returns the number of measurements processed.
+- (unsigned) replayMeasurementsFromFile: (NSString *)inName
+                                 toFile: (NSString *)outName;
+
 - (void) makePosteriorDistributionHistogramForStateComponent: (unsigned)i;
 - (void) makePredictiveDistributionHistogramForMeasurementComponent: (unsigned)i;
 
@@ -253,4 +629,34 @@ enum {
 - (void)writeEstimationErrorToFile:(NSString *)fName;
 - (void)writeStateToFile:(NSString *)fName;
 
+// Writes the time span, the particles, the weights, the histograms, the
+// estimates and their variances and covariances, the smoothed estimates
+// (if smoothing), the effective sample sizes, the increments of the log
+// marginal likelihood, the parameter estimates (if learned) and the
+// states of the system to a binary archive (see MatrixArchive.h) which
+// can be mapped back with -[MatrixArchive initWithContentsOfFile:].
+// Unlike the methods above, the path is used as it is.  In streaming
+// mode, only the generations kept in memory are written.
+- (BOOL)writeRunToBinaryFile:(NSString *)path
+                  compressed:(BOOL)compressed;
+
+@end
+
+
+// *****************************************************************************
+//
+//  DELEGATE METHODS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Delegate Methods
+
+@interface NSObject (GenericParticleFilterDelegate)
+
+// Sent after the particles at time index ``index'' (0-based) are resampled
+// and the states at that time are estimated.  The generation is available
+// through particlesAtIndex:, weightsAtIndex:, etc. until the next step.
+- (void) particleFilter: (GenericParticleFilter *)pf
+   didFinishStepAtIndex: (unsigned)index;
+
 @end
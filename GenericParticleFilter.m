@@ -11,20 +11,132 @@
 #import "GenericSystem.h"
 #import "random.h"
 #import "MathUtil.h"
+#import "MatrixArchive.h"
 #import "stdlib.h"
+#import "string.h"
+#import "float.h"
 
 #define CONST_DEFAULT_CAPACITY				200
 #define CONST_DEFAULT_DOMAIN_LOWER_BOUND	0.0
 #define CONST_DEFAULT_DOMAIN_UPPER_BOUND	10.0
 #define CONST_DEFAULT_DOMAIN_NUM_STEP		100
+#define CONST_REPLAY_LINE_LENGTH			4096
+#define CONST_PARALLEL_CHUNK_SIZE			256
+#define CONST_WEIGHT_EPS					2.2204e-16
+#define CONST_DEFAULT_PARAMETER_DISCOUNT	0.98
+#define CONST_DEFAULT_PARAMETER_PRIOR_SCALE	0.1
+
+// coefficients of the Nelder-Mead simplex algorithm
+#define CONST_NM_REFLECTION					1.0
+#define CONST_NM_EXPANSION					1.0
+#define CONST_NM_CONTRACTION				0.5
+#define CONST_NM_SHRINK						0.5
+#define CONST_NM_TOLERANCE					1.0e-8
+
+// instrumentation of a phase of a step
+// Without a record of the step, i.e., without a profiler, they cost only
+// the test of a pointer.
+#define PF_PROFILE_BEGIN(start) \
+	if ( stepRecord ) { start = StepProfilerNow(); }
+#define PF_PROFILE_END(start, phase) \
+	if ( stepRecord ) { stepRecord -> seconds[phase] += StepProfilerNow() - start; }
 
 enum {
 	CONST_RESAMPLE_SCHEME_RESIDUAL = 0,
 	CONST_RESAMPLE_SCHEME_SYSTEMATIC,
-	CONST_RESAMPLE_SCHEME_MULTINOMIAL
+	CONST_RESAMPLE_SCHEME_MULTINOMIAL,
+	CONST_RESAMPLE_SCHEME_STRATIFIED
 };
 
 
+// *****************************************************************************
+//
+//  PARALLEL EXECUTION SUPPORT
+//
+// *****************************************************************************
+
+// Everything a chunk of particles needs for one step of the filter.
+// All the blocks have the layout of the MathMatrix of particles, i.e.,
+// their stride is the leading dimension of the populations.
+typedef struct {
+	GenericSystem *system;
+	
+	BOOL isTimeBased;		// driven by times (online) or by a time index
+	unsigned index;			// time index (index based) or the number of
+							// the online step; selects the storage
+	double t0, t1;			// times of the previous and current steps
+	double *y;				// measurement (time based)
+	unsigned ldy;			// stride of y
+	
+	unsigned count;			// number of particles
+	unsigned ld;			// stride of the blocks
+	double *prev;			// particles at the previous step
+	double *pred;			// predicted states
+	double *predMeasure;	// predicted measurements
+	double *w;				// weights
+	double *prevW;			// weights of the previous step
+							// (NULL if the previous step resampled)
+	
+	BOOL isLookAhead;		// first stage of the auxiliary particle filter:
+							// the look-ahead points are weighted
+	double *lookAhead;		// likelihoods at the look-ahead points
+							// (NULL for the bootstrap filter)
+	unsigned *ancestors;	// parents chosen by the first stage
+							// (NULL but in the second stage)
+	
+	double *theta;			// parameters of each particle, d x count
+							// (NULL unless the parameters are learned)
+	unsigned parameterCount;	// d
+	
+	double *partialSums;	// sum of the weights in each chunk
+	unsigned *nanCounts;	// NaN and zero likelihoods in each chunk
+	unsigned *zeroCounts;	// (NULL if the step is not instrumented)
+} PFStepContext;
+
+static void PropagateChunk (void *context,
+                            unsigned begin, unsigned end, unsigned chunk);
+static void WeightChunk (void *context,
+                         unsigned begin, unsigned end, unsigned chunk);
+static void PropagateAndWeightWithParametersChunk (void *context,
+                                                   unsigned begin,
+                                                   unsigned end,
+                                                   unsigned chunk);
+
+// Everything the rollouts of an iteration of SPSA need.
+// See estimateParametersUsingSPSAWithAlpha:... for the order of the
+// rollouts.
+typedef struct {
+	GenericSystem *system;
+	unsigned windowSize;
+	unsigned k;					// iteration (1-based)
+	
+	MathMatrix **thetaPlus;		// theta + c_k*delta of each direction
+	MathMatrix **thetaMinus;	// theta - c_k*delta of each direction
+	MathMatrix **states;		// X+, X-, X~+, X~- of each direction
+	MathMatrix **measurements;	// Y+, Y- of each direction
+	MathMatrix **stateIn;		// temporary storage of each rollout
+	MathMatrix **stateOut;
+	MathMatrix **measurementOut;
+	double *grads;				// gradient estimate of each direction
+} SPSAContext;
+
+static void SPSARolloutChunk (void *context,
+                              unsigned begin, unsigned end, unsigned chunk);
+static void SPSAGradientChunk (void *context,
+                               unsigned begin, unsigned end, unsigned chunk);
+
+// The filters which evaluate the objective of the measurement comparison
+// method at some vertices, and the values.
+typedef struct {
+	GenericParticleFilter **filters;
+	double *objectives;
+} VertexObjectiveContext;
+
+static void VertexObjectiveChunk (void *context,
+                                  unsigned begin, unsigned end, unsigned chunk);
+
+
+
 // *****************************************************************************
 //
 //  PRIVATE METHODS
@@ -42,13 +154,46 @@ enum {
 // This function is the main engine of the particle filter.
 // See the comments at the implementation of this function below.
 
+- (void) auxiliarySampleWithContext: (PFStepContext *)context;
+// The two stages of a step of the auxiliary particle filter.
+// See the comments at the implementation of this function below.
+
+- (void) learnParametersWithContext: (PFStepContext *)context;
+// A step of the filter in which each particle carries its parameters.
+// See the comments at the implementation of this function below.
+
+- (void) moveParametersByKernelAtIndex: (unsigned)index;
+// Moves the parameters of the particles by the kernel of Liu & West
+// into parameterProposals.
+
+- (void) initializeParameterParticles;
+// (Re-)allocates the storage of the parameters of the particles if
+// needed, and draws them around the parameters of the system.
+
+- (void) estimateParametersAtIndex: (unsigned)index;
+// Writes the weighted mean of the parameters of the particles to the
+// (index + 1)'th column of parameterEstimate.
+
+- (void) selectAncestorsAtIndex:(unsigned)index;
+// This function chooses the parent of each particle by the normalized
+// weights at the index given according to the scheme.
+// The indices go to the ancestors of the population.
+
 - (void) resampleByMultinomialAtIndex:(unsigned)index;
 // This function does multinomial resampling.
 
+- (void) resampleBySystematicAtIndex:(unsigned)index;
+- (void) resampleByStratifiedAtIndex:(unsigned)index;
+- (void) resampleByResidualAtIndex:(unsigned)index;
+// These functions do systematic, stratified and residual resampling,
+// respectively. See MathUtil.h for the kernels.
+
 - (void) finishResamplingUsingNewIndices:(unsigned *)newIndices
+                              fromStates:(double *)src
                                  atIndex:(unsigned)index;
-// This function calculates new indeces.
-// It is called by resampleByMultinomialAtIndex:(unsigned) only.
+// This function gathers the parents, i.e., the columns newIndices of
+// src, into the particles at the index given.
+// It is called after selectAncestorsAtIndex:(unsigned) only.
 
 - (void) setHistogram: (NSMutableArray *)theHistogram;
 // An access method.
@@ -70,13 +215,610 @@ enum {
 - (void) estimateStatesAtIndex: (unsigned)index;
 // This function estimates states at the index given.
 
+- (unsigned) generationCount;
+// The number of generations of particles stored.
+// It is 2 in streaming mode, and the size of time span otherwise.
+
+- (unsigned) slotForIndex: (unsigned)index;
+// Converts a (0-based) time index to the index of the storage arrays,
+// i.e., particles, weights, particlesPredicted and measurementsPredicted.
+
+- (void) allocateGenerations;
+// (Re-)allocates particles, weights, particlesPredicted,
+// measurementsPredicted and histogram according to the system,
+// the number of particles and the streaming flag.
+// The resampling workspaces are (re-)allocated as well.
+
+- (void) freeResamplingWorkspaces;
+
+- (void) notifyDelegateOfStepAtIndex: (unsigned)index;
+// Hands the generation to the generation writer, if any, and sends
+// particleFilter:didFinishStepAtIndex: to the delegate if it implements
+// the method.
+
+- (void) beginStepWithContext: (PFStepContext *)context;
+// Begins the record of the step, if there is a profiler, and fills in
+// the storage of the step at context -> index.
+
+- (double) predictAndWeightWithContext: (PFStepContext *)context;
+// Propagates the particles and evaluates the importance weights chunk by
+// chunk on the thread pool.
+// Returns the sum of the weights.
+
+- (void) normalizeWeights: (double)wSum
+       andResampleAtIndex: (unsigned)index;
+// Normalizes the importance weights at the index given and
+// resamples the predicted particles according to the scheme.
+
+- (void) accumulateLogLikelihood: (double)increment
+                         atIndex: (unsigned)index;
+// Adds log p(y_t | y_1:t-1) of the step to the log marginal likelihood.
+
+- (void) normalizeWeights: (double)wSum
+                  atIndex: (unsigned)index;
+// Divides the weights at the index given by their sum, and records the
+// effective sample size and the weighted moments of the predicted states
+// (see getMomentsOfStates:weights:normalizingBy:atIndex:).
+
+- (void) adoptPredictedStatesAtIndex: (unsigned)index;
+// Makes the predicted states the particles at the index given.  They are
+// copied, so particlesPredicted keeps the predictions, except in
+// streaming mode, where the two are exchanged without copying.
+
+- (unsigned) distinctAncestorsAtIndex: (unsigned)index;
+// The number of particles at the previous step with at least one child.
+// It marks them in a resampling workspace.
+
+- (void) getMomentsOfParticlesAtIndex: (unsigned)index;
+// Calculates the moments of the particles at the index given with their
+// weights, e.g., of the initial particles.
+
+- (double) getMomentsOfStates: (const double *)x
+                      weights: (double *)w
+                normalizingBy: (double)wSum
+                      atIndex: (unsigned)index;
+// Divides the weights w by wSum, calculates the weighted mean and
+// covariance of the states x (rows of particleStride doubles) into
+// lastMean and lastCovariance, and writes them to the columns of the
+// index given.  Returns the sum of the squared weights (after division).
+// The division, that sum and the moments of the first component take one
+// pass over the particles, each other component one more, and each pair
+// of components one more for their covariance.
+
+- (void) allocateLagBuffers;
+// (Re-)allocates the ring of fixed-lag smoothing and the smoothed
+// estimates according to the lag, the system and the number of
+// particles.  They are freed if the lag is 0.
+
+- (void) smoothAtIndex: (unsigned)index;
+// Puts the generation at the index given into the ring, and estimates the
+// states smoothingLag steps behind.
+
+- (void) getMean: (double *)mean
+          stride: (unsigned)ld
+         withLag: (unsigned)lag
+ofAncestorsAtIndex: (unsigned)index;
+// Calculates the weighted mean of the ancestors, lag steps behind, of the
+// particles at the index given.  lag must not exceed smoothingLag.
+// The i'th component (0-based) is written to mean[i*ld].
+
+- (void) finishSmoothing;
+// Smooths the last smoothingLag estimates of estimateStates with the
+// lags which remain.
+
 - (BOOL) bernoulli;
 // This function mimics Bernoulli trial.
 
+- (unsigned) occupyRandomSlotPreferring: (unsigned)n;
+// Occupies the n'th slot of the generator if it is free, or else the
+// slot suggested by the generator.  Returns the slot, or 0 if none is
+// free.
+
+- (void) freeRandomSlots;
+// Hands the slots of the resampler, the Bernoulli trials and the
+// parameters back to the generator.
+
+- (double) measurementComparisonError;
+// The RMS of the difference between the measurements of the system and
+// the noise-free measurements of the estimated states.
+// It is the objective of estimateParametersUsingMeasurementComparison.
+
+- (void) evaluateObjectivesAtVertices: (NSArray *)points
+                                cache: (NSMutableDictionary *)cache;
+// Evaluates the objective at the points (column vectors of parameters)
+// which are not in the cache yet, and adds the values to the cache.
+// Each point is evaluated by an independent filter with a copy of the
+// system, and the filters run on the thread pool if the system is
+// thread-safe.
+
+- (double) objectiveAtVertex: (MathMatrix *)point
+                       cache: (NSMutableDictionary *)cache;
+// The objective at a point, which is evaluated only if it is not in the
+// cache.
+
 @end
 
 
 
+// Propagates the particles in [begin, end) from the previous step, or
+// moves them to their look-ahead points in the first stage of the
+// auxiliary particle filter.
+// Each call has its own autorelease pool since it may run on a thread
+// of the pool.
+static void PropagateChunk (void *context,
+                            unsigned begin, unsigned end, unsigned chunk) {
+	
+	PFStepContext *c = (PFStepContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	
+	// The counter-based streams address the numbers of a particle by its
+	// index in the whole population.
+	[RandomNumberGenerator setParticleOffset:begin];
+	
+	if ( c -> isLookAhead ) {
+		if ( c -> isTimeBased ) {
+			[c -> system getPointPredictions: c -> pred + begin
+			                        fromTime: c -> t0
+			                          toTime: c -> t1
+			               withCurrentStates: c -> prev + begin
+			                           count: end - begin
+			                          stride: c -> ld];
+		} else {
+			[c -> system getPointPredictions: c -> pred + begin
+			                     atTimeIndex: c -> index
+			               withCurrentStates: c -> prev + begin
+			                           count: end - begin
+			                          stride: c -> ld];
+		}
+	} else if ( c -> isTimeBased ) {
+		[c -> system getNextStates: c -> pred + begin
+		                  fromTime: c -> t0
+		                    toTime: c -> t1
+		         withCurrentStates: c -> prev + begin
+		                     count: end - begin
+		                    stride: c -> ld
+		                   control: nil];
+	} else {
+		[c -> system getNextStates: c -> pred + begin
+		               atTimeIndex: c -> index
+		         withCurrentStates: c -> prev + begin
+		                     count: end - begin
+		                    stride: c -> ld
+		                   control: nil];
+	}
+	
+	[RandomNumberGenerator setParticleOffset:0UL];
+	[pool release];
+}
+
+// Evaluates the predicted measurements and the weights in [begin, end),
+// and sums up the weights of the chunk into partialSums[chunk].
+static void WeightChunk (void *context,
+                         unsigned begin, unsigned end, unsigned chunk) {
+	
+	PFStepContext *c = (PFStepContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	double *w = c -> w;
+	double sum = 0.0;
+	unsigned i;
+	
+	if ( c -> isTimeBased ) {
+		[c -> system getNoiseFreeMeasurements: c -> predMeasure + begin
+		                               atTime: c -> t1
+		                    withCurrentStates: c -> pred + begin
+		                                count: end - begin
+		                               stride: c -> ld];
+		
+		[c -> system importanceWeights: w + begin
+		                        atTime: c -> t1
+		                forMeasurement: c -> y
+		             measurementStride: c -> ldy
+		     withPredictedMeasurements: c -> predMeasure + begin
+		                         count: end - begin
+		                        stride: c -> ld];
+	} else {
+		[c -> system getNoiseFreeMeasurements: c -> predMeasure + begin
+		                          atTimeIndex: c -> index
+		                    withCurrentStates: c -> pred + begin
+		                                count: end - begin
+		                               stride: c -> ld];
+		
+		[c -> system importanceWeights: w + begin
+		                   atTimeIndex: c -> index
+		     withPredictedMeasurements: c -> predMeasure + begin
+		                         count: end - begin
+		                        stride: c -> ld];
+	}
+	
+	// only for the profiler; it costs a pass over the chunk
+	if ( c -> nanCounts ) {
+		c -> nanCounts[chunk] = 0UL;
+		c -> zeroCounts[chunk] = 0UL;
+		for ( i = begin; i < end; i++ ) {
+			if ( isnan(w[i]) ) {
+				c -> nanCounts[chunk]++;
+			} else if ( w[i] == 0.0 ) {
+				c -> zeroCounts[chunk]++;
+			}
+		}
+	}
+	
+	for ( i = begin; i < end; i++ ) {
+		// A particle whose likelihood is not finite, e.g., one whose state
+		// has become NaN, gets no weight at all, so it is never resampled
+		// and is left out of the moments (see normalizeWeights:atIndex:).
+		if ( isfinite(w[i]) ) {
+			w[i] += CONST_WEIGHT_EPS;
+		} else {
+			w[i] = 0.0;
+		}
+		
+		// The auxiliary particle filter keeps the likelihoods at the
+		// look-ahead points, and divides the likelihoods of the children
+		// by those of their parents.
+		if ( c -> isLookAhead ) {
+			c -> lookAhead[i] = w[i];
+		} else if ( c -> ancestors ) {
+			w[i] /= c -> lookAhead[c -> ancestors[i]];
+		}
+		
+		// if the last step did not resample, its weights are carried forward
+		if ( c -> prevW ) {
+			w[i] *= c -> prevW[i];
+		}
+		sum += w[i];
+	}
+	c -> partialSums[chunk] = sum;
+	
+	[pool release];
+}
+
+// Propagates and weights the particles in [begin, end), each with its own
+// parameters, by the per-particle methods of the system which take
+// parameters.  Each particle draws its noise at its index.
+static void PropagateAndWeightWithParametersChunk (void *context,
+                                                   unsigned begin,
+                                                   unsigned end,
+                                                   unsigned chunk) {
+	
+	PFStepContext *c = (PFStepContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	GenericSystem *system = c -> system;
+	unsigned xdim = [system dimX];
+	unsigned d = c -> parameterCount;
+	MathMatrix *state = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:xdim];
+	MathMatrix *next = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                    height:xdim];
+	MathMatrix *params = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                      height:d];
+	MathMatrix *y = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                 height:[system dimY]];
+	double *s = [state doubleElements];
+	double *p = [next doubleElements];
+	double *q = [params doubleElements];
+	double *w = c -> w;
+	double sum = 0.0;
+	unsigned i, k;
+	
+	// the index'th (0-based) measurement
+	[[system Y] getVector:y atColumn:(c -> index + 1)];
+	
+	if ( c -> nanCounts ) {
+		c -> nanCounts[chunk] = 0UL;
+		c -> zeroCounts[chunk] = 0UL;
+	}
+	
+	for ( i = begin; i < end; i++ ) {
+		for ( k = 0; k < xdim; k++ ) {
+			s[k] = c -> prev[k*(c -> ld) + i];
+		}
+		for ( k = 0; k < d; k++ ) {
+			q[k] = c -> theta[k*(c -> count) + i];
+		}
+		
+		[RandomNumberGenerator setParticleOffset:i];
+		[system getNextState: next
+		         atTimeIndex: c -> index
+		    withCurrentState: state
+		          parameters: params
+		             control: nil];
+		for ( k = 0; k < xdim; k++ ) {
+			c -> pred[k*(c -> ld) + i] = p[k];
+		}
+		
+		w[i] = [system probabilityOf: y
+		                       given: next
+		                 atTimeIndex: c -> index
+		              withParameters: params];
+		
+		// only for the profiler
+		if ( c -> nanCounts ) {
+			if ( isnan(w[i]) ) {
+				c -> nanCounts[chunk]++;
+			} else if ( w[i] == 0.0 ) {
+				c -> zeroCounts[chunk]++;
+			}
+		}
+		
+		// no weight for a likelihood which is not finite, as in WeightChunk
+		if ( isfinite(w[i]) ) {
+			w[i] += CONST_WEIGHT_EPS;
+		} else {
+			w[i] = 0.0;
+		}
+		
+		// if the last step did not resample, its weights are carried forward
+		if ( c -> prevW ) {
+			w[i] *= c -> prevW[i];
+		}
+		sum += w[i];
+	}
+	c -> partialSums[chunk] = sum;
+	
+	[RandomNumberGenerator setParticleOffset:0UL];
+	[state release];
+	[next release];
+	[params release];
+	[y release];
+	[pool release];
+}
+
+// sum_j w_j d_j and sum_j w_j d_j^2 over the n particles into m and s,
+// where d_j = a_j - sa for a row a of the states.  A particle whose
+// deviation is not finite adds nothing, so the states of the particles
+// without weights, which may be NaN, cannot spoil the sums.  The test is
+// a select rather than a branch, and the four partial sums let the
+// compiler vectorize the loop without reordering the additions itself.
+static inline void WeightedDeviations (const double *w,
+                                       const double *a, double sa,
+                                       unsigned n,
+                                       double *m, double *s) {
+	double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double sq[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double d;
+	unsigned j, q;
+	
+	for ( j = 0; j + 4 <= n; j += 4 ) {
+		for ( q = 0; q < 4; q++ ) {
+			d = a[j + q] - sa;
+			d = ( d - d == 0.0 ) ? d : 0.0;	// 0 for NaN and infinity
+			sum[q] += w[j + q]*d;
+			sq[q] += w[j + q]*d*d;
+		}
+	}
+	for ( ; j < n; j++ ) {
+		d = a[j] - sa;
+		d = ( d - d == 0.0 ) ? d : 0.0;
+		sum[0] += w[j]*d;
+		sq[0] += w[j]*d*d;
+	}
+	*m = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	*s = (sq[0] + sq[1]) + (sq[2] + sq[3]);
+}
+
+// The same as WeightedDeviations, but the weights are divided by wSum in
+// the same pass.  Returns sum_j w_j^2 of the divided weights.
+static inline double NormalizeWithDeviations (double *restrict w, double wSum,
+                                              const double *a, double sa,
+                                              unsigned n,
+                                              double *m, double *s) {
+	double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double sq[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double wSq[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double d;
+	unsigned j, q;
+	
+	for ( j = 0; j + 4 <= n; j += 4 ) {
+		for ( q = 0; q < 4; q++ ) {
+			w[j + q] /= wSum;
+			wSq[q] += w[j + q]*w[j + q];
+			d = a[j + q] - sa;
+			d = ( d - d == 0.0 ) ? d : 0.0;
+			sum[q] += w[j + q]*d;
+			sq[q] += w[j + q]*d*d;
+		}
+	}
+	for ( ; j < n; j++ ) {
+		w[j] /= wSum;
+		wSq[0] += w[j]*w[j];
+		d = a[j] - sa;
+		d = ( d - d == 0.0 ) ? d : 0.0;
+		sum[0] += w[j]*d;
+		sq[0] += w[j]*d*d;
+	}
+	*m = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	*s = (sq[0] + sq[1]) + (sq[2] + sq[3]);
+	return (wSq[0] + wSq[1]) + (wSq[2] + wSq[3]);
+}
+
+// sum_j w_j (a_j - sa)(b_j - sb), as above for two rows of the states
+static inline double WeightedCodeviations (const double *w,
+                                           const double *a, double sa,
+                                           const double *b, double sb,
+                                           unsigned n) {
+	double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+	double d;
+	unsigned j, q;
+	
+	for ( j = 0; j + 4 <= n; j += 4 ) {
+		for ( q = 0; q < 4; q++ ) {
+			d = (a[j + q] - sa)*(b[j + q] - sb);
+			d = ( d - d == 0.0 ) ? d : 0.0;
+			sum[q] += w[j + q]*d;
+		}
+	}
+	for ( ; j < n; j++ ) {
+		d = (a[j] - sa)*(b[j] - sb);
+		sum[0] += ( d - d == 0.0 ) ? w[j]*d : 0.0;
+	}
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+// Estimates the states with the filters in [begin, end) and evaluates the
+// objective of each.
+static void VertexObjectiveChunk (void *context,
+                                  unsigned begin, unsigned end, unsigned chunk) {
+	
+	VertexObjectiveContext *c = (VertexObjectiveContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	unsigned q;
+	
+	for ( q = begin; q < end; q++ ) {
+		[c -> filters[q] estimateStates];
+		c -> objectives[q] = [c -> filters[q] measurementComparisonError];
+	}
+	
+	[pool release];
+}
+
+// The key of a vertex in the cache of the objective, i.e., its elements
+static NSData *VertexKey (MathMatrix *v) {
+	return [NSData dataWithBytes:[v elements]
+	                      length:([v count] * sizeof(double))];
+}
+
+static double ObjectiveOfVertex (NSDictionary *cache, MathMatrix *v) {
+	return [[cache objectForKey:VertexKey(v)] doubleValue];
+}
+
+// orders vertices by their objectives in the cache (context)
+static NSInteger CompareObjectivesOfVertices (id a, id b, void *context) {
+	double fa = ObjectiveOfVertex((NSDictionary *)context, (MathMatrix *)a);
+	double fb = ObjectiveOfVertex((NSDictionary *)context, (MathMatrix *)b);
+	
+	return ( fa < fb ) ? NSOrderedAscending :
+	       ( ( fa > fb ) ? NSOrderedDescending : NSOrderedSame );
+}
+
+// A new (retained) column vector, from + s*(to - from)
+static MathMatrix *NewPointAlong (MathMatrix *from, MathMatrix *to, double s) {
+	MathMatrix *p = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                 height:[from count]];
+	double *x = [from doubleElements], *y = [to doubleElements];
+	unsigned i;
+	
+	for ( i = 0; i < [from count]; i++ ) {
+		[p doubleElements][i] = x[i] + s*(y[i] - x[i]);
+	}
+	return p;
+}
+
+// Runs the rollouts in [begin, end) over the window of the k'th iteration.
+// Each rollout continues from the last state of its previous window, and
+// draws its noise at its own position of the counter-based streams.
+static void SPSARolloutChunk (void *context,
+                              unsigned begin, unsigned end, unsigned chunk) {
+	
+	SPSAContext *c = (SPSAContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	unsigned L = c -> windowSize;
+	unsigned i, j, q, r, im1, ti;
+	MathMatrix *X, *Y, *theta;
+	
+	for ( q = begin; q < end; q++ ) {
+		j = q / 4;
+		r = q % 4;
+		X = c -> states[q];
+		Y = ( r >= 2 ) ? c -> measurements[2*j + r - 2] : nil;
+		theta = ( r % 2 == 0 ) ? c -> thetaPlus[j] : c -> thetaMinus[j];
+		
+		[RandomNumberGenerator setParticleOffset:q];
+		
+		for ( i = 0; i < L; i++ ) {
+			im1 = ( i == 0 ) ? L : i;
+			ti = (c -> k - 1)*L + i;
+			
+			// previous state -> next state
+			[X getVector:c -> stateIn[q] atColumn:im1];
+			[c -> system getNextState: c -> stateOut[q]
+			              atTimeIndex: ti
+			         withCurrentState: c -> stateIn[q]
+			               parameters: theta
+			                  control: nil];
+			[X setVector:c -> stateOut[q] atColumn:(i + 1)];
+			
+			// Y+ or Y-
+			if ( Y ) {
+				[c -> system getMeasurement: c -> measurementOut[q]
+				                atTimeIndex: (ti + 1)
+				           withCurrentState: c -> stateOut[q]
+				                 parameters: theta];
+				[Y setVector:c -> measurementOut[q] atColumn:(i + 1)];
+			}
+		}
+	}
+	
+	[RandomNumberGenerator setParticleOffset:0UL];
+	[pool release];
+}
+
+// Estimates the gradients of the directions in [begin, end) from their
+// rollouts, i.e.,
+//   g_{theta+}(Y+ | X+) - g_{theta+}(Y | X+)
+//     - g_{theta-}(Y- | X-) + g_{theta-}(Y | X-)
+// over the window, which is divided by c_k*delta later.
+static void SPSAGradientChunk (void *context,
+                               unsigned begin, unsigned end, unsigned chunk) {
+	
+	SPSAContext *c = (SPSAContext *)context;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	unsigned L = c -> windowSize;
+	unsigned i, j, ti;
+	double grad1, grad2, grad3, grad4;
+	MathMatrix *x, *y, *y_temp;
+	
+	for ( j = begin; j < end; j++ ) {
+		// the temporary storage of the rollouts of the direction
+		x = c -> stateIn[4*j];
+		y = c -> measurementOut[4*j];
+		y_temp = c -> measurementOut[4*j + 1];
+		
+		grad1 = grad2 = grad3 = grad4 = 1.0;
+		for ( i = 1; i <= L; i++ ) {
+			ti = (c -> k - 1)*L + i;
+			
+			// actual measurement of the system
+			[[c -> system Y] getVector:y atColumn:ti];
+			
+			// 1. g_{thata+}(Y+ | X+)
+			[c -> measurements[2*j] getVector:y_temp atColumn:i];
+			[c -> states[4*j] getVector:x atColumn:i];
+			
+			grad1 *= [c -> system probabilityOf: y_temp
+			                              given: x
+			                        atTimeIndex: ti
+			                     withParameters: c -> thetaPlus[j]];
+			
+			// 2. g_{theta+}(Y | X+)
+			grad2 *= [c -> system probabilityOf: y
+			                              given: x
+			                        atTimeIndex: ti
+			                     withParameters: c -> thetaPlus[j]];
+			
+			// 3. g_{theta-}(Y- | X-)
+			[c -> measurements[2*j + 1] getVector:y_temp atColumn:i];
+			[c -> states[4*j + 1] getVector:x atColumn:i];
+			
+			grad3 *= [c -> system probabilityOf: y_temp
+			                              given: x
+			                        atTimeIndex: ti
+			                     withParameters: c -> thetaMinus[j]];
+			
+			// 4. g_{theta-}(Y | X-)
+			grad4 *= [c -> system probabilityOf: y
+			                              given: x
+			                        atTimeIndex: ti
+			                     withParameters: c -> thetaMinus[j]];
+		}
+		c -> grads[j] = grad1 - grad2 - grad3 + grad4;
+	}
+	
+	[pool release];
+}
+
+
+
 // *****************************************************************************
 //
 //  IMPLEMENTATION BEGINS HERE
@@ -100,32 +842,45 @@ enum {
             withSelectionScheme: PF_CONST_RESAMPLE_MULTINOMIAL];
 }
 
-// this is the designated initializer of this class
 - (id) initWithCapacity: (unsigned)num
               forSystem: (GenericSystem *)theSystem
     withSelectionScheme: (unsigned)theScheme {
+	return [self initWithCapacity: num
+	                    forSystem: theSystem
+	          withSelectionScheme: theScheme
+	                    streaming: NO];
+}
+
+// this is the designated initializer of this class
+- (id) initWithCapacity: (unsigned)num
+              forSystem: (GenericSystem *)theSystem
+    withSelectionScheme: (unsigned)theScheme
+              streaming: (BOOL)flag {
   
 	unsigned i, timeCount;
-	unsigned dimX, dimY;
+	unsigned dimX;
 	double step;
 	
 	iterationLimit = 200UL;
+	resampleThreshold = 1.0;	// resample at every step
+	threadCount = 1UL;			// serial
+	SPSADirectionCount = 1UL;	// one perturbation direction per iteration
+	parameterDiscount = CONST_DEFAULT_PARAMETER_DISCOUNT;
 	
 	if (self = [super init]) {
 		count = num;
 		system = theSystem;
 		scheme = theScheme;
+		isStreaming = flag;
 		
 		if ( theSystem ) { // system to estimate is given
 			// get properties of the system
 			timeCount = [[theSystem timeSpan] count];
 			dimX = [theSystem dimX];
-			dimY = [theSystem dimY];
       
 			// set the domain of histogram to the default values
-			domain = [[MathMatrix alloc] initWithType:@"double"
-                                          width:(CONST_DEFAULT_DOMAIN_NUM_STEP + 1)
-                                         height:1UL];
+			domain = [[MathMatrix alloc] initDoubleWithWidth:(CONST_DEFAULT_DOMAIN_NUM_STEP + 1)
+			                                          height:1UL];
 			
 			step = (double)CONST_DEFAULT_DOMAIN_UPPER_BOUND
       - (double)CONST_DEFAULT_DOMAIN_LOWER_BOUND;
@@ -137,11 +892,22 @@ enum {
 			}
 			
 			// allocate resource for storage of estimated states
-			estimate = [[MathMatrix alloc] initWithType:@"double"
-                                            width:timeCount
-                                           height:dimX];
+			estimate = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                            height:dimX];
+			estimateVariance = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                                    height:dimX];
+			estimateCovariance = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                                      height:dimX*dimX];
+			lastCovariance = [[MathMatrix alloc] initDoubleWithWidth:dimX
+			                                                  height:dimX];
+			lastMean = (double *)calloc(2*dimX, sizeof(double));
+			effectiveSampleSizes = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                                        height:1UL];
+			logLikelihoodIncrements = [[MathMatrix alloc] initDoubleWithWidth:timeCount
+			                                                           height:1UL];
 			
 			// allocate arrays
+			populations = [[NSMutableArray alloc] init];
 			particles = [[NSMutableArray alloc] init];
 			weights = [[NSMutableArray alloc] init];
 			particlesPredicted = [[NSMutableArray alloc] init];
@@ -149,45 +915,47 @@ enum {
 			histogram = [[NSMutableArray alloc] init];
 			
 			// add data structures to corresponding arrays
-			for ( i = 0; i < timeCount; i++ ) {
-				// particles, particlesPredicted and histogram
-				[particles addObject:
-         [[MathMatrix alloc] initWithType:@"double"
-                                    width:count
-                                   height:dimX]];
-				
-				[particlesPredicted addObject:
-         [[MathMatrix alloc] initWithType:@"double"
-                                    width:count
-                                   height:dimX]];
-				
-				[histogram addObject:
-         [[MathMatrix alloc] initWithType:@"unsigned"
-                                    width:CONST_DEFAULT_DOMAIN_NUM_STEP
-                                   height:dimX]];
-				
-				[measurementsPredicted addObject:
-         [[MathMatrix alloc] initWithType:@"double"
-                                    width:count
-                                   height:dimY]];
-				
-				[weights addObject:
-         [[MathMatrix alloc] initWithType:@"double"
-                                    width:count
-                                   height:1UL]];
-			}
+			[self allocateGenerations];
 		}
 	}
 	return self;
 }
 
 - (void) dealloc {
+	ThreadPoolDestroy(threadPool);
+	free(partialSums);
+	free(nanCounts);
+	free(zeroCounts);
+	[self freeResamplingWorkspaces];
+	
 	[domain release];
 	[estimate release];
+	[estimateVariance release];
+	[estimateCovariance release];
+	[lastCovariance release];
+	free(lastMean);
+	[effectiveSampleSizes release];
+	[logLikelihoodIncrements release];
+	[generationWriter release];
+	[profiler release];
+	[genealogy release];
+	[smoothedEstimate release];
+	[lastSmoothedEstimate release];
+	free(lagStates);
+	free(lagAncestors);
+	free(lagLineages);
+	[parameterPriorScales release];
+	[parameterParticles release];
+	[parameterProposals release];
+	[parameterEstimate release];
+	free(parameterWorkspace);
 	
 	[particles removeAllObjects];
 	[particles release];
 	
+	[populations removeAllObjects];
+	[populations release];
+	
 	[weights removeAllObjects];
 	[weights release];
 	
@@ -199,6 +967,10 @@ enum {
 	
 	[histogram removeAllObjects];
 	[histogram release];
+	
+	// The slots are free for the next filter sharing the generator.
+	[self freeRandomSlots];
+	[RNGenerator release];
   
   //	[system release];
 	
@@ -270,7 +1042,8 @@ enum {
 		domain = theDomain;
 		
 		newHistogram = [[NSMutableArray alloc] init];
-		for ( i = 0; i < [[system timeSpan] count]; i++ ) {
+		// The histogram is not available in streaming mode.
+		for ( i = 0; !isStreaming && i < [[system timeSpan] count]; i++ ) {
 			[newHistogram addObject:[[MathMatrix alloc]
                                initWithType:@"unsigned"
                                width:([domain count] - 1)
@@ -301,7 +1074,19 @@ enum {
 }
 
 - (void) setScheme:(unsigned)theScheme {
-	scheme = theScheme;
+	switch ( theScheme ) {
+		case PF_CONST_RESAMPLE_RESIDUAL:
+		case PF_CONST_RESAMPLE_SYSTEMATIC:
+		case PF_CONST_RESAMPLE_MULTINOMIAL:
+		case PF_CONST_RESAMPLE_STRATIFIED:
+			scheme = theScheme;
+			break;
+			
+		default:
+			NSLog(@"Unknown resampling scheme %u. The scheme is not changed.",
+			      theScheme);
+			break;
+	}
 }
 
 // random number generator
@@ -310,7 +1095,11 @@ enum {
 }
 
 - (void)setRNGIDForResampler: (unsigned)genId {
+	if ( genId == RNGIDForResampler ) {
+		return;
+	}
 	if ( [RNGenerator occupySlot:genId] ) {
+		[RNGenerator freeSlot:RNGIDForResampler];
 		RNGIDForResampler = genId;
 	} else {
 		NSLog(@"Setting RNG id for resampler failed.");
@@ -322,22 +1111,53 @@ enum {
 }
 
 - (void)setRNGIDForBernoulli: (unsigned)genId {
+	if ( genId == RNGIDForBernoulli ) {
+		return;
+	}
 	if ( [RNGenerator occupySlot:genId] ) {
+		[RNGenerator freeSlot:RNGIDForBernoulli];
 		RNGIDForBernoulli = genId;
 	} else {
 		NSLog( @"Setting RNG id for estimator failed.");
 	}
 }
 
+- (unsigned)RNGIDForParameters {
+	return RNGIDForParameters;
+}
+
+- (void)setRNGIDForParameters: (unsigned)genId {
+	if ( genId == RNGIDForParameters ) {
+		return;
+	}
+	if ( [RNGenerator occupySlot:genId] ) {
+		[RNGenerator freeSlot:RNGIDForParameters];
+		RNGIDForParameters = genId;
+	} else {
+		NSLog(@"Setting RNG id for parameters failed.");
+	}
+}
+
 - (RandomNumberGenerator *)RNGenerator {
 	return RNGenerator;
 }
 
 - (void)setRNGenerator: (RandomNumberGenerator *)gen {
 	[gen retain];
+	[self freeRandomSlots];
 	[RNGenerator release];
 	
 	RNGenerator = gen;
+	
+	// The resampler, the Bernoulli trials and the parameters draw from
+	// slots of their own, which are held until the filter is deallocated
+	// or given another generator.  The ids set before are kept if they
+	// are free in the new generator.
+	if ( RNGenerator ) {
+		RNGIDForResampler = [self occupyRandomSlotPreferring:RNGIDForResampler];
+		RNGIDForBernoulli = [self occupyRandomSlotPreferring:RNGIDForBernoulli];
+		RNGIDForParameters = [self occupyRandomSlotPreferring:RNGIDForParameters];
+	}
 }
 
 // accessors for windowSize
@@ -358,117 +1178,559 @@ enum {
 	iterationLimit = il;
 }
 
+// accessors for parallel execution
+- (unsigned) threadCount {
+	return threadCount;
+}
 
-- (BOOL)isStateEstimator {
-	return isStateEstimator;
+- (void) setThreadCount: (unsigned)n {
+	if ( n < 1 ) {
+		NSLog(@"The number of threads must be at least 1.");
+		return;
+	}
+	
+	ThreadPoolDestroy(threadPool);
+	threadPool = NULL;
+	threadCount = n;
+	if ( n > 1 ) {
+		ThreadPoolEnterMultiThreadedMode();
+		threadPool = ThreadPoolCreate(n);
+		if ( !threadPool ) {
+			NSLog(@"Creating %u threads failed. The filter runs serially.", n);
+			threadCount = 1UL;
+		}
+	}
 }
 
-- (void)enableStateEstimator: (BOOL)flag {
-	isStateEstimator = flag;
+// accessors for SPSA
+- (unsigned) SPSADirectionCount {
+	return SPSADirectionCount;
 }
 
-- (BOOL)isParameterEstimator {
-	return isParameterEstimator;
+- (void) setSPSADirectionCount: (unsigned)n {
+	if ( n == 0 ) {
+		NSLog(@"At least one direction is needed.");
+		return;
+	}
+	SPSADirectionCount = n;
 }
 
-- (void)enableParameterEstimator : (BOOL)flag {
-	isParameterEstimator = flag;
+// accessors for adaptive resampling
+- (double) resampleThreshold {
+	return resampleThreshold;
 }
 
-// Note that GenericParticleFilter class does NOT have timeSpan as
-// data member. These access methods returns the timeSpan of system and
-// sets new timeSpan of the system, respectively.
-// setTimeSpan:(MathMatrix *) method also reallocate resources accordingly.
-- (MathMatrix *) timeSpan {
-	return [system timeSpan];
+- (void) setResampleThreshold: (double)ratio {
+	if ( ratio <= 0.0 || ratio > 1.0 ) {
+		NSLog(@"The threshold ratio must be in (0, 1].");
+		return;
+	}
+	resampleThreshold = ratio;
 }
 
-- (void) setTimeSpan: (MathMatrix *)newTimeSpan {
-	[system setTimeSpan: newTimeSpan];
-	[self reallocResourcesWithNewSystem];
+- (MathMatrix *) effectiveSampleSizes {
+	return effectiveSampleSizes;
 }
 
+// accessors for the marginal likelihood
+- (double) logMarginalLikelihood {
+	return logLikelihood;
+}
 
-// *****************************************************************************
-//
-//  ENGINE METHODS
-//
-// *****************************************************************************
-#pragma mark -
-#pragma mark Engine Methods
+- (double) lastLogLikelihoodIncrement {
+	return lastLogLikelihoodIncrement;
+}
 
-- (void) estimateStates {
-	unsigned i, tmax;
-	
-	// 1. initialize particle filter
-	[self initializeParticleFilter];
-	[self estimateStatesAtIndex: 0];
-	
-	// 2. iterate importance sampling and resampling steps
-	tmax = [[system timeSpan] count];
-	for ( i = 1; i < tmax; i++ ) {  // i is 0-based index
-		// 2a. importance sampling and resample step
-		[self importanceSampleAtIndex:i];
-		
-		// 2b. estimate states by calculating the mean of particles
-		[self estimateStatesAtIndex: i];
-	}
+- (MathMatrix *) logLikelihoodIncrements {
+	return logLikelihoodIncrements;
 }
 
-- (void) estimateStatesAtIndex: (unsigned)index {
-	unsigned i, j, ctr;
-	double sum, val;
-	
-	// index means time
-	MathMatrix *currentParticles = [particles objectAtIndex:index];
-	
-	for ( i = 1; i <= [system dimX]; i++ ) {	// estimate i'th component
-		sum = 0.0;
-		ctr = 0UL;
-		for ( j = 1; j <= count; j++ ) {	// there are (count) particles
-			val = [currentParticles doubleValueAtRow:i column:j];
-			if ( isnan(val) ) {	// val is NaN
-				NSLog(@"NaN occurred in [GenericParticleFilter estimateStatesAtIndex:");
-				continue;
-			} else {
-				sum += val;
-				ctr++;
-			}
-      
+- (double) lastEffectiveSampleSize {
+	return lastESS;
+}
+
+- (BOOL) isLastStepResampled {
+	return lastStepResampled;
+}
+
+- (unsigned) resampleCount {
+	return resampleCount;
+}
+
+// accessors for streaming mode
+- (BOOL) isStreaming {
+	return isStreaming;
+}
+
+- (void) enableStreaming: (BOOL)flag {
+	if ( isStreaming != flag ) {
+		isStreaming = flag;
+		if ( system ) { // The particle filter is connected to a system.
+			[self reallocResourcesWithNewSystem];
 		}
-		sum /= (double)ctr;
-    
-		// write the mean of the i'th component
-		[estimate setDoubleValue:sum atRow:i column:(index + 1)];
 	}
 }
 
-// parameter estimator (auxiliary particle filter)
-- (void) estimateParametersUsingAuxParticleFilter {
-	
+// accessors for the auxiliary particle filter
+- (BOOL) isAuxiliaryFilter {
+	return isAuxiliaryFilter;
 }
 
-// parameter estimator (measurement comparison method)
-- (void) estimateParametersUsingMeasurementComparison {
-  
-	// Here, I adopt Nelder-Mead simplex (amoeba) algorithm.
-	// The summary of the algorithm is as follows:
-	// =========================================================================
-	// The amoeba algorithm maintains at each iteration a nondegenerate simplex,
-	// a geometric figure in n dimensions of nonzero volume that is the
-	// convex hull of n+1 vertices, x_0, x_1, ... , x_n, and their respective
-	// function values.
-	// In each iteration, new points are computed, along with their function values,
-	// to form a new simplex. The algorithm terminates when the function values
-	// at the vertices of the simplex satisfy a predetermined condition.
-	//
-	// One iteration of the amoeba algorithm consists of the following steps:
-	//
-	// 1. Order: Order and re-label the n+1 vertices as x_0, x_1, ... , x_n,
-	//    such that F(x_0) <= F(x_1) <= ... <= F(x_n).
-	//    Since we want to minimize, we refer to x_0 as the best vertex or point,
-	//    to x_n as the worst point, and to x_{n-1} as the next-worst point.
-	//    Let \overline{x} refer to the centroid of the n best points in the vertex
+- (void) enableAuxiliaryFilter: (BOOL)flag {
+	isAuxiliaryFilter = flag;
+}
+
+// accessors for delegate
+// Note that the delegate is NOT retained.
+- (id) delegate {
+	return delegate;
+}
+
+- (void) setDelegate: (id)theDelegate {
+	delegate = theDelegate;
+}
+
+- (GenerationWriter *) generationWriter {
+	return generationWriter;
+}
+
+- (void) setGenerationWriter: (GenerationWriter *)writer {
+	[writer retain];
+	[generationWriter release];
+	generationWriter = writer;
+}
+
+- (StepProfiler *) profiler {
+	return profiler;
+}
+
+- (void) setProfiler: (StepProfiler *)theProfiler {
+	[theProfiler retain];
+	[profiler release];
+	profiler = theProfiler;
+	stepRecord = NULL;
+}
+
+- (ParticleGenealogy *) genealogy {
+	return genealogy;
+}
+
+- (void) setGenealogy: (ParticleGenealogy *)theGenealogy {
+	if ( theGenealogy && system && [theGenealogy dimX] != [system dimX] ) {
+		NSLog(@"Dimension mismatch in [GenericParticleFilter setGenealogy:]");
+		return;
+	}
+	[theGenealogy retain];
+	[genealogy release];
+	genealogy = theGenealogy;
+}
+
+// accessors for a generation at a time index
+- (MathMatrix *) particlesAtIndex: (unsigned)index {
+	return [particles objectAtIndex:[self slotForIndex:index]];
+}
+
+- (MathMatrix *) weightsAtIndex: (unsigned)index {
+	return [weights objectAtIndex:[self slotForIndex:index]];
+}
+
+- (MathMatrix *) particlesPredictedAtIndex: (unsigned)index {
+	return [particlesPredicted objectAtIndex:[self slotForIndex:index]];
+}
+
+- (MathMatrix *) measurementsPredictedAtIndex: (unsigned)index {
+	return [measurementsPredicted objectAtIndex:[self slotForIndex:index]];
+}
+
+- (ParticlePopulation *) populationAtIndex: (unsigned)index {
+	return [populations objectAtIndex:[self slotForIndex:index]];
+}
+
+- (MathMatrix *) estimate {
+	return estimate;
+}
+
+- (MathMatrix *) estimateVariance {
+	return estimateVariance;
+}
+
+- (MathMatrix *) estimateCovariance {
+	return estimateCovariance;
+}
+
+- (MathMatrix *) lastCovariance {
+	return lastCovariance;
+}
+
+- (unsigned) smoothingLag {
+	return smoothingLag;
+}
+
+- (void) setSmoothingLag: (unsigned)L {
+	smoothingLag = L;
+	if ( system ) {
+		[self allocateLagBuffers];
+	}
+}
+
+- (MathMatrix *) smoothedEstimate {
+	return smoothedEstimate;
+}
+
+- (MathMatrix *) lastSmoothedEstimate {
+	return hasSmoothedEstimate ? lastSmoothedEstimate : nil;
+}
+
+- (unsigned) lastSmoothedIndex {
+	return lastSmoothedIndex;
+}
+
+
+- (BOOL)isStateEstimator {
+	return isStateEstimator;
+}
+
+- (void)enableStateEstimator: (BOOL)flag {
+	isStateEstimator = flag;
+}
+
+- (BOOL)isParameterEstimator {
+	return isParameterEstimator;
+}
+
+- (void)enableParameterEstimator : (BOOL)flag {
+	isParameterEstimator = flag;
+}
+
+- (double) parameterDiscount {
+	return parameterDiscount;
+}
+
+- (void) setParameterDiscount: (double)delta {
+	if ( delta <= 0.0 || delta > 1.0 ) {
+		NSLog(@"The discount factor must be in (0, 1].");
+		return;
+	}
+	parameterDiscount = delta;
+}
+
+- (MathMatrix *) parameterPriorScales {
+	return parameterPriorScales;
+}
+
+- (void) setParameterPriorScales: (MathMatrix *)scales {
+	if ( scales && system && [scales count] != [[system parameters] count] ) {
+		NSLog(@"Dimension mismatch in [GenericParticleFilter setParameterPriorScales:]");
+		return;
+	}
+	[scales retain];
+	[parameterPriorScales release];
+	
+	parameterPriorScales = scales;
+}
+
+- (MathMatrix *) parameterParticles {
+	return parameterParticles;
+}
+
+- (MathMatrix *) parameterEstimate {
+	return parameterEstimate;
+}
+
+// Note that GenericParticleFilter class does NOT have timeSpan as
+// data member. These access methods returns the timeSpan of system and
+// sets new timeSpan of the system, respectively.
+// setTimeSpan:(MathMatrix *) method also reallocate resources accordingly.
+- (MathMatrix *) timeSpan {
+	return [system timeSpan];
+}
+
+- (void) setTimeSpan: (MathMatrix *)newTimeSpan {
+	[system setTimeSpan: newTimeSpan];
+	[self reallocResourcesWithNewSystem];
+}
+
+
+// *****************************************************************************
+//
+//  ENGINE METHODS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Engine Methods
+
+- (void) estimateStates {
+	unsigned i, tmax;
+	
+	// 1. initialize particle filter
+	[self initializeParticleFilter];
+	[self estimateStatesAtIndex: 0];
+	[self notifyDelegateOfStepAtIndex: 0];
+	
+	// 2. iterate importance sampling and resampling steps
+	tmax = [[system timeSpan] count];
+	for ( i = 1; i < tmax; i++ ) {  // i is 0-based index
+		// 2a. importance sampling and resample step
+		[self importanceSampleAtIndex:i];
+		
+		// 2b. estimate states by calculating the mean of particles
+		[self estimateStatesAtIndex: i];
+		
+		// 2c. hand the generation over to the delegate
+		// (in streaming mode, it is overwritten two steps later)
+		[self notifyDelegateOfStepAtIndex: i];
+	}
+	
+	// 3. smooth the estimates at the end of the time span
+	if ( smoothingLag ) {
+		[self finishSmoothing];
+	}
+}
+
+- (void) estimateStatesAtIndex: (unsigned)index {
+	double phaseStart = 0.0;
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	
+	// The moments of the later steps are made while their weights are
+	// normalized, so only the initial particles are left.
+	if ( index == 0 ) {
+		[self getMomentsOfParticlesAtIndex: 0];
+	}
+	
+	if ( smoothingLag ) {
+		[self smoothAtIndex:index];
+	}
+	
+	PF_PROFILE_END(phaseStart, PF_PHASE_ESTIMATE);
+}
+
+- (void) beginOnlineFilteringAtTime: (double)t0 {
+	if ( !system ) {	// system is NOT specified yet
+		NSLog(@"Online filtering cannot begin.");
+		NSLog(@"System is not specified yet.");
+		return;
+	}
+	
+	// Only the last two generations are needed.
+	// This is the only place where resources are (re-)allocated.
+	[self enableStreaming: YES];
+	[self initializeParticleFilter];
+	
+	isOnline = YES;
+	onlineIndex = 0UL;
+	onlineTime = t0;
+	
+	// the particles at t0 begin the ring of the smoother
+	if ( smoothingLag ) {
+		[self smoothAtIndex:0UL];
+	}
+}
+
+- (BOOL) filterMeasurement: (MathMatrix *)y
+                    atTime: (double)t
+              intoEstimate: (MathMatrix *)est {
+	
+	PFStepContext context;
+	unsigned index;
+	double phaseStart = 0.0;
+	
+	if ( !isOnline ) {
+		NSLog(@"Online filtering has not begun.");
+		NSLog(@"Call beginOnlineFilteringAtTime: first.");
+		return NO;
+	}
+	
+	if ( [y count] != [system dimY] || [est count] != [system dimX] ) {
+		NSLog(@"The dimension of measurement or estimate is wrong.");
+		return NO;
+	}
+	
+	// The propagation needs a positive time step (NaN is rejected, too).
+	if ( !(t > onlineTime) ) {
+		NSLog(@"The measurement at t = %f is not after the last one at t = %f.",
+		      t, onlineTime);
+		return NO;
+	}
+	
+	index = onlineIndex + 1UL;
+	
+	// The same steps as importanceSampleAtIndex: but driven by time
+	// instead of by the time index.
+	context.isTimeBased = YES;
+	context.index = index;
+	context.t0 = onlineTime;
+	context.t1 = t;
+	context.y = (double *)[y elements];
+	context.ldy = 1UL;	// y is a column vector
+	
+	[self beginStepWithContext:&context];
+	if ( isAuxiliaryFilter ) {
+		[self auxiliarySampleWithContext:&context];
+	} else {
+		[self normalizeWeights: [self predictAndWeightWithContext:&context]
+		    andResampleAtIndex: index];
+	}
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	memcpy([est elements], lastMean, [system dimX] * sizeof(double));
+	if ( smoothingLag ) {
+		[self smoothAtIndex:index];
+	}
+	PF_PROFILE_END(phaseStart, PF_PHASE_ESTIMATE);
+	
+	onlineIndex = index;
+	onlineTime = t;
+	
+	[self notifyDelegateOfStepAtIndex: index];
+	return YES;
+}
+
+- (unsigned) onlineStepCount {
+	return onlineIndex;
+}
+
+- (unsigned) replayMeasurementsFromFile: (NSString *)inName
+                                 toFile: (NSString *)outName {
+	unsigned k, steps = 0UL;
+	char line[CONST_REPLAY_LINE_LENGTH];
+	char *p, *end;
+	double t;
+	BOOL isValid;
+	NSString* dir = @"/tmp/";
+	FILE *IN, *OUT;
+	
+	if ( !system ) {	// system is NOT specified yet
+		NSLog(@"System is not specified yet.");
+		return 0UL;
+	}
+	
+	IN = fopen([[dir stringByAppendingString:inName]
+	            cStringUsingEncoding:NSASCIIStringEncoding], "r");
+	if ( !IN ) {	// file open error
+		NSLog(@"Opening the file %@ failed.\n", inName);
+		return 0UL;
+	}
+	OUT = fopen([[dir stringByAppendingString:outName]
+	             cStringUsingEncoding:NSASCIIStringEncoding], "w");
+	if ( !OUT ) {	// file open error
+		NSLog(@"Opening a new file %@ failed.\n", outName);
+		fclose(IN);
+		return 0UL;
+	}
+	
+	MathMatrix *y = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                 height:[system dimY]];
+	MathMatrix *est = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                   height:[system dimX]];
+	double *yVal = (double *)[y elements];
+	double *estVal = (double *)[est elements];
+	
+	// the particles are initialized at the beginning of the time span
+	[self beginOnlineFilteringAtTime:((double *)[[system timeSpan] elements])[0]];
+	
+	fprintf(OUT, "#\n# Time and estimated states\n#\n");
+	
+	while ( fgets(line, CONST_REPLAY_LINE_LENGTH, IN) ) {
+		if ( line[0] == '#' ) continue;	// comment
+		
+		// time followed by dimY components of the measurement
+		t = strtod(line, &end);
+		if ( end == line ) continue;	// empty line
+		
+		isValid = YES;
+		for ( k = 0; k < [system dimY]; k++ ) {
+			p = end;
+			yVal[k] = strtod(p, &end);
+			if ( end == p ) {
+				isValid = NO;
+				break;
+			}
+		}
+		if ( !isValid ) {
+			NSLog(@"Skipped a measurement at t = %f with too few components.", t);
+			continue;
+		}
+		
+		if ( ![self filterMeasurement:y atTime:t intoEstimate:est] ) break;
+		steps++;
+		
+		fprintf(OUT, " %9.4f", t);
+		for ( k = 0; k < [system dimX]; k++ ) {
+			fprintf(OUT, "\t %9.4f", estVal[k]);
+		}
+		fprintf(OUT, "\n");
+	}
+	
+	[y release];
+	[est release];
+	fclose(IN);
+	fclose(OUT);
+	
+	return steps;
+}
+
+// parameter estimator (auxiliary particle filter)
+- (void) estimateParametersUsingAuxParticleFilter {
+	BOOL wasAuxiliary = isAuxiliaryFilter;
+	
+	// The filters of the vertices inherit the mode of this filter.
+	isAuxiliaryFilter = YES;
+	[self estimateParametersUsingMeasurementComparison];
+	isAuxiliaryFilter = wasAuxiliary;
+}
+
+// parameter estimator (online learning)
+- (void) estimateParametersViaFiltering {
+	BOOL wasParameterEstimator = isParameterEstimator;
+	MathMatrix *theta;
+	NSString *fileName;
+	unsigned i;
+	
+	isParameterEstimator = YES;
+	[self estimateStates];
+	isParameterEstimator = wasParameterEstimator;
+	
+	if ( !parameterEstimate ) {
+		return;
+	}
+	
+	// The system gets the estimate at the end of the time span.
+	theta = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                         height:[parameterEstimate height]];
+	[parameterEstimate getVector:theta atColumn:[parameterEstimate width]];
+	[system setParameters:theta];
+	[theta release];
+	
+	// print the history to file
+	for ( i = 1; i <= [parameterEstimate height]; i++ ) {
+		fileName = [NSString stringWithFormat:@"param_est_%d", i];
+		[parameterEstimate writeRowTransposed: i
+		                               toFile: fileName ];
+	}
+}
+
+// parameter estimator (measurement comparison method)
+- (void) estimateParametersUsingMeasurementComparison {
+  
+	// Here, I adopt Nelder-Mead simplex (amoeba) algorithm.
+	// The summary of the algorithm is as follows:
+	// =========================================================================
+	// The amoeba algorithm maintains at each iteration a nondegenerate simplex,
+	// a geometric figure in n dimensions of nonzero volume that is the
+	// convex hull of n+1 vertices, x_0, x_1, ... , x_n, and their respective
+	// function values.
+	// In each iteration, new points are computed, along with their function values,
+	// to form a new simplex. The algorithm terminates when the function values
+	// at the vertices of the simplex satisfy a predetermined condition.
+	//
+	// One iteration of the amoeba algorithm consists of the following steps:
+	//
+	// 1. Order: Order and re-label the n+1 vertices as x_0, x_1, ... , x_n,
+	//    such that F(x_0) <= F(x_1) <= ... <= F(x_n).
+	//    Since we want to minimize, we refer to x_0 as the best vertex or point,
+	//    to x_n as the worst point, and to x_{n-1} as the next-worst point.
+	//    Let \overline{x} refer to the centroid of the n best points in the vertex
 	//    (i.e., all vertices except for x_n.):
 	//    \overline{x} = \sum_{i=x_0}^{x_{n-1}}x_i / n
 	//
@@ -483,10 +1745,14 @@ enum {
 	//    otherwise (i.e., if F(x_r) <= F(x_e)) accept x_r and terminate the
 	//    iteration.
 	//
-	// 4. Contract: If F(x_r) > F(x_{n-1}), perform a contraction between
-	//    \overline{x} and x_n
-	//    x_c = \overline{x} + \zeta (\overline{x} - x_n).
-	//	  If F(x_c) <= F(x_n), accept x_c and terminate the iteration.
+	// 4. Contract: If F(x_r) >= F(x_{n-1}), perform a contraction.
+	//    If F(x_r) < F(x_n), contract outside, between \overline{x} and x_r,
+	//    x_c = \overline{x} + \zeta (x_r - \overline{x}),
+	//    and accept x_c if F(x_c) <= F(x_r).
+	//    Otherwise, contract inside, between \overline{x} and x_n,
+	//    x_c = \overline{x} + \zeta (x_n - \overline{x}),
+	//    and accept x_c if F(x_c) < F(x_n).
+	//    If x_c is not accepted, shrink the simplex.
 	//
 	// 5. Shrink Simplex: Evaluate F at the n new vertices for i=1, ..., n.
 	//    x_i = x_0 + \eta (x_i - x_0).
@@ -507,6 +1773,14 @@ enum {
 	// 3. Compare Yb with actual measurements Y.
 	// 4. The difference between Y and Yb is the value of objective function.
 	//    Hence, we should minimize it.
+	//
+	// Each value is computed by an independent filter with a copy of the
+	// system whose parameters are those of the vertex, so several
+	// vertices are evaluated at once on the threads of this filter (see
+	// evaluateObjectivesAtVertices:cache:).  All of them draw from the
+	// same streams, so the objective is a deterministic function of the
+	// parameters, and each value is kept in a cache keyed by the vertex.
+	// The vertices which an iteration keeps are never evaluated again.
 	
 	
 	
@@ -518,11 +1792,7 @@ enum {
 	//
   
 	// For iteration indeces.
-	unsigned i, j, ti;
-	
-	// RMS of the difference between actual measurements and
-	// noise-free artificial measurements.
-	double rms, temp;
+	unsigned i, j;
 	
 	// number of iterations
 	unsigned counter;
@@ -531,33 +1801,26 @@ enum {
 	unsigned paramCount = [[system parameters] count];
 	
 	// Storage for (n + 1) sets of parameters.
-	NSMutableArray *vertices = [NSMutableArray arrayWithCapacity:0UL];
+	NSMutableArray *vertices = [[NSMutableArray alloc] initWithCapacity:(paramCount + 1)];
 	
 	// Storage for one set of parameters.
 	MathMatrix *vertex;
 	
-	// Storage for the history of optimization. It stores all values of the
-	// objective function for each vertex.
-	NSMutableArray *allObjectiveFunctionValues = [NSMutableArray arrayWithCapacity:0UL];
-	
-	// Storage for the values of the objective function for a specific time.
-	MathMatrix *objectiveFunctionValues;
+	// the values of the objective function for each vertex evaluated
+	NSMutableDictionary *cache = [[NSMutableDictionary alloc] init];
 	
-	// storage for noise-free measurements
-	MathMatrix *noiseFreeMeasurements =
-    [[MathMatrix alloc] initWithType:@"double"
-                               width:[[system timeSpan] count]
-                              height:[system dimY]];
+	// centroid, reflection, expansion and contraction points
+	MathMatrix *centroid = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                        height:paramCount];
+	MathMatrix *x_r, *x_e, *x_oc, *x_ic, *accepted;
+	double f_0, f_n1, f_n, f_r, f_e, f_c;
+	BOOL isShrinking;
 	
-	// temporary storage for current state and measurement
-	MathMatrix *currentState =
-    [[MathMatrix alloc] initWithType:@"double"
-                               width:1UL
-                              height:[system dimX]];
-	MathMatrix *currentMeasurement =
-    [[MathMatrix alloc] initWithType:@"double"
-                               width:1UL
-                              height:[system dimY]];
+	// Storage for the history of optimization, i.e., the best vertex of
+	// each iteration.
+	MathMatrix *allTheta = [[MathMatrix alloc] initDoubleWithWidth:iterationLimit
+	                                                        height:paramCount];
+	NSString *fileName;
 	
 	//
 	// 1. Initialize the vertices (sets of parameters).
@@ -574,99 +1837,163 @@ enum {
 	//
 	// Note that each vertex is column vector.
 	
-	vertex = [[MathMatrix alloc] initWithType:@"double"
-                                      width:1UL
-                                     height:paramCount];
-	[vertices addObject:vertex];
-	[vertex release];
-	
-	// The other sets of parameters has 1.0
-	for ( i = 1UL; i <= paramCount; i++ ) {
-		vertex = [[MathMatrix alloc] initWithType:@"double"
-                                        width:1UL
-                                       height:paramCount];
-		[vertex setDoubleValue:1.0 atRow:i column:1UL];
+	for ( i = 0UL; i <= paramCount; i++ ) {
+		vertex = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                          height:paramCount];
+		for ( j = 1UL; j <= paramCount; j++ ) {
+			[vertex setDoubleValue:(( i == j ) ? 1.0 : 0.0) atRow:j column:1UL];
+		}
 		[vertices addObject:vertex];
 		[vertex release];
 	}
 	
+	// all the (n + 1) vertices at once
+	[self evaluateObjectivesAtVertices:vertices cache:cache];
+	
 	//
 	// Run through optimization process
 	// ================================
 	//
 	for ( counter = 1UL; counter <= iterationLimit; counter++ ) {
-		objectiveFunctionValues  =
-      [[MathMatrix alloc] initWithType:@"double"
-                                 width:1UL
-                                height:(paramCount + 1)];
 		//
-		// For (n + 1) vertices ...
+		// 2. Order
+		// ========
+		[vertices sortUsingFunction:CompareObjectivesOfVertices context:cache];
+		
+		f_0 = ObjectiveOfVertex(cache, [vertices objectAtIndex:0]);
+		f_n1 = ObjectiveOfVertex(cache, [vertices objectAtIndex:(paramCount - 1)]);
+		f_n = ObjectiveOfVertex(cache, [vertices objectAtIndex:paramCount]);
+		
+		[allTheta setVector:[vertices objectAtIndex:0] atColumn:counter];
+		
+		// The simplex has converged.
+		if ( f_n - f_0 <= CONST_NM_TOLERANCE * (fabs(f_0) + fabs(f_n)) + DBL_MIN ) {
+			break;
+		}
+		
+		// centroid of the n best vertices
+		for ( j = 1UL; j <= paramCount; j++ ) {
+			double sum = 0.0;
+			for ( i = 0UL; i < paramCount; i++ ) {
+				sum += [[vertices objectAtIndex:i] doubleValueAtRow:j column:1UL];
+			}
+			[centroid setDoubleValue:(sum / (double)paramCount) atRow:j column:1UL];
+		}
+		
+		vertex = [vertices objectAtIndex:paramCount];	// the worst one
+		x_r = NewPointAlong(centroid, vertex, -CONST_NM_REFLECTION);
+		x_e = NewPointAlong(centroid, vertex,
+		                    -CONST_NM_REFLECTION * (1.0 + CONST_NM_EXPANSION));
+		x_oc = NewPointAlong(centroid, vertex,
+		                     -CONST_NM_REFLECTION * CONST_NM_CONTRACTION);
+		x_ic = NewPointAlong(centroid, vertex, CONST_NM_CONTRACTION);
+		
+		// With several threads, the candidates of the iteration are
+		// evaluated at once, which takes as long as evaluating one of them.
+		// If the system is not thread-safe, they would be evaluated one
+		// after another, so only those which the search needs are.
+		if ( threadPool && [system isPropagationThreadSafe]
+		     && [system isWeightingThreadSafe] ) {
+			[self evaluateObjectivesAtVertices:
+			 [NSArray arrayWithObjects:x_r, x_e, x_oc, x_ic, nil]
+			                             cache:cache];
+		}
+		
 		//
-		for ( i = 1UL; i <= (paramCount + 1); i++ ) {
+		// 3. Reflect
+		// ==========
+		accepted = nil;
+		isShrinking = NO;
+		f_r = [self objectiveAtVertex:x_r cache:cache];
+		
+		if ( f_0 <= f_r && f_r < f_n1 ) {
+			accepted = x_r;
+		} else if ( f_r < f_0 ) {
 			//
-			// 2.1 Run particle filtering.
-			// ===========================
-			[self estimateStates];
-			
+			// 4. Expand
+			// =========
+			f_e = [self objectiveAtVertex:x_e cache:cache];
+			accepted = ( f_e < f_r ) ? x_e : x_r;
+		} else if ( f_r < f_n ) {
 			//
-			// 2.2 Generate noise-free measurements
-			// ====================================
-			for ( ti = 1UL; ti <= [[system timeSpan] count]; ti++ ) {
-				[estimate getVector:currentState atColumn:ti];
-				[system getNoiseFreeMeasurement:currentMeasurement
-                            atTimeIndex:ti
-                       withCurrentState:currentState];
-				[noiseFreeMeasurements setVector:currentMeasurement
-                                atColumn:ti];
+			// 5. Contract (outside)
+			// =====================
+			f_c = [self objectiveAtVertex:x_oc cache:cache];
+			if ( f_c <= f_r ) {
+				accepted = x_oc;
+			} else {
+				isShrinking = YES;
 			}
-			
+		} else {
 			//
-			// 2.3 Compare Yb with actual measurements
-			// =======================================
-			// For now, use RMS (root mean square) to compare actual measurements
-			// with noise-free measurements.
-			rms = 0.0;
-			for ( ti = 1UL; ti <= [[system timeSpan] count]; ti++ ) {
-				temp = 0.0;
-				for ( j = 1UL; j <= [system dimY]; j++ ) {
-					temp += pow(([[system Y] doubleValueAtRow:j column:ti] -
-                       [noiseFreeMeasurements doubleValueAtRow:j column:ti]), 2);
-				}
-				rms += temp;
+			// 5. Contract (inside)
+			// ====================
+			f_c = [self objectiveAtVertex:x_ic cache:cache];
+			if ( f_c < f_n ) {
+				accepted = x_ic;
+			} else {
+				isShrinking = YES;
 			}
-			rms = sqrt(rms);
-			
-			[objectiveFunctionValues setDoubleValue:rms
-                                        atRow:i
-                                       column:1UL];
 		}
 		
-		//
-		// 3. Modify the vertices using Nelder-Mead simplex algorithm.
-		//
-		
-		//
-		// 3.1 Order
-		// ---------
-		
-		
+		if ( accepted ) {
+			[vertices replaceObjectAtIndex:paramCount withObject:accepted];
+		} else if ( isShrinking ) {
+			//
+			// 6. Shrink Simplex
+			// =================
+			// The best vertex stays, and the n new ones are evaluated at once.
+			for ( i = 1UL; i <= paramCount; i++ ) {
+				vertex = NewPointAlong([vertices objectAtIndex:0],
+				                       [vertices objectAtIndex:i],
+				                       CONST_NM_SHRINK);
+				[vertices replaceObjectAtIndex:i withObject:vertex];
+				[vertex release];
+			}
+			[self evaluateObjectivesAtVertices:vertices cache:cache];
+		}
 		
-		[objectiveFunctionValues release];
+		[x_r release];
+		[x_e release];
+		[x_oc release];
+		[x_ic release];
 	}
 	
 	//
-	// 6. Cleanup
+	// 7. Result
+	// =========
+	// The system gets the best parameters, whose states are estimated.
+	[vertices sortUsingFunction:CompareObjectivesOfVertices context:cache];
+	vertex = [[vertices objectAtIndex:0] copy];
+	[system setParameters:vertex];
+	[vertex release];
+	[self estimateStates];
+	
+	// print the history to file
+	if ( counter > iterationLimit ) {
+		counter = iterationLimit;
+	}
+	for ( i = 1; i <= paramCount; i++ ) {
+		fileName = [NSString stringWithFormat:@"param_est_%d", i];
+		for ( j = counter + 1; j <= iterationLimit; j++ ) {	// converged
+			[allTheta setDoubleValue:[[system parameters] doubleValueAtRow:i
+			                                                        column:1UL]
+			                   atRow:i
+			                  column:j];
+		}
+		[allTheta writeRowTransposed: i
+		                      toFile: fileName ];
+	}
+	
+	//
+	// 8. Cleanup
 	// ==========
 	//
 	[vertices removeAllObjects];
 	[vertices release];
-	[allObjectiveFunctionValues removeAllObjects];
-	[allObjectiveFunctionValues release];
-  
-	
-	[noiseFreeMeasurements release];
-	[currentState release];
-	[currentMeasurement release];
+	[cache release];
+	[centroid release];
+	[allTheta release];
 }
 
 // parameter estimator (SPSA)
@@ -677,90 +2004,74 @@ enum {
                                            A: (double) A
 {
 	NSString *fileName;
-	unsigned i, k, tmax, kmax, im1;
+	unsigned i, j, k, q, tmax, kmax;
 	double a_k, c_k;
-	double di, theta_i;
-	double grad1, grad2, grad3, grad4, grad;
+	double di, theta_i, gradSum;
 	unsigned d = [[system parameters] count];	// number of parameters
   // to estimate
+	unsigned D = SPSADirectionCount;			// number of directions
 	unsigned xdim = [system dimX];
 	unsigned ydim = [system dimY];
+	SPSAContext context;
+	ThreadPool *rolloutPool = [system isRolloutThreadSafe] ? threadPool : NULL;
 	
-	MathMatrix* delta = [[MathMatrix alloc] initWithType:@"double"
-                                                 width:1UL
-                                                height:d];
+	// delta: a perturbation direction in each column
+	MathMatrix* delta = [[MathMatrix alloc] initDoubleWithWidth:D
+	                                                     height:d];
   
 	// theta: parameter estimated
-	MathMatrix* theta = [[MathMatrix alloc] initWithType:@"double"
-                                                 width:1UL
-                                                height:d];
-	
-	// theta_p: theta + c_k*delta
-	MathMatrix* theta_p = [[MathMatrix alloc] initWithType:@"double"
-                                                   width:1UL
-                                                  height:d];
-	// theta_m: theta - c_k*delta
-	MathMatrix* theta_m = [[MathMatrix alloc] initWithType:@"double"
-                                                   width:1UL
-                                                  height:d];
-	
-	// X_p: X+ (k-1)L+1:kL
-	MathMatrix* X_p = [[MathMatrix alloc] initWithType:@"double"
-                                               width:windowSize
-                                              height:xdim];
-	
-	// X_m: X- (k-1)L+1:kL
-	MathMatrix* X_m = [[MathMatrix alloc] initWithType:@"double"
-                                               width:windowSize
-                                              height:xdim];
-	
-	// X_pt: X+~ (k-1)L+1:kL
-	MathMatrix* X_pt = [[MathMatrix alloc] initWithType:@"double"
-                                                width:windowSize
-                                               height:xdim];
-	
-	// Y_p: Y+ (k-1)L+1:kL
-	MathMatrix* Y_p = [[MathMatrix alloc] initWithType:@"double"
-                                               width:windowSize
-                                              height:ydim];
-	
-	// X_mt: X-~ (k-1)L+1:kL
-	MathMatrix* X_mt = [[MathMatrix alloc] initWithType:@"double"
-                                                width:windowSize
-                                               height:xdim];
-	
-	// Y_m: Y- (k-1)L+1:kL
-	MathMatrix* Y_m = [[MathMatrix alloc] initWithType:@"double"
-                                               width:windowSize
-                                              height:ydim];
-	
-	// temporary storage
-	MathMatrix* x_temp_i = [[MathMatrix alloc] initWithType:@"double"
-                                                    width:1UL
-                                                   height:xdim];
-	
-	MathMatrix* x_temp_o = [[MathMatrix alloc] initWithType:@"double"
-                                                    width:1UL
-                                                   height:xdim];
-	
-	MathMatrix* y_temp = [[MathMatrix alloc] initWithType:@"double"
-                                                  width:1UL
-                                                 height:ydim];
-	
-	MathMatrix* y = [[MathMatrix alloc] initWithType:@"double"
-                                             width:1UL
-                                            height:ydim];
-	
-	MathMatrix* x = [[MathMatrix alloc] initWithType:@"double"
-                                             width:1UL
-                                            height:xdim];
-	
-	MathMatrix* vecGrad = [[MathMatrix alloc] initWithType:@"double"
-                                                   width:1UL
-                                                  height:d];
+	MathMatrix* theta = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:d];
+	
+	MathMatrix* vecGrad = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                       height:d];
 	
 	MathMatrix* allTheta;
-  
+	
+	// Each direction has two parameters and four rollouts, i.e.,
+	// for the q'th rollout, q = 4*j + r, of the j'th direction,
+	//
+	//		r = 0: X+ (k-1)L+1:kL			with theta + c_k*delta
+	//		r = 1: X- (k-1)L+1:kL			with theta - c_k*delta
+	//		r = 2: X~+ & Y+ (k-1)L+1:kL		with theta + c_k*delta
+	//		r = 3: X~- & Y- (k-1)L+1:kL		with theta - c_k*delta
+	//
+	// Each rollout has its own temporary storage, so the rollouts of all
+	// the directions can run at once.
+	context.system = system;
+	context.windowSize = windowSize;
+	context.thetaPlus = (MathMatrix **)malloc(D * sizeof(MathMatrix *));
+	context.thetaMinus = (MathMatrix **)malloc(D * sizeof(MathMatrix *));
+	context.states = (MathMatrix **)malloc(4*D * sizeof(MathMatrix *));
+	context.measurements = (MathMatrix **)malloc(2*D * sizeof(MathMatrix *));
+	context.stateIn = (MathMatrix **)malloc(4*D * sizeof(MathMatrix *));
+	context.stateOut = (MathMatrix **)malloc(4*D * sizeof(MathMatrix *));
+	context.measurementOut = (MathMatrix **)malloc(4*D * sizeof(MathMatrix *));
+	context.grads = (double *)malloc(D * sizeof(double));
+	
+	for ( j = 0; j < D; j++ ) {
+		context.thetaPlus[j] = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                        height:d];
+		context.thetaMinus[j] = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                         height:d];
+		context.measurements[2*j] =
+		[[MathMatrix alloc] initDoubleWithWidth:windowSize height:ydim];
+		context.measurements[2*j + 1] =
+		[[MathMatrix alloc] initDoubleWithWidth:windowSize height:ydim];
+	}
+	for ( q = 0; q < 4*D; q++ ) {
+		context.states[q] = [[MathMatrix alloc] initDoubleWithWidth:windowSize
+		                                                     height:xdim];
+		context.stateIn[q] = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                      height:xdim];
+		context.stateOut[q] = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                       height:xdim];
+		context.measurementOut[q] = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                             height:ydim];
+	}
+	
+	// every run draws from new noise streams
+	[system advanceNoiseStreams];
 	
 	// The initial guess for the parameters are all assumed to be 1.0
 	for ( i = 1; i <= d; i++ ) {
@@ -770,27 +2081,28 @@ enum {
 	tmax = [[system timeSpan] count];
 	kmax = tmax / windowSize;
 	
-	allTheta = [[MathMatrix alloc] initWithType: @"double"
-                                        width: kmax
-                                       height: d];
+	allTheta = [[MathMatrix alloc] initDoubleWithWidth: kmax
+	                                            height: d];
 	
 	for ( k = 1; k <= kmax; k++ ) {
 		
 		//
 		// 1. Sampling step
 		//
-		// 1.a Build-up Delta vector using Bernoulli trials
+		// 1.a Build-up Delta vectors using Bernoulli trials
+		// (on this thread, so they do not depend on the number of threads)
 		//
-		[RNGenerator setCurrentGenerator:RNGIDForBernoulli];
-		for ( i = 1; i <= d; i++ ) {
-			if ( [self bernoulli] ) {
-				[delta setDoubleValue:1.0
-                        atRow:i
-                       column:1UL];
-			} else {
-				[delta setDoubleValue:-1.0
-                        atRow:i
-                       column:1UL];
+		for ( j = 1; j <= D; j++ ) {
+			for ( i = 1; i <= d; i++ ) {
+				if ( [self bernoulli] ) {
+					[delta setDoubleValue:1.0
+					                atRow:i
+					               column:j];
+				} else {
+					[delta setDoubleValue:-1.0
+					                atRow:i
+					               column:j];
+				}
 			}
 		}
 		
@@ -798,154 +2110,43 @@ enum {
 		c_k = c / pow((double)k + 1.0, gamma);
 		
 		//
-		// 1.b Calculate theta_p & theta_m
+		// 1.b Calculate theta_p & theta_m of each direction
 		//
-		for ( i = 1; i <= d; i++ ) {
-			di = [delta doubleValueAtRow:i column:1UL];
-			theta_i = [theta doubleValueAtRow:i column:1UL];
-			di *= c_k;
-			[theta_p setDoubleValue:(theta_i + di) atRow:i column:1UL];
-			[theta_m setDoubleValue:(theta_i - di) atRow:i column:1UL];
+		for ( j = 0; j < D; j++ ) {
+			for ( i = 1; i <= d; i++ ) {
+				di = [delta doubleValueAtRow:i column:(j + 1)];
+				theta_i = [theta doubleValueAtRow:i column:1UL];
+				di *= c_k;
+				[context.thetaPlus[j] setDoubleValue:(theta_i + di)
+				                               atRow:i
+				                              column:1UL];
+				[context.thetaMinus[j] setDoubleValue:(theta_i - di)
+				                                atRow:i
+				                               column:1UL];
+			}
 		}
 		
 		//
-		// 1.c Sample X+, X-, X~+, Y+, X~-, Y-
+		// 1.c Sample X+, X-, X~+, Y+, X~-, Y- of all the directions
+		// If the system cannot run rollouts concurrently, they are run in
+		// order on this thread.
 		//
-		for ( i = 0; i < windowSize; i++ ) {
-			
-			if ( i == 0 ) {
-				im1 = windowSize;
-			} else {
-				im1 = i;
-			}
-			
-			//
-			// 1. X+
-			// ------------------------
-			// x_temp_i: previous state
-			[X_p getVector:x_temp_i atColumn:im1];
-			
-			[system getNextState: x_temp_o
-               atTimeIndex: ((k - 1)*windowSize + i)
-          withCurrentState: x_temp_i
-                parameters: theta_p
-                   control: nil];
-			
-			// x_temp_o: next state
-			[X_p setVector:x_temp_o atColumn:(i + 1)];
-			
-			//
-			// 2. X-
-			// ------------------------
-			// x_temp_i: previous state
-			[X_m getVector:x_temp_i atColumn:im1];
-			
-			[system getNextState: x_temp_o
-               atTimeIndex: ((k - 1)*windowSize + i)
-          withCurrentState: x_temp_i
-                parameters: theta_m
-                   control: nil];
-			
-			// x_temp_o: next state
-			[X_m setVector:x_temp_o atColumn:(i + 1)];
-			
-			//
-			// 3. X~+
-			// ------------------------
-			// x_temp_i: previous state
-			[X_pt getVector:x_temp_i atColumn:im1];
-			
-			[system getNextState: x_temp_o
-               atTimeIndex: ((k - 1)*windowSize + i)
-          withCurrentState: x_temp_i
-                parameters: theta_p
-                   control: nil];
-			
-			// x_temp_o: next state
-			[X_pt setVector:x_temp_o atColumn:(i + 1)];
-			
-			//
-			// 4. Y+
-			// ------------------------
-			[system getMeasurement: y_temp
-                 atTimeIndex: ((k - 1)*windowSize + i + 1)
-            withCurrentState: x_temp_o
-                  parameters: theta_p];
-			
-			[Y_p setVector:y_temp atColumn:(i + 1)];
-			
-			//
-			// 5. X~-
-			// ------------------------
-			// x_temp_i: previous state
-			[X_mt getVector:x_temp_i atColumn:im1];
-			
-			[system getNextState: x_temp_o
-               atTimeIndex: ((k - 1)*windowSize + i)
-          withCurrentState: x_temp_i
-                parameters: theta_m
-                   control: nil];
-			
-			// x_temp_o: next state
-			[X_mt setVector:x_temp_o atColumn:(i + 1)];
-			
-			//
-			// 6. Y-
-			// ------------------------
-			// x_temp_i: previous state
-			[system getMeasurement: y_temp
-                 atTimeIndex: ((k - 1)*windowSize + i + 1)
-            withCurrentState: x_temp_o
-                  parameters: theta_m];
-			
-			[Y_m setVector:y_temp atColumn:(i + 1)];
-      
-		}
-		
+		context.k = k;
+		ThreadPoolParallelFor(rolloutPool, 4*D, 4*D, SPSARolloutChunk, &context);
 		
 		//
 		// 2. Gradient estimation step
 		// ===========================
-		grad1 = grad2 = grad3 = grad4 = 1.0;
-		for ( i = 1; i <= windowSize; i++ ) {
-			// actual measurement of the system
-			[[system Y] getVector:y atColumn:((k - 1)*windowSize + i)];
-			
-			// 1. g_{thata+}(Y+ | X+)
-			[Y_p getVector:y_temp atColumn:i];
-			[X_p getVector:x atColumn:i];
-			
-			grad1 *= [system probabilityOf: y_temp
-                               given: x
-                         atTimeIndex: ((k - 1)*windowSize + i)
-                      withParameters: theta_p];
-			
-			// 2. g_{theta+}(Y | X+)
-			grad2 *= [system probabilityOf: y
-                               given: x
-                         atTimeIndex: ((k - 1)*windowSize + i)
-                      withParameters: theta_p];
-			
-			// 3. g_{theta-}(Y- | X-)
-			[Y_m getVector:y_temp atColumn:i];
-			[X_m getVector:x atColumn:i];
-			
-			grad3 *= [system probabilityOf: y_temp
-                               given: x
-                         atTimeIndex: ((k - 1)*windowSize + i)
-                      withParameters: theta_m];
-			
-			// 4. g_{theta-}(Y | X-)
-			grad4 *= [system probabilityOf: y
-                               given: x
-                         atTimeIndex: ((k - 1)*windowSize + i)
-                      withParameters: theta_m];
-			
-		}
-		grad = grad1 - grad2 - grad3 + grad4;
+		// The gradients of the directions are averaged.
+		ThreadPoolParallelFor(rolloutPool, D, D, SPSAGradientChunk, &context);
 		
 		for ( i = 1; i <= d; i++ ) {
-			[vecGrad setDoubleValue: (grad/(c_k * [delta doubleValueAtRow:i column:1UL]) )
+			gradSum = 0.0;
+			for ( j = 0; j < D; j++ ) {
+				gradSum += context.grads[j]
+				/ (c_k * [delta doubleValueAtRow:i column:(j + 1)]);
+			}
+			[vecGrad setDoubleValue: (gradSum / (double)D)
                         atRow: i
                        column: 1UL];
 		}
@@ -972,25 +2173,29 @@ enum {
 	}
   //	[allTheta writeMatrixToFile:@"parameter_estimated"];
 	
-	[delta release];
+	for ( j = 0; j < D; j++ ) {
+		[context.thetaPlus[j] release];
+		[context.thetaMinus[j] release];
+		[context.measurements[2*j] release];
+		[context.measurements[2*j + 1] release];
+	}
+	for ( q = 0; q < 4*D; q++ ) {
+		[context.states[q] release];
+		[context.stateIn[q] release];
+		[context.stateOut[q] release];
+		[context.measurementOut[q] release];
+	}
+	free(context.thetaPlus);
+	free(context.thetaMinus);
+	free(context.states);
+	free(context.measurements);
+	free(context.stateIn);
+	free(context.stateOut);
+	free(context.measurementOut);
+	free(context.grads);
 	
+	[delta release];
 	[theta release];
-	[theta_p release];
-	[theta_m release];
-	
-	[X_p release];
-	[X_pt release];
-	[X_m release];
-	[X_mt release];
-	[Y_p release];
-	[Y_m release];
-	
-	[x_temp_i release];
-	[x_temp_o release];
-	[y_temp release];
-	[y release];
-	[x release];
-	
 	[vecGrad release];
 	[allTheta release];
 }
@@ -1001,10 +2206,12 @@ enum {
 	double *time = (double *)[[system timeSpan] elements];
 	
 	for ( i = 1; i <= [system dimX]; i++ ) {
+		double *est = [estimate doubleRow:i];
+		double *x = [[system X] doubleRow:i];
+		
 		val = 0.0;
-		for ( j = 1; j <= [[system timeSpan] count]; j++ ) {	// j means time
-			val += ([estimate doubleValueAtRow:i column:j]
-              - [[system X] doubleValueAtRow:i column:j]);
+		for ( j = 0; j < [[system timeSpan] count]; j++ ) {	// j means time
+			val += (est[j] - x[j]);
 		}
 		val /= (double)[[system timeSpan] count];
 		
@@ -1039,6 +2246,14 @@ enum {
 		case PF_CONST_RESAMPLE_MULTINOMIAL:
 			schemeString = @"Multinomial Resampling";
 			break;
+			
+		case PF_CONST_RESAMPLE_STRATIFIED:
+			schemeString = @"Stratified Resampling";
+			break;
+			
+		default:
+			schemeString = @"Unknown";
+			break;
 	}
 	about = [about stringByAppendingFormat:@"\tResampling Scheme: %@\n\n", schemeString];
   
@@ -1046,14 +2261,18 @@ enum {
 }
 
 - (void)makePosteriorDistributionHistogramForStateComponent: (unsigned)i {
+	if ( isStreaming ) {
+		NSLog(@"The histogram is not available in streaming mode.\n");
+		return;
+	}
+	
 	//
 	//  NOTE
 	//    i is a 1 based index
 	//
 	int ti;
-	MathMatrix* row = [[MathMatrix alloc] initWithType:@"double"
-                                               width:count
-                                              height:1UL];
+	MathMatrix* row = [[MathMatrix alloc] initDoubleWithWidth:count
+	                                                   height:1UL];
 	
 	if ( !domain ) { // domain is not specified yet
 		NSLog(@"The domain of the histogram is not defiend.\n");
@@ -1072,14 +2291,18 @@ enum {
 }
 
 - (void)makePredictiveDistributionHistogramForMeasurementComponent: (unsigned)i {
+	if ( isStreaming ) {
+		NSLog(@"The histogram is not available in streaming mode.\n");
+		return;
+	}
+	
 	//
 	//  NOTE
 	//    i is a 1 based index
 	//
 	int ti;
-	MathMatrix* row = [[MathMatrix alloc] initWithType:@"double"
-                                               width:count
-                                              height:1UL];
+	MathMatrix* row = [[MathMatrix alloc] initDoubleWithWidth:count
+	                                                   height:1UL];
 	
 	if ( !domain ) { // domain is not specified yet
 		NSLog(@"The domain of the histogram is not defiend.\n");
@@ -1101,6 +2324,11 @@ enum {
 - (void)makePosteriorDistributionHistogram {
 	int i;
 	
+	if ( isStreaming ) {
+		NSLog(@"The histogram is not available in streaming mode.\n");
+		return;
+	}
+	
 	if ( !domain ) { // domain is not specified yet
 		NSLog(@"The domain of the histogram is not defined.\n");
 		return;
@@ -1118,6 +2346,11 @@ enum {
 - (void)makePredictiveDistributionHistogram {
 	int i;
 	
+	if ( isStreaming ) {
+		NSLog(@"The histogram is not available in streaming mode.\n");
+		return;
+	}
+	
 	if ( !domain ) { // domain is not specified yet
 		NSLog(@"The domain of the histogram is not defined.\n");
 		return;
@@ -1152,7 +2385,7 @@ enum {
 	for ( k = 0; k < [system dimX]; k++ ) { // k'th component of particles
 		for ( i = 0; i < [particles count]; i++ ) { // number of sets of particles
 			theArray = [particles objectAtIndex:i];
-			for ( j = k*count; j < (k + 1)*count; j++ ) { // number of particles in a set
+			for ( j = k*particleStride; j < k*particleStride + count; j++ ) { // number of particles in a set
 				fprintf(FP, " %9.4f", ((double *)[theArray elements])[j]);
 			}
 			fprintf(FP, "\n");
@@ -1320,6 +2553,61 @@ enum {
 	fclose(FP);
 }
 
+- (BOOL)writeRunToBinaryFile:(NSString *)path
+                  compressed:(BOOL)compressed {
+	NSMutableArray *records = [NSMutableArray array];
+	NSMutableArray *names = [NSMutableArray array];
+	
+	[records addObject:[NSArray arrayWithObject:[system timeSpan]]];
+	[names addObject:@"time"];
+	
+	[records addObject:particles];
+	[names addObject:@"particles"];
+	
+	[records addObject:weights];
+	[names addObject:@"weights"];
+	
+	if ( [histogram count] ) {
+		[records addObject:histogram];
+		[names addObject:@"histogram"];
+	}
+	
+	[records addObject:[NSArray arrayWithObject:estimate]];
+	[names addObject:@"estimate"];
+	
+	[records addObject:[NSArray arrayWithObject:estimateVariance]];
+	[names addObject:@"estimate_variance"];
+	
+	[records addObject:[NSArray arrayWithObject:estimateCovariance]];
+	[names addObject:@"estimate_covariance"];
+	
+	if ( smoothedEstimate ) {
+		[records addObject:[NSArray arrayWithObject:smoothedEstimate]];
+		[names addObject:@"smoothed_estimate"];
+	}
+	
+	[records addObject:[NSArray arrayWithObject:effectiveSampleSizes]];
+	[names addObject:@"ess"];
+	
+	[records addObject:[NSArray arrayWithObject:logLikelihoodIncrements]];
+	[names addObject:@"log_likelihood"];
+	
+	if ( parameterEstimate ) {
+		[records addObject:[NSArray arrayWithObject:parameterEstimate]];
+		[names addObject:@"parameter_estimate"];
+	}
+	
+	if ( [system X] ) {
+		[records addObject:[NSArray arrayWithObject:[system X]]];
+		[names addObject:@"states"];
+	}
+	
+	return [MatrixArchive writeRecords:records
+	                             names:names
+	                            toFile:path
+	                        compressed:compressed];
+}
+
 // *****************************************************************************
 //
 //  PRIVATE METHODS
@@ -1331,8 +2619,8 @@ enum {
 
 - (void) initializeParticleFilter {
 	unsigned i, j;
-	MathMatrix* p = [particles objectAtIndex:0];	// particles at t_0
-	MathMatrix* w = [weights objectAtIndex:0];		// weights at t_0
+	double* p = [[particles objectAtIndex:0] doubleElements];	// particles at t_0
+	double* w = [[weights objectAtIndex:0] doubleElements];		// weights at t_0
 	unsigned* data;
 	
 	if ( !system ) {	// system is NOT specified yet
@@ -1341,28 +2629,66 @@ enum {
 		return;
 	}
 	
-	for ( i = 1; i <= [system dimX]; i++ ) {
-		for ( j = 1; j <= count; j++ ) {
-			[p setDoubleValue:0.0	// 0 is set to the initial guess
-                  atRow:i
-                 column:j];
+	// every run draws from new noise streams
+	[system advanceNoiseStreams];
+	
+	for ( i = 0; i < [system dimX]; i++ ) {
+		for ( j = 0; j < count; j++ ) {
+			p[i*particleStride + j] = 0.0;	// 0 is set to the initial guess
 		}
 	}
+	[[populations objectAtIndex:0] resetAncestors];
+	[[populations objectAtIndex:0] setResampled:YES];	// equally weighted
+	
+	// the particles at t_0 are the roots of the genealogy
+	[genealogy beginWithStates: p
+	                    stride: particleStride
+	                     count: count
+	                   atIndex: 0UL];
 	
 	// set all the weights at t_0 to 1.0/(number of particles)
-	for ( j = 1; j <= count; j++ ) {
-		[w setDoubleValue:1.0/(double)count
-                atRow:1UL
-               column:j];
+	for ( j = 0; j < count; j++ ) {
+		w[j] = 1.0/(double)count;
 	}
 	
 	// set all the elements of histogram (for all time t_i) to 0
-	for ( i = 0; i < [[system timeSpan] count]; i++ ) {
+	for ( i = 0; i < [histogram count]; i++ ) {
 		data = (unsigned*)[[histogram objectAtIndex:i] elements];
 		for ( j = 0; j < [[histogram objectAtIndex:i] count]; j++ ) {
 			data[j] = 0UL;
 		}
 	}
+	
+	// any online filtering in progress is over
+	isOnline = NO;
+	onlineIndex = 0UL;
+	
+	// the initial step is not instrumented
+	stepRecord = NULL;
+	
+	// the smoother starts over
+	hasSmoothedEstimate = NO;
+	
+	// the weights at t_0 are uniform as if they were resampled
+	lastESS = (double)count;
+	lastStepResampled = YES;
+	resampleCount = 0UL;
+	if ( [effectiveSampleSizes count] > 0 ) {
+		((double *)[effectiveSampleSizes elements])[0] = lastESS;
+	}
+	
+	// nothing is measured at t_0
+	logLikelihood = 0.0;
+	logLikelihoodError = 0.0;
+	lastLogLikelihoodIncrement = 0.0;
+	if ( [logLikelihoodIncrements count] > 0 ) {
+		((double *)[logLikelihoodIncrements elements])[0] = 0.0;
+	}
+	
+	// the parameters are learned along with the states
+	if ( isParameterEstimator ) {
+		[self initializeParameterParticles];
+	}
 }
 
 - (void)importanceSampleAtIndex:(unsigned)index {
@@ -1385,95 +2711,570 @@ enum {
 	//		x_{i} from x_{i-1} by using the equation.)
 	//
 	
-	//
-	//		<<< NOTE >>>
-	//
-	//		The input argument, ``index'' is 0-based.
+	//
+	//		<<< NOTE >>>
+	//
+	//		The input argument, ``index'' is 0-based.
+	
+	PFStepContext context;
+	
+	context.isTimeBased = NO;
+	context.index = index;		// it means t_{index}
+	
+	[self beginStepWithContext:&context];
+	if ( isParameterEstimator && parameterParticles ) {
+		[self learnParametersWithContext:&context];
+	} else if ( isAuxiliaryFilter ) {
+		[self auxiliarySampleWithContext:&context];
+	} else {
+		[self normalizeWeights: [self predictAndWeightWithContext:&context]
+		    andResampleAtIndex: index];
+	}
+}
+
+- (void) beginStepWithContext: (PFStepContext *)context {
+	unsigned index = context -> index;
+	
+	// A record for the step, which lasts until the delegate is notified
+	stepRecord = !profiler ? NULL :
+    [profiler beginStepAtIndex:index
+                          time:(context -> isTimeBased ? context -> t1 :
+                                ((double *)[[system timeSpan] elements])[index])];
+	
+	// predicted states & measurements
+	context -> system = system;
+	context -> count = count;
+	context -> ld = particleStride;
+	context -> prev = (double *)[[particles objectAtIndex:
+	                              [self slotForIndex:(index-1)]] elements];
+	context -> pred = (double *)[[particlesPredicted objectAtIndex:
+	                              [self slotForIndex:index]] elements];
+	context -> predMeasure = (double *)[[measurementsPredicted objectAtIndex:
+	                                     [self slotForIndex:index]] elements];
+	context -> w = (double *)[[weights objectAtIndex:
+	                           [self slotForIndex:index]] elements];
+	context -> prevW = lastStepResampled ? NULL :
+    (double *)[[weights objectAtIndex:[self slotForIndex:(index-1)]] elements];
+	context -> partialSums = partialSums;
+	context -> nanCounts = stepRecord ? nanCounts : NULL;
+	context -> zeroCounts = stepRecord ? zeroCounts : NULL;
+	
+	// the bootstrap filter
+	context -> isLookAhead = NO;
+	context -> lookAhead = NULL;
+	context -> ancestors = NULL;
+	
+	// the parameters of the system are shared by the particles
+	context -> theta = NULL;
+	context -> parameterCount = 0UL;
+}
+
+- (double) predictAndWeightWithContext: (PFStepContext *)context {
+	unsigned i;
+	double wSum, phaseStart = 0.0;
+	
+	// Each particle carries its own parameters, so the particles are
+	// propagated and weighted one by one with the per-particle methods.
+	// The predicted measurements are not made.
+	if ( context -> theta ) {
+		PF_PROFILE_BEGIN(phaseStart);
+		ThreadPoolParallelFor([system isRolloutThreadSafe] ? threadPool : NULL,
+		                      count, chunkCount,
+		                      PropagateAndWeightWithParametersChunk, context);
+		wSum = 0.0;
+		for ( i = 0; i < chunkCount; i++ ) {
+			wSum += partialSums[i];
+		}
+		PF_PROFILE_END(phaseStart, PF_PHASE_PROPAGATE);
+		
+		if ( stepRecord ) {
+			stepRecord -> propagationCalls += count;
+			stepRecord -> likelihoodCalls += count;
+			stepRecord -> evaluations = count;
+			for ( i = 0; i < chunkCount; i++ ) {
+				stepRecord -> nanWeights += nanCounts[i];
+				stepRecord -> zeroWeights += zeroCounts[i];
+			}
+		}
+		return wSum;
+	}
+	
+	//  PREDICTION STEP:
+	//  ================
+	//  We use the transition prior as proposal.
+	//  All the particles are propagated from t_{index-1} to t_{index}.
+	//  Note that the particles are stored in the same layout the batch
+	//  methods of GenericSystem expect (stride == particleStride), so a
+	//  chunk is just an offset into the blocks.
+	//  If the system cannot propagate concurrently, the chunks are run in
+	//  order on this thread.
+	PF_PROFILE_BEGIN(phaseStart);
+	ThreadPoolParallelFor([system isPropagationThreadSafe] ? threadPool : NULL,
+	                      count, chunkCount, PropagateChunk, context);
+	PF_PROFILE_END(phaseStart, PF_PHASE_PROPAGATE);
+	
+	//  EVALUATE IMPORTANCE WEIGHTS:
+	//  ============================
+	//  make fictitious measurements from the predicted states (at t_{index})
+	//  note that these measurements do NOT contain measurement noise.
+	//  For our choice of proposal, the importance weights are given by
+	//  the likelihood of the measurement.
+	PF_PROFILE_BEGIN(phaseStart);
+	ThreadPoolParallelFor([system isWeightingThreadSafe] ? threadPool : NULL,
+	                      count, chunkCount, WeightChunk, context);
+	
+	// The partial sums are reduced in the order of the chunks, so the sum
+	// does not depend on the number of threads.
+	wSum = 0.0;
+	for ( i = 0; i < chunkCount; i++ ) {
+		wSum += partialSums[i];
+	}
+	PF_PROFILE_END(phaseStart, PF_PHASE_WEIGHT);
+	
+	// Each chunk calls each batch method of the system once.
+	// (The auxiliary particle filter comes here twice a step.)
+	if ( stepRecord ) {
+		stepRecord -> propagationCalls += chunkCount;
+		stepRecord -> measurementCalls += chunkCount;
+		stepRecord -> likelihoodCalls += chunkCount;
+		stepRecord -> evaluations = count;
+		for ( i = 0; i < chunkCount; i++ ) {
+			stepRecord -> nanWeights += nanCounts[i];
+			stepRecord -> zeroWeights += zeroCounts[i];
+		}
+	}
+	return wSum;
+}
+
+- (void) normalizeWeights: (double)wSum
+       andResampleAtIndex: (unsigned)index {
+	unsigned slot = [self slotForIndex:index];
+	double phaseStart = 0.0;
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	
+	//  MARGINAL LIKELIHOOD:
+	//  ====================
+	//  wSum is the sum of the likelihoods times the normalized weights of
+	//  the last step, which are 1/count if it resampled.  Hence,
+	//  p(y_t | y_1:t-1) is wSum/count or wSum.
+	[self accumulateLogLikelihood: log(wSum)
+	 - ( lastStepResampled ? log((double)count) : 0.0 )
+	                      atIndex: index];
+	
+	//  normalise the weights
+	[self normalizeWeights:wSum atIndex:index];
+	
+	PF_PROFILE_END(phaseStart, PF_PHASE_NORMALIZE);
+	if ( stepRecord ) {
+		stepRecord -> distinctAncestors = count;
+	}
+	
+	if ( resampleThreshold < 1.0 && lastESS >= resampleThreshold*(double)count ) {
+		// The weights are good enough. Skip resampling, and use the predicted
+		// states as the new particles.
+		[self adoptPredictedStatesAtIndex:index];
+		[[populations objectAtIndex:slot] resetAncestors];
+		[[populations objectAtIndex:slot] setResampled:NO];
+		
+		lastStepResampled = NO;
+		return;
+	}
+	lastStepResampled = YES;
+	[[populations objectAtIndex:slot] setResampled:YES];
+	resampleCount++;
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	[self selectAncestorsAtIndex:index];
+	[self finishResamplingUsingNewIndices:[[populations objectAtIndex:slot] ancestors]
+	                           fromStates:(double *)[[particlesPredicted
+	                                                  objectAtIndex:slot] elements]
+	                              atIndex:index];
+	PF_PROFILE_END(phaseStart, PF_PHASE_RESAMPLE);
+	
+	if ( stepRecord ) {
+		stepRecord -> isResampled = YES;
+		stepRecord -> distinctAncestors = [self distinctAncestorsAtIndex:index];
+	}
+}
+
+- (void) auxiliarySampleWithContext: (PFStepContext *)context {
+	//
+	//  DESCRIPTION of the algorithm
+	//  ========================================================================
+	//
+	//  FIRST STAGE:
+	//		Each particle at t_{i-1} is moved to its look-ahead point, a point
+	//		prediction of its state at t_{i} (see GenericSystem.h), and is
+	//		weighted with the likelihood of the measurement there, g_j, times
+	//		its weight.  The parents of the new particles are chosen by these
+	//		weights, so the particles which are likely to explain the
+	//		measurement get the children.
+	//
+	//  SECOND STAGE:
+	//		The children are propagated from their parents as usual, and the
+	//		likelihood of each is divided by g of its parent.
+	//		These weights are carried forward to the next step.
+	//
+	//  The particles are selected at every step, in the first stage, so the
+	//  resampling threshold is not used.
+	//
+	
+	unsigned index = context -> index;
+	unsigned slot = [self slotForIndex:index];
+	unsigned *ancestors = [[populations objectAtIndex:slot] ancestors];
+	double *parents = (double *)[[particles objectAtIndex:slot] elements];
+	double *w = context -> w;
+	double lookAheadSum, wSum, phaseStart = 0.0;
+	unsigned i;
+	
+	//  FIRST STAGE:
+	//  ============
+	context -> isLookAhead = YES;
+	context -> lookAhead = lookAheadLikelihoods;
+	lookAheadSum = [self predictAndWeightWithContext:context];
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	for ( i = 0; i < count; i++ ) {
+		w[i] /= lookAheadSum;
+	}
+	PF_PROFILE_END(phaseStart, PF_PHASE_NORMALIZE);
+	
+	// The parents are gathered into the particles of this step, which are
+	// free until the end of the step.
+	PF_PROFILE_BEGIN(phaseStart);
+	[self selectAncestorsAtIndex:index];
+	[self finishResamplingUsingNewIndices:ancestors
+	                           fromStates:context -> prev
+	                              atIndex:index];
+	PF_PROFILE_END(phaseStart, PF_PHASE_RESAMPLE);
+	resampleCount++;
+	
+	//  SECOND STAGE:
+	//  =============
+	context -> isLookAhead = NO;
+	context -> ancestors = ancestors;
+	context -> prev = parents;
+	context -> prevW = NULL;	// the parents have equal weights
+	wSum = [self predictAndWeightWithContext:context];
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	
+	//  MARGINAL LIKELIHOOD:
+	//  ====================
+	//  p(y_t | y_1:t-1) is the product of the sum of the first stage
+	//  weights (with the normalized weights of the last step) and the mean
+	//  of the second stage weights.
+	[self accumulateLogLikelihood: log(lookAheadSum)
+	 - ( lastStepResampled ? log((double)count) : 0.0 )
+	 + log(wSum) - log((double)count)
+	                      atIndex: index];
+	
+	[self normalizeWeights:wSum atIndex:index];
+	
+	PF_PROFILE_END(phaseStart, PF_PHASE_NORMALIZE);
+	
+	// The children become the particles, which carry their weights.
+	// The ancestors are those chosen in the first stage.
+	[self adoptPredictedStatesAtIndex:index];
+	[[populations objectAtIndex:slot] setResampled:NO];
+	lastStepResampled = NO;
+	
+	if ( stepRecord ) {
+		stepRecord -> isResampled = YES;
+		stepRecord -> distinctAncestors = [self distinctAncestorsAtIndex:index];
+	}
+}
+
+- (void) learnParametersWithContext: (PFStepContext *)context {
+	//
+	//  DESCRIPTION of the algorithm (Liu & West, 2001)
+	//  ========================================================================
+	//
+	//  The parameters theta_j are a part of the state of the j'th particle,
+	//  which does not change in time.  To keep the particles of the
+	//  parameters from collapsing onto a few values after resampling, they
+	//  are moved by a kernel before the states are propagated:
+	//
+	//		theta_j <- a theta_j + (1 - a) mean + h L eps_j
+	//
+	//  where mean and L L' = V are the weighted mean and covariance of the
+	//  parameters, eps_j ~ N(0, I), a = (3 delta - 1)/(2 delta) and
+	//  h^2 = 1 - a^2 for the discount factor delta.  The shrinkage toward
+	//  the mean keeps the mean and the covariance of the parameters as they
+	//  are.  Then, the particles are propagated, weighted and resampled as
+	//  in the bootstrap filter, and the parameters follow the states.
+	//
+	
+	unsigned index = context -> index;
+	unsigned slot = [self slotForIndex:index];
+	unsigned d = [parameterParticles height];
+	unsigned *ancestors;
+	double *from, *to;
+	unsigned i, k;
+	MathMatrix *tmp;
+	
+	[self moveParametersByKernelAtIndex:index];
+	
+	context -> theta = [parameterProposals doubleElements];
+	context -> parameterCount = d;
+	[self normalizeWeights: [self predictAndWeightWithContext:context]
+	    andResampleAtIndex: index];
+	
+	if ( lastStepResampled ) {
+		// The parameters follow the states to their children.
+		ancestors = [[populations objectAtIndex:slot] ancestors];
+		from = [parameterProposals doubleElements];
+		to = [parameterParticles doubleElements];
+		for ( k = 0; k < d; k++ ) {
+			for ( i = 0; i < count; i++ ) {
+				to[k*count + i] = from[k*count + ancestors[i]];
+			}
+		}
+	} else {
+		// The moved parameters become the parameters of the particles.
+		tmp = parameterParticles;
+		parameterParticles = parameterProposals;
+		parameterProposals = tmp;
+	}
+	
+	[self estimateParametersAtIndex:index];
+}
+
+- (void) moveParametersByKernelAtIndex: (unsigned)index {
+	unsigned d = [parameterParticles height];
+	double *theta = [parameterParticles doubleElements];
+	double *moved = [parameterProposals doubleElements];
+	double *W = lastStepResampled ? NULL :
+    (double *)[[weights objectAtIndex:[self slotForIndex:(index-1)]] elements];
+	double *mean = parameterWorkspace;
+	double *L = parameterWorkspace + d;
+	double *eps = parameterWorkspace + d + d*d;
+	double a = (3.0*parameterDiscount - 1.0)/(2.0*parameterDiscount);
+	double h = sqrt(1.0 - a*a);
+	double wj, sum;
+	unsigned i, j, k;
+	PhiloxStream stream;
+	
+	// weighted mean and covariance (lower triangle) of the parameters
+	for ( k = 0; k < d; k++ ) {
+		mean[k] = 0.0;
+		for ( j = 0; j < count; j++ ) {
+			wj = W ? W[j] : 1.0/(double)count;
+			mean[k] += wj*theta[k*count + j];
+		}
+	}
+	for ( k = 0; k < d; k++ ) {
+		for ( i = 0; i <= k; i++ ) {
+			sum = 0.0;
+			for ( j = 0; j < count; j++ ) {
+				wj = W ? W[j] : 1.0/(double)count;
+				sum += wj*(theta[k*count + j] - mean[k])
+				*(theta[i*count + j] - mean[i]);
+			}
+			L[k*d + i] = sum;
+		}
+	}
+	
+	// Cholesky factor in place.  A direction with no spread (a pivot which
+	// is not positive) is not perturbed.
+	for ( k = 0; k < d; k++ ) {
+		sum = L[k*d + k];
+		for ( i = 0; i < k; i++ ) {
+			sum -= L[k*d + i]*L[k*d + i];
+		}
+		if ( sum <= 0.0 ) {
+			for ( i = k; i < d; i++ ) {
+				L[i*d + k] = 0.0;
+			}
+			continue;
+		}
+		L[k*d + k] = sqrt(sum);
+		for ( i = k + 1; i < d; i++ ) {
+			sum = L[i*d + k];
+			for ( j = 0; j < k; j++ ) {
+				sum -= L[i*d + j]*L[k*d + j];
+			}
+			L[i*d + k] = sum/L[k*d + k];
+		}
+	}
+	
+	// The noise of the j'th particle is at the positions j*d, ..., j*d + d-1
+	// of the substream of this step.
+	[RNGenerator getStream:&stream forSlot:RNGIDForParameters substream:index];
+	for ( j = 0; j < count; j++ ) {
+		for ( k = 0; k < d; k++ ) {
+			eps[k] = PhiloxNormalAt(&stream, j*d + k);
+		}
+		for ( k = 0; k < d; k++ ) {
+			sum = 0.0;
+			for ( i = 0; i <= k; i++ ) {
+				sum += L[k*d + i]*eps[i];
+			}
+			moved[k*count + j] = a*theta[k*count + j] + (1.0 - a)*mean[k]
+			+ h*sum;
+		}
+	}
+}
+
+- (void) initializeParameterParticles {
+	unsigned d = [[system parameters] count];
+	double *theta, *scales, *center;
+	double scale;
+	unsigned j, k, tmax;
+	PhiloxStream stream;
+	
+	if ( d == 0 ) {
+		NSLog(@"The system has no parameters to estimate.");
+		[parameterParticles release];
+		[parameterProposals release];
+		[parameterEstimate release];
+		parameterParticles = nil;
+		parameterProposals = nil;
+		parameterEstimate = nil;
+		free(parameterWorkspace);
+		parameterWorkspace = NULL;
+		return;
+	}
 	
-	// predicted states & measurements
-	MathMatrix *predStates, *predMeasure, *prevParticles;
-	MathMatrix *state, *pState, *pMeasure;
-	unsigned i, j;
-	double val, wSum, t, lik;
-	double *weightVal;
-	double kEPS = 2.2204e-16;
-  
-	predStates = [particlesPredicted objectAtIndex:index];
-	predMeasure = [measurementsPredicted objectAtIndex:index];
-	
-	t = ((double *)[[system timeSpan] elements])[index];
-	prevParticles = [particles objectAtIndex:(index-1)];
-	
-	// current state
-	state = [[MathMatrix alloc] initWithType:@"double"
-                                     width:1UL
-                                    height:[system dimX]];
-	// predicted state
-	pState = [[MathMatrix alloc] initWithType:@"double"
-                                      width:1UL
-                                     height:[system dimX]];
-	// predicted measurement
-	pMeasure = [[MathMatrix alloc] initWithType:@"double"
-                                        width:1UL
-                                       height:[system dimY]];
+	// (re)allocate the storage if the sizes have changed
+	tmax = [[system timeSpan] count];
+	if ( [parameterParticles height] != d || [parameterParticles width] != count ) {
+		[parameterParticles release];
+		[parameterProposals release];
+		parameterParticles = [[MathMatrix alloc] initDoubleWithWidth:count
+		                                                      height:d];
+		parameterProposals = [[MathMatrix alloc] initDoubleWithWidth:count
+		                                                      height:d];
+		free(parameterWorkspace);
+		parameterWorkspace = (double *)malloc((2*d + d*d) * sizeof(double));
+	}
+	if ( [parameterEstimate height] != d || [parameterEstimate width] != tmax ) {
+		[parameterEstimate release];
+		parameterEstimate = [[MathMatrix alloc] initDoubleWithWidth:tmax
+		                                                     height:d];
+	}
 	
-	//  PREDICTION STEP:
-	//  ================
-	//  We use the transition prior as proposal
-	for ( i = 1; i <= count; i++ ) {
-		[prevParticles getVector: state
-                    atColumn: i];
-		
-		// calculate x_{index} from x_{index-1} (particles at t_{index-1})
-		[system getNextState: pState
-             atTimeIndex: index		// it means t_{index}
-        withCurrentState: state
-                 control: nil];
-		
-		// copy the states calculated above to predicted particle storage
-		for ( j = 1; j <= [system dimX]; j++ ) {
-			[pState getValue:&val atRow:j column:1UL];
-			[predStates setDoubleValue:val
-                           atRow:j
-                          column:i];
+	// The particles of the parameters are drawn around the parameters of the
+	// system, from new noise every run.
+	[RNGenerator advanceSlot:RNGIDForParameters];
+	[RNGenerator getStream:&stream forSlot:RNGIDForParameters substream:0UL];
+	theta = [parameterParticles doubleElements];
+	center = [[system parameters] doubleElements];
+	scales = parameterPriorScales ? [parameterPriorScales doubleElements] : NULL;
+	for ( k = 0; k < d; k++ ) {
+		scale = scales ? scales[k] : CONST_DEFAULT_PARAMETER_PRIOR_SCALE;
+		for ( j = 0; j < count; j++ ) {
+			theta[k*count + j] = center[k]
+			+ scale*PhiloxNormalAt(&stream, j*d + k);
 		}
 	}
 	
-	//  EVALUATE IMPORTANCE WEIGHTS:
-	//  ============================
-	//  For our choice of proposal, the importance weights are given by:
-	wSum = 0.0;
-	weightVal = (double *)[[weights objectAtIndex:index] elements];
+	[self estimateParametersAtIndex:0];
+}
+
+- (void) estimateParametersAtIndex: (unsigned)index {
+	unsigned d = [parameterParticles height];
+	double *theta = [parameterParticles doubleElements];
+	double *W = lastStepResampled ? NULL :
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
+	double *e = [parameterEstimate doubleElements];
+	unsigned ld = [parameterEstimate width];
+	double sum;
+	unsigned j, k;
+	
+	if ( index >= ld ) {
+		return;
+	}
 	
-	for ( i = 0; i < count; i++ ) {
-		// retrieve a state vector from the predicted particle storage
-		[predStates getVector:pState atColumn:(i + 1)];
-		
-		// make fictitious measurement from the state (at t_{index})
-		// note that this measurement does NOT contain measurement noise
-		[system getNoiseFreeMeasurement: pMeasure
-                        atTimeIndex: index
-                   withCurrentState: pState];
-		
-		// copy the virtual measurements to predicted measurement storage
-		for ( j = 1; j <= [system dimY]; j++ ) {
-			[pMeasure getValue:&val atRow:j column:1UL];
-			[predMeasure setDoubleValue:val atRow:j column:(i + 1)];
+	// write the weighted mean to the (index + 1)'th column
+	for ( k = 0; k < d; k++ ) {
+		sum = 0.0;
+		for ( j = 0; j < count; j++ ) {
+			sum += ( W ? W[j] : 1.0/(double)count )*theta[k*count + j];
 		}
-		
-		// calculate importance weights
-		lik = [system importanceWeightAtTimeIndex: index
-                     withPredictedMeasurement: pMeasure] + kEPS;
-		
-		weightVal[i] = lik;
-		wSum += lik;
+		e[k*ld + index] = sum;
+	}
+}
+
+- (void) accumulateLogLikelihood: (double)increment
+                         atIndex: (unsigned)index {
+	double term, sum;
+	
+	// Kahan summation
+	lastLogLikelihoodIncrement = increment;
+	term = increment - logLikelihoodError;
+	sum = logLikelihood + term;
+	logLikelihoodError = (sum - logLikelihood) - term;
+	logLikelihood = sum;
+	if ( !isOnline && index < [logLikelihoodIncrements count] ) {
+		((double *)[logLikelihoodIncrements elements])[index] = increment;
+	}
+}
+
+- (void) normalizeWeights: (double)wSum
+                  atIndex: (unsigned)index {
+	unsigned slot = [self slotForIndex:index];
+	double wSqSum;
+	
+	// the moments of the predicted states, before they are resampled,
+	// along with the normalization
+	wSqSum = [self getMomentsOfStates: (double *)[[particlesPredicted objectAtIndex:slot]
+	                                              elements]
+	                          weights: (double *)[[weights objectAtIndex:slot]
+	                                              elements]
+	                    normalizingBy: wSum
+	                          atIndex: index];
+	
+	//  EFFECTIVE SAMPLE SIZE:
+	//  ======================
+	lastESS = 1.0/wSqSum;
+	if ( !isOnline && index < [effectiveSampleSizes count] ) {
+		((double *)[effectiveSampleSizes elements])[index] = lastESS;
+	}
+	if ( stepRecord ) {
+		stepRecord -> ess = lastESS;
+	}
+}
+
+- (void) adoptPredictedStatesAtIndex: (unsigned)index {
+	unsigned slot = [self slotForIndex:index];
+	ParticlePopulation *pop = [populations objectAtIndex:slot];
+	
+	// The generations are kept, so the predictions stay where they are.
+	if ( !isStreaming ) {
+		memcpy([pop states], [pop predictedStates],
+		       [pop dimX] * [pop leadingDimension] * sizeof(double));
+		return;
 	}
 	
-	//  normalise the weights
+	// The two matrices are of the same size, so they are exchanged.
+	MathMatrix *predStates = [[particlesPredicted objectAtIndex:slot] retain];
+	[particlesPredicted replaceObjectAtIndex:slot
+	                              withObject:[particles objectAtIndex:slot]];
+	[particles replaceObjectAtIndex:slot withObject:predStates];
+	[predStates release];
+	
+	[pop exchangeStatesWithPredictedStates];
+}
+
+- (unsigned) distinctAncestorsAtIndex: (unsigned)index {
+	unsigned i, n = 0UL;
+	unsigned *ancestors =
+    [[populations objectAtIndex:[self slotForIndex:index]] ancestors];
+	
+	// resampleCounts is free after resampling
+	memset(resampleCounts, 0, count * sizeof(unsigned));
 	for ( i = 0; i < count; i++ ) {
-		weightVal[i] /= wSum;
+		if ( !resampleCounts[ancestors[i]] ) {
+			resampleCounts[ancestors[i]] = 1UL;
+			n++;
+		}
 	}
-	
+	return n;
+}
+
+- (void) selectAncestorsAtIndex:(unsigned)index {
 	//  SELECTION STEP:
 	//  ===============
 	//  Here, we give you the choice to try three different types of
@@ -1481,37 +3282,34 @@ enum {
 	//  applies to any problem!
 	switch ( scheme ) {
 		case CONST_RESAMPLE_SCHEME_RESIDUAL:
-			//
-			// NOT IMPLEMENTED YET !!!
-			//
+			[self resampleByResidualAtIndex:index];
 			break;
 			
 		case CONST_RESAMPLE_SCHEME_SYSTEMATIC:
-			//
-			// NOT IMPLEMENTED YET !!!
-			//
+			[self resampleBySystematicAtIndex:index];
 			break;
 			
 		case CONST_RESAMPLE_SCHEME_MULTINOMIAL:
 			[self resampleByMultinomialAtIndex:index];
 			break;
+			
+		case CONST_RESAMPLE_SCHEME_STRATIFIED:
+			[self resampleByStratifiedAtIndex:index];
+			break;
 	}
-	
-	[state release];
-	[pState release];
-	[pMeasure release];
 }
 
 - (void)resampleByMultinomialAtIndex:(unsigned)index {
 	
-	unsigned *N_babies =	(unsigned *)malloc(count * sizeof(unsigned));
-	unsigned *out_index =   (unsigned *)malloc(count * sizeof(unsigned));
-	double *cumDist =	(double *)malloc(count * sizeof(double));
-	double *u =			(double *)malloc(count * sizeof(double));
-	double *cumProd =	(double *)malloc(count * sizeof(double));
-	double *randNum =	(double *)malloc(count * sizeof(double));
+	unsigned *N_babies =	resampleCounts;
+	unsigned *out_index =
+    [[populations objectAtIndex:[self slotForIndex:index]] ancestors];
+	double *cumDist =	resampleCumDist;
+	double *cumProd =	resampleUniforms;	// in place of the random numbers
+	double *u =			resampleScratch;
 	
-	double *currentWeights = (double *)[[weights objectAtIndex:index] elements];
+	double *currentWeights =
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
 	unsigned i, j, k;
 	
 	// make a vector containing cumulative sum
@@ -1519,12 +3317,12 @@ enum {
 	
 	// generate ``count'' ordered random variables uniformly distributed in [0,1]
 	// high speed Niclas Bergman Procedure
-	[RNGenerator setCurrentGenerator:RNGIDForResampler];
+	[RNGenerator getUniforms:cumProd count:count fromSlot:RNGIDForResampler];
 	for ( i = 0; i < count; i++ ) {
 		N_babies[i] = 0;
-		randNum[i] = pow(genunf(0.0, 1.0), 1.0/((double)(count - i)));
+		cumProd[i] = pow(cumProd[i], 1.0/((double)(count - i)));
 	}
-	CumulativeProduct( randNum, cumProd, count);
+	CumulativeProduct( cumProd, cumProd, count);
 	FlipLR( cumProd, u, count);
   
 	
@@ -1546,47 +3344,73 @@ enum {
 		}
 		k += N_babies[i];
 	}
-  
-	[self finishResamplingUsingNewIndices:out_index
-                                atIndex:index];
+}
+
+- (void)resampleBySystematicAtIndex:(unsigned)index {
+	
+	double *currentWeights =
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
+	unsigned *out_index =
+    [[populations objectAtIndex:[self slotForIndex:index]] ancestors];
+	double u;
+	
+	// only one uniform random number for all the particles
+	u = [RNGenerator uniformFromSlot:RNGIDForResampler];
+	
+	SystematicResample(currentWeights, count, u, out_index);
+}
+
+- (void)resampleByStratifiedAtIndex:(unsigned)index {
+	
+	double *currentWeights =
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
+	unsigned *out_index =
+    [[populations objectAtIndex:[self slotForIndex:index]] ancestors];
+	
+	// one uniform random number for each stratum
+	[RNGenerator getUniforms:resampleUniforms
+	                   count:count
+	                fromSlot:RNGIDForResampler];
+	
+	StratifiedResample(currentWeights, count, resampleUniforms, out_index);
+}
+
+- (void)resampleByResidualAtIndex:(unsigned)index {
+	
+	double *currentWeights =
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
+	unsigned *out_index =
+    [[populations objectAtIndex:[self slotForIndex:index]] ancestors];
+	double u;
 	
-	free(N_babies);
-	free(out_index);
-	free(cumDist);
-	free(u);
-	free(cumProd);
-	free(randNum);
+	// the residuals are resampled by the systematic scheme
+	u = [RNGenerator uniformFromSlot:RNGIDForResampler];
+	
+	ResidualResample(currentWeights, count, u, out_index);
 }
 
 - (void)finishResamplingUsingNewIndices:(unsigned *)newIndices
+                             fromStates:(double *)src
                                 atIndex:(unsigned)index {
 	
-	unsigned i, j;
-	MathMatrix *predStates = [particlesPredicted objectAtIndex:index];
-	MathMatrix *newParticles = [[MathMatrix alloc] initWithType:@"double"
-                                                        width:count
-                                                       height:[system dimX]];
-	MathMatrix *theState = [[MathMatrix alloc] initWithType:@"double"
-                                                    width:1UL
-                                                   height:[system dimX]];
+	unsigned i, k, dimX;
+	unsigned slot = [self slotForIndex:index];
 	
-	for ( i = 0; i < count; i++ ) {
-		// get a column vector from predicted states according to new indices
-		// Note that newIndices has 0-based indices, hence +1 is required
-		// to use getVector:atColumn: which uses 1-based index.
-		[predStates getVector:theState atColumn:((newIndices[i] + 1))];
-		for ( j = 1; j <= [system dimX]; j++ ) {
-			// copy the vector to new particles
-			[newParticles setDoubleValue:((double *)[theState elements])[j - 1]
-                             atRow:j
-                            column:(i + 1)];
-		}
-    //		[newParticles values][i] = [theStates valueAtIndex:(newIndices[i])];
-	}
-	[particles replaceObjectAtIndex:index withObject:newParticles];
-  
-	[newParticles release];
-	[theState release];
+	// src is the predicted states of the slot (or the particles of the
+	// previous step in the auxiliary particle filter).  The children are
+	// gathered from it into the particles of the slot, whose previous
+	// contents are no longer needed.
+	// Note that newIndices has 0-based indices.
+	double *dst = (double *)[[particles objectAtIndex:slot] elements];
+	
+	dimX = [system dimX];
+	for ( k = 0; k < dimX; k++ ) {
+		for ( i = 0; i < count; i++ ) {
+			dst[i] = src[newIndices[i]];
+		}
+		src += particleStride;
+		dst += particleStride;
+	}
 }
 
 - (void) setHistogram:(NSMutableArray *)theHistogram {
@@ -1597,106 +3421,549 @@ enum {
 }
 
 - (void) reallocResourcesWithNewCount {
-	unsigned timeCount, dimX, dimY, i;
-	
-	// Release previous structures.
-	[particles removeAllObjects];
-	[weights removeAllObjects];
-	[particlesPredicted removeAllObjects];
-	[measurementsPredicted removeAllObjects];
-	
 	// Realloc new structures
+	[self allocateGenerations];
+	
+	// ask system to initialize the particle filter
+	[self initializeParticleFilter];
+}
+
+- (void) reallocResourcesWithNewSystem {
+	unsigned timeCount, dimX;
 	
+	// Release previous structures.
+	[estimate release];
+	[estimateVariance release];
+	[estimateCovariance release];
+	[lastCovariance release];
+	free(lastMean);
+	[effectiveSampleSizes release];
+	[logLikelihoodIncrements release];
+  
 	// Get properties of the system
 	timeCount = [[system timeSpan] count];
 	dimX = [system dimX];
-	dimY = [system dimY];
-	
-	// add data structures to corresponding arrays
-	for ( i = 0; i < timeCount; i++ ) {
-		// particles, particlesPredicted and histogram
-		[particles addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimX]];
-		
-		[particlesPredicted addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimX]];
-		
-		[measurementsPredicted addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimY]];
-		
-		[weights addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:1UL]];
-	}
-	
+  
+	// Realloc new structures
+	[self allocateGenerations];
+	
+	estimate = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                            height: dimX];
+	estimateVariance = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                                    height: dimX];
+	estimateCovariance = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                                      height: dimX*dimX];
+	lastCovariance = [[MathMatrix alloc] initDoubleWithWidth: dimX
+	                                                  height: dimX];
+	lastMean = (double *)calloc(2*dimX, sizeof(double));
+	effectiveSampleSizes = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                                        height: 1UL];
+	logLikelihoodIncrements = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                                           height: 1UL];
+  
 	// ask system to initialize the particle filter
 	[self initializeParticleFilter];
 }
 
-- (void) reallocResourcesWithNewSystem {
-	unsigned timeCount, dimX, dimY, i;
+- (unsigned) generationCount {
+	if ( isStreaming ) {
+		return 2UL;
+	} else {
+		return [[system timeSpan] count];
+	}
+}
+
+- (unsigned) slotForIndex: (unsigned)index {
+	if ( isStreaming ) {
+		return index % 2UL;
+	} else {
+		return index;
+	}
+}
+
+- (void) allocateGenerations {
+	unsigned i, dimX, dimY;
+	ParticlePopulation *pop;
+	MathMatrix *mat;
 	
 	// Release previous structures.
+	[populations removeAllObjects];
 	[particles removeAllObjects];
 	[weights removeAllObjects];
 	[particlesPredicted removeAllObjects];
 	[measurementsPredicted removeAllObjects];
 	[histogram removeAllObjects];
-	[estimate release];
-  
-	// Realloc new structures
 	
 	// Get properties of the system
-	timeCount = [[system timeSpan] count];
 	dimX = [system dimX];
 	dimY = [system dimY];
-  
+	
+	// a partial sum of weights for each chunk of particles
+	free(partialSums);
+	chunkCount = ThreadPoolChunkCount(count, CONST_PARALLEL_CHUNK_SIZE);
+	partialSums = (double *)malloc(chunkCount * sizeof(double));
+	free(nanCounts);
+	free(zeroCounts);
+	nanCounts = (unsigned *)malloc(chunkCount * sizeof(unsigned));
+	zeroCounts = (unsigned *)malloc(chunkCount * sizeof(unsigned));
+	
+	// resampling workspaces
+	[self freeResamplingWorkspaces];
+	resampleCounts = (unsigned *)malloc(count * sizeof(unsigned));
+	resampleCumDist = (double *)malloc(count * sizeof(double));
+	resampleUniforms = (double *)malloc(count * sizeof(double));
+	resampleScratch = (double *)malloc(count * sizeof(double));
+	lookAheadLikelihoods = (double *)malloc(count * sizeof(double));
+	
+	// the ring of the smoother
+	[self allocateLagBuffers];
+	
 	// add data structures to corresponding arrays
-	for ( i = 0; i < timeCount; i++ ) {
-		// particles, particlesPredicted and histogram
-		[particles addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimX]];
+	for ( i = 0; i < [self generationCount]; i++ ) {
+		pop = [[ParticlePopulation alloc] initWithCount:count
+		                                 stateDimension:dimX
+		                           measurementDimension:dimY];
+		[populations addObject:pop];
+		[pop release];
+		
+		// views of the arrays of the population
+		[particles addObject:[pop statesMatrix]];
+		[weights addObject:[pop weightsMatrix]];
+		[particlesPredicted addObject:[pop predictedStatesMatrix]];
+		[measurementsPredicted addObject:[pop predictedMeasurementsMatrix]];
+		particleStride = [pop leadingDimension];
+		
+		// The histogram is not available in streaming mode.
+		if ( !isStreaming ) {
+			mat = [[MathMatrix alloc] initWithType:@"unsigned"
+			                                 width:([domain count] - 1)
+			                                height:dimX];
+			[histogram addObject:mat];
+			[mat release];
+		}
+	}
+}
+
+- (void) freeResamplingWorkspaces {
+	free(resampleCounts);
+	free(resampleCumDist);
+	free(resampleUniforms);
+	free(resampleScratch);
+	free(lookAheadLikelihoods);
+	
+	resampleCounts = NULL;
+	resampleCumDist = NULL;
+	resampleUniforms = NULL;
+	resampleScratch = NULL;
+	lookAheadLikelihoods = NULL;
+}
+
+- (void) notifyDelegateOfStepAtIndex: (unsigned)index {
+	double t, phaseStart = 0.0;
+	
+	PF_PROFILE_BEGIN(phaseStart);
+	
+	// Only the ancestor indices link the generation to the last one.
+	// (The generation at t_0 begins the genealogy.)
+	if ( genealogy && index > 0 ) {
+		[genealogy appendStates: (double *)[[self particlesAtIndex:index] elements]
+		                 stride: particleStride
+		              ancestors: [[populations objectAtIndex:
+		                           [self slotForIndex:index]] ancestors]
+		                atIndex: index];
+	}
+	
+	// The writer copies the generation, so the step does not wait for
+	// the disk unless its queue is full.
+	if ( generationWriter ) {
+		t = isOnline ? onlineTime
+		             : ((double *)[[system timeSpan] elements])[index];
+		[generationWriter writeParticles:[self particlesAtIndex:index]
+		                         weights:[self weightsAtIndex:index]
+		                         atIndex:index
+		                            time:t];
+	}
+	
+	if ( [delegate respondsToSelector:
+	      @selector(particleFilter:didFinishStepAtIndex:)] ) {
+		[delegate particleFilter:self didFinishStepAtIndex:index];
+	}
+	
+	// the step is over
+	PF_PROFILE_END(phaseStart, PF_PHASE_NOTIFY);
+	stepRecord = NULL;
+}
+
+- (void) getMomentsOfParticlesAtIndex: (unsigned)index {
+	unsigned slot = [self slotForIndex:index];
+	
+	// the weights are normalized already
+	[self getMomentsOfStates: (double *)[[particles objectAtIndex:slot] elements]
+	                 weights: (double *)[[weights objectAtIndex:slot] elements]
+	           normalizingBy: 1.0
+	                 atIndex: index];
+}
+
+- (double) getMomentsOfStates: (const double *)x
+                      weights: (double *)w
+                normalizingBy: (double)wSum
+                      atIndex: (unsigned)index {
+	unsigned dimX = [system dimX];
+	unsigned ld = [estimate width];
+	unsigned j, k, l;
+	double wSqSum;
+	double *m = lastMean;
+	double *sh = lastMean + dimX;
+	double *S = [lastCovariance doubleElements];
+	double *e = [estimate doubleElements];
+	double *v = [estimateVariance doubleElements];
+	double *c = [estimateCovariance doubleElements];
+	
+	//  MEAN AND COVARIANCE:
+	//  ====================
+	//  With the deviations d_j = x_j - s from the shift s, the sums are
+	//  m = sum_j w_j d_j and S = sum_j w_j d_j d_j^T, so that
+	//
+	//		mean = s + m,  Cov = S - m m^T.
+	//
+	//  s is the first particle with a weight (which is usually the first
+	//  particle), so the subtraction does not lose the digits which it
+	//  would about the origin.  Each sum runs along one or two rows of the
+	//  states, which are contiguous.  The weights are divided in the pass
+	//  of the first component, which also gives the sum of their squares
+	//  for the effective sample size.
+	for ( j = 0; j + 1 < count && w[j] == 0.0; j++ ) {
+		;
+	}
+	for ( k = 0; k < dimX; k++ ) {
+		sh[k] = x[k*particleStride + j];
+	}
+	
+	wSqSum = NormalizeWithDeviations(w, wSum, x, sh[0], count, m, S);
+	for ( k = 1; k < dimX; k++ ) {
+		WeightedDeviations(w, x + k*particleStride, sh[k], count,
+		                   m + k, S + k*dimX + k);
+		for ( l = 0; l < k; l++ ) {
+			S[k*dimX + l] = WeightedCodeviations(w,
+			                                     x + k*particleStride, sh[k],
+			                                     x + l*particleStride, sh[l],
+			                                     count);
+		}
+	}
+	
+	for ( k = 0; k < dimX; k++ ) {
+		for ( l = 0; l <= k; l++ ) {
+			S[k*dimX + l] -= m[k]*m[l];
+			S[l*dimX + k] = S[k*dimX + l];
+		}
+		if ( S[k*dimX + k] < 0.0 ) {	// by rounding
+			S[k*dimX + k] = 0.0;
+		}
+	}
+	for ( k = 0; k < dimX; k++ ) {
+		m[k] += sh[k];
+	}
+	
+	// write to the (index + 1)'th columns
+	if ( isOnline || index >= ld ) {
+		return wSqSum;
+	}
+	for ( k = 0; k < dimX; k++ ) {
+		e[k*ld + index] = m[k];
+		v[k*ld + index] = S[k*dimX + k];
+		for ( l = 0; l < dimX; l++ ) {
+			c[(k*dimX + l)*ld + index] = S[k*dimX + l];
+		}
+	}
+	return wSqSum;
+}
+
+- (double) measurementComparisonError {
+	unsigned j, ti;
+	unsigned tmax = [[system timeSpan] count];
+	double rms, temp;
+	
+	// storage for noise-free measurements
+	MathMatrix *noiseFreeMeasurements =
+    [[MathMatrix alloc] initDoubleWithWidth:tmax
+                                     height:[system dimY]];
+	
+	// temporary storage for current state and measurement
+	MathMatrix *currentState =
+    [[MathMatrix alloc] initDoubleWithWidth:1UL
+                                     height:[system dimX]];
+	MathMatrix *currentMeasurement =
+    [[MathMatrix alloc] initDoubleWithWidth:1UL
+                                     height:[system dimY]];
+	
+	//
+	// Generate noise-free measurements
+	// ================================
+	for ( ti = 1UL; ti <= tmax; ti++ ) {
+		[estimate getVector:currentState atColumn:ti];
+		[system getNoiseFreeMeasurement:currentMeasurement
+		                    atTimeIndex:(ti - 1)	// 0-based
+		               withCurrentState:currentState];
+		[noiseFreeMeasurements setVector:currentMeasurement
+		                        atColumn:ti];
+	}
+	
+	//
+	// Compare Yb with actual measurements
+	// ===================================
+	// For now, use RMS (root mean square) to compare actual measurements
+	// with noise-free measurements.
+	rms = 0.0;
+	for ( j = 1UL; j <= [system dimY]; j++ ) {
+		double *yRow = [[system Y] doubleRow:j];
+		double *ybRow = [noiseFreeMeasurements doubleRow:j];
 		
-		[weights addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:1UL]];
+		temp = 0.0;
+		for ( ti = 0UL; ti < tmax; ti++ ) {
+			temp += (yRow[ti] - ybRow[ti])*(yRow[ti] - ybRow[ti]);
+		}
+		rms += temp;
+	}
+	rms = sqrt(rms / (double)(tmax * [system dimY]));
+	
+	[noiseFreeMeasurements release];
+	[currentState release];
+	[currentMeasurement release];
+	
+	return rms;
+}
+
+- (void) evaluateObjectivesAtVertices: (NSArray *)points
+                                cache: (NSMutableDictionary *)cache {
+	
+	NSMutableArray *keys = [NSMutableArray arrayWithCapacity:[points count]];
+	NSMutableArray *pending = [NSMutableArray arrayWithCapacity:[points count]];
+	NSMutableArray *systems = [NSMutableArray arrayWithCapacity:[points count]];
+	VertexObjectiveContext context;
+	GenericSystem *sys;
+	RandomNumberGenerator *rng;
+	MathMatrix *params;
+	NSData *key;
+	unsigned q, n;
+	
+	// the points which are not evaluated yet (once each)
+	for ( q = 0; q < [points count]; q++ ) {
+		key = VertexKey([points objectAtIndex:q]);
+		if ( ![cache objectForKey:key] && ![keys containsObject:key] ) {
+			[keys addObject:key];
+			[pending addObject:[points objectAtIndex:q]];
+		}
+	}
+	n = [pending count];
+	if ( n == 0 ) {
+		return;
+	}
+	
+	context.filters =
+    (GenericParticleFilter **)malloc(n * sizeof(GenericParticleFilter *));
+	context.objectives = (double *)malloc(n * sizeof(double));
+	
+	// An independent filter for each point.  The generators are seeded
+	// alike (common random numbers), so the points are compared under the
+	// same noise, and do not touch the global state of ranlib.
+	for ( q = 0; q < n; q++ ) {
+		sys = [system copy];
+		params = [[pending objectAtIndex:q] copy];
+		[sys setParameters:params];
+		[params release];
 		
-		[particlesPredicted addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimX]];
+		rng = [[RandomNumberGenerator alloc] initWithStreamSeed:[RNGenerator seed]];
+		[sys setRNGenerator:rng];
 		
-		[measurementsPredicted addObject:
-     [[MathMatrix alloc] initWithType:@"double"
-                                width:count
-                               height:dimY]];
+		// The filter does not retain its system.
+		[systems addObject:sys];
+		[sys release];
 		
-		[histogram addObject:
-     [[MathMatrix alloc] initWithType:@"unsigned"
-                                width:([domain count] - 1)
-                               height:dimX]];
+		// only the estimates are used
+		context.filters[q] = [[GenericParticleFilter alloc] initWithCapacity:count
+		                                                           forSystem:sys
+		                                                 withSelectionScheme:scheme
+		                                                           streaming:YES];
+		[context.filters[q] setRNGenerator:rng];
+		if ( RNGIDForResampler ) {
+			[context.filters[q] setRNGIDForResampler:RNGIDForResampler];
+		}
+		if ( RNGIDForBernoulli ) {
+			[context.filters[q] setRNGIDForBernoulli:RNGIDForBernoulli];
+		}
+		[context.filters[q] setResampleThreshold:resampleThreshold];
+		[context.filters[q] enableAuxiliaryFilter:isAuxiliaryFilter];
+		[rng release];
 	}
 	
-	estimate = [[MathMatrix alloc] initWithType: @"double"
-                                        width: timeCount
-                                       height: dimX];
-  
-	// ask system to initialize the particle filter
-	[self initializeParticleFilter];
+	// If the system is not thread-safe, the filters run in order on this
+	// thread.
+	ThreadPoolParallelFor(([system isPropagationThreadSafe]
+	                       && [system isWeightingThreadSafe]) ? threadPool : NULL,
+	                      n, n, VertexObjectiveChunk, &context);
+	
+	for ( q = 0; q < n; q++ ) {
+		[cache setObject:[NSNumber numberWithDouble:context.objectives[q]]
+		          forKey:[keys objectAtIndex:q]];
+		[context.filters[q] release];
+	}
+	free(context.filters);
+	free(context.objectives);
+}
+
+- (double) objectiveAtVertex: (MathMatrix *)point
+                       cache: (NSMutableDictionary *)cache {
+	
+	[self evaluateObjectivesAtVertices:[NSArray arrayWithObject:point]
+	                             cache:cache];
+	return ObjectiveOfVertex(cache, point);
+}
+
+- (void) allocateLagBuffers {
+	unsigned dimX = [system dimX];
+	unsigned timeCount = [[system timeSpan] count];
+	
+	free(lagStates);
+	free(lagAncestors);
+	free(lagLineages);
+	[smoothedEstimate release];
+	[lastSmoothedEstimate release];
+	lagStates = NULL;
+	lagAncestors = NULL;
+	lagLineages = NULL;
+	smoothedEstimate = nil;
+	lastSmoothedEstimate = nil;
+	hasSmoothedEstimate = NO;
+	
+	if ( !smoothingLag ) {
+		return;
+	}
+	
+	// L + 1 generations: the current one and the L before it
+	lagStates = (double *)malloc((smoothingLag + 1) * dimX * count
+	                             * sizeof(double));
+	lagAncestors = (unsigned *)malloc((smoothingLag + 1) * count
+	                                  * sizeof(unsigned));
+	lagLineages = (unsigned *)malloc(count * sizeof(unsigned));
+	if ( !lagStates || !lagAncestors || !lagLineages ) {
+		NSLog(@"Memory for the lag of %u cannot be allocated.", smoothingLag);
+		free(lagStates);
+		free(lagAncestors);
+		free(lagLineages);
+		lagStates = NULL;
+		lagAncestors = NULL;
+		lagLineages = NULL;
+		smoothingLag = 0UL;
+		return;
+	}
+	
+	smoothedEstimate = [[MathMatrix alloc] initDoubleWithWidth: timeCount
+	                                                    height: dimX];
+	lastSmoothedEstimate = [[MathMatrix alloc] initDoubleWithWidth: 1UL
+	                                                        height: dimX];
+}
+
+- (void) smoothAtIndex: (unsigned)index {
+	unsigned i, k, dimX = [system dimX];
+	unsigned ring = (index % (smoothingLag + 1)) * count;
+	double *x = (double *)[[self particlesAtIndex:index] elements];
+	unsigned *ancestors = [[populations objectAtIndex:
+	                        [self slotForIndex:index]] ancestors];
+	
+	// The generation is packed into its place in the ring.
+	// The particles at the first step have no ancestors.
+	for ( k = 0; k < dimX; k++ ) {
+		memcpy(lagStates + ring*dimX + k*count, x + k*particleStride,
+		       count * sizeof(double));
+	}
+	for ( i = 0; i < count; i++ ) {
+		lagAncestors[ring + i] = ( index > 0 ) ? ancestors[i] : i;
+	}
+	
+	if ( index < smoothingLag ) {
+		return;
+	}
+	
+	[self getMean: (double *)[lastSmoothedEstimate elements]
+	       stride: 1UL
+	      withLag: smoothingLag
+	ofAncestorsAtIndex: index];
+	lastSmoothedIndex = index - smoothingLag;
+	hasSmoothedEstimate = YES;
+	
+	// write it to the (index - L + 1)'th column of smoothedEstimate
+	if ( !isOnline && lastSmoothedIndex < [smoothedEstimate width] ) {
+		for ( k = 0; k < dimX; k++ ) {
+			[smoothedEstimate doubleRow:(k + 1)][lastSmoothedIndex] =
+			[lastSmoothedEstimate doubleElements][k];
+		}
+	}
+}
+
+- (void) getMean: (double *)mean
+          stride: (unsigned)ld
+         withLag: (unsigned)lag
+ofAncestorsAtIndex: (unsigned)index {
+	unsigned i, j, g, dimX = [system dimX];
+	unsigned ringSize = smoothingLag + 1;
+	double *x = lagStates + ((index - lag) % ringSize) * dimX * count;
+	double sum, wSum, val;
+	
+	// If the particles are not resampled, they carry weights.
+	double *w = lastStepResampled ? NULL :
+    (double *)[[weights objectAtIndex:[self slotForIndex:index]] elements];
+	
+	// Each particle is traced back through the ancestor indices of the
+	// ring to its ancestor lag steps behind.
+	for ( j = 0; j < count; j++ ) {
+		lagLineages[j] = j;
+	}
+	for ( g = index; g > index - lag; g-- ) {
+		for ( j = 0; j < count; j++ ) {
+			lagLineages[j] = lagAncestors[(g % ringSize)*count + lagLineages[j]];
+		}
+	}
+	
+	for ( i = 0; i < dimX; i++ ) {
+		sum = 0.0;
+		wSum = 0.0;
+		for ( j = 0; j < count; j++ ) {
+			val = x[i*count + lagLineages[j]];
+			if ( isnan(val) ) {
+				continue;
+			} else if ( w ) {
+				sum += w[j]*val;
+				wSum += w[j];
+			} else {
+				sum += val;
+				wSum += 1.0;
+			}
+		}
+		mean[i*ld] = sum/wSum;
+	}
+}
+
+- (void) finishSmoothing {
+	unsigned s, last;
+	
+	if ( [[system timeSpan] count] == 0 ) {
+		return;
+	}
+	last = [[system timeSpan] count] - 1;
+	
+	// The estimates within L of the end are smoothed with all the
+	// measurements, i.e., with the lags up to the last index.
+	s = ( last >= smoothingLag ) ? last - smoothingLag + 1 : 0UL;
+	for ( ; s <= last; s++ ) {
+		[self getMean: ((double *)[smoothedEstimate elements]) + s
+		       stride: [smoothedEstimate width]
+		      withLag: last - s
+		ofAncestorsAtIndex: last];
+	}
 }
 
 - (BOOL) bernoulli {
-	float rn = genunf( 0.0, 1.0 );
+	double rn = [RNGenerator uniformFromSlot:RNGIDForBernoulli];
 	if ( rn >= 0.5 ) {
 		return YES;
 	} else {
@@ -1704,6 +3971,26 @@ enum {
 	}
 }
 
+- (unsigned) occupyRandomSlotPreferring: (unsigned)n {
+	if ( n && [RNGenerator occupySlot:n] ) {
+		return n;
+	}
+	
+	n = [RNGenerator suggestEmptySlot];
+	if ( n && [RNGenerator occupySlot:n] ) {
+		return n;
+	}
+	NSLog(@"All the slots of the random number generator are occupied.");
+	return 0UL;
+}
+
+- (void) freeRandomSlots {
+	// freeSlot: ignores 0, i.e., an id which was never set
+	[RNGenerator freeSlot:RNGIDForResampler];
+	[RNGenerator freeSlot:RNGIDForBernoulli];
+	[RNGenerator freeSlot:RNGIDForParameters];
+}
+
 
 @end
 
@@ -30,7 +30,7 @@
 //
 //		Other data have the same structure as X.
 
-@interface GenericSystem : NSObject {
+@interface GenericSystem : NSObject <NSCopying> {
 @protected
 	//
 	//  Primary data structure
@@ -72,6 +72,14 @@
 
 - (void) dealloc;
 
+// A system of the same class with copies of the time span, the
+// parameters, the states, the inputs, the outputs and the noises.  It
+// shares the random number generator and uses the same generator ids.
+// It is made with the designated initializer of this class, so neither
+// init nor the initializers of subclasses run: a subclass with state of
+// its own overrides this, calls super and copies that state.
+- (id) copyWithZone: (NSZone *)zone;
+
 
 // *****************************************************************************
 //
@@ -166,8 +174,10 @@
      withCurrentState: (MathMatrix *)x
               control: (MathMatrix *)control;
 
+// the state at t1 from the state at t0, for online filtering
 - (void) getNextState: (MathMatrix *)next
-               atTime: (double)t
+             fromTime: (double)t0
+               toTime: (double)t1
      withCurrentState: (MathMatrix *)x
               control: (MathMatrix *)control;
 
@@ -208,5 +218,167 @@
 - (double) importanceWeightAtTimeIndex: (unsigned)i
               withPredictedMeasurement: (MathMatrix *)pMeasure;
 
+//
+//  Concurrency
+//
+//  GenericParticleFilter may call the batch methods below for disjoint
+//  blocks of particles from several threads at once.  A subclass returns
+//  YES only if its methods can be called that way.
+//  isWeightingThreadSafe covers getNoiseFreeMeasurements:... and
+//  importanceWeights:..., and isPropagationThreadSafe covers
+//  getNextStates:....  Both return NO in this base class.
+//
+//  The SPSA parameter estimator of GenericParticleFilter runs several
+//  rollouts of the system at once, each with its own parameters.
+//  isRolloutThreadSafe covers getNextState:atTimeIndex:withCurrentState:
+//  parameters:control:, getMeasurement:...parameters: and probabilityOf:...
+//  A subclass which returns YES should draw the noise of a rollout from
+//  the counter-based streams at the position [RandomNumberGenerator
+//  particleOffset], which is distinct for each rollout.  It returns NO in
+//  this base class.
+//
+- (BOOL) isWeightingThreadSafe;
+- (BOOL) isPropagationThreadSafe;
+- (BOOL) isRolloutThreadSafe;
+
+//
+//  Noise streams
+//
+//  The batch methods draw the noise of a particle from the counter-based
+//  stream of XNoiseGenID (see RandomNumberGenerator.h), e.g., with the
+//  substream given by the time and the position given by the index of
+//  the particle plus [RandomNumberGenerator particleOffset].
+//  This moves XNoiseGenID and YNoiseGenID to new epochs, so that each run
+//  of a filter gets new noise. GenericParticleFilter calls it when it is
+//  initialized.
+//
+- (void) advanceNoiseStreams;
+
+//
+//  Batch (whole population) versions of the methods above.
+//
+//  A block of particles is stored in the same way as a MathMatrix of
+//  particles in GenericParticleFilter, i.e., the k'th component of the j'th
+//  particle is x[k*ld + j] where ld (stride) is the distance between two
+//  successive components.  Both indices are 0-based here.
+//  Predicted measurements use the same layout with dimY rows.
+//
+//  The implementations in this base class fall back on the per-particle
+//  methods, so subclasses which do not override them still work.
+//  Subclasses should override them to avoid the message dispatch and
+//  the copies through temporary MathMatrix objects for every particle.
+//
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control;
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                      atTimeIndex: (unsigned)i
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld;
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)i
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld;
+
+//
+//  Time based versions of the methods above for online filtering.
+//
+//  These do not refer to timeSpan or Y, so they can be used for
+//  measurements arriving one at a time (see GenericParticleFilter).
+//  The measurement vector y has its k'th component at y[k*ldy].
+//  For a column vector (a MathMatrix of width 1), ldy is 1.
+//
+//  The batch fallbacks in this base class call the per-particle
+//  methods getNextState:fromTime:toTime:withCurrentState:control:,
+//  getNoiseFreeMeasurement:atTime:withCurrentState: and
+//  importanceWeightAtTime:forMeasurement:withPredictedMeasurement:.
+//  A subclass for online filtering overrides either the batch methods or
+//  the per-particle ones; the per-particle ones of this base class only
+//  log that they are missing (and the weight is 0).
+//
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure;
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control;
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld;
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)y
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld;
+
+//
+//  Look-ahead points of the auxiliary particle filter
+//
+//  A point prediction of the next state of each particle without noise,
+//  typically its mean E[x_t | x_t-1].  The auxiliary particle filter of
+//  GenericParticleFilter chooses the parents by the likelihood of the
+//  measurement at these points.  The layout of the blocks is the same as
+//  above, and isPropagationThreadSafe covers these methods as well.
+//  The implementations in this base class copy the current states, which
+//  suits slowly changing states.  Subclasses should override them.
+//
+- (void) getPointPredictions: (double *)next
+                 atTimeIndex: (unsigned)i
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld;
+
+- (void) getPointPredictions: (double *)next
+                    fromTime: (double)t0
+                      toTime: (double)t1
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld;
+
+//
+//  Transition densities for smoothing
+//
+//  p[j] = p(x_i = next | x_i-1 = the j'th current state), where next is
+//  a state (dimX contiguous doubles) at the time index i and the current
+//  states are laid out as above.  transitionDensityBoundAtTimeIndex:
+//  returns an upper bound of the density of the transition to i over all
+//  the states, or 0 if no bound is known.  The backward simulation
+//  smoother (see BackwardSimulationSmoother.h) draws the ancestors by
+//  rejection against the bound, and evaluates the densities of all the
+//  particles only if the rejections run too long.
+//  A subclass which implements them returns YES for hasTransitionDensity,
+//  and isPropagationThreadSafe covers them as well.  In this base class,
+//  there is no density: hasTransitionDensity returns NO and the others
+//  return 0.
+//
+- (BOOL) hasTransitionDensity;
+
+- (void) transitionDensities: (double *)p
+                 atTimeIndex: (unsigned)i
+                 ofNextState: (const double *)next
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld;
+
+- (double) transitionDensityBoundAtTimeIndex: (unsigned)i;
+
 
 @end
@@ -9,6 +9,7 @@
 #import "GenericSystem.h"
 #import "time.h"
 #import "random.h"
+#import "string.h"
 
 #define GENERIC_SYSTEM_DEFAULT_TIME_BEGIN       0.0
 #define GENERIC_SYSTEM_DEFAULT_TIME_END         120.0
@@ -66,9 +67,8 @@
 		if ( !span ) { // time span NOT given
 			double t = GENERIC_SYSTEM_DEFAULT_TIME_BEGIN;
 			timeSpan = [[MathMatrix alloc]
-                  initWithType:@"double"
-                  width:GENERIC_SYSTEM_DEFAULT_TIME_SPAN_SIZE
-                  height:1UL];
+                  initDoubleWithWidth:GENERIC_SYSTEM_DEFAULT_TIME_SPAN_SIZE
+                               height:1UL];
       
 			for ( i = 0; i < GENERIC_SYSTEM_DEFAULT_TIME_SPAN_SIZE; i++ ) {
 				((double *)[timeSpan elements])[i] = t;
@@ -81,9 +81,8 @@
 		// 2. set system parameters
 		if ( !theParameters ) { // parameters NOT given
       // simply set 1.0 as the only one parameter
-			parameters = [[MathMatrix alloc] initWithType: @"double"
-                                              width: 1UL
-                                             height: 1UL];
+			parameters = [[MathMatrix alloc] initDoubleWithWidth: 1UL
+			                                              height: 1UL];
       
 			[parameters setDoubleValue:1.0 atRow:1UL column:1UL];
 		} else {
@@ -93,21 +92,16 @@
 		
 		// 3. allocate other resources accordingly
 		capa = [timeSpan count];
-		X = [[MathMatrix alloc] initWithType:@"double"
-                                   width:capa
-                                  height:xdim];
-		U = [[MathMatrix alloc] initWithType:@"double"
-                                   width:capa
-                                  height:udim];
-		Y = [[MathMatrix alloc] initWithType:@"double"
-                                   width:capa
-                                  height:ydim];
-		XNoise = [[MathMatrix alloc] initWithType:@"double"
-                                        width:capa
-                                       height:xndim];
-		YNoise = [[MathMatrix alloc] initWithType:@"double"
-                                        width:capa
-                                       height:yndim];
+		X = [[MathMatrix alloc] initDoubleWithWidth:capa
+		                                     height:xdim];
+		U = [[MathMatrix alloc] initDoubleWithWidth:capa
+		                                     height:udim];
+		Y = [[MathMatrix alloc] initDoubleWithWidth:capa
+		                                     height:ydim];
+		XNoise = [[MathMatrix alloc] initDoubleWithWidth:capa
+		                                          height:xndim];
+		YNoise = [[MathMatrix alloc] initDoubleWithWidth:capa
+		                                          height:yndim];
 		
 	}
 	
@@ -126,6 +120,56 @@
 	[super dealloc];
 }
 
+- (id) copyWithZone: (NSZone *)zone {
+	// Not init, whose overrides may do more than setting defaults; the
+	// subclasses copy the rest of their state after calling this.
+	GenericSystem *copy = [[[self class] allocWithZone:zone]
+	                       initWithTimeSpan:nil
+	                       systemParameters:nil
+	                         stateDimension:[self dimX]
+	                         inputDimension:[self dimU]
+	                        outputDimension:[self dimY]
+	                  processNoiseDimension:[self dimXNoise]
+	                   outputNoiseDimension:[self dimYNoise]];
+	MathMatrix *mat;
+	
+	// The time span goes first since setting it reallocates the others.
+	mat = [timeSpan copyWithZone:zone];
+	[copy setTimeSpan:mat];
+	[mat release];
+	
+	mat = [parameters copyWithZone:zone];
+	[copy setParameters:mat];
+	[mat release];
+	
+	mat = [X copyWithZone:zone];
+	[copy setX:mat];
+	[mat release];
+	
+	mat = [U copyWithZone:zone];
+	[copy setU:mat];
+	[mat release];
+	
+	mat = [Y copyWithZone:zone];
+	[copy setY:mat];
+	[mat release];
+	
+	mat = [XNoise copyWithZone:zone];
+	[copy setXNoise:mat];
+	[mat release];
+	
+	mat = [YNoise copyWithZone:zone];
+	[copy setYNoise:mat];
+	[mat release];
+	
+	// the slots are already occupied by this system
+	[copy setRNGenerator:RNGenerator];
+	copy -> XNoiseGenID = XNoiseGenID;
+	copy -> YNoiseGenID = YNoiseGenID;
+	
+	return copy;
+}
+
 // *****************************************************************************
 //
 //  ACCESSORS
@@ -172,9 +216,8 @@
 	[X release];
 	
 	// 2. allocate new resources
-	X = [[MathMatrix alloc] initWithType:@"double"
-                                 width:[timeSpan count]
-                                height:dim];
+	X = [[MathMatrix alloc] initDoubleWithWidth:[timeSpan count]
+	                                     height:dim];
 }
 
 // dimension of input
@@ -188,9 +231,8 @@
 	[U release];
 	
 	// 2. allocate new resources
-	U = [[MathMatrix alloc] initWithType:@"double"
-                                 width:[timeSpan count]
-                                height:dim];
+	U = [[MathMatrix alloc] initDoubleWithWidth:[timeSpan count]
+	                                     height:dim];
 	
 }
 
@@ -205,9 +247,8 @@
 	[Y release];
 	
 	// 2. allocate new resources
-	Y = [[MathMatrix alloc] initWithType:@"double"
-                                 width:[timeSpan count]
-                                height:dim];
+	Y = [[MathMatrix alloc] initDoubleWithWidth:[timeSpan count]
+	                                     height:dim];
 	
 }
 
@@ -222,9 +263,8 @@
 	[XNoise release];
 	
 	// 2. allocate new resources
-	XNoise = [[MathMatrix alloc] initWithType:@"double"
-                                      width:[timeSpan count]
-                                     height:dim];
+	XNoise = [[MathMatrix alloc] initDoubleWithWidth:[timeSpan count]
+	                                          height:dim];
 	
 }
 
@@ -239,9 +279,8 @@
 	[YNoise release];
 	
 	// 2. allocate new resources
-	YNoise = [[MathMatrix alloc] initWithType:@"double"
-                                      width:[timeSpan count]
-                                     height:dim];
+	YNoise = [[MathMatrix alloc] initDoubleWithWidth:[timeSpan count]
+	                                          height:dim];
 	
 }
 
@@ -388,21 +427,16 @@
 	
 	// allocate new resources
 	capa = [timeSpan count];
-	X = [[MathMatrix alloc] initWithType:@"double"
-                                 width:capa
-                                height:xdim];
-	U = [[MathMatrix alloc] initWithType:@"double"
-                                 width:capa
-                                height:udim];
-	Y = [[MathMatrix alloc] initWithType:@"double"
-                                 width:capa
-                                height:ydim];
-	XNoise = [[MathMatrix alloc] initWithType:@"double"
-                                      width:capa
-                                     height:xndim];
-	YNoise = [[MathMatrix alloc] initWithType:@"double"
-                                      width:capa
-                                     height:yndim];
+	X = [[MathMatrix alloc] initDoubleWithWidth:capa
+	                                     height:xdim];
+	U = [[MathMatrix alloc] initDoubleWithWidth:capa
+	                                     height:udim];
+	Y = [[MathMatrix alloc] initDoubleWithWidth:capa
+	                                     height:ydim];
+	XNoise = [[MathMatrix alloc] initDoubleWithWidth:capa
+	                                          height:xndim];
+	YNoise = [[MathMatrix alloc] initDoubleWithWidth:capa
+	                                          height:yndim];
 }
 
 
@@ -544,10 +578,14 @@
 }
 
 - (void) getNextState: (MathMatrix *)next
-               atTime: (double)t
+             fromTime: (double)t0
+               toTime: (double)t1
      withCurrentState: (MathMatrix *)x
               control: (MathMatrix *)control {
-	// do nothing for this base class
+	// The time based methods are only for online filtering, so a system
+	// without them must not be used that way.
+	NSLog(@"%@ does not implement getNextState:fromTime:toTime:withCurrentState:control:",
+	      NSStringFromClass([self class]));
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
@@ -559,7 +597,8 @@
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
                           atTime: (double)t
                 withCurrentState: (MathMatrix *)x {
-	// do nothing for this base class
+	NSLog(@"%@ does not implement getNoiseFreeMeasurement:atTime:withCurrentState:",
+	      NSStringFromClass([self class]));
 }
 
 - (void) getNextState: (MathMatrix *)next
@@ -603,5 +642,274 @@
 	return 0.0;
 }
 
+// The per-particle methods of subclasses are not known to be thread-safe.
+- (BOOL) isWeightingThreadSafe {
+	return NO;
+}
+
+- (BOOL) isPropagationThreadSafe {
+	return NO;
+}
+
+- (BOOL) isRolloutThreadSafe {
+	return NO;
+}
+
+- (void) advanceNoiseStreams {
+	[RNGenerator advanceSlot:XNoiseGenID];
+	[RNGenerator advanceSlot:YNoiseGenID];
+}
+
+// Batch versions.
+// These fall back on the per-particle methods above.
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	unsigned j, k;
+	unsigned xdim = [self dimX];
+	MathMatrix *state = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:xdim];
+	MathMatrix *pState = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                      height:xdim];
+	double *s = [state doubleElements];
+	double *p = [pState doubleElements];
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < xdim; k++ ) {
+			s[k] = x[k*ld + j];
+		}
+		
+		[self getNextState: pState
+		       atTimeIndex: i
+		  withCurrentState: state
+		           control: control];
+		
+		for ( k = 0; k < xdim; k++ ) {
+			next[k*ld + j] = p[k];
+		}
+	}
+	
+	[state release];
+	[pState release];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                      atTimeIndex: (unsigned)i
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+	unsigned j, k;
+	unsigned xdim = [self dimX];
+	unsigned ydim = [self dimY];
+	MathMatrix *state = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:xdim];
+	MathMatrix *pMeasure = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                        height:ydim];
+	double *s = [state doubleElements];
+	double *m = [pMeasure doubleElements];
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < xdim; k++ ) {
+			s[k] = x[k*ld + j];
+		}
+		
+		[self getNoiseFreeMeasurement: pMeasure
+		                  atTimeIndex: i
+		             withCurrentState: state];
+		
+		for ( k = 0; k < ydim; k++ ) {
+			output[k*ld + j] = m[k];
+		}
+	}
+	
+	[state release];
+	[pMeasure release];
+}
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)i
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	unsigned j, k;
+	unsigned ydim = [self dimY];
+	MathMatrix *measure = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                       height:ydim];
+	double *m = [measure doubleElements];
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < ydim; k++ ) {
+			m[k] = pMeasure[k*ld + j];
+		}
+		
+		w[j] = [self importanceWeightAtTimeIndex: i
+		                withPredictedMeasurement: measure];
+	}
+	
+	[measure release];
+}
+
+// Time based versions.
+// These fall back on the per-particle methods, too.
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure {
+	NSLog(@"%@ does not implement importanceWeightAtTime:forMeasurement:withPredictedMeasurement:",
+	      NSStringFromClass([self class]));
+	return 0.0;
+}
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	unsigned j, k;
+	unsigned xdim = [self dimX];
+	MathMatrix *state = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:xdim];
+	MathMatrix *pState = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                      height:xdim];
+	double *s = [state doubleElements];
+	double *p = [pState doubleElements];
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < xdim; k++ ) {
+			s[k] = x[k*ld + j];
+		}
+		
+		[self getNextState: pState
+		          fromTime: t0
+		            toTime: t1
+		  withCurrentState: state
+		           control: control];
+		
+		for ( k = 0; k < xdim; k++ ) {
+			next[k*ld + j] = p[k];
+		}
+	}
+	
+	[state release];
+	[pState release];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+	unsigned j, k;
+	unsigned xdim = [self dimX];
+	unsigned ydim = [self dimY];
+	MathMatrix *state = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                     height:xdim];
+	MathMatrix *pMeasure = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                        height:ydim];
+	double *s = [state doubleElements];
+	double *m = [pMeasure doubleElements];
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < xdim; k++ ) {
+			s[k] = x[k*ld + j];
+		}
+		
+		[self getNoiseFreeMeasurement: pMeasure
+		                       atTime: t
+		             withCurrentState: state];
+		
+		for ( k = 0; k < ydim; k++ ) {
+			output[k*ld + j] = m[k];
+		}
+	}
+	
+	[state release];
+	[pMeasure release];
+}
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)y
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	unsigned j, k;
+	unsigned ydim = [self dimY];
+	MathMatrix *measure = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                       height:ydim];
+	MathMatrix *predicted = [[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                         height:ydim];
+	double *m = [measure doubleElements];
+	double *pm = [predicted doubleElements];
+	
+	for ( k = 0; k < ydim; k++ ) {
+		m[k] = y[k*ldy];
+	}
+	
+	for ( j = 0; j < n; j++ ) {
+		for ( k = 0; k < ydim; k++ ) {
+			pm[k] = pMeasure[k*ld + j];
+		}
+		
+		w[j] = [self importanceWeightAtTime: t
+		                     forMeasurement: measure
+		           withPredictedMeasurement: predicted];
+	}
+	
+	[measure release];
+	[predicted release];
+}
+
+// Look-ahead points.
+// The current states, i.e., the states are assumed to change slowly.
+- (void) getPointPredictions: (double *)next
+                 atTimeIndex: (unsigned)i
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	unsigned k;
+	
+	for ( k = 0; k < [self dimX]; k++ ) {
+		memcpy(next + k*ld, x + k*ld, n * sizeof(double));
+	}
+}
+
+- (void) getPointPredictions: (double *)next
+                    fromTime: (double)t0
+                      toTime: (double)t1
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	unsigned k;
+	
+	for ( k = 0; k < [self dimX]; k++ ) {
+		memcpy(next + k*ld, x + k*ld, n * sizeof(double));
+	}
+}
+
+// Transition densities.
+// Nothing is known about the transition in this base class.
+- (BOOL) hasTransitionDensity {
+	return NO;
+}
+
+- (void) transitionDensities: (double *)p
+                 atTimeIndex: (unsigned)i
+                 ofNextState: (const double *)next
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	memset(p, 0, n * sizeof(double));
+}
+
+- (double) transitionDensityBoundAtTimeIndex: (unsigned)i {
+	return 0.0;
+}
+
 
 @end
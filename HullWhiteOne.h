@@ -12,6 +12,13 @@
 #import "MathMatrix.h"
 #import "CubicSpline2D.h"
 
+//
+//  The parameters of the system (see GenericSystem) are (mrs, vol), which
+//  are kept in step with the accessors below.  The methods which take
+//  parameters use them in place of mrs and vol, so each particle of a
+//  filter which learns the parameters may have its own.
+//
+
 @interface HullWhiteOne : GenericSystem {
 @private
 	double mrs;		// mean reverting speed
@@ -52,6 +59,10 @@
 
 - (void) dealloc;
 
+// The maturities and the spline of the initial term structure are copied
+// as well, without going through the designated initializer.
+- (id) copyWithZone: (NSZone *)zone;
+
 
 // *****************************************************************************
 //
@@ -67,6 +78,9 @@
 - (double) vol;
 - (void) setVol: (double)s;
 
+// sets mrs and vol as well (2 x 1)
+- (void) setParameters: (MathMatrix *)theParameters;
+
 - (double) lambda;
 - (void) setLambda: (double)l;
 
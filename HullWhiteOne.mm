@@ -17,6 +17,9 @@
 #define HULL_WHITE_ONE_SYSTEM_DEFAULT_TIME_SPAN_SIZE		81
 #define HULL_WHITE_ONE_SYSTEM_DEFAULT_NUM_MEASUREMENTS		12UL
 
+// number of particles whose noise is drawn at a time
+#define HULL_WHITE_ONE_SYSTEM_NOISE_BLOCK					256U
+
 using namespace std;
 
 // *****************************************************************************
@@ -33,6 +36,12 @@ using namespace std;
                withMaturityIndex: (unsigned)idx
                        OUProcess: (double)x;
 
+- (double) pureMeasurementAtTime: (double)t
+               withMaturityIndex: (unsigned)idx
+                       OUProcess: (double)x
+                 meanRevertSpeed: (double)m
+                      volatility: (double)v;
+
 @end
 
 
@@ -95,8 +104,15 @@ using namespace std;
               initialTS: (double *)its
                 volBSRM: (double)v2 {
 	
+	// (mrs, vol)
+	MathMatrix *params = [[[MathMatrix alloc] initDoubleWithWidth:1UL
+	                                                       height:2UL]
+	                      autorelease];
+	[params doubleElements][0] = m;
+	[params doubleElements][1] = v;
+	
 	if ( self = [super initWithTimeSpan: span
-                     systemParameters: nil
+                     systemParameters: params
                        stateDimension: 1UL
                        inputDimension: 0UL
                       outputDimension: ydim
@@ -140,6 +156,19 @@ using namespace std;
 	[super dealloc];
 }
 
+- (id) copyWithZone: (NSZone *)zone {
+	HullWhiteOne *copy = [super copyWithZone:zone];
+	
+	copy -> mrs = mrs;
+	copy -> vol = vol;
+	copy -> lambda = lambda;
+	copy -> volBSRM = volBSRM;
+	copy -> numInitialSR = numInitialSR;
+	copy -> maturity = [maturity copyWithZone:zone];
+	copy -> initialTS = new CubicSpline2D(*initialTS);
+	return copy;
+}
+
 
 // *****************************************************************************
 //
@@ -155,6 +184,7 @@ using namespace std;
 
 - (void) setMrs: (double)a {
 	mrs = a;
+	[parameters doubleElements][0] = a;
 }
 
 - (double) vol {
@@ -163,6 +193,17 @@ using namespace std;
 
 - (void) setVol: (double)s {
 	vol = s;
+	[parameters doubleElements][1] = s;
+}
+
+- (void) setParameters: (MathMatrix *)theParameters {
+	if ( [theParameters count] != 2UL ) {
+		NSLog(@"The parameters of HullWhiteOne are (mrs, vol).");
+		return;
+	}
+	[super setParameters:theParameters];
+	mrs = [theParameters doubleElements][0];
+	vol = [theParameters doubleElements][1];
 }
 
 - (double) lambda {
@@ -247,7 +288,7 @@ using namespace std;
 			s = pow(lambda, [self tau:j]/[self tau:0])*volBSRM; // sigma_{hi}
 			z = sqrt(s) * gennor(0.0, 1.0);
 			y += z;
-			[Y setDoubleValue:y atRow:(j+1) column:(i+1)];
+			[Y doubleRow:(j+1)][i] = y;
 		}
     
 		// calculate short rate from O-U process
@@ -278,7 +319,7 @@ using namespace std;
 	[RNGenerator setCurrentGenerator:XNoiseGenID];
 	tmp1 = exp(-mrs*(t[i] - t[i-1]));
 	xx = tmp1*_x + vol*sqrt((1.0 - tmp1*tmp1)/(2.0*mrs))*gennor(0.0, 1.0);
-	[next setDoubleValue:xx atRow:1UL column:1UL];
+	[next doubleElements][0] = xx;
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
@@ -294,7 +335,7 @@ using namespace std;
                   withMaturityIndex:j
                           OUProcess:_x];
     
-		[output setDoubleValue:y atRow:(j+1) column:1UL];
+		[output doubleElements][j] = y;
 	}
 	return;
 }
@@ -311,11 +352,92 @@ using namespace std;
                   withMaturityIndex:j
                           OUProcess:_x];
 		
-		[output setDoubleValue:y atRow:(j+1) column:1UL];
+		[output doubleElements][j] = y;
 	}
 	return;
 }
 
+// The O-U process with the parameters (mrs, vol) in params.
+// The noise is drawn at the position of the rollout in the stream which
+// the batch version uses, so the two agree for the same parameters.
+- (void) getNextState: (MathMatrix *)next
+          atTimeIndex: (unsigned)i
+     withCurrentState: (MathMatrix *)x
+           parameters: (MathMatrix *)params
+              control: (MathMatrix *)control {
+	
+	double* t = (double *)[timeSpan elements];
+	double m = [params doubleElements][0];
+	double v = [params doubleElements][1];
+	double tmp1, scale;
+	PhiloxStream stream;
+	
+	tmp1 = exp(-m*(t[i] - t[i-1]));
+	// (a Brownian motion if the process does not revert)
+	scale = ( m != 0.0 ) ? v*sqrt((1.0 - tmp1*tmp1)/(2.0*m))
+	: v*sqrt(t[i] - t[i-1]);
+	
+	[RNGenerator getStream:&stream forSlot:XNoiseGenID atTime:t[i]];
+	[next doubleElements][0] = tmp1*[x doubleElements][0]
+	+ scale*PhiloxNormalAt(&stream, [RandomNumberGenerator particleOffset]);
+}
+
+- (void) getMeasurement: (MathMatrix *)output
+            atTimeIndex: (unsigned)i
+       withCurrentState: (MathMatrix *)x
+             parameters: (MathMatrix *)params {
+	
+	double t = ((double *)[timeSpan elements])[i];
+	double _x = [x doubleElements][0];
+	unsigned ydim = [self dimY];
+	unsigned offset = [RandomNumberGenerator particleOffset];
+	double s;
+	PhiloxStream stream;
+	
+	[RNGenerator getStream:&stream forSlot:YNoiseGenID atTime:t];
+	for ( unsigned j = 0; j < ydim; j++ ) {
+		s = pow(lambda, [self tau:j]/[self tau:0])*volBSRM; // sigma_{hi}
+		[output doubleElements][j] =
+		[self pureMeasurementAtTime:t
+		          withMaturityIndex:j
+		                  OUProcess:_x
+		            meanRevertSpeed:[params doubleElements][0]
+		                 volatility:[params doubleElements][1]]
+		+ sqrt(s)*PhiloxNormalAt(&stream, offset*ydim + j);
+	}
+}
+
+// The same density as importanceWeights:..., for the measurement made
+// with the parameters in params.  The mean reverting speed must be
+// positive.
+- (double) probabilityOf: (MathMatrix *)output
+                   given: (MathMatrix *)state
+             atTimeIndex: (unsigned)ti
+          withParameters: (MathMatrix *)params {
+	
+	double t = ((double *)[timeSpan elements])[ti];
+	double _x = [state doubleElements][0];
+	double m = [params doubleElements][0];
+	double v = [params doubleElements][1];
+	double s, d, pdf = 1.0;
+	
+	if ( m <= 0.0 ) {
+		return 0.0;
+	}
+	
+	for ( unsigned j = 0; j < [self dimY]; j++ ) {
+		s = pow(lambda, [self tau:j]/[self tau:0])*volBSRM; // sigma_{hi}, variance
+		d = [output doubleElements][j]
+		- [self pureMeasurementAtTime:t
+		            withMaturityIndex:j
+		                    OUProcess:_x
+		              meanRevertSpeed:m
+		                   volatility:v];
+		pdf *= exp(-0.25*d*d/s)/sqrt(s);
+	}
+	return pdf;
+}
+
 - (double) initialTermStructure: (double)t {
 	double last;
 	[maturity getValue:&last atRow:1UL column:[maturity count]];
@@ -349,16 +471,15 @@ using namespace std;
 	double pdf = 1.0;
   //	double tmp1, tmp2;
 	
-	MathMatrix* measure = [[MathMatrix alloc] initWithType:@"double"
-                                                   width:1UL
-                                                  height:[self dimY]];
-	[Y getVector:measure atColumn:(index + 1)]; // since index is 0-based.
+	// the (index + 1)'th column of Y, since index is 0-based.
+	double *measure = [Y doubleColumn:(index + 1)];
+	unsigned ldy = [Y width];
 	
 	for ( unsigned j = 0; j < [self dimY]; j++ ) {
 		s = pow(lambda, [self tau:j]/[self tau:0])*volBSRM; // sigma_{hi}, variance
     
-		[measure getValue:&m atRow:(j+1) column:1UL];
-		[pMeasure getValue:&pm atRow:(j+1) column:1UL];
+		m = measure[j*ldy];
+		pm = [pMeasure doubleElements][j];
 		
     //		NSLog(@"The value of simualted measurement is %f, predicted is %f", m, pm);
     //		if ( tmp1 != tmp2 ) {
@@ -369,12 +490,244 @@ using namespace std;
 		pdf *= (double)exp(-0.25 * pow((m - pm), 2.0) / s)/sqrt(s);
     //		NSLog(@"The pdf = %f", pdf);
 	}
-	[measure release];
 	
   //	NSLog(@"the weight: %f", pdf);
 	return pdf;
 }
 
+// The measurements and the weights only read the parameters and
+// the initial term structure, and the propagation draws from a
+// counter-based stream, so all of them can be evaluated concurrently.
+- (BOOL) isWeightingThreadSafe {
+	return YES;
+}
+
+- (BOOL) isPropagationThreadSafe {
+	return YES;
+}
+
+- (BOOL) isRolloutThreadSafe {
+	return YES;
+}
+
+// Batch versions for the whole population of particles.
+// See GenericSystem.h for the layout of the blocks.
+// The versions driven by time index call the time based versions.
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	
+	double* t = (double *)[timeSpan elements];
+	
+	[self getNextStates: next
+	           fromTime: t[i-1]
+	             toTime: t[i]
+	  withCurrentStates: x
+	              count: n
+	             stride: ld
+	            control: control];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                      atTimeIndex: (unsigned)index
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+	
+	[self getNoiseFreeMeasurements: output
+	                        atTime: ((double *)[timeSpan elements])[index]
+	             withCurrentStates: x
+	                         count: n
+	                        stride: ld];
+}
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)index
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	
+	// the index'th column of Y (index is 0-based)
+	[self importanceWeights: w
+	                 atTime: ((double *)[timeSpan elements])[index]
+	         forMeasurement: ((double *)[Y elements]) + index
+	      measurementStride: [Y width]
+	withPredictedMeasurements: pMeasure
+	                  count: n
+	                 stride: ld];
+}
+
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure {
+	
+	double w;
+	
+	[self importanceWeights: &w
+	                 atTime: t
+	         forMeasurement: (double *)[y elements]
+	      measurementStride: 1UL
+	withPredictedMeasurements: (double *)[pMeasure elements]
+	                  count: 1UL
+	                 stride: 1UL];
+	return w;
+}
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	
+	double tmp1 = exp(-mrs*(t1 - t0));
+	double scale = vol*sqrt((1.0 - tmp1*tmp1)/(2.0*mrs));
+	double noise[HULL_WHITE_ONE_SYSTEM_NOISE_BLOCK];
+	unsigned b, m;
+	unsigned offset = [RandomNumberGenerator particleOffset];
+	PhiloxStream stream;
+	
+	[RNGenerator getStream:&stream forSlot:XNoiseGenID atTime:t1];
+	for ( b = 0; b < n; b += m ) {
+		m = ( n - b < HULL_WHITE_ONE_SYSTEM_NOISE_BLOCK ) ? n - b : HULL_WHITE_ONE_SYSTEM_NOISE_BLOCK;
+		
+		PhiloxFillNormal(&stream, offset + b, m, noise);
+		for ( unsigned j = 0; j < m; j++ ) {
+			next[b + j] = tmp1*x[b + j] + scale*noise[j];
+		}
+	}
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+	
+	double slope, intercept, tau;
+	double* y;
+	
+	// The measurement is affine in the state of the O-U process, i.e.,
+	// y_j = (B_j/tau_j)*x + (the value of y_j at x = 0).
+	// Hence, the spline evaluations are done once per maturity,
+	// not once per particle.
+	for ( unsigned k = 0; k < [self dimY]; k++ ) {
+		tau = [self tau:k];
+		slope = (1.0 - exp(-mrs*tau))/(mrs*tau);
+		intercept = [self pureMeasurementAtTime:t
+		                      withMaturityIndex:k
+		                              OUProcess:0.0];
+		y = output + k*ld;
+		for ( unsigned j = 0; j < n; j++ ) {
+			y[j] = slope*x[j] + intercept;
+		}
+	}
+}
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)measure
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	
+	unsigned ydim = [self dimY];
+	double m, s, d, c, norm = 1.0;
+	double* pm;
+	
+	// The product of the Gaussian densities is evaluated as one exponential
+	// of the sum of exponents.
+	for ( unsigned j = 0; j < n; j++ ) {
+		w[j] = 0.0;
+	}
+	
+	for ( unsigned k = 0; k < ydim; k++ ) {
+		s = pow(lambda, [self tau:k]/[self tau:0])*volBSRM; // sigma_{hi}, variance
+		m = measure[k*ldy];
+		c = -0.25/s;
+		norm /= sqrt(s);
+		
+		pm = pMeasure + k*ld;
+		for ( unsigned j = 0; j < n; j++ ) {
+			d = m - pm[j];
+			w[j] += c*d*d;
+		}
+	}
+	
+	for ( unsigned j = 0; j < n; j++ ) {
+		w[j] = exp(w[j])*norm;
+	}
+}
+
+// The mean of the O-U process after t1 - t0
+- (void) getPointPredictions: (double *)next
+                 atTimeIndex: (unsigned)i
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	
+	double* t = (double *)[timeSpan elements];
+	
+	[self getPointPredictions: next
+	                 fromTime: t[i-1]
+	                   toTime: t[i]
+	        withCurrentStates: x
+	                    count: n
+	                   stride: ld];
+}
+
+- (void) getPointPredictions: (double *)next
+                    fromTime: (double)t0
+                      toTime: (double)t1
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	
+	double tmp1 = exp(-mrs*(t1 - t0));
+	
+	for ( unsigned j = 0; j < n; j++ ) {
+		next[j] = tmp1*x[j];
+	}
+}
+
+// The transition of the O-U process is Gaussian, with the mean of the
+// point prediction and the variance of the noise of getNextStates:...
+- (BOOL) hasTransitionDensity {
+	return YES;
+}
+
+- (void) transitionDensities: (double *)p
+                 atTimeIndex: (unsigned)i
+                 ofNextState: (const double *)next
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+	
+	double* t = (double *)[timeSpan elements];
+	double tmp1 = exp(-mrs*(t[i] - t[i-1]));
+	double scale = vol*sqrt((1.0 - tmp1*tmp1)/(2.0*mrs));
+	double c = 1.0/(sqrt(2.0*M_PI)*scale);
+	double d;
+	
+	for ( unsigned j = 0; j < n; j++ ) {
+		d = (next[0] - tmp1*x[j])/scale;
+		p[j] = c*exp(-0.5*d*d);
+	}
+}
+
+// the density at the mean
+- (double) transitionDensityBoundAtTimeIndex: (unsigned)i {
+	double* t = (double *)[timeSpan elements];
+	double tmp1 = exp(-mrs*(t[i] - t[i-1]));
+	
+	return 1.0/(sqrt(2.0*M_PI)*vol*sqrt((1.0 - tmp1*tmp1)/(2.0*mrs)));
+}
+
 // *****************************************************************************
 //
 //  Private Methods
@@ -384,15 +737,28 @@ using namespace std;
                withMaturityIndex: (unsigned)idx
                        OUProcess: (double) x {
 	
+	return [self pureMeasurementAtTime:t
+	                 withMaturityIndex:idx
+	                         OUProcess:x
+	                   meanRevertSpeed:mrs
+	                        volatility:vol];
+}
+
+- (double) pureMeasurementAtTime: (double)t
+               withMaturityIndex: (unsigned)idx
+                       OUProcess: (double)x
+                 meanRevertSpeed: (double)m
+                      volatility: (double)v {
+	
 	// instantaneous forward rate
 	double f = t * (initialTS -> Derivative(t)).y + [self initialTermStructure:t];
 	double tau = [self tau:idx];
-	double B = (1.0 - exp( -mrs*tau ))/mrs;
-	double logA = -0.25*vol*vol/(pow(mrs,3.0))
-  *pow(exp(-mrs*(t + tau)) - exp(-mrs*t), 2.0)*(exp(2.0*mrs*t) - 1.0)
+	double B = (1.0 - exp( -m*tau ))/m;
+	double logA = -0.25*v*v/(pow(m,3.0))
+  *pow(exp(-m*(t + tau)) - exp(-m*t), 2.0)*(exp(2.0*m*t) - 1.0)
   + B*f + t*[self initialTermStructure:t] 
   - (t + tau)*[self initialTermStructure:(t + tau)];
-	double y = B/tau*x + (B/tau*(f + 0.5*pow((vol/mrs*(1.0 - exp(-mrs*t))), 2.0))
+	double y = B/tau*x + (B/tau*(f + 0.5*pow((v/m*(1.0 - exp(-m*t))), 2.0))
                         - logA/tau);
 	return y;
 }
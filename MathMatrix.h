@@ -8,14 +8,16 @@
 
 #import <Foundation/Foundation.h>
 
-@interface MathMatrix : NSObject {
+@interface MathMatrix : NSObject <NSCopying> {
 @private
 	int _type;
 	
 	unsigned _width;
 	unsigned _height;
+	unsigned _ld;		// distance between two successive rows
 	
 	void* _data;
+	id _owner;			// owner of _data if this is a view (retained)
 }
 
 // *****************************************************************************
@@ -33,9 +35,36 @@
              width: (unsigned)width
             height: (unsigned)height;
 
+// the same as initWithType:@"double" width:width height:height
+// without comparing the type name
+- (id)initDoubleWithWidth: (unsigned)width
+                   height: (unsigned)height;
+
+// A view of double elements owned by another object, e.g., a
+// ParticlePopulation.  The (r, c) element is data[(r - 1)*ld + (c - 1)].
+// The view retains owner, and does not free data.
+- (id)initDoubleViewOfElements: (double *)data
+                         width: (unsigned)width
+                        height: (unsigned)height
+              leadingDimension: (unsigned)ld
+                         owner: (id)owner;
+
+// the same as above for elements of any type, e.g., @"unsigned"
+- (id)initViewOfElements: (void *)data
+                    type: (NSString *)type
+                   width: (unsigned)width
+                  height: (unsigned)height
+        leadingDimension: (unsigned)ld
+                   owner: (id)owner;
+
 // dealloc
 - (void)dealloc;
 
+// A matrix (not a view) with its own copy of the elements.
+// The copy of a view is contiguous, i.e., its leading dimension is its
+// width.
+- (id)copyWithZone: (NSZone *)zone;
+
 
 // *****************************************************************************
 //
@@ -57,6 +86,13 @@
 - (void *)elements;
 - (void)setElements: (void *)dt;
 
+// The distance between two successive rows in elements.
+// It is the width unless the matrix is a view.
+- (unsigned)leadingDimension;
+
+// size of an element in bytes
+- (unsigned)elementSize;
+
 
 // *****************************************************************************
 //
@@ -133,6 +169,36 @@
 
 - (MathMatrix *)rankOfElements;
 
+
+// *****************************************************************************
+//
+//  TYPED ACCESS TO DOUBLE MATRICES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Typed Access to Double Matrices
+
+//
+//  The methods above check the type and the range on every call.
+//  For loops over many elements, get a typed pointer once instead:
+//
+//    double *row = [m doubleRow:r];	  // row[c - 1] is the (r, c) element
+//    double *col = [m doubleColumn:c];  // col[(r - 1)*[m leadingDimension]]
+//                                       // is the (r, c) element
+//
+//  Indices begin from 1 as above.  The pointers are not checked unless
+//  MATH_MATRIX_BOUNDS_CHECK is defined (as in the Development build),
+//  in which case an index out of range or a matrix of another type is
+//  logged and NULL is returned.
+//
+- (BOOL)isDouble;
+
+- (double *)doubleElements;
+
+- (double *)doubleRow: (unsigned)r;
+
+- (double *)doubleColumn: (unsigned)c;
+
 // *****************************************************************************
 //
 //  MATHEMATICAL OPERATIONS
@@ -167,4 +233,9 @@
 - (void) writeColumn: (unsigned)c
               toFile: (NSString *)fileName;
 
+// Writes the matrix to a binary archive (see MatrixArchive.h) as a record
+// named "matrix".  The path is used as it is.
+- (BOOL) writeBinaryToFile: (NSString *)path
+                compressed: (BOOL)compressed;
+
 @end
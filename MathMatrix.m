@@ -7,6 +7,7 @@
 //
 
 #import "MathMatrix.h"
+#import "MatrixArchive.h"
 
 // type constants
 enum {
@@ -46,6 +47,7 @@ enum {
 		
 		_width = width;
 		_height = height;
+		_ld = width;
 		
 		// memory allocation
 		if ( [type isEqualToString:@"char"] ) {
@@ -71,15 +73,95 @@ enum {
 	return self;
 }
 
+- (id)initDoubleWithWidth: (unsigned)width
+                   height: (unsigned)height {
+	
+	if (self = [super init]) {
+		_width = width;
+		_height = height;
+		_ld = width;
+		
+		_data = (double *)malloc(width * height * sizeof(double));
+		_type = CONST_MATH_MATRIX_TYPE_DOUBLE;
+	}
+	return self;
+}
+
+- (id)initDoubleViewOfElements: (double *)data
+                         width: (unsigned)width
+                        height: (unsigned)height
+              leadingDimension: (unsigned)ld
+                         owner: (id)owner {
+	
+	if (self = [super init]) {
+		_width = width;
+		_height = height;
+		_ld = ld;
+		
+		_data = data;
+		_owner = [owner retain];
+		_type = CONST_MATH_MATRIX_TYPE_DOUBLE;
+	}
+	return self;
+}
+
+- (id)initViewOfElements: (void *)data
+                    type: (NSString *)type
+                   width: (unsigned)width
+                  height: (unsigned)height
+        leadingDimension: (unsigned)ld
+                   owner: (id)owner {
+	
+	if (self = [super init]) {
+		_width = width;
+		_height = height;
+		_ld = ld;
+		
+		_data = data;
+		_owner = [owner retain];
+		
+		if ( [type isEqualToString:@"char"] ) {
+			_type = CONST_MATH_MATRIX_TYPE_CHAR;
+		} else if ( [type isEqualToString:@"unsigned char"] ) {
+			_type = CONST_MATH_MATRIX_TYPE_UNSIGNED_CHAR;
+		} else if ( [type isEqualToString:@"int"] ) {
+			_type = CONST_MATH_MATRIX_TYPE_INT;
+		} else if ( [type isEqualToString:@"unsigned"] ) {
+			_type = CONST_MATH_MATRIX_TYPE_UNSIGNED;
+		} else if ( [type isEqualToString:@"float"] ) {
+			_type = CONST_MATH_MATRIX_TYPE_FLOAT;
+		} else {
+			_type = CONST_MATH_MATRIX_TYPE_DOUBLE;
+		}
+	}
+	return self;
+}
+
 // dealloc
 - (void)dealloc {
-	if ( _data ) { /// _data is not nil
+	if ( _owner ) {	// a view does not own _data
+		[_owner release];
+	} else if ( _data ) { /// _data is not nil
 		free(_data);
 	}
 	
 	[super dealloc];
 }
 
+- (id)copyWithZone: (NSZone *)zone {
+	MathMatrix *copy = [[MathMatrix allocWithZone:zone] initWithType:[self type]
+	                                                          width:_width
+	                                                         height:_height];
+	unsigned r, size = [self elementSize];
+	
+	for ( r = 0; r < _height; r++ ) {
+		memcpy((char *)[copy elements] + r*_width*size,
+		       (char *)_data + r*_ld*size,
+		       _width*size);
+	}
+	return copy;
+}
+
 
 // *****************************************************************************
 //
@@ -143,6 +225,36 @@ enum {
 	// NOT implemented yet.
 }
 
+- (unsigned)leadingDimension {
+	return _ld;
+}
+
+- (unsigned)elementSize {
+	unsigned size = sizeof(double);
+	
+	switch ( _type ) {
+		case CONST_MATH_MATRIX_TYPE_CHAR:
+			size = sizeof(char);
+			break;
+		case CONST_MATH_MATRIX_TYPE_UNSIGNED_CHAR:
+			size = sizeof(unsigned char);
+			break;
+		case CONST_MATH_MATRIX_TYPE_INT:
+			size = sizeof(int);
+			break;
+		case CONST_MATH_MATRIX_TYPE_UNSIGNED:
+			size = sizeof(unsigned);
+			break;
+		case CONST_MATH_MATRIX_TYPE_FLOAT:
+			size = sizeof(float);
+			break;
+		case CONST_MATH_MATRIX_TYPE_DOUBLE:
+			size = sizeof(double);
+			break;
+	}
+	return size;
+}
+
 
 // *****************************************************************************
 //
@@ -168,7 +280,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
   
 	switch ( _type ) {
 		case CONST_MATH_MATRIX_TYPE_CHAR:
@@ -215,8 +327,19 @@ enum {
 		return;
 	}
 	
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		double *src = ((double *)_data) + (c - 1);
+		double *dst = (double *)[v elements];
+		unsigned ldv = [v leadingDimension];
+		
+		for ( i = 0; i < _height; i++ ) {
+			dst[i*ldv] = src[i*_ld];
+		}
+		return;
+	}
+	
 	for ( i = 1; i <= _height; i++ ) {
-		offset = (i - 1)*_width + (c - 1);
+		offset = (i - 1)*_ld + (c - 1);
     
 		switch ( _type ) {
 			case CONST_MATH_MATRIX_TYPE_CHAR:
@@ -276,8 +399,14 @@ enum {
 		return;
 	}
 	
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		memcpy([v elements], ((double *)_data) + (r - 1)*_ld,
+		       _width * sizeof(double));
+		return;
+	}
+	
 	for ( i = 1; i <= _width; i++ ) {
-		offset = (r - 1)*_width + (i - 1);
+		offset = (r - 1)*_ld + (i - 1);
 		
 		switch ( _type ) {
 			case CONST_MATH_MATRIX_TYPE_CHAR:
@@ -337,6 +466,17 @@ enum {
 		return;
 	}
 	
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		double *src = (double *)[v elements];
+		double *dst = ((double *)_data) + (c - 1);
+		unsigned ldv = [v leadingDimension];
+		
+		for ( i = 0; i < _height; i++ ) {
+			dst[i*_ld] = src[i*ldv];
+		}
+		return;
+	}
+	
 	for ( i = 1; i <= _height; i++ ) {
 		switch ( _type ) {
 			case CONST_MATH_MATRIX_TYPE_CHAR:
@@ -368,7 +508,7 @@ enum {
 			case CONST_MATH_MATRIX_TYPE_DOUBLE:
 				[self setDoubleValue: [v doubleValueAtRow:i column:1UL]
                        atRow: i
-                      column: 1UL];
+                      column: c];
 				break;
 		}
 	}
@@ -397,8 +537,14 @@ enum {
 		return;
 	}
 	
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		memcpy(((double *)_data) + (r - 1)*_ld, [v elements],
+		       _width * sizeof(double));
+		return;
+	}
+	
 	for ( i = 1; i <= _width; i++ ) {
-		offset = (r - 1)*_width + (i - 1);
+		offset = (r - 1)*_ld + (i - 1);
 		
 		switch ( _type ) {
 			case CONST_MATH_MATRIX_TYPE_CHAR:
@@ -454,7 +600,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((char*)_data)[offset] = val;
 }
 
@@ -476,7 +622,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((unsigned char*)_data)[offset] = val;
 }
 
@@ -498,7 +644,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((int*)_data)[offset] = val;
 }
 
@@ -520,7 +666,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((unsigned*)_data)[offset] = val;
 }
 
@@ -542,7 +688,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((float*)_data)[offset] = val;
 }
 
@@ -564,7 +710,7 @@ enum {
 		return;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	((double*)_data)[offset] = val;
 }
 
@@ -588,7 +734,7 @@ enum {
 		return '\0';
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((char*)_data)[offset];
 }
 
@@ -611,7 +757,7 @@ enum {
 		return '\0';
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((unsigned char*)_data)[offset];
 }
 
@@ -634,7 +780,7 @@ enum {
 		return 0L;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((int*)_data)[offset];
 }
 
@@ -657,7 +803,7 @@ enum {
 		return 0UL;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((unsigned*)_data)[offset];
 }
 
@@ -680,7 +826,7 @@ enum {
 		return 0.0;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((float*)_data)[offset];
 }
 
@@ -703,7 +849,7 @@ enum {
 		return 0.0;
 	}
 	
-	offset = (r - 1)*_width + (c - 1);
+	offset = (r - 1)*_ld + (c - 1);
 	return ((double*)_data)[offset];
 }
 
@@ -723,6 +869,57 @@ enum {
 	return result;
 }
 
+// *****************************************************************************
+//
+//  TYPED ACCESS TO DOUBLE MATRICES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Typed Access to Double Matrices
+
+- (BOOL)isDouble {
+	return ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE );
+}
+
+- (double *)doubleElements {
+#ifdef MATH_MATRIX_BOUNDS_CHECK
+	if ( _type != CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		NSLog(@"Type mismatch error in doubleElements");
+		return NULL;
+	}
+#endif
+	return (double *)_data;
+}
+
+- (double *)doubleRow: (unsigned)r {
+#ifdef MATH_MATRIX_BOUNDS_CHECK
+	if ( _type != CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		NSLog(@"Type mismatch error in doubleRow:");
+		return NULL;
+	}
+	if ((r < 1UL) || (_height < r)) {
+		NSLog(@"The argument to doubleRow: out of range");
+		return NULL;
+	}
+#endif
+	return ((double *)_data) + (r - 1)*_ld;
+}
+
+- (double *)doubleColumn: (unsigned)c {
+#ifdef MATH_MATRIX_BOUNDS_CHECK
+	if ( _type != CONST_MATH_MATRIX_TYPE_DOUBLE ) {
+		NSLog(@"Type mismatch error in doubleColumn:");
+		return NULL;
+	}
+	if ((c < 1UL) || (_width < c)) {
+		NSLog(@"The argument to doubleColumn: out of range");
+		return NULL;
+	}
+#endif
+	return ((double *)_data) + (c - 1);
+}
+
+
 // *****************************************************************************
 //
 //  MATHEMATICAL OPERATIONS
@@ -733,34 +930,46 @@ enum {
 
 - (void) multiplyScalar: (double)scalar {
 	unsigned i;
-	unsigned numberOfAllElements = _width * _height;
+	// all the rows, and the padding between them if this is a view
+	unsigned numberOfAllElements = _height ? (_height - 1)*_ld + _width : 0UL;
 	
-	for ( i = 0UL; i < numberOfAllElements; i++ ) {
-		switch ( _type ) {
-			case CONST_MATH_MATRIX_TYPE_CHAR:
+	// the type is dispatched once, outside the loops
+	switch ( _type ) {
+		case CONST_MATH_MATRIX_TYPE_CHAR:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((char*)_data)[i] = ((char*)_data)[i] * scalar;
-				break;
-        
-			case CONST_MATH_MATRIX_TYPE_UNSIGNED_CHAR:
+			}
+			break;
+			
+		case CONST_MATH_MATRIX_TYPE_UNSIGNED_CHAR:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((unsigned char*)_data)[i] = ((unsigned char*)_data)[i] * scalar;
-				break;
-        
-			case CONST_MATH_MATRIX_TYPE_INT:
+			}
+			break;
+			
+		case CONST_MATH_MATRIX_TYPE_INT:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((int*)_data)[i] = ((int*)_data)[i] * scalar;
-				break;
-				
-			case CONST_MATH_MATRIX_TYPE_UNSIGNED:
+			}
+			break;
+			
+		case CONST_MATH_MATRIX_TYPE_UNSIGNED:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((unsigned*)_data)[i] = ((unsigned*)_data)[i] * scalar;
-				break;
-				
-			case CONST_MATH_MATRIX_TYPE_FLOAT:
+			}
+			break;
+			
+		case CONST_MATH_MATRIX_TYPE_FLOAT:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((float*)_data)[i] = ((float*)_data)[i] * scalar;
-				break;
-				
-			case CONST_MATH_MATRIX_TYPE_DOUBLE:
+			}
+			break;
+			
+		case CONST_MATH_MATRIX_TYPE_DOUBLE:
+			for ( i = 0UL; i < numberOfAllElements; i++ ) {
 				((double*)_data)[i] = ((double*)_data)[i] * scalar;
-				break;
-		}
+			}
+			break;
 	}
 }
 
@@ -779,6 +988,19 @@ enum {
 		return;
 	}
 	
+	// double matrices of the same layout are added element by element
+	// without messages
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE && [mat leadingDimension] == _ld ) {
+		double *a = (double *)_data;
+		double *b = (double *)[mat elements];
+		unsigned i, n = _height ? (_height - 1)*_ld + _width : 0UL;
+		
+		for ( i = 0UL; i < n; i++ ) {
+			a[i] += b[i];
+		}
+		return;
+	}
+	
 	for ( r = 1UL; r <= _height; r++ ) {
 		for ( c = 1UL; c <= _width; c++ ) {
 			switch ( _type ) {
@@ -843,6 +1065,19 @@ enum {
 		return;
 	}
 	
+	// double matrices of the same layout are subtracted element by element
+	// without messages
+	if ( _type == CONST_MATH_MATRIX_TYPE_DOUBLE && [mat leadingDimension] == _ld ) {
+		double *a = (double *)_data;
+		double *b = (double *)[mat elements];
+		unsigned i, n = _height ? (_height - 1)*_ld + _width : 0UL;
+		
+		for ( i = 0UL; i < n; i++ ) {
+			a[i] -= b[i];
+		}
+		return;
+	}
+	
 	for ( r = 1UL; r <= _height; r++ ) {
 		for ( c = 1UL; c <= _width; c++ ) {
 			switch ( _type ) {
@@ -1028,4 +1263,14 @@ enum {
 	fclose(FP);
 }
 
+- (BOOL) writeBinaryToFile: (NSString *)path
+                compressed: (BOOL)compressed {
+	
+	return [MatrixArchive writeRecords:[NSArray arrayWithObject:
+	                                    [NSArray arrayWithObject:self]]
+	                             names:[NSArray arrayWithObject:@"matrix"]
+	                            toFile:path
+	                        compressed:compressed];
+}
+
 @end
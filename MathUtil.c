@@ -94,3 +94,105 @@ Hist (double *inVector, unsigned iSize,
 		outVector[left]++;
 	}
 }
+
+
+void
+SystematicResample (double *weights,
+                    unsigned size,
+                    double u,
+                    unsigned *outIndex
+                    ) {
+	
+	// The k'th (0-based) pointer is (u + k)/size.  Instead of dividing
+	// it, the cumulative sum of the weights is multiplied by size.
+	unsigned i, k;
+	double cum = 0.0;
+	double pointer = u;
+	
+	k = 0;
+	for ( i = 0; i < size && k < size; i++ ) {
+		cum += weights[i] * (double)size;
+		while ( k < size && pointer < cum ) {
+			outIndex[k++] = i;
+			pointer += 1.0;
+		}
+	}
+	
+	// in case the sum of the weights is slightly less than 1
+	while ( k < size ) {
+		outIndex[k++] = size - 1;
+	}
+}
+
+void
+StratifiedResample (double *weights,
+                    unsigned size,
+                    double *u,
+                    unsigned *outIndex
+                    ) {
+	
+	// The same as SystematicResample except that each stratum
+	// [k, k + 1) has its own uniform random number.
+	unsigned i, k;
+	double cum = 0.0;
+	
+	k = 0;
+	for ( i = 0; i < size && k < size; i++ ) {
+		cum += weights[i] * (double)size;
+		while ( k < size && ((double)k + u[k]) < cum ) {
+			outIndex[k++] = i;
+		}
+	}
+	
+	// in case the sum of the weights is slightly less than 1
+	while ( k < size ) {
+		outIndex[k++] = size - 1;
+	}
+}
+
+void
+ResidualResample (double *weights,
+                  unsigned size,
+                  double u,
+                  unsigned *outIndex
+                  ) {
+	
+	// 1. The i'th particle is copied floor(size * w_i) times.
+	// 2. The other R = size - sum floor(size * w_i) particles are selected
+	//    with the residuals, size * w_i - floor(size * w_i), whose sum is R.
+	//    Since they are selected by the systematic scheme with R pointers,
+	//    the pointers are (u + k) for k = 0, ..., R - 1.
+	//
+	// Both are done in one sweep, so the output is in ascending order.
+	unsigned i, j, k, copies, R;
+	double nw, cum = 0.0;
+	double pointer = u;
+	
+	R = size;
+	for ( i = 0; i < size; i++ ) {
+		copies = (unsigned)(weights[i] * (double)size);
+		R = ( copies < R ) ? R - copies : 0;
+	}
+	
+	k = 0;
+	for ( i = 0; i < size && k < size; i++ ) {
+		nw = weights[i] * (double)size;
+		copies = (unsigned)nw;
+		for ( j = 0; j < copies && k < size; j++ ) {
+			outIndex[k++] = i;
+		}
+		
+		cum += nw - (double)copies;
+		while ( R > 0 && k < size && pointer < cum ) {
+			outIndex[k++] = i;
+			pointer += 1.0;
+			R--;
+		}
+	}
+	
+	// in case of rounding errors
+	while ( k < size ) {
+		outIndex[k++] = size - 1;
+	}
+}
+
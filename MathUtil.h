@@ -37,3 +37,37 @@ Hist (double *inVector, unsigned iSize,
       unsigned *outVector
       );
 
+
+/*
+ *  Resampling kernels
+ *
+ *  weights must be normalized, i.e., their sum is 1.
+ *  outIndex receives size (0-based) indices of the selected particles
+ *  in ascending order.  All of them run in O(size) time and do not
+ *  call transcendental functions.
+ */
+
+/* u: one uniform random number in [0, 1) */
+void
+SystematicResample (double *weights,
+                    unsigned size,
+                    double u,
+                    unsigned *outIndex
+                    );
+
+/* u: size uniform random numbers in [0, 1) */
+void
+StratifiedResample (double *weights,
+                    unsigned size,
+                    double *u,
+                    unsigned *outIndex
+                    );
+
+/* u: one uniform random number in [0, 1)
+ * The residuals are resampled by the systematic scheme. */
+void
+ResidualResample (double *weights,
+                  unsigned size,
+                  double u,
+                  unsigned *outIndex
+                  );
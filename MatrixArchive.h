@@ -0,0 +1,216 @@
+//
+//  MatrixArchive.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+#import "MathMatrix.h"
+
+// version of the file format
+#define MATRIX_ARCHIVE_VERSION			1
+
+// alignment of the data of every record in bytes
+#define MATRIX_ARCHIVE_ALIGNMENT		64
+
+// raw bytes per compressed chunk
+#define MATRIX_ARCHIVE_CHUNK_SIZE		(1U << 20)
+
+// maximum length of the name of a record (including the terminating NUL)
+#define MATRIX_ARCHIVE_NAME_LENGTH		24
+
+//
+//  A binary archive of matrices
+//
+//  ============================================================================
+//
+//  An archive holds named records.  A record is a sequence of matrices
+//  of the same type and size, e.g., the particles of all the generations
+//  of a run.  All the numbers are little-endian.
+//
+//		header				64 bytes
+//			magic			"GPFARCH" and a NUL
+//			version			uint32
+//			record count	uint32
+//			table offset	uint64, from the beginning of the file
+//			reserved
+//
+//		data of the records, each aligned to MATRIX_ARCHIVE_ALIGNMENT
+//
+//		record table		64 bytes per record, aligned
+//			name			MATRIX_ARCHIVE_NAME_LENGTH bytes, NUL padded
+//			type			uint32, one of MATRIX_ARCHIVE_TYPE_...
+//			element size	uint32
+//			height			uint32
+//			width			uint32
+//			count			uint32, number of matrices
+//			compression		uint32, one of MATRIX_ARCHIVE_COMPRESSION_...
+//			offset			uint64, from the beginning of the file
+//			size			uint64, bytes stored at offset
+//
+//  The table comes last so that records can be appended one at a time
+//  without knowing their number or size in advance (see
+//  MatrixArchiveWriter below).
+//
+//  Uncompressed data are the matrices one after another, each dense and
+//  row by row (the (r, c) element is at (r - 1)*width + (c - 1)).
+//
+//  Compressed data are split into chunks of MATRIX_ARCHIVE_CHUNK_SIZE raw
+//  bytes (the last one may be shorter).  The bytes of the elements of a
+//  chunk are shuffled (all the first bytes, then all the second bytes,
+//  ...), which makes floating point data compress much better, and the
+//  chunk is deflated by zlib.  The chunks are followed by
+//
+//			sizes			uint64 for each chunk, bytes after deflation,
+//							aligned to 8 bytes
+//			chunk count		uint32
+//			chunk size		uint32, raw bytes per chunk
+//
+//  so the last 8 bytes of the data locate the chunks.
+//
+//  Reading
+//
+//  initWithContentsOfFile: maps the file into memory.  The matrices of an
+//  uncompressed record are views into the mapping, so nothing is read or
+//  copied until an element is touched.  The mapping is private: writing
+//  to a view changes the copy in memory, never the file.
+//  A compressed record is inflated into memory on first access.
+//  The views retain the archive, so they stay valid after it is released.
+//
+
+enum {
+	MATRIX_ARCHIVE_TYPE_CHAR = 0,
+	MATRIX_ARCHIVE_TYPE_UNSIGNED_CHAR,
+	MATRIX_ARCHIVE_TYPE_INT,
+	MATRIX_ARCHIVE_TYPE_UNSIGNED,
+	MATRIX_ARCHIVE_TYPE_FLOAT,
+	MATRIX_ARCHIVE_TYPE_DOUBLE
+};
+
+enum {
+	MATRIX_ARCHIVE_COMPRESSION_NONE = 0,
+	MATRIX_ARCHIVE_COMPRESSION_SHUFFLE_DEFLATE
+};
+
+@interface MatrixArchive : NSObject {
+@private
+	void *map;					// the mapped file
+	size_t mapSize;
+	
+	unsigned recordCount;
+	void *records;				// the record table in the mapping
+	NSMutableDictionary *inflated;	// inflated compressed records by name
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+// Maps an archive.  Returns nil if the file cannot be mapped or is not an
+// archive of this version.
+- (id) initWithContentsOfFile: (NSString *)path;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  WRITING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing
+
+// Writes an archive.  Each object of records is an NSArray of MathMatrix
+// objects of the same type and size, and is stored under the NSString
+// at the same index of names.  The path is used as it is.
++ (BOOL) writeRecords: (NSArray *)records
+                names: (NSArray *)names
+               toFile: (NSString *)path
+           compressed: (BOOL)compressed;
+
+
+// *****************************************************************************
+//
+//  READING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Reading
+
+// names of the records in the order they are stored
+- (NSArray *) names;
+
+// number of matrices in a record (0 if there is no such record)
+- (unsigned) countOfRecordNamed: (NSString *)name;
+
+// a new (autoreleased) view of the index'th (0-based) matrix of a record,
+// or nil if there is no such matrix
+- (MathMatrix *) matrixNamed: (NSString *)name
+                     atIndex: (unsigned)index;
+
+// the same as matrixNamed:name atIndex:0
+- (MathMatrix *) matrixNamed: (NSString *)name;
+
+@end
+
+
+//
+//  A writer which appends records to an archive one matrix at a time
+//
+//  ============================================================================
+//
+//		writer = [[MatrixArchiveWriter alloc] initWithFile:path compressed:NO];
+//		[writer beginRecordNamed:@"particles" type:@"double"
+//		                   width:n height:dimX];
+//		[writer appendMatrix:...];		// as many as needed
+//		[writer beginRecordNamed:...];	// ends the previous record
+//		...
+//		[writer close];					// writes the table and the header
+//
+//  Every method returns NO once a write has failed.  The archive cannot
+//  be read until it is closed.  dealloc closes it if it is still open.
+//  A writer is not thread safe; use it from one thread at a time.
+//
+
+@interface MatrixArchiveWriter : NSObject {
+@private
+	void *FP;					// the file (FILE *)
+	NSString *fileName;
+	BOOL isCompressed;
+	BOOL hasFailed;
+	
+	void *table;				// the record table so far
+	unsigned recordCount;
+	unsigned recordCapacity;
+	void *writer;				// the writer of the open record (or NULL)
+}
+
+// designated initializer
+- (id) initWithFile: (NSString *)path
+         compressed: (BOOL)flag;
+
+- (void) dealloc;
+
+- (BOOL) beginRecordNamed: (NSString *)name
+                     type: (NSString *)type
+                    width: (unsigned)width
+                   height: (unsigned)height;
+
+// Appends a matrix to the open record.  It has to have the type and the
+// size given when the record began.
+- (BOOL) appendMatrix: (MathMatrix *)mat;
+
+// Appends a matrix given by its elements, whose rows are ld elements apart.
+- (BOOL) appendElements: (const void *)data
+       leadingDimension: (unsigned)ld;
+
+- (BOOL) endRecord;
+
+- (BOOL) close;
+
+@end
@@ -0,0 +1,725 @@
+//
+//  MatrixArchive.m
+//  GenericParticleFilter
+//
+
+#import "MatrixArchive.h"
+
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <zlib.h>
+
+#define MATRIX_ARCHIVE_MAGIC		"GPFARCH"
+#define MATRIX_ARCHIVE_HEADER_SIZE	64
+
+// offset rounded up to the alignment
+#define ALIGNED_OFFSET(n) \
+	((((n) + MATRIX_ARCHIVE_ALIGNMENT - 1) / MATRIX_ARCHIVE_ALIGNMENT) \
+	* MATRIX_ARCHIVE_ALIGNMENT)
+
+// The header and the entries of the record table.
+// Both are 64 bytes without padding.
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordCount;
+	uint64_t tableOffset;
+	uint8_t reserved[40];
+} MatrixArchiveHeader;
+
+typedef struct {
+	char name[MATRIX_ARCHIVE_NAME_LENGTH];
+	uint32_t type;
+	uint32_t elementSize;
+	uint32_t height;
+	uint32_t width;
+	uint32_t count;
+	uint32_t compression;
+	uint64_t offset;
+	uint64_t size;
+} MatrixArchiveRecord;
+
+// names of the types in the order of MATRIX_ARCHIVE_TYPE_...
+static NSString *TypeName (uint32_t type) {
+	switch ( type ) {
+		case MATRIX_ARCHIVE_TYPE_CHAR:			return @"char";
+		case MATRIX_ARCHIVE_TYPE_UNSIGNED_CHAR:	return @"unsigned char";
+		case MATRIX_ARCHIVE_TYPE_INT:			return @"int";
+		case MATRIX_ARCHIVE_TYPE_UNSIGNED:		return @"unsigned";
+		case MATRIX_ARCHIVE_TYPE_FLOAT:			return @"float";
+	}
+	return @"double";
+}
+
+static uint32_t TypeFromName (NSString *type) {
+	if ( [type isEqualToString:@"char"] ) {
+		return MATRIX_ARCHIVE_TYPE_CHAR;
+	} else if ( [type isEqualToString:@"unsigned char"] ) {
+		return MATRIX_ARCHIVE_TYPE_UNSIGNED_CHAR;
+	} else if ( [type isEqualToString:@"int"] ) {
+		return MATRIX_ARCHIVE_TYPE_INT;
+	} else if ( [type isEqualToString:@"unsigned"] ) {
+		return MATRIX_ARCHIVE_TYPE_UNSIGNED;
+	} else if ( [type isEqualToString:@"float"] ) {
+		return MATRIX_ARCHIVE_TYPE_FLOAT;
+	}
+	return MATRIX_ARCHIVE_TYPE_DOUBLE;
+}
+
+static uint32_t ElementSize (uint32_t type) {
+	switch ( type ) {
+		case MATRIX_ARCHIVE_TYPE_CHAR:			return sizeof(char);
+		case MATRIX_ARCHIVE_TYPE_UNSIGNED_CHAR:	return sizeof(unsigned char);
+		case MATRIX_ARCHIVE_TYPE_INT:			return sizeof(int);
+		case MATRIX_ARCHIVE_TYPE_UNSIGNED:		return sizeof(unsigned);
+		case MATRIX_ARCHIVE_TYPE_FLOAT:			return sizeof(float);
+	}
+	return sizeof(double);
+}
+
+// Byte shuffle of n elements of the given size and its inverse.
+// The b'th byte of the i'th element goes to out[b*n + i].
+static void Shuffle (const uint8_t *in, uint8_t *out, size_t n, size_t size) {
+	size_t i, b;
+	
+	for ( b = 0; b < size; b++ ) {
+		for ( i = 0; i < n; i++ ) {
+			out[b*n + i] = in[i*size + b];
+		}
+	}
+}
+
+static void Unshuffle (const uint8_t *in, uint8_t *out, size_t n, size_t size) {
+	size_t i, b;
+	
+	for ( b = 0; b < size; b++ ) {
+		for ( i = 0; i < n; i++ ) {
+			out[i*size + b] = in[b*n + i];
+		}
+	}
+}
+
+// zero bytes up to the next aligned offset
+static BOOL PadToAlignment (FILE *FP) {
+	static const uint8_t zeros[MATRIX_ARCHIVE_ALIGNMENT] = { 0 };
+	long pos = ftell(FP);
+	size_t pad = ALIGNED_OFFSET((size_t)pos) - (size_t)pos;
+	
+	return ( pos >= 0 && fwrite(zeros, 1, pad, FP) == pad );
+}
+
+//
+//  A writer of the raw bytes of a record, which deflates full chunks
+//  as they fill up if it compresses.
+//
+typedef struct {
+	FILE *FP;
+	BOOL compressed;
+	size_t elementSize;
+	
+	uint8_t *chunk;			// raw bytes of the current chunk
+	size_t fill;
+	uint8_t *shuffled;
+	uint8_t *deflated;
+	uLong deflatedCapacity;
+	
+	uint64_t *chunkSizes;	// bytes of the chunks after deflation
+	uint32_t chunkCount;
+	uint32_t chunkCapacity;
+	
+	uint64_t written;		// bytes written so far
+} RecordWriter;
+
+static BOOL FlushChunk (RecordWriter *w) {
+	uLongf size = w -> deflatedCapacity;
+	
+	if ( w -> fill == 0 ) {
+		return YES;
+	}
+	
+	Shuffle(w -> chunk, w -> shuffled,
+	        w -> fill / w -> elementSize, w -> elementSize);
+	if ( compress2(w -> deflated, &size, w -> shuffled, w -> fill,
+	               Z_DEFAULT_COMPRESSION) != Z_OK ) {
+		return NO;
+	}
+	if ( fwrite(w -> deflated, 1, size, w -> FP) != size ) {
+		return NO;
+	}
+	
+	if ( w -> chunkCount == w -> chunkCapacity ) {
+		w -> chunkCapacity = w -> chunkCapacity ? 2*w -> chunkCapacity : 16;
+		w -> chunkSizes = (uint64_t *)realloc(w -> chunkSizes,
+		                                      w -> chunkCapacity*sizeof(uint64_t));
+	}
+	
+	w -> chunkSizes[w -> chunkCount++] = size;
+	w -> written += size;
+	w -> fill = 0;
+	return YES;
+}
+
+static BOOL WriteBytes (RecordWriter *w, const uint8_t *bytes, size_t n) {
+	size_t part;
+	
+	if ( !w -> compressed ) {
+		w -> written += n;
+		return ( fwrite(bytes, 1, n, w -> FP) == n );
+	}
+	
+	while ( n > 0 ) {
+		part = MATRIX_ARCHIVE_CHUNK_SIZE - w -> fill;
+		if ( part > n ) {
+			part = n;
+		}
+		memcpy(w -> chunk + w -> fill, bytes, part);
+		w -> fill += part;
+		bytes += part;
+		n -= part;
+		
+		if ( w -> fill == MATRIX_ARCHIVE_CHUNK_SIZE && !FlushChunk(w) ) {
+			return NO;
+		}
+	}
+	return YES;
+}
+
+// Private methods
+@interface MatrixArchive (Private)
+- (MatrixArchiveRecord *) recordNamed: (NSString *)name;
+- (uint8_t *) inflatedRecord: (MatrixArchiveRecord *)entry;
+@end
+
+
+@implementation MatrixArchive
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	NSLog(@"Use initWithContentsOfFile: to read an archive.");
+	[self release];
+	return nil;
+}
+
+// designated initializer
+- (id) initWithContentsOfFile: (NSString *)path {
+
+	if ( self = [super init] ) {
+		const char *filepath = [path fileSystemRepresentation];
+		MatrixArchiveHeader *header;
+		MatrixArchiveRecord *entry;
+		struct stat st;
+		unsigned i;
+		int fd;
+		
+		if ( NSHostByteOrder() != NS_LittleEndian ) {
+			NSLog(@"Archives can be read only on little-endian hosts.");
+			[self release];
+			return nil;
+		}
+		
+		fd = open(filepath, O_RDONLY);
+		if ( fd < 0 || fstat(fd, &st) != 0
+		     || st.st_size < MATRIX_ARCHIVE_HEADER_SIZE ) {
+			NSLog(@"Cannot open the archive %@.", path);
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			[self release];
+			return nil;
+		}
+		
+		// Private and writable: writing to a view copies the page.
+		mapSize = (size_t)st.st_size;
+		map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if ( map == MAP_FAILED ) {
+			NSLog(@"Cannot map the archive %@.", path);
+			map = NULL;
+			[self release];
+			return nil;
+		}
+		
+		header = (MatrixArchiveHeader *)map;
+		if ( memcmp(header -> magic, MATRIX_ARCHIVE_MAGIC, 8) != 0
+		     || header -> version != MATRIX_ARCHIVE_VERSION
+		     || header -> tableOffset
+		        + (uint64_t)header -> recordCount*sizeof(MatrixArchiveRecord)
+		        > mapSize ) {
+			NSLog(@"%@ is not an archive of version %d.",
+			      path, MATRIX_ARCHIVE_VERSION);
+			[self release];
+			return nil;
+		}
+		
+		recordCount = header -> recordCount;
+		records = (uint8_t *)map + header -> tableOffset;
+		
+		// every record has to lie in the file
+		entry = (MatrixArchiveRecord *)records;
+		for ( i = 0; i < recordCount; i++, entry++ ) {
+			if ( entry -> offset + entry -> size > mapSize ) {
+				NSLog(@"The record %u of %@ is truncated.", i, path);
+				[self release];
+				return nil;
+			}
+		}
+		
+		inflated = [[NSMutableDictionary alloc] init];
+	}
+	return self;
+}
+
+- (void) dealloc {
+	[inflated release];
+	if ( map ) {
+		munmap(map, mapSize);
+	}
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  WRITING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing
+
++ (BOOL) writeRecords: (NSArray *)recordArray
+                names: (NSArray *)names
+               toFile: (NSString *)path
+           compressed: (BOOL)compressed {
+	
+	MatrixArchiveWriter *writer;
+	NSArray *matrices;
+	MathMatrix *first;
+	unsigned i, j, n = [recordArray count];
+	BOOL success = YES;
+	
+	if ( [names count] != n ) {
+		NSLog(@"The number of names does not match the number of records.");
+		return NO;
+	}
+	
+	writer = [[MatrixArchiveWriter alloc] initWithFile:path
+	                                        compressed:compressed];
+	if ( !writer ) {
+		return NO;
+	}
+	
+	for ( i = 0; success && i < n; i++ ) {
+		matrices = [recordArray objectAtIndex:i];
+		first = [matrices count] ? [matrices objectAtIndex:0] : nil;
+		
+		success = [writer beginRecordNamed:[names objectAtIndex:i]
+		                              type:(first ? [first type] : @"double")
+		                             width:[first width]
+		                            height:[first height]];
+		for ( j = 0; success && j < [matrices count]; j++ ) {
+			success = [writer appendMatrix:[matrices objectAtIndex:j]];
+		}
+	}
+	
+	if ( ![writer close] ) {
+		success = NO;
+	}
+	[writer release];
+	return success;
+}
+
+
+// *****************************************************************************
+//
+//  READING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Reading
+
+- (NSArray *) names {
+	NSMutableArray *names = [NSMutableArray arrayWithCapacity:recordCount];
+	MatrixArchiveRecord *entry = (MatrixArchiveRecord *)records;
+	char name[MATRIX_ARCHIVE_NAME_LENGTH + 1];
+	unsigned i;
+	
+	for ( i = 0; i < recordCount; i++, entry++ ) {
+		memcpy(name, entry -> name, MATRIX_ARCHIVE_NAME_LENGTH);
+		name[MATRIX_ARCHIVE_NAME_LENGTH] = '\0';
+		[names addObject:[NSString stringWithUTF8String:name]];
+	}
+	return names;
+}
+
+- (unsigned) countOfRecordNamed: (NSString *)name {
+	MatrixArchiveRecord *entry = [self recordNamed:name];
+	
+	return ( entry ? entry -> count : 0 );
+}
+
+- (MathMatrix *) matrixNamed: (NSString *)name
+                     atIndex: (unsigned)index {
+
+	MatrixArchiveRecord *entry = [self recordNamed:name];
+	size_t matrixSize;
+	uint8_t *data;
+	id owner = self;
+	
+	if ( !entry || index >= entry -> count ) {
+		NSLog(@"There is no matrix %@[%u] in the archive.", name, index);
+		return nil;
+	}
+	
+	if ( entry -> compression == MATRIX_ARCHIVE_COMPRESSION_NONE ) {
+		data = (uint8_t *)map + entry -> offset;
+	} else {
+		data = [self inflatedRecord:entry];
+		owner = [inflated objectForKey:name];
+	}
+	if ( !data ) {
+		return nil;
+	}
+	
+	matrixSize = (size_t)entry -> height * entry -> width * entry -> elementSize;
+	return [[[MathMatrix alloc] initViewOfElements:data + index*matrixSize
+	                                          type:TypeName(entry -> type)
+	                                         width:entry -> width
+	                                        height:entry -> height
+	                              leadingDimension:entry -> width
+	                                         owner:owner] autorelease];
+}
+
+- (MathMatrix *) matrixNamed: (NSString *)name {
+	return [self matrixNamed:name atIndex:0];
+}
+
+@end
+
+
+@implementation MatrixArchive (Private)
+
+- (MatrixArchiveRecord *) recordNamed: (NSString *)name {
+	MatrixArchiveRecord *entry = (MatrixArchiveRecord *)records;
+	const char *cname = [name UTF8String];
+	unsigned i;
+	
+	for ( i = 0; i < recordCount; i++, entry++ ) {
+		if ( strncmp(entry -> name, cname, MATRIX_ARCHIVE_NAME_LENGTH) == 0 ) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Inflates a compressed record into an NSMutableData kept in inflated.
+- (uint8_t *) inflatedRecord: (MatrixArchiveRecord *)entry {
+	NSString *name = [NSString stringWithUTF8String:entry -> name];
+	NSMutableData *raw = [inflated objectForKey:name];
+	uint8_t *src = (uint8_t *)map + entry -> offset;
+	uint8_t *dst, *shuffled, *trailer;
+	uint32_t chunkCount, chunkSize;
+	uint64_t *sizes, rawSize, pos;
+	uLongf size;
+	unsigned i;
+	
+	if ( raw ) {
+		return (uint8_t *)[raw mutableBytes];
+	}
+	
+	// the trailer at the end of the data
+	if ( entry -> size < 2*sizeof(uint32_t) ) {
+		NSLog(@"The record %@ is corrupt.", name);
+		return NULL;
+	}
+	trailer = src + entry -> size - 2*sizeof(uint32_t);
+	memcpy(&chunkCount, trailer, sizeof(uint32_t));
+	memcpy(&chunkSize, trailer + sizeof(uint32_t), sizeof(uint32_t));
+	if ( (uint64_t)chunkCount*sizeof(uint64_t) + 2*sizeof(uint32_t)
+	     > entry -> size ) {
+		NSLog(@"The record %@ is corrupt.", name);
+		return NULL;
+	}
+	sizes = (uint64_t *)(trailer - chunkCount*sizeof(uint64_t));
+	
+	rawSize = (uint64_t)entry -> height * entry -> width
+	          * entry -> elementSize * entry -> count;
+	raw = [NSMutableData dataWithLength:(NSUInteger)rawSize];
+	dst = (uint8_t *)[raw mutableBytes];
+	shuffled = (uint8_t *)malloc(chunkSize);
+	
+	for ( i = 0, pos = 0; i < chunkCount; i++ ) {
+		size = chunkSize;
+		if ( uncompress(shuffled, &size, src, (uLong)sizes[i]) != Z_OK
+		     || pos + size > rawSize ) {
+			NSLog(@"The chunk %u of %@ is corrupt.", i, name);
+			free(shuffled);
+			return NULL;
+		}
+		Unshuffle(shuffled, dst + pos, size / entry -> elementSize,
+		          entry -> elementSize);
+		src += sizes[i];
+		pos += size;
+	}
+	free(shuffled);
+	
+	[inflated setObject:raw forKey:name];
+	return dst;
+}
+
+@end
+
+
+@implementation MatrixArchiveWriter
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	NSLog(@"Use initWithFile:compressed: to write an archive.");
+	[self release];
+	return nil;
+}
+
+// designated initializer
+- (id) initWithFile: (NSString *)path
+         compressed: (BOOL)flag {
+	
+	if ( self = [super init] ) {
+		MatrixArchiveHeader header;
+		
+		if ( NSHostByteOrder() != NS_LittleEndian ) {
+			NSLog(@"Archives can be written only on little-endian hosts.");
+			[self release];
+			return nil;
+		}
+		
+		FP = fopen([path fileSystemRepresentation], "wb");
+		if ( !FP ) {
+			NSLog(@"Cannot open %@ for writing.", path);
+			[self release];
+			return nil;
+		}
+		
+		fileName = [path copy];
+		isCompressed = flag;
+		
+		// The header is written again when the archive is closed.
+		memset(&header, 0, sizeof(header));
+		if ( fwrite(&header, sizeof(header), 1, FP) != 1 ) {
+			hasFailed = YES;
+		}
+	}
+	return self;
+}
+
+- (void) dealloc {
+	if ( FP ) {
+		[self close];
+	}
+	[fileName release];
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  WRITING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing
+
+- (BOOL) beginRecordNamed: (NSString *)name
+                     type: (NSString *)type
+                    width: (unsigned)width
+                   height: (unsigned)height {
+	
+	MatrixArchiveRecord *entry;
+	RecordWriter *w;
+	
+	if ( !FP || hasFailed ) {
+		return NO;
+	}
+	if ( writer && ![self endRecord] ) {
+		return NO;
+	}
+	if ( !PadToAlignment((FILE *)FP) ) {
+		hasFailed = YES;
+		return NO;
+	}
+	
+	if ( recordCount == recordCapacity ) {
+		recordCapacity = recordCapacity ? 2*recordCapacity : 8;
+		table = realloc(table, recordCapacity*sizeof(MatrixArchiveRecord));
+	}
+	entry = (MatrixArchiveRecord *)table + recordCount++;
+	memset(entry, 0, sizeof(MatrixArchiveRecord));
+	
+	strncpy(entry -> name, [name UTF8String], MATRIX_ARCHIVE_NAME_LENGTH - 1);
+	entry -> type = TypeFromName(type);
+	entry -> elementSize = ElementSize(entry -> type);
+	entry -> height = height;
+	entry -> width = width;
+	entry -> compression = isCompressed ? MATRIX_ARCHIVE_COMPRESSION_SHUFFLE_DEFLATE
+	                                    : MATRIX_ARCHIVE_COMPRESSION_NONE;
+	entry -> offset = (uint64_t)ftell((FILE *)FP);
+	
+	w = (RecordWriter *)calloc(1, sizeof(RecordWriter));
+	w -> FP = (FILE *)FP;
+	w -> compressed = isCompressed;
+	w -> elementSize = entry -> elementSize;
+	if ( isCompressed ) {
+		w -> chunk = (uint8_t *)malloc(MATRIX_ARCHIVE_CHUNK_SIZE);
+		w -> shuffled = (uint8_t *)malloc(MATRIX_ARCHIVE_CHUNK_SIZE);
+		w -> deflatedCapacity = compressBound(MATRIX_ARCHIVE_CHUNK_SIZE);
+		w -> deflated = (uint8_t *)malloc(w -> deflatedCapacity);
+	}
+	writer = w;
+	return YES;
+}
+
+- (BOOL) appendElements: (const void *)data
+       leadingDimension: (unsigned)ld {
+	
+	MatrixArchiveRecord *entry;
+	RecordWriter *w = (RecordWriter *)writer;
+	size_t rowSize;
+	unsigned r;
+	
+	if ( !w || hasFailed ) {
+		return NO;
+	}
+	entry = (MatrixArchiveRecord *)table + recordCount - 1;
+	
+	rowSize = (size_t)entry -> width * entry -> elementSize;
+	for ( r = 0; r < entry -> height; r++ ) {
+		if ( !WriteBytes(w, (const uint8_t *)data
+		                 + (size_t)r*ld*entry -> elementSize, rowSize) ) {
+			hasFailed = YES;
+			return NO;
+		}
+	}
+	entry -> count++;
+	return YES;
+}
+
+- (BOOL) appendMatrix: (MathMatrix *)mat {
+	MatrixArchiveRecord *entry;
+	
+	if ( !writer ) {
+		return NO;
+	}
+	entry = (MatrixArchiveRecord *)table + recordCount - 1;
+	if ( TypeFromName([mat type]) != entry -> type
+	     || [mat height] != entry -> height
+	     || [mat width] != entry -> width ) {
+		NSLog(@"The matrices of %s differ in type or size.", entry -> name);
+		return NO;
+	}
+	
+	// The matrix may be a view with padded rows.
+	return [self appendElements:[mat elements]
+	           leadingDimension:[mat leadingDimension]];
+}
+
+- (BOOL) endRecord {
+	static const uint8_t zeros[sizeof(uint64_t)] = { 0 };
+	MatrixArchiveRecord *entry;
+	RecordWriter *w = (RecordWriter *)writer;
+	uint32_t trailer[2];
+	size_t pad;
+	
+	if ( !w ) {
+		return NO;
+	}
+	entry = (MatrixArchiveRecord *)table + recordCount - 1;
+	
+	// the rest of the chunks, their sizes (8 byte aligned) and the trailer
+	if ( w -> compressed && !hasFailed ) {
+		if ( !FlushChunk(w) ) {
+			hasFailed = YES;
+		} else {
+			pad = (size_t)((sizeof(uint64_t) - w -> written % sizeof(uint64_t))
+			               % sizeof(uint64_t));
+			trailer[0] = w -> chunkCount;
+			trailer[1] = MATRIX_ARCHIVE_CHUNK_SIZE;
+			if ( fwrite(zeros, 1, pad, w -> FP) != pad
+			     || fwrite(w -> chunkSizes, sizeof(uint64_t), w -> chunkCount,
+			               w -> FP) != w -> chunkCount
+			     || fwrite(trailer, sizeof(uint32_t), 2, w -> FP) != 2 ) {
+				hasFailed = YES;
+			}
+			w -> written += pad + w -> chunkCount*sizeof(uint64_t)
+			                + 2*sizeof(uint32_t);
+		}
+	}
+	entry -> size = w -> written;
+	
+	free(w -> chunk);
+	free(w -> shuffled);
+	free(w -> deflated);
+	free(w -> chunkSizes);
+	free(w);
+	writer = NULL;
+	
+	return !hasFailed;
+}
+
+- (BOOL) close {
+	MatrixArchiveHeader header;
+	
+	if ( !FP ) {
+		return NO;
+	}
+	if ( writer ) {
+		[self endRecord];
+	}
+	
+	// the record table and the header
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MATRIX_ARCHIVE_MAGIC, 8);
+	header.version = MATRIX_ARCHIVE_VERSION;
+	header.recordCount = recordCount;
+	
+	if ( !hasFailed && !PadToAlignment((FILE *)FP) ) {
+		hasFailed = YES;
+	}
+	if ( !hasFailed ) {
+		header.tableOffset = (uint64_t)ftell((FILE *)FP);
+		hasFailed = !( fwrite(table, sizeof(MatrixArchiveRecord), recordCount,
+		                      (FILE *)FP) == recordCount
+		               && fseek((FILE *)FP, 0L, SEEK_SET) == 0
+		               && fwrite(&header, sizeof(header), 1, (FILE *)FP) == 1 );
+	}
+	if ( fclose((FILE *)FP) != 0 ) {
+		hasFailed = YES;
+	}
+	FP = NULL;
+	
+	free(table);
+	table = NULL;
+	
+	if ( hasFailed ) {
+		NSLog(@"Writing the archive %@ failed.", fileName);
+	}
+	return !hasFailed;
+}
+
+@end
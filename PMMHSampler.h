@@ -0,0 +1,184 @@
+//
+//  PMMHSampler.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+#import "GenericParticleFilter.h"
+#import "GenericSystem.h"
+#import "MathMatrix.h"
+#import "RandomNumberGenerator.h"
+#import "ThreadPool.h"
+
+// default standard deviation of the random walk proposal
+#define PMMH_DEFAULT_PROPOSAL_SCALE		0.1
+
+// default slot of the chain generators for the proposals and acceptances
+#define PMMH_DEFAULT_PROPOSAL_SLOT		32
+
+// State of a chain
+typedef struct {
+	GenericSystem *system;			// copy of the system (retained)
+	GenericParticleFilter *filter;	// filter of the copy (retained)
+	RandomNumberGenerator *RNGenerator;	// streams of the chain (retained)
+	
+	MathMatrix *current;			// parameters of the chain
+	MathMatrix *proposed;			// buffer of the proposal
+	double currentLogLikelihood;
+	double currentLogPrior;
+	
+	MathMatrix *samples;			// d x (number of iterations)
+	MathMatrix *logLikelihoods;		// 1 x (number of iterations)
+	unsigned acceptCount;			// acceptances after the burn-in
+} PMMHChain;
+
+//
+//  Particle marginal Metropolis-Hastings sampler of the parameters
+//
+//  ============================================================================
+//
+//  Draws from the posterior of the parameters of a system, i.e., the
+//  parameters matrix of GenericSystem, given its measurements Y.
+//  Each iteration of a chain proposes
+//
+//		theta' = theta + scale .* N(0, I)
+//
+//  runs a particle filter with theta', and accepts theta' with probability
+//
+//		min(1, p^(Y | theta') p(theta') / (p^(Y | theta) p(theta)))
+//
+//  where p^(Y | theta) is the marginal likelihood estimated by the filter
+//  (-[GenericParticleFilter logMarginalLikelihood]).  Since the estimate
+//  is unbiased, the chain targets the exact posterior.
+//
+//  The sampler is made from a filter, which serves as a template: each
+//  chain gets a copy of its system (with the settings of the model as
+//  well, see -[GenericSystem copyWithZone:], so a system class with
+//  state of its own must copy it), a filter with the same number of
+//  particles, scheme, resampling threshold and auxiliary mode in
+//  streaming mode, and a generator of its own, whose streams are derived
+//  from the seed and the index of the chain.  These are made once and
+//  reused by every iteration and every run, so an iteration does not
+//  allocate memory.
+//
+//  The chains run at once, one on each thread, if the system is
+//  thread-safe (isPropagationThreadSafe and isWeightingThreadSafe), and
+//  in order otherwise.
+//
+//  The prior is uniform within the bounds (if any).  Subclasses may
+//  override logPriorOfParameters: for other priors; it is called from the
+//  threads of the chains.
+//
+
+@interface PMMHSampler : NSObject {
+@private
+	unsigned chainCount;
+	unsigned parameterCount;
+	PMMHChain *chains;
+	
+	unsigned iterationCount;	// samples kept per chain by the last run
+	unsigned burnIn;			// iterations discarded by the last run
+	
+	MathMatrix *proposalScales;	// d x 1
+	MathMatrix *lowerBounds;	// d x 1 or nil
+	MathMatrix *upperBounds;	// d x 1 or nil
+	unsigned proposalSlot;
+	
+	ThreadPool *threadPool;		// NULL if the chains run in order
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init;
+
+// designated initializer
+// The chains start from the parameters of the system of the filter.
+// seed derives the generators of the chains.
+// Returns nil if the filter has no system.
+- (id) initWithFilter: (GenericParticleFilter *)pf
+           chainCount: (unsigned)n
+                 seed: (unsigned long long)seed;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) chainCount;
+- (unsigned) parameterCount;
+
+// standard deviations of the proposal (d x 1)
+// PMMH_DEFAULT_PROPOSAL_SCALE for all the parameters by default
+- (MathMatrix *) proposalScales;
+- (void) setProposalScales: (MathMatrix *)scales;
+
+// The support of the uniform prior.  Either may be nil (no bound).
+- (MathMatrix *) lowerBounds;
+- (MathMatrix *) upperBounds;
+- (void) setLowerBounds: (MathMatrix *)lower
+            upperBounds: (MathMatrix *)upper;
+
+// The slot of the chain generators which the proposals and the
+// acceptances are drawn from.  It is occupied in each chain generator,
+// so the filters of the chains draw from other slots.  Setting a slot
+// which is in use in a chain generator fails, leaving the slot as it is.
+- (unsigned) proposalSlot;
+- (void) setProposalSlot: (unsigned)n;
+
+
+// *****************************************************************************
+//
+//  SAMPLING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Sampling
+
+// Runs every chain for burnIn + n iterations and keeps the last n.
+// A chain continues from where the previous run left it.
+- (void) runWithIterations: (unsigned)n
+                    burnIn: (unsigned)b;
+
+// log of the prior density up to a constant, -HUGE_VAL outside the support
+- (double) logPriorOfParameters: (MathMatrix *)theta;
+
+
+// *****************************************************************************
+//
+//  RESULTS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Results
+
+// d x n samples and 1 x n log-likelihoods of the c'th (0-based) chain
+- (MathMatrix *) samplesOfChain: (unsigned)c;
+- (MathMatrix *) logLikelihoodsOfChain: (unsigned)c;
+
+// the ratio of accepted proposals after the burn-in
+- (double) acceptanceRateOfChain: (unsigned)c;
+
+// Mean and standard deviation of the samples of all the chains (d x 1).
+// Either may be nil.
+- (void) getPosteriorMean: (MathMatrix *)mean
+        standardDeviation: (MathMatrix *)sd;
+
+// Writes the samples and the log-likelihoods of each chain (records
+// "samples_<c>" and "log_likelihood_<c>") to a binary archive (see
+// MatrixArchive.h).  The path is used as it is.
+- (BOOL) writeSamplesToBinaryFile: (NSString *)path;
+
+@end
@@ -0,0 +1,431 @@
+//
+//  PMMHSampler.m
+//  GenericParticleFilter
+//
+
+#import "PMMHSampler.h"
+#import "MatrixArchive.h"
+
+#import <math.h>
+#import <stdlib.h>
+
+// Private methods
+@interface PMMHSampler (Private)
+- (void) runChain: (unsigned)c;
+- (void) allocateSamples;
+@end
+
+// runs the chains in [begin, end)
+static void RunChainChunk (void *context,
+                           unsigned begin, unsigned end, unsigned chunk) {
+	unsigned c;
+	
+	for ( c = begin; c < end; c++ ) {
+		[(PMMHSampler *)context runChain:c];
+	}
+}
+
+
+@implementation PMMHSampler
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	NSLog(@"Use initWithFilter:chainCount:seed: to create a sampler.");
+	[self release];
+	return nil;
+}
+
+// designated initializer
+- (id) initWithFilter: (GenericParticleFilter *)pf
+           chainCount: (unsigned)n
+                 seed: (unsigned long long)seed {
+
+	GenericSystem *system = [pf system];
+	PMMHChain *ch;
+	unsigned c, i;
+	
+	if ( self = [super init] ) {
+		if ( !system || n == 0 ) {
+			NSLog(@"A sampler needs a filter with a system and a chain.");
+			[self release];
+			return nil;
+		}
+		
+		chainCount = n;
+		parameterCount = [[system parameters] count];
+		proposalSlot = PMMH_DEFAULT_PROPOSAL_SLOT;
+		
+		proposalScales = [[MathMatrix alloc] initDoubleWithWidth:1UL
+		                                                  height:parameterCount];
+		for ( i = 0; i < parameterCount; i++ ) {
+			[proposalScales doubleElements][i] = PMMH_DEFAULT_PROPOSAL_SCALE;
+		}
+		
+		// everything a chain needs, once and for all
+		chains = (PMMHChain *)calloc(chainCount, sizeof(PMMHChain));
+		for ( c = 0; c < chainCount; c++ ) {
+			ch = chains + c;
+			
+			ch -> RNGenerator = [[RandomNumberGenerator alloc]
+			                     initWithStreamSeed:PhiloxMix(seed + c)];
+			[ch -> RNGenerator occupySlot:proposalSlot];
+			
+			// The copy keeps the calibration of the system (noise
+			// levels and the like), which the subclasses copy.
+			ch -> system = [system copy];
+			[ch -> system setRNGenerator:ch -> RNGenerator];
+			
+			ch -> current = [[system parameters] copy];
+			ch -> proposed = [[system parameters] copy];
+			ch -> currentLogLikelihood = -HUGE_VAL;	// not evaluated yet
+			
+			// only the likelihood is used
+			ch -> filter = [[GenericParticleFilter alloc]
+			                initWithCapacity:[pf count]
+			                       forSystem:ch -> system
+			             withSelectionScheme:[pf scheme]
+			                       streaming:YES];
+			
+			// The filter takes free slots of the generator of the chain,
+			// which stay clear of the proposals.
+			[ch -> filter setRNGenerator:ch -> RNGenerator];
+			[ch -> filter setResampleThreshold:[pf resampleThreshold]];
+			[ch -> filter enableAuxiliaryFilter:[pf isAuxiliaryFilter]];
+		}
+		
+		// one thread for each chain
+		if ( chainCount > 1
+		     && [system isPropagationThreadSafe]
+		     && [system isWeightingThreadSafe] ) {
+			
+			ThreadPoolEnterMultiThreadedMode();
+			threadPool = ThreadPoolCreate(chainCount);
+			if ( !threadPool ) {
+				NSLog(@"Creating %u threads failed. The chains run in order.",
+				      chainCount);
+			}
+		}
+	}
+	return self;
+}
+
+- (void) dealloc {
+	PMMHChain *ch;
+	unsigned c;
+	
+	ThreadPoolDestroy(threadPool);
+	
+	for ( c = 0; chains && c < chainCount; c++ ) {
+		ch = chains + c;
+		[ch -> filter release];		// before the system it does not retain
+		[ch -> system release];
+		[ch -> RNGenerator release];
+		[ch -> current release];
+		[ch -> proposed release];
+		[ch -> samples release];
+		[ch -> logLikelihoods release];
+	}
+	free(chains);
+	
+	[proposalScales release];
+	[lowerBounds release];
+	[upperBounds release];
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) chainCount {
+	return chainCount;
+}
+
+- (unsigned) parameterCount {
+	return parameterCount;
+}
+
+- (MathMatrix *) proposalScales {
+	return proposalScales;
+}
+
+- (void) setProposalScales: (MathMatrix *)scales {
+	if ( [scales count] != parameterCount || ![scales isDouble] ) {
+		NSLog(@"The proposal scales must be %u doubles.", parameterCount);
+		return;
+	}
+	[scales retain];
+	[proposalScales release];
+	proposalScales = scales;
+}
+
+- (MathMatrix *) lowerBounds {
+	return lowerBounds;
+}
+
+- (MathMatrix *) upperBounds {
+	return upperBounds;
+}
+
+- (void) setLowerBounds: (MathMatrix *)lower
+            upperBounds: (MathMatrix *)upper {
+
+	if ( ( lower && [lower count] != parameterCount )
+	     || ( upper && [upper count] != parameterCount ) ) {
+		NSLog(@"The bounds must have %u elements.", parameterCount);
+		return;
+	}
+	[lower retain];
+	[lowerBounds release];
+	lowerBounds = lower;
+	
+	[upper retain];
+	[upperBounds release];
+	upperBounds = upper;
+}
+
+- (unsigned) proposalSlot {
+	return proposalSlot;
+}
+
+- (void) setProposalSlot: (unsigned)n {
+	PMMHChain *ch;
+	unsigned c;
+	
+	if ( n == proposalSlot ) {
+		return;
+	}
+	for ( c = 0; c < chainCount; c++ ) {
+		ch = chains + c;
+		if ( ![ch -> RNGenerator isSlotFree:n] ) {
+			NSLog(@"Slot %u is in use. The proposal slot is not changed.", n);
+			return;
+		}
+	}
+	for ( c = 0; c < chainCount; c++ ) {
+		ch = chains + c;
+		[ch -> RNGenerator freeSlot:proposalSlot];
+		[ch -> RNGenerator occupySlot:n];
+	}
+	proposalSlot = n;
+}
+
+
+// *****************************************************************************
+//
+//  SAMPLING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Sampling
+
+- (void) runWithIterations: (unsigned)n
+                    burnIn: (unsigned)b {
+
+	iterationCount = n;
+	burnIn = b;
+	[self allocateSamples];
+	
+	// If the system is not thread-safe, the chains run in order on this
+	// thread.
+	ThreadPoolParallelFor(threadPool, chainCount, chainCount,
+	                      RunChainChunk, self);
+}
+
+- (double) logPriorOfParameters: (MathMatrix *)theta {
+	double *x = [theta doubleElements];
+	unsigned i;
+	
+	for ( i = 0; i < parameterCount; i++ ) {
+		if ( ( lowerBounds && x[i] < [lowerBounds doubleElements][i] )
+		     || ( upperBounds && x[i] > [upperBounds doubleElements][i] ) ) {
+			return -HUGE_VAL;
+		}
+	}
+	return 0.0;
+}
+
+
+// *****************************************************************************
+//
+//  RESULTS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Results
+
+- (MathMatrix *) samplesOfChain: (unsigned)c {
+	return ( c < chainCount ) ? chains[c].samples : nil;
+}
+
+- (MathMatrix *) logLikelihoodsOfChain: (unsigned)c {
+	return ( c < chainCount ) ? chains[c].logLikelihoods : nil;
+}
+
+- (double) acceptanceRateOfChain: (unsigned)c {
+	if ( c >= chainCount || iterationCount == 0 ) {
+		return 0.0;
+	}
+	return (double)chains[c].acceptCount / (double)iterationCount;
+}
+
+- (void) getPosteriorMean: (MathMatrix *)mean
+        standardDeviation: (MathMatrix *)sd {
+
+	unsigned i, k, c;
+	unsigned total = chainCount * iterationCount;
+	double sum, sumSq, x, m;
+	
+	for ( i = 1; i <= parameterCount; i++ ) {
+		sum = sumSq = 0.0;
+		for ( c = 0; c < chainCount; c++ ) {
+			double *row = [chains[c].samples doubleRow:i];
+			
+			for ( k = 0; k < iterationCount; k++ ) {
+				x = row[k];
+				sum += x;
+				sumSq += x*x;
+			}
+		}
+		m = total ? sum / (double)total : 0.0;
+		
+		[mean setDoubleValue:m atRow:i column:1UL];
+		[sd setDoubleValue:( total > 1 ?
+		                     sqrt(fmax(0.0, (sumSq - total*m*m) / (double)(total - 1)))
+		                     : 0.0 )
+		             atRow:i
+		            column:1UL];
+	}
+}
+
+- (BOOL) writeSamplesToBinaryFile: (NSString *)path {
+	NSMutableArray *records = [NSMutableArray array];
+	NSMutableArray *names = [NSMutableArray array];
+	unsigned c;
+	
+	if ( iterationCount == 0 ) {
+		NSLog(@"There is no sample to write.");
+		return NO;
+	}
+	
+	for ( c = 0; c < chainCount; c++ ) {
+		[records addObject:[NSArray arrayWithObject:chains[c].samples]];
+		[names addObject:[NSString stringWithFormat:@"samples_%u", c]];
+		
+		[records addObject:[NSArray arrayWithObject:chains[c].logLikelihoods]];
+		[names addObject:[NSString stringWithFormat:@"log_likelihood_%u", c]];
+	}
+	
+	return [MatrixArchive writeRecords:records
+	                             names:names
+	                            toFile:path
+	                        compressed:NO];
+}
+
+@end
+
+
+@implementation PMMHSampler (Private)
+
+// (Re-)allocates the storage of the samples only if their number changed.
+- (void) allocateSamples {
+	PMMHChain *ch;
+	unsigned c;
+	
+	for ( c = 0; c < chainCount; c++ ) {
+		ch = chains + c;
+		ch -> acceptCount = 0UL;
+		
+		if ( ch -> samples && [ch -> samples width] == iterationCount ) {
+			continue;
+		}
+		[ch -> samples release];
+		[ch -> logLikelihoods release];
+		ch -> samples = [[MathMatrix alloc] initDoubleWithWidth:iterationCount
+		                                                 height:parameterCount];
+		ch -> logLikelihoods = [[MathMatrix alloc] initDoubleWithWidth:iterationCount
+		                                                        height:1UL];
+	}
+}
+
+// The Metropolis-Hastings loop of a chain.
+// It touches nothing but the chain, so the chains may run at once.
+- (void) runChain: (unsigned)c {
+	PMMHChain *ch = chains + c;
+	NSAutoreleasePool *pool;
+	MathMatrix *swap;
+	double *theta, *proposed, *scale = [proposalScales doubleElements];
+	double logLikelihood, logPrior;
+	unsigned i, k;
+	
+	// the likelihood of the starting point
+	if ( ch -> currentLogLikelihood == -HUGE_VAL ) {
+		pool = [[NSAutoreleasePool alloc] init];
+		[ch -> system setParameters:ch -> current];
+		[ch -> filter estimateStates];
+		ch -> currentLogLikelihood = [ch -> filter logMarginalLikelihood];
+		ch -> currentLogPrior = [self logPriorOfParameters:ch -> current];
+		[pool release];
+	}
+	
+	for ( k = 0; k < burnIn + iterationCount; k++ ) {
+		pool = [[NSAutoreleasePool alloc] init];
+		
+		// random walk proposal
+		theta = [ch -> current doubleElements];
+		proposed = [ch -> proposed doubleElements];
+		for ( i = 0; i < parameterCount; i++ ) {
+			proposed[i] = theta[i]
+			+ scale[i] * [ch -> RNGenerator normalFromSlot:proposalSlot];
+		}
+		
+		// A proposal outside the support is rejected without a filter run.
+		logPrior = [self logPriorOfParameters:ch -> proposed];
+		if ( logPrior > -HUGE_VAL ) {
+			[ch -> system setParameters:ch -> proposed];
+			[ch -> filter estimateStates];
+			logLikelihood = [ch -> filter logMarginalLikelihood];
+			
+			// NaN is rejected as well
+			if ( log([ch -> RNGenerator uniformFromSlot:proposalSlot])
+			     < (logLikelihood + logPrior)
+			     - (ch -> currentLogLikelihood + ch -> currentLogPrior) ) {
+				
+				swap = ch -> current;
+				ch -> current = ch -> proposed;
+				ch -> proposed = swap;
+				ch -> currentLogLikelihood = logLikelihood;
+				ch -> currentLogPrior = logPrior;
+				if ( k >= burnIn ) {
+					ch -> acceptCount++;
+				}
+			}
+		}
+		
+		if ( k >= burnIn ) {
+			[ch -> samples setVector:ch -> current atColumn:(k - burnIn + 1)];
+			[ch -> logLikelihoods setDoubleValue:ch -> currentLogLikelihood
+			                               atRow:1UL
+			                              column:(k - burnIn + 1)];
+		}
+		
+		[pool release];
+	}
+	
+	// the system is left with the last state of the chain
+	[ch -> system setParameters:ch -> current];
+}
+
+@end
@@ -0,0 +1,143 @@
+//
+//  ParticleGenealogy.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+#import "MathMatrix.h"
+
+// parent of the particles of the first generation
+#define PARTICLE_GENEALOGY_NO_PARENT	0xFFFFFFFFU
+
+//
+//  The ancestral tree of the particles of a filter
+//
+//  ============================================================================
+//
+//  Each node of the tree is the state of a particle at a generation and
+//  the index of the node of its parent, the particle of the previous
+//  generation which it was propagated from.  A generation is appended
+//  with the ancestor indices of its particles (see ParticlePopulation.h),
+//  so the trajectory of a particle of the last generation is found by
+//  walking back through the parents, without copying the particles of
+//  the earlier generations.
+//
+//  A node lives only as long as it is a particle of the last generation
+//  or an ancestor of one of them.  When a generation is appended, the
+//  particles of the previous generation without children are removed,
+//  and so are their ancestors which are left without children.  Since
+//  the lineages coalesce after resampling, the tree holds about
+//  T + C*N*log(N) nodes for T generations of N particles instead of T*N
+//  (Jacob, Murray and Rubenthaler, 2015).  The nodes removed are reused.
+//
+//  Hand a genealogy to the filter with -[GenericParticleFilter
+//  setGenealogy:], which appends every generation.  Together with the
+//  streaming mode of the filter, it gives the trajectories of the
+//  particles while only two generations are kept in full.
+//
+
+@interface ParticleGenealogy : NSObject {
+@private
+	unsigned count;				// number of particles of a generation
+	unsigned dimX;
+	
+	// the nodes, addressed by their index
+	double *states;				// dimX doubles per node
+	unsigned *parents;			// PARTICLE_GENEALOGY_NO_PARENT for the roots
+	unsigned *references;		// children, plus 1 for the last generation
+	unsigned capacity;			// nodes allocated
+	unsigned used;				// nodes ever handed out (<= capacity)
+	unsigned *freeNodes;		// removed nodes, to be reused
+	unsigned freeCount;
+	unsigned nodeCount;			// nodes alive
+	unsigned peakNodeCount;
+	
+	unsigned *leaves;			// nodes of the last generation
+	unsigned *newLeaves;		// nodes of the generation being appended
+	
+	unsigned *indices;			// time index of each generation
+	unsigned generationCount;
+	unsigned generationCapacity;
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init;
+
+// designated initializer
+- (id) initWithStateDimension: (unsigned)xdim;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) count;
+- (unsigned) dimX;
+- (unsigned) generationCount;
+
+// the time index of the g'th (0-based) generation
+- (unsigned) indexOfGeneration: (unsigned)g;
+
+// nodes alive now and at most so far
+- (unsigned) nodeCount;
+- (unsigned) peakNodeCount;
+
+
+// *****************************************************************************
+//
+//  BUILDING THE TREE
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Building the Tree
+
+// Removes all the nodes and starts a tree with n particles, the roots.
+// The k'th component (0-based) of the j'th particle is x[k*ld + j].
+- (BOOL) beginWithStates: (const double *)x
+                  stride: (unsigned)ld
+                   count: (unsigned)n
+                 atIndex: (unsigned)index;
+
+// Appends a generation of count particles.  The parent of the j'th
+// particle is the ancestors[j]'th particle of the last generation.
+// Returns NO if there is no memory for the new nodes, in which case the
+// tree is left as it was.
+- (BOOL) appendStates: (const double *)x
+               stride: (unsigned)ld
+            ancestors: (const unsigned *)ancestors
+              atIndex: (unsigned)index;
+
+
+// *****************************************************************************
+//
+//  TRAJECTORIES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Trajectories
+
+// Writes the trajectory of the j'th (0-based) particle of the last
+// generation into traj (dimX x generationCount): the (g + 1)'th column is
+// its ancestor at the g'th generation.
+- (BOOL) getTrajectory: (MathMatrix *)traj
+            ofParticle: (unsigned)j;
+
+// The number of distinct ancestors of the last generation at the g'th
+// generation, e.g., to see how far back the lineages have coalesced.
+- (unsigned) distinctAncestorsAtGeneration: (unsigned)g;
+
+@end
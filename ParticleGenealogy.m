@@ -0,0 +1,351 @@
+//
+//  ParticleGenealogy.m
+//  GenericParticleFilter
+//
+
+#import "ParticleGenealogy.h"
+
+#import <stdlib.h>
+#import <string.h>
+
+#define CONST_DEFAULT_GENERATION_CAPACITY	256
+
+static int CompareNodes (const void *a, const void *b) {
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+	
+	return ( x < y ) ? -1 : ( x > y );
+}
+
+
+// *****************************************************************************
+//
+//  PRIVATE METHODS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Private Methods
+
+@interface ParticleGenealogy (PrivateMethods)
+
+- (BOOL) reserveNodes: (unsigned)n;
+// Makes sure that n nodes can be handed out without allocating memory.
+
+- (unsigned) newNodeWithParent: (unsigned)parent;
+// Hands out a node, whose only reference is from the last generation.
+// The parent, if any, gets a reference as well.
+
+- (void) releaseNode: (unsigned)node;
+// Drops a reference to the node.  A node without references is removed,
+// and its parent loses a reference in turn.
+
+@end
+
+
+@implementation ParticleGenealogy
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	return [self initWithStateDimension:1UL];
+}
+
+// designated initializer
+- (id) initWithStateDimension: (unsigned)xdim {
+	if ( self = [super init] ) {
+		dimX = xdim;
+		generationCapacity = CONST_DEFAULT_GENERATION_CAPACITY;
+		indices = (unsigned *)malloc(generationCapacity * sizeof(unsigned));
+		if ( !indices ) {
+			NSLog(@"Memory for the genealogy cannot be allocated.");
+			[self release];
+			return nil;
+		}
+	}
+	return self;
+}
+
+- (void) dealloc {
+	free(states);
+	free(parents);
+	free(references);
+	free(freeNodes);
+	free(leaves);
+	free(newLeaves);
+	free(indices);
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) count {
+	return count;
+}
+
+- (unsigned) dimX {
+	return dimX;
+}
+
+- (unsigned) generationCount {
+	return generationCount;
+}
+
+- (unsigned) indexOfGeneration: (unsigned)g {
+	return ( g < generationCount ) ? indices[g] : 0UL;
+}
+
+- (unsigned) nodeCount {
+	return nodeCount;
+}
+
+- (unsigned) peakNodeCount {
+	return peakNodeCount;
+}
+
+
+// *****************************************************************************
+//
+//  BUILDING THE TREE
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Building the Tree
+
+- (BOOL) beginWithStates: (const double *)x
+                  stride: (unsigned)ld
+                   count: (unsigned)n
+                 atIndex: (unsigned)index {
+
+	unsigned j, k, node;
+	
+	// all the nodes are free again
+	used = 0UL;
+	freeCount = 0UL;
+	nodeCount = 0UL;
+	peakNodeCount = 0UL;
+	generationCount = 0UL;
+	
+	if ( n != count ) {
+		free(leaves);
+		free(newLeaves);
+		leaves = (unsigned *)malloc(n * sizeof(unsigned));
+		newLeaves = (unsigned *)malloc(n * sizeof(unsigned));
+		count = ( leaves && newLeaves ) ? n : 0UL;
+		if ( !count ) {
+			NSLog(@"Memory for the genealogy cannot be allocated.");
+			return NO;
+		}
+	}
+	if ( ![self reserveNodes:n] ) {
+		return NO;
+	}
+	
+	for ( j = 0; j < n; j++ ) {
+		node = [self newNodeWithParent:PARTICLE_GENEALOGY_NO_PARENT];
+		for ( k = 0; k < dimX; k++ ) {
+			states[node*dimX + k] = x[k*ld + j];
+		}
+		leaves[j] = node;
+	}
+	
+	indices[generationCount++] = index;
+	return YES;
+}
+
+- (BOOL) appendStates: (const double *)x
+               stride: (unsigned)ld
+            ancestors: (const unsigned *)ancestors
+              atIndex: (unsigned)index {
+
+	unsigned *grown, *tmp;
+	unsigned j, k, node;
+	
+	if ( generationCount == 0 ) {
+		NSLog(@"The genealogy has not begun.");
+		NSLog(@"Call beginWithStates:stride:count:atIndex: first.");
+		return NO;
+	}
+	
+	// All the memory is reserved first, so the tree is either appended
+	// to or left as it was.
+	if ( generationCount == generationCapacity ) {
+		grown = (unsigned *)realloc(indices,
+		                            2 * generationCapacity * sizeof(unsigned));
+		if ( !grown ) {
+			NSLog(@"Memory for the genealogy cannot be allocated.");
+			return NO;
+		}
+		indices = grown;
+		generationCapacity *= 2;
+	}
+	if ( ![self reserveNodes:count] ) {
+		return NO;
+	}
+	
+	// The nodes of the last generation are still referenced by the
+	// generation, so none of them is handed out again here.
+	for ( j = 0; j < count; j++ ) {
+		node = [self newNodeWithParent:leaves[ancestors[j]]];
+		for ( k = 0; k < dimX; k++ ) {
+			states[node*dimX + k] = x[k*ld + j];
+		}
+		newLeaves[j] = node;
+	}
+	
+	// PRUNING:
+	// ========
+	// The last generation lets go of its nodes, so the particles without
+	// children are removed along with their ancestors which are left
+	// without children.
+	for ( j = 0; j < count; j++ ) {
+		[self releaseNode:leaves[j]];
+	}
+	
+	tmp = leaves;
+	leaves = newLeaves;
+	newLeaves = tmp;
+	indices[generationCount++] = index;
+	return YES;
+}
+
+
+// *****************************************************************************
+//
+//  TRAJECTORIES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Trajectories
+
+- (BOOL) getTrajectory: (MathMatrix *)traj
+            ofParticle: (unsigned)j {
+
+	unsigned g, k, node;
+	double *row;
+	
+	if ( j >= count || generationCount == 0 ) {
+		NSLog(@"There is no such particle in the genealogy.");
+		return NO;
+	}
+	if ( [traj height] != dimX || [traj width] != generationCount ) {
+		NSLog(@"Dimension mismatch in [ParticleGenealogy getTrajectory:ofParticle:]");
+		return NO;
+	}
+	
+	// from the last generation back to the first
+	node = leaves[j];
+	for ( g = generationCount; g > 0; g-- ) {
+		for ( k = 0; k < dimX; k++ ) {
+			row = [traj doubleRow:(k + 1)];
+			row[g - 1] = states[node*dimX + k];
+		}
+		node = parents[node];
+	}
+	return YES;
+}
+
+- (unsigned) distinctAncestorsAtGeneration: (unsigned)g {
+	unsigned i, j, n;
+	
+	if ( g >= generationCount ) {
+		return 0UL;
+	}
+	
+	// newLeaves is free between the appends.
+	memcpy(newLeaves, leaves, count * sizeof(unsigned));
+	for ( i = generationCount - 1; i > g; i-- ) {
+		for ( j = 0; j < count; j++ ) {
+			newLeaves[j] = parents[newLeaves[j]];
+		}
+	}
+	
+	qsort(newLeaves, count, sizeof(unsigned), CompareNodes);
+	n = count ? 1UL : 0UL;
+	for ( j = 1; j < count; j++ ) {
+		if ( newLeaves[j] != newLeaves[j - 1] ) {
+			n++;
+		}
+	}
+	return n;
+}
+
+@end
+
+
+@implementation ParticleGenealogy (PrivateMethods)
+
+- (BOOL) reserveNodes: (unsigned)n {
+	unsigned newCapacity;
+	void *grown;
+	
+	if ( freeCount + (capacity - used) >= n ) {
+		return YES;
+	}
+	
+	// Each array is grown on its own; the ones grown before a failure
+	// are merely larger than needed.
+	newCapacity = capacity ? 2 * capacity : n;
+	while ( newCapacity - used + freeCount < n ) {
+		newCapacity *= 2;
+	}
+	
+	if ( (grown = realloc(states, newCapacity * dimX * sizeof(double))) ) {
+		states = (double *)grown;
+	}
+	if ( grown && (grown = realloc(parents, newCapacity * sizeof(unsigned))) ) {
+		parents = (unsigned *)grown;
+	}
+	if ( grown && (grown = realloc(references, newCapacity * sizeof(unsigned))) ) {
+		references = (unsigned *)grown;
+	}
+	if ( grown && (grown = realloc(freeNodes, newCapacity * sizeof(unsigned))) ) {
+		freeNodes = (unsigned *)grown;
+	}
+	if ( !grown ) {
+		NSLog(@"Memory for %u nodes of the genealogy cannot be allocated.",
+		      newCapacity);
+		return NO;
+	}
+	
+	capacity = newCapacity;
+	return YES;
+}
+
+- (unsigned) newNodeWithParent: (unsigned)parent {
+	unsigned node = freeCount ? freeNodes[--freeCount] : used++;
+	
+	parents[node] = parent;
+	references[node] = 1UL;
+	if ( parent != PARTICLE_GENEALOGY_NO_PARENT ) {
+		references[parent]++;
+	}
+	
+	nodeCount++;
+	if ( nodeCount > peakNodeCount ) {
+		peakNodeCount = nodeCount;
+	}
+	return node;
+}
+
+- (void) releaseNode: (unsigned)node {
+	// Walks up the lineage as long as the nodes are left unreferenced.
+	while ( node != PARTICLE_GENEALOGY_NO_PARENT && --references[node] == 0 ) {
+		freeNodes[freeCount++] = node;
+		nodeCount--;
+		node = parents[node];
+	}
+}
+
+@end
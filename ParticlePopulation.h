@@ -0,0 +1,120 @@
+//
+//  ParticlePopulation.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+#import "MathMatrix.h"
+
+// alignment of every array of a population in bytes (a cache line)
+#define PARTICLE_POPULATION_ALIGNMENT	64
+
+//
+//  A generation of particles in one aligned allocation
+//
+//  ============================================================================
+//
+//  The arrays of a generation are laid out as structure of arrays:
+//
+//		states					dimX rows
+//		predicted states		dimX rows
+//		predicted measurements	dimY rows
+//		weights					1 row
+//		log-weights				1 row
+//		ancestor indices		1 row (unsigned)
+//
+//  Each row holds count elements and is padded to leadingDimension
+//  elements, a multiple of PARTICLE_POPULATION_ALIGNMENT bytes, so every
+//  row begins on a cache line.  The k'th component (0-based) of the j'th
+//  particle is states[k*leadingDimension + j], which is the layout the
+//  batch methods of GenericSystem expect with stride leadingDimension.
+//
+//  The ...Matrix methods return MathMatrix views (width count) of the
+//  arrays for the code written against MathMatrix.  A view retains the
+//  population, so it stays valid as long as the view is alive.
+//
+
+@interface ParticlePopulation : NSObject {
+@private
+	unsigned count;				// number of particles
+	unsigned leadingDimension;	// count padded to the alignment
+	unsigned dimX;
+	unsigned dimY;
+	
+	void *block;				// the allocation
+	double *states;
+	double *predictedStates;
+	double *predictedMeasurements;
+	double *weights;
+	double *logWeights;
+	unsigned *ancestors;
+	BOOL isResampled;			// the weights do not apply to the states
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+// designated initializer
+- (id) initWithCount: (unsigned)n
+      stateDimension: (unsigned)xdim
+measurementDimension: (unsigned)ydim;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) count;
+- (unsigned) leadingDimension;
+- (unsigned) dimX;
+- (unsigned) dimY;
+
+- (double *) states;
+- (double *) predictedStates;
+- (double *) predictedMeasurements;
+- (double *) weights;
+- (double *) logWeights;
+- (unsigned *) ancestors;
+
+// YES if the states were selected by the weights, so they are equally
+// weighted and the weights are those before the selection.
+// GenericParticleFilter sets it at every step.
+- (BOOL) isResampled;
+- (void) setResampled: (BOOL)flag;
+
+// new (autoreleased) views of the arrays
+- (MathMatrix *) statesMatrix;
+- (MathMatrix *) predictedStatesMatrix;
+- (MathMatrix *) predictedMeasurementsMatrix;
+- (MathMatrix *) weightsMatrix;
+
+
+// *****************************************************************************
+//
+//  OPERATIONS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Operations
+
+// Exchanges the states and the predicted states without copying, e.g.,
+// when the predicted states become the particles without resampling.
+// The views exchange their roles as well.
+- (void) exchangeStatesWithPredictedStates;
+
+// Sets the ancestor of every particle to itself.
+- (void) resetAncestors;
+
+@end
@@ -0,0 +1,185 @@
+//
+//  ParticlePopulation.m
+//  GenericParticleFilter
+//
+
+#import "ParticlePopulation.h"
+
+#import <stdlib.h>
+
+// number of elements of the given size in an aligned block
+#define ALIGNED_COUNT(n, size) \
+	((((n)*(size) + PARTICLE_POPULATION_ALIGNMENT - 1) \
+	/ PARTICLE_POPULATION_ALIGNMENT) * PARTICLE_POPULATION_ALIGNMENT / (size))
+
+@implementation ParticlePopulation
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	return [self initWithCount: 1UL
+	            stateDimension: 1UL
+	      measurementDimension: 1UL];
+}
+
+// designated initializer
+- (id) initWithCount: (unsigned)n
+      stateDimension: (unsigned)xdim
+measurementDimension: (unsigned)ydim {
+
+	if ( self = [super init] ) {
+		size_t rows, size;
+		
+		count = n;
+		dimX = xdim;
+		dimY = ydim;
+		leadingDimension = ALIGNED_COUNT(n, sizeof(double));
+		
+		// the double rows, followed by the ancestor indices
+		rows = 2*dimX + dimY + 2;
+		size = rows*leadingDimension*sizeof(double)
+		+ ALIGNED_COUNT(n, sizeof(unsigned))*sizeof(unsigned);
+		
+		if ( posix_memalign(&block, PARTICLE_POPULATION_ALIGNMENT, size) ) {
+			NSLog(@"Allocation of a particle population of %u failed.", n);
+			[self release];
+			return nil;
+		}
+		
+		states = (double *)block;
+		predictedStates = states + dimX*leadingDimension;
+		predictedMeasurements = predictedStates + dimX*leadingDimension;
+		weights = predictedMeasurements + dimY*leadingDimension;
+		logWeights = weights + leadingDimension;
+		ancestors = (unsigned *)(logWeights + leadingDimension);
+		
+		[self resetAncestors];
+	}
+	return self;
+}
+
+- (void) dealloc {
+	free(block);
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  ACCESSORS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Accessors
+
+- (unsigned) count {
+	return count;
+}
+
+- (unsigned) leadingDimension {
+	return leadingDimension;
+}
+
+- (unsigned) dimX {
+	return dimX;
+}
+
+- (unsigned) dimY {
+	return dimY;
+}
+
+- (double *) states {
+	return states;
+}
+
+- (double *) predictedStates {
+	return predictedStates;
+}
+
+- (double *) predictedMeasurements {
+	return predictedMeasurements;
+}
+
+- (double *) weights {
+	return weights;
+}
+
+- (double *) logWeights {
+	return logWeights;
+}
+
+- (unsigned *) ancestors {
+	return ancestors;
+}
+
+- (BOOL) isResampled {
+	return isResampled;
+}
+
+- (void) setResampled: (BOOL)flag {
+	isResampled = flag;
+}
+
+- (MathMatrix *) statesMatrix {
+	return [[[MathMatrix alloc] initDoubleViewOfElements:states
+	                                               width:count
+	                                              height:dimX
+	                                    leadingDimension:leadingDimension
+	                                               owner:self] autorelease];
+}
+
+- (MathMatrix *) predictedStatesMatrix {
+	return [[[MathMatrix alloc] initDoubleViewOfElements:predictedStates
+	                                               width:count
+	                                              height:dimX
+	                                    leadingDimension:leadingDimension
+	                                               owner:self] autorelease];
+}
+
+- (MathMatrix *) predictedMeasurementsMatrix {
+	return [[[MathMatrix alloc] initDoubleViewOfElements:predictedMeasurements
+	                                               width:count
+	                                              height:dimY
+	                                    leadingDimension:leadingDimension
+	                                               owner:self] autorelease];
+}
+
+- (MathMatrix *) weightsMatrix {
+	return [[[MathMatrix alloc] initDoubleViewOfElements:weights
+	                                               width:count
+	                                              height:1UL
+	                                    leadingDimension:leadingDimension
+	                                               owner:self] autorelease];
+}
+
+
+// *****************************************************************************
+//
+//  OPERATIONS
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Operations
+
+- (void) exchangeStatesWithPredictedStates {
+	double *tmp = states;
+	
+	states = predictedStates;
+	predictedStates = tmp;
+}
+
+- (void) resetAncestors {
+	unsigned i;
+	
+	for ( i = 0; i < count; i++ ) {
+		ancestors[i] = i;
+	}
+}
+
+@end
@@ -0,0 +1,395 @@
+/*
+ *  Philox.c
+ *  GenericParticleFilter
+ *
+ */
+
+#include "Philox.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+#define PHILOX_M0		0xD2511F53U
+#define PHILOX_M1		0xCD9E8D57U
+#define PHILOX_W0		0x9E3779B9U
+#define PHILOX_W1		0xBB67AE85U
+#define PHILOX_ROUNDS	10
+
+/* 2^-53 */
+#define PHILOX_TWO_POW_M53	1.1102230246251565e-16
+
+/* number of counter blocks transformed at a time by the bulk functions */
+#define PHILOX_FILL_BLOCKS	128
+
+static void
+Round (uint32_t c[4], const uint32_t k[2]) {
+	
+	uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+	uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+	uint32_t c1 = c[1], c3 = c[3];
+	
+	c[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k[0];
+	c[1] = (uint32_t)p1;
+	c[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k[1];
+	c[3] = (uint32_t)p0;
+}
+
+void
+Philox4x32 (const uint32_t counter[4],
+            const uint32_t key[2],
+            uint32_t out[4]
+            ) {
+	
+	uint32_t k[2];
+	int r;
+	
+	out[0] = counter[0];
+	out[1] = counter[1];
+	out[2] = counter[2];
+	out[3] = counter[3];
+	k[0] = key[0];
+	k[1] = key[1];
+	
+	for ( r = 0; r < PHILOX_ROUNDS; r++ ) {
+		if ( r > 0 ) {
+			k[0] += PHILOX_W0;
+			k[1] += PHILOX_W1;
+		}
+		Round(out, k);
+	}
+}
+
+uint64_t
+PhiloxMix (uint64_t x) {
+	
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+void
+PhiloxStreamInit (PhiloxStream *stream,
+                  uint64_t seed,
+                  uint64_t streamId,
+                  uint64_t substream
+                  ) {
+	
+	uint64_t key = PhiloxMix(seed ^ PhiloxMix(streamId));
+	
+	stream -> key[0] = (uint32_t)key;
+	stream -> key[1] = (uint32_t)(key >> 32);
+	PhiloxStreamSetSubstream(stream, substream);
+}
+
+void
+PhiloxStreamSetSubstream (PhiloxStream *stream,
+                          uint64_t substream
+                          ) {
+	
+	stream -> substream[0] = (uint32_t)substream;
+	stream -> substream[1] = (uint32_t)(substream >> 32);
+}
+
+void
+PhiloxUniformPair (const PhiloxStream *stream,
+                   uint64_t block,
+                   double *u0,
+                   double *u1
+                   ) {
+	
+	uint32_t counter[4], out[4];
+	
+	counter[0] = (uint32_t)block;
+	counter[1] = (uint32_t)(block >> 32);
+	counter[2] = stream -> substream[0];
+	counter[3] = stream -> substream[1];
+	Philox4x32(counter, stream -> key, out);
+	
+	/* 53 bits from two 32-bit words; +0.5 keeps the result off 0 and 1 */
+	*u0 = ((double)(((uint64_t)(out[0] >> 5) << 26) | (out[1] >> 6)) + 0.5)
+	      * PHILOX_TWO_POW_M53;
+	*u1 = ((double)(((uint64_t)(out[2] >> 5) << 26) | (out[3] >> 6)) + 0.5)
+	      * PHILOX_TWO_POW_M53;
+}
+
+double
+PhiloxUniformAt (const PhiloxStream *stream,
+                 uint64_t position
+                 ) {
+	
+	double u0, u1;
+	
+	PhiloxUniformPair(stream, position >> 1, &u0, &u1);
+	return ( position & 1 ) ? u1 : u0;
+}
+
+double
+PhiloxNormalAt (const PhiloxStream *stream,
+                uint64_t position
+                ) {
+	
+	double u0, u1, r;
+	
+	PhiloxUniformPair(stream, position >> 1, &u0, &u1);
+	r = sqrt(-2.0 * log(u0));
+	return ( position & 1 ) ? r * sin(2.0 * M_PI * u1) : r * cos(2.0 * M_PI * u1);
+}
+
+double
+PhiloxGammaAt (const PhiloxStream *stream,
+               uint64_t position,
+               double shape,
+               double rate
+               ) {
+	
+	double d = shape - 1.0/3.0;
+	double c = 1.0/sqrt(9.0 * d);
+	double u0, u1, u2, u3, z, v;
+	uint64_t block = position * PHILOX_GAMMA_BLOCKS;
+	unsigned k;
+	
+	/* Each trial takes two blocks: a normal from the first and a uniform
+	 * from the second. The acceptance rate is above 0.95 for shape >= 1,
+	 * so running out of blocks practically never happens. */
+	for ( k = 0; k < PHILOX_GAMMA_BLOCKS/2; k++ ) {
+		PhiloxUniformPair(stream, block + 2*k, &u0, &u1);
+		PhiloxUniformPair(stream, block + 2*k + 1, &u2, &u3);
+		
+		z = sqrt(-2.0 * log(u0)) * cos(2.0 * M_PI * u1);
+		v = 1.0 + c*z;
+		if ( v <= 0.0 ) continue;
+		v = v*v*v;
+		
+		if ( log(u2) < 0.5*z*z + d - d*v + d*log(v) ) {
+			return d*v/rate;
+		}
+	}
+	
+	/* the mean */
+	return shape/rate;
+}
+
+void
+PhiloxFillUniform (const PhiloxStream *stream,
+                   uint64_t position,
+                   unsigned n,
+                   double *out
+                   ) {
+	
+	double u0, u1;
+	uint64_t end = position + n;
+	
+	/* an odd start takes the second number of its block */
+	if ( n > 0 && (position & 1) ) {
+		PhiloxUniformPair(stream, position >> 1, &u0, &u1);
+		*out++ = u1;
+		position++;
+	}
+	for ( ; position + 1 < end; position += 2 ) {
+		PhiloxUniformPair(stream, position >> 1, out, out + 1);
+		out += 2;
+	}
+	if ( position < end ) {
+		PhiloxUniformPair(stream, position >> 1, &u0, &u1);
+		*out = u0;
+	}
+}
+
+#ifndef __APPLE__
+/* Without vForce, the logarithm and the sine and cosine of BoxMuller are
+ * computed by the polynomials below (the coefficients are those of fdlibm).
+ * They have no branches and no calls, so that the compiler vectorizes the
+ * loops over a fill block. They cover only what BoxMuller needs: VectorLog
+ * a positive x that is not subnormal, and VectorSinCos2Pi a moderate t
+ * (|t| < 2^49), for which it gives the sine and cosine of 2*pi*t. */
+
+static inline double
+AsDouble (uint64_t b) {
+	
+	double x;
+	
+	memcpy(&x, &b, sizeof(x));
+	return x;
+}
+
+static inline uint64_t
+AsBits (double x) {
+	
+	uint64_t b;
+	
+	memcpy(&b, &x, sizeof(b));
+	return b;
+}
+
+static inline double
+VectorLog (double x) {
+	
+	/* x = 2^e * m with m in [sqrt(2)/2, sqrt(2)), found in the integer
+	 * bits without comparisons; the exponent is converted with the 2^52
+	 * trick, because vector conversion from 64-bit integers is rare */
+	uint64_t b = AsBits(x);
+	uint64_t t = b + (0x3FF0000000000000ULL - 0x3FE6A09E667F3BCDULL);
+	double m = AsDouble(b - ((t & 0xFFF0000000000000ULL) - 0x3FF0000000000000ULL));
+	double e = AsDouble(0x4330000000000000ULL | (t >> 52)) - 4503599627370496.0 - 1023.0;
+	double f, s, z, R, hfsq;
+	
+	f = m - 1.0;
+	s = f/(2.0 + f);
+	z = s*s;
+	R = z*(6.666666666666735130e-01 + z*(3.999999999940941908e-01
+	  + z*(2.857142874366239149e-01 + z*(2.222219843214978396e-01
+	  + z*(1.818357216161805012e-01 + z*(1.531383769920937332e-01
+	  + z*1.479819860511658591e-01))))));
+	hfsq = 0.5*f*f;
+	
+	/* ln(2) split in a high part with a short mantissa and a low part */
+	return e*6.93147180369123816490e-01
+	- ((hfsq - (s*(hfsq + R) + e*1.90821492927058770002e-10)) - f);
+}
+
+static inline void
+VectorSinCos2Pi (double t,
+                 double *sine,
+                 double *cosine
+                 ) {
+	
+	/* t = q/4 + y with the integer q and |y| <= 1/8, both exact; adding
+	 * 1.5*2^52 rounds 4t to an integer in the low bits of the mantissa */
+	double shifted = 4.0*t + 6755399441055744.0;
+	double q = shifted - 6755399441055744.0;
+	uint64_t quadrant = AsBits(shifted);
+	double x = 2.0*M_PI*(t - 0.25*q);
+	double z = x*x;
+	double sx, cx;
+	uint64_t swap, bs, bc;
+	
+	sx = x + x*z*(-1.66666666666666324348e-01 + z*(8.33333333332248946124e-03
+	   + z*(-1.98412698298579493134e-04 + z*(2.75573137070700676789e-06
+	   + z*(-2.50507602534068634195e-08 + z*1.58969099521155010221e-10)))));
+	cx = 1.0 - 0.5*z + z*z*(4.16666666666666019037e-02
+	   + z*(-1.38888888888741095749e-03 + z*(2.48015872894767294178e-05
+	   + z*(-2.75573143513906633035e-07 + z*(2.08757232129817482790e-09
+	   + z*-1.13596475577881948265e-11)))));
+	
+	/* rotate by q quarter turns: swap for odd q, and flip the signs of
+	 * the sine for q = 2, 3 and of the cosine for q = 1, 2 (mod 4) */
+	swap = 0 - (quadrant & 1);
+	bs = (AsBits(sx) & ~swap) | (AsBits(cx) & swap);
+	bc = (AsBits(cx) & ~swap) | (AsBits(sx) & swap);
+	*sine = AsDouble(bs ^ ((quadrant & 2) << 62));
+	*cosine = AsDouble(bc ^ (((quadrant + 1) & 2) << 62));
+}
+#endif
+
+/* Box-Muller transform of m blocks: on entry, r[k] and a[k] hold the two
+ * uniform numbers of the k'th block, and on exit, r[k]*c[k] and r[k]*a[k]
+ * are the two normal numbers. */
+static void
+BoxMuller (double *restrict r,
+           double *restrict a,
+           double *restrict c,
+           unsigned m
+           ) {
+	
+	unsigned k;
+	
+#ifdef __APPLE__
+	{
+		int len = (int)m;
+		
+		for ( k = 0; k < m; k++ ) {
+			a[k] *= 2.0 * M_PI;
+		}
+		vvlog(r, r, &len);
+		for ( k = 0; k < m; k++ ) {
+			r[k] *= -2.0;
+		}
+		vvsqrt(r, r, &len);
+		vvsincos(a, c, a, &len);
+	}
+#else
+	for ( k = 0; k < m; k++ ) {
+		r[k] = -2.0 * VectorLog(r[k]);
+		VectorSinCos2Pi(a[k], a + k, c + k);
+	}
+	
+	/* on its own, because sqrt is vectorized only without errno
+	 * (-fno-math-errno) */
+	for ( k = 0; k < m; k++ ) {
+		r[k] = sqrt(r[k]);
+	}
+#endif
+}
+
+void
+PhiloxFillNormal (const PhiloxStream *stream,
+                  uint64_t position,
+                  unsigned n,
+                  double *out
+                  ) {
+	
+	double r[PHILOX_FILL_BLOCKS], a[PHILOX_FILL_BLOCKS], c[PHILOX_FILL_BLOCKS];
+	uint64_t end = position + n;
+	uint64_t block, first, last;
+	unsigned k, m;
+	
+	if ( n == 0 ) return;
+	
+	/* the blocks from first to last (inclusive) cover the positions */
+	first = position >> 1;
+	last = (end - 1) >> 1;
+	
+	for ( block = first; block <= last; block += m ) {
+		m = ( last - block + 1 < PHILOX_FILL_BLOCKS )
+		? (unsigned)(last - block + 1) : PHILOX_FILL_BLOCKS;
+		
+		for ( k = 0; k < m; k++ ) {
+			PhiloxUniformPair(stream, block + k, r + k, a + k);
+		}
+		BoxMuller(r, a, c, m);
+		
+		for ( k = 0; k < m; k++ ) {
+			/* the cosine at 2(block + k), the sine at 2(block + k) + 1 */
+			uint64_t p = 2*(block + k);
+			if ( position <= p && p < end ) *out++ = r[k] * c[k];
+			if ( position <= p + 1 && p + 1 < end ) *out++ = r[k] * a[k];
+		}
+	}
+}
+
+double
+PhiloxNextUniform (PhiloxSequence *sequence) {
+	
+	return PhiloxUniformAt(&(sequence -> stream), sequence -> position++);
+}
+
+double
+PhiloxNextNormal (PhiloxSequence *sequence) {
+	
+	return PhiloxNormalAt(&(sequence -> stream), sequence -> position++);
+}
+
+void
+PhiloxNextUniforms (PhiloxSequence *sequence,
+                    unsigned n,
+                    double *out
+                    ) {
+	
+	PhiloxFillUniform(&(sequence -> stream), sequence -> position, n, out);
+	sequence -> position += n;
+}
+
+void
+PhiloxNextNormals (PhiloxSequence *sequence,
+                   unsigned n,
+                   double *out
+                   ) {
+	
+	PhiloxFillNormal(&(sequence -> stream), sequence -> position, n, out);
+	sequence -> position += n;
+}
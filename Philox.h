@@ -0,0 +1,147 @@
+/*
+ *  Philox.h
+ *  GenericParticleFilter
+ *
+ *  Philox4x32-10 counter-based random number generator
+ *  (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", 2011).
+ *
+ *  A random number is a pure function of a key and a counter, so there is
+ *  no state to share or to switch.  Here,
+ *
+ *    key      (64 bits): identifies a stream, e.g., a seed and the slot of
+ *                        a noise source.
+ *    substream(64 bits): the upper half of the counter, e.g., a time step.
+ *    position (64 bits): the lower half of the counter, e.g., the index
+ *                        of a particle times the number of draws per
+ *                        particle.
+ *
+ *  Any thread can draw the number at any position independently, so the
+ *  draws do not depend on how the particles are split among threads.
+ *
+ */
+
+#ifndef __PHILOX__
+#define __PHILOX__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	typedef struct {
+		uint32_t key[2];
+		uint32_t substream[2];
+	} PhiloxStream;
+	
+	/* A sequence of draws from a stream, for the serial users. */
+	typedef struct {
+		PhiloxStream stream;
+		uint64_t position;
+	} PhiloxSequence;
+	
+	/* out = Philox4x32-10(counter, key) */
+	void
+	Philox4x32 (const uint32_t counter[4],
+	            const uint32_t key[2],
+	            uint32_t out[4]
+	            );
+	
+	/* Derives the key of a stream from a seed and a stream id
+	 * (e.g., a slot number and an epoch mixed together). */
+	void
+	PhiloxStreamInit (PhiloxStream *stream,
+	                  uint64_t seed,
+	                  uint64_t streamId,
+	                  uint64_t substream
+	                  );
+	
+	void
+	PhiloxStreamSetSubstream (PhiloxStream *stream,
+	                          uint64_t substream
+	                          );
+	
+	/* Two uniform doubles in (0, 1) with 53 random bits each from the
+	 * block'th counter. */
+	void
+	PhiloxUniformPair (const PhiloxStream *stream,
+	                   uint64_t block,
+	                   double *u0,
+	                   double *u1
+	                   );
+	
+	/* The uniform number in (0, 1) at the position given */
+	double
+	PhiloxUniformAt (const PhiloxStream *stream,
+	                 uint64_t position
+	                 );
+	
+	/* The standard normal number at the position given.
+	 * The numbers at 2k and 2k + 1 are the pair from one Box-Muller
+	 * transform. */
+	double
+	PhiloxNormalAt (const PhiloxStream *stream,
+	                uint64_t position
+	                );
+	
+	/* The gamma number with density rate^shape / Gamma(shape)
+	 * * x^(shape - 1) * exp(-rate * x) at the position given, by the
+	 * method of Marsaglia and Tsang.  shape must be at least 1.
+	 * A position takes PHILOX_GAMMA_BLOCKS blocks of the counter since
+	 * the method rejects some candidates. */
+#define PHILOX_GAMMA_BLOCKS	64
+	double
+	PhiloxGammaAt (const PhiloxStream *stream,
+	               uint64_t position,
+	               double shape,
+	               double rate
+	               );
+	
+	/* Bulk versions of PhiloxUniformAt and PhiloxNormalAt.
+	 * out[k] is the number at position + k for k = 0, ..., n - 1.
+	 * The normals are transformed a block at a time with vector math
+	 * (vForce of the Accelerate framework on Mac OS X, and polynomial
+	 * approximations that the compiler vectorizes elsewhere), so they
+	 * may differ from PhiloxNormalAt in the last bits. */
+	void
+	PhiloxFillUniform (const PhiloxStream *stream,
+	                   uint64_t position,
+	                   unsigned n,
+	                   double *out
+	                   );
+	
+	void
+	PhiloxFillNormal (const PhiloxStream *stream,
+	                  uint64_t position,
+	                  unsigned n,
+	                  double *out
+	                  );
+	
+	double
+	PhiloxNextUniform (PhiloxSequence *sequence);
+	
+	double
+	PhiloxNextNormal (PhiloxSequence *sequence);
+	
+	/* n draws at once; the sequence moves n positions forward */
+	void
+	PhiloxNextUniforms (PhiloxSequence *sequence,
+	                    unsigned n,
+	                    double *out
+	                    );
+	
+	void
+	PhiloxNextNormals (PhiloxSequence *sequence,
+	                   unsigned n,
+	                   double *out
+	                   );
+	
+	/* A 64-bit mixing function (splitmix64 finalizer) for deriving keys */
+	uint64_t
+	PhiloxMix (uint64_t x);
+	
+#ifdef __cplusplus
+}
+#endif
+
+#endif
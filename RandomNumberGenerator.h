@@ -6,12 +6,31 @@
 //  Copyright 2004 Seoul National University. All rights reserved.
 //
 
-#import <Cocoa/Cocoa.h>
+#import <Foundation/Foundation.h>
 
+#import "Philox.h"
+
+//
+//  Two kinds of generators are available.
+//
+//  1. netlib ranlib (random.h), whose 32 generators share process-global
+//     state.  setCurrentGenerator: selects one of them.
+//
+//  2. Counter-based (Philox4x32-10) streams.  A slot and its epoch
+//     identify a stream, which is split further into substreams (e.g.,
+//     one for each time step) whose numbers are addressed by position
+//     (e.g., by the index of a particle).  Nothing is shared, so they can
+//     be used from any thread, and the numbers do not depend on how the
+//     work is split among threads.
+//
 @interface RandomNumberGenerator : NSObject {
 @private
 	BOOL* slots;
 	unsigned currentGenerator;
+	
+	unsigned long long seed;		// seed of the counter-based streams
+	unsigned long long* epochs;		// epoch of each slot
+	PhiloxSequence* sequences;		// sequential draws of each slot
 }
 
 // *****************************************************************************
@@ -24,6 +43,13 @@
 
 - (id) init;
 - (id) initWithTwoSeeds: (long)seed1 :(long)seed2;
+- (id) initWithSeed: (unsigned long long)theSeed;
+
+// designated initializer
+// Only the counter-based streams are seeded; the process-global state of
+// ranlib is left as it is.  Use it for generators created while others
+// are in use, e.g., one for each of several filters running at once.
+- (id) initWithStreamSeed: (unsigned long long)theSeed;
 - (void) dealloc;
 
 
@@ -50,10 +76,63 @@
 
 - (BOOL) isSlotFree: (unsigned)n;
 - (BOOL) isSlotOccupied: (unsigned)n;
+
+// The highest free slot, or 0 if all of them are occupied.  Slots are
+// suggested from the top so that they stay clear of the fixed ids, which
+// count up from 1.  The slot is not occupied until occupySlot: is called.
 - (unsigned) suggestEmptySlot;
 
 - (BOOL) occupySlot: (unsigned)n;
 - (BOOL) freeSlot: (unsigned)n;
 
 
+// *****************************************************************************
+//
+// Counter-based Streams
+//
+// *****************************************************************************
+#pragma -
+#pragma Counter-based Streams
+
+- (unsigned long long) seed;
+
+// Derives the stream of the n'th slot in its current epoch.
+// The substream is given directly or by a time.
+- (void) getStream: (PhiloxStream *)stream
+           forSlot: (unsigned)n
+         substream: (unsigned long long)sub;
+
+- (void) getStream: (PhiloxStream *)stream
+           forSlot: (unsigned)n
+            atTime: (double)t;
+
+// Moves the n'th slot to a new epoch, so the streams derived afterwards
+// are independent of the ones before, e.g., for every run of a filter.
+// It also restarts the sequential draws of the slot.
+- (void) advanceSlot: (unsigned)n;
+
+// Sequential draws from the n'th slot, in (0, 1) and from N(0, 1).
+// Each slot has its own sequence, so switching between slots costs
+// nothing. A slot must not be drawn from by two threads at a time.
+// A slot out of range (e.g., 0, an id which was never set) raises
+// NSRangeException, since no number drawn from it would be random.
+- (double) uniformFromSlot: (unsigned)n;
+- (double) normalFromSlot: (unsigned)n;
+
+// Bulk versions of the two above; they fill buf with count numbers.
+- (void) getUniforms: (double *)buf
+               count: (unsigned)count
+            fromSlot: (unsigned)n;
+- (void) getNormals: (double *)buf
+              count: (unsigned)count
+           fromSlot: (unsigned)n;
+
+// The index of the first particle of the block the calling thread works
+// on. GenericParticleFilter sets it for every chunk of particles, and
+// the systems add it to the index of a particle in the block to get the
+// position of its numbers. It is 0 unless set, and local to each thread.
++ (void) setParticleOffset: (unsigned)offset;
++ (unsigned) particleOffset;
+
+
 @end
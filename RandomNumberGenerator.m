@@ -9,6 +9,17 @@
 #import "RandomNumberGenerator.h"
 #import "time.h"
 #import "random.h"
+#import <pthread.h>
+
+#define CONST_NUMBER_OF_SLOTS	32
+
+// thread-local particle offset (see particleOffset)
+static pthread_key_t particleOffsetKey;
+static pthread_once_t particleOffsetOnce = PTHREAD_ONCE_INIT;
+
+static void CreateParticleOffsetKey (void) {
+	pthread_key_create(&particleOffsetKey, NULL);
+}
 
 
 // *****************************************************************************
@@ -38,22 +49,51 @@
 	return [self initWithTwoSeeds: now :(now-1000)];
 }
 
-// designated initializer
 - (id) initWithTwoSeeds: (long)seed1 :(long)seed2 {
-	unsigned i;
 	setall(seed1, seed2);
-  
-	slots = (BOOL*)malloc(32 * sizeof(BOOL));
-	for ( i = 0; i < 32; i++ ) {
-		slots[i] = NO;
-	}
+	return [self initWithStreamSeed: ((unsigned long long)(unsigned long)seed1 << 32)
+	                                 ^ (unsigned long long)(unsigned long)seed2];
+}
+
+- (id) initWithSeed: (unsigned long long)theSeed {
+	// ranlib needs two seeds in [1, 2147483562] and [1, 2147483398].
+	setall((long)(theSeed % 2147483562ULL) + 1L,
+	       (long)((theSeed >> 32) % 2147483398ULL) + 1L);
 	
-	currentGenerator = 0UL;
+	// the streams are derived from the seed given as is
+	return [self initWithStreamSeed:theSeed];
+}
+
+// designated initializer
+- (id) initWithStreamSeed: (unsigned long long)theSeed {
+	unsigned i;
+	
+	if ( self = [super init] ) {
+		slots = (BOOL*)malloc(CONST_NUMBER_OF_SLOTS * sizeof(BOOL));
+		for ( i = 0; i < CONST_NUMBER_OF_SLOTS; i++ ) {
+			slots[i] = NO;
+		}
+		
+		currentGenerator = 0UL;
+		
+		// the counter-based streams
+		seed = theSeed;
+		epochs = (unsigned long long*)calloc(CONST_NUMBER_OF_SLOTS,
+		                                     sizeof(unsigned long long));
+		sequences = (PhiloxSequence*)malloc(CONST_NUMBER_OF_SLOTS
+		                                    * sizeof(PhiloxSequence));
+		for ( i = 1; i <= CONST_NUMBER_OF_SLOTS; i++ ) {
+			sequences[i - 1].position = 0ULL;
+			[self getStream:&(sequences[i - 1].stream) forSlot:i substream:0ULL];
+		}
+	}
 	return self;
 }
 
 - (void) dealloc {
 	free(slots);
+	free(epochs);
+	free(sequences);
   [super dealloc];
 }
 
@@ -121,10 +161,15 @@
 }
 
 - (unsigned) suggestEmptySlot {
-	//
-	// NOT implemented yet !!!!!
-	//
-	return 0UL;
+	unsigned n;
+	
+	// from the top, away from the fixed ids which count up from 1
+	for ( n = CONST_NUMBER_OF_SLOTS; n >= 1; n-- ) {
+		if ( slots[n - 1] == NO ) {
+			return n;
+		}
+	}
+	return 0UL;	// all the slots are occupied
 }
 
 - (BOOL) occupySlot: (unsigned)n { // this function checks whether
@@ -154,6 +199,104 @@
 
 
 
+// *****************************************************************************
+//
+// Counter-based Streams
+//
+// *****************************************************************************
+#pragma -
+#pragma Counter-based Streams
+
+- (unsigned long long) seed {
+	return seed;
+}
+
+- (void) getStream: (PhiloxStream *)stream
+           forSlot: (unsigned)n
+         substream: (unsigned long long)sub {
+	
+	if ( ![self checkRange:n] ) {
+		NSLog( @"The argument is out of range in getStream:forSlot:substream:" );
+		n = 0UL;	// an unused stream rather than garbage
+	}
+	
+	// the slot in the upper 16 bits and its epoch in the rest
+	PhiloxStreamInit(stream, seed,
+	                 ((unsigned long long)n << 48)
+	                 + ( n ? epochs[n - 1] : 0ULL ),
+	                 sub);
+}
+
+- (void) getStream: (PhiloxStream *)stream
+           forSlot: (unsigned)n
+            atTime: (double)t {
+	
+	// the bit pattern of t is the substream
+	unsigned long long sub;
+	memcpy(&sub, &t, sizeof(sub));
+	[self getStream:stream forSlot:n substream:sub];
+}
+
+- (void) advanceSlot: (unsigned)n {
+	if ( [self checkRange:n] ) {
+		epochs[n - 1]++;
+		sequences[n - 1].position = 0ULL;
+		[self getStream:&(sequences[n - 1].stream) forSlot:n substream:0ULL];
+	}
+}
+
+- (double) uniformFromSlot: (unsigned)n {
+	if ( [self checkRange:n] ) {
+		return PhiloxNextUniform(&(sequences[n - 1]));
+	}
+	
+	[NSException raise:NSRangeException
+	            format:@"Slot %u is out of range in uniformFromSlot:", n];
+	return 0.0;
+}
+
+- (double) normalFromSlot: (unsigned)n {
+	if ( [self checkRange:n] ) {
+		return PhiloxNextNormal(&(sequences[n - 1]));
+	}
+	
+	[NSException raise:NSRangeException
+	            format:@"Slot %u is out of range in normalFromSlot:", n];
+	return 0.0;
+}
+
+- (void) getUniforms: (double *)buf
+               count: (unsigned)count
+            fromSlot: (unsigned)n {
+	if ( ![self checkRange:n] ) {
+		[NSException raise:NSRangeException
+		            format:@"Slot %u is out of range in getUniforms:count:fromSlot:", n];
+	}
+	PhiloxNextUniforms(&(sequences[n - 1]), count, buf);
+}
+
+- (void) getNormals: (double *)buf
+              count: (unsigned)count
+           fromSlot: (unsigned)n {
+	if ( ![self checkRange:n] ) {
+		[NSException raise:NSRangeException
+		            format:@"Slot %u is out of range in getNormals:count:fromSlot:", n];
+	}
+	PhiloxNextNormals(&(sequences[n - 1]), count, buf);
+}
+
++ (void) setParticleOffset: (unsigned)offset {
+	pthread_once(&particleOffsetOnce, CreateParticleOffsetKey);
+	pthread_setspecific(particleOffsetKey, (void *)(uintptr_t)offset);
+}
+
++ (unsigned) particleOffset {
+	pthread_once(&particleOffsetOnce, CreateParticleOffsetKey);
+	return (unsigned)(uintptr_t)pthread_getspecific(particleOffsetKey);
+}
+
+
+
 // *****************************************************************************
 //
 // Private Methods
@@ -163,7 +306,7 @@
 #pragma Private Methods
 
 - (BOOL) checkRange: (unsigned)n {
-	if (( 1UL <= n ) && ( n <= 32UL )) {
+	if (( 1UL <= n ) && ( n <= CONST_NUMBER_OF_SLOTS )) {
 		return YES;
 	} else {
 		return NO;
@@ -16,6 +16,7 @@
 - (id) init;
 - (id) initWithTimeSpan: (MathMatrix *)span;	// designated initializer
 - (void) dealloc;
+- (id) copyWithZone: (NSZone *)zone;
 
 - (double)processNoise;
 - (void)setProcessNoise: (double)var;
@@ -6,6 +6,9 @@
 #import "RandomWalk.h"
 #import "random.h"
 
+// number of particles whose noise is drawn at a time
+#define CONST_NOISE_BLOCK	256
+
 @implementation RandomWalk
 - (id) init {
 	return [self initWithTimeSpan: nil ];
@@ -38,6 +41,14 @@
 	[super dealloc];
 }
 
+- (id) copyWithZone: (NSZone *)zone {
+	RandomWalk *copy = [super copyWithZone:zone];
+	
+	copy -> processNoise = processNoise;
+	copy -> measurementNoise = measurementNoise;
+	return copy;
+}
+
 - (double)processNoise {
 	return processNoise;
 }
@@ -62,51 +73,39 @@
 // *****************************************************************************
 - (void) simulateWithInitialState: (MathMatrix *)xInit
                           control: (MathMatrix *)control {
-	unsigned i;
-
-  double x[4];
-  double x_n[4];
+	unsigned i, k;
 	
-	[xInit getValue:&x[0] atRow:1UL column:1UL];
-	[xInit getValue:&x[1] atRow:2UL column:1UL];
-  [xInit getValue:&x[2] atRow:3UL column:1UL];
-  [xInit getValue:&x[3] atRow:4UL column:1UL];
-
-	[X setDoubleValue:x[0] atRow:1UL column:1UL];
-	[X setDoubleValue:x[1] atRow:2UL column:1UL];
-  [X setDoubleValue:x[2] atRow:3UL column:1UL];
-	[X setDoubleValue:x[3] atRow:4UL column:1UL];
+	// the (i + 1)'th columns of X and Y (i is 0-based)
+	unsigned ldx = [X width];
+	unsigned ldy = [Y width];
+	double *t = [timeSpan doubleElements];
+	double *xs = [X doubleElements];
+	double *ys = [Y doubleElements];
+	double *x, *x_n;
+	
+	for ( k = 0; k < 4; k++ ) {
+		xs[k*ldx] = [xInit doubleElements][k];
+	}
 	
 	for ( i = 1; i < [timeSpan count]; i++ ) {
 		// propagate the system dynamics
-		double t = ((double *)[timeSpan elements])[i];
-    double dt = ((double *)[timeSpan elements])[i+1] - t;
+		double dt = t[i] - t[i-1];
 		
-		[X getValue:&x[0] atRow:1UL column:i];
-		[X getValue:&x[1] atRow:2UL column:i];
-    [X getValue:&x[2] atRow:3UL column:i];
-    [X getValue:&x[3] atRow:4UL column:i];
+		x = xs + (i - 1);
+		x_n = xs + i;
 		
 		[RNGenerator setCurrentGenerator:XNoiseGenID];
-    double noiseX = gennor(0.0, processNoise);
-    double noiseY = gennor(0.0, processNoise);
-    x_n[0] = x[0] + dt*x[2] + noiseX*dt*dt/2.;
-    x_n[1] = x[1] + dt*x[3] + noiseY*dt*dt/2.;
-    x_n[2] = x[2] + noiseX*dt;
-    x_n[3] = x[3] + noiseY*dt;
-		
-		[X setDoubleValue:x_n[0] atRow:1UL column:(i + 1UL)];
-		[X setDoubleValue:x_n[1] atRow:2UL column:(i + 1UL)];
-    [X setDoubleValue:x_n[2] atRow:3UL column:(i + 1UL)];
-		[X setDoubleValue:x_n[3] atRow:4UL column:(i + 1UL)];
+		double noiseX = gennor(0.0, processNoise);
+		double noiseY = gennor(0.0, processNoise);
+		x_n[0]     = x[0] + dt*x[2*ldx] + noiseX*dt*dt/2.;
+		x_n[ldx]   = x[ldx] + dt*x[3*ldx] + noiseY*dt*dt/2.;
+		x_n[2*ldx] = x[2*ldx] + noiseX*dt;
+		x_n[3*ldx] = x[3*ldx] + noiseY*dt;
 		
 		// generate artificial measurement
-    [RNGenerator setCurrentGenerator:YNoiseGenID];
-		double z1 = x_n[0] + gennor(0.0, measurementNoise);
-    double z2 = x_n[1] + gennor(0.0, measurementNoise);
-    
-		[Y setDoubleValue:z1 atRow:1UL column:(i + 1UL)];
-    [Y setDoubleValue:z2 atRow:2UL column:(i + 1UL)];
+		[RNGenerator setCurrentGenerator:YNoiseGenID];
+		ys[i]       = x_n[0] + gennor(0.0, measurementNoise);
+		ys[ldy + i] = x_n[ldx] + gennor(0.0, measurementNoise);
 	}
 }
 
@@ -115,77 +114,60 @@
      withCurrentState: (MathMatrix *)x_current
               control: (MathMatrix *)control
 {
-	double t = [timeSpan doubleValueAtRow:1UL column:(i + 1UL)];
-  double dt = t - [timeSpan doubleValueAtRow:1UL column:i];;
-  double x[4];
-  for (unsigned i = 0; i != 4; ++i) {
-    x[i] = [x_current doubleValueAtRow:(i+1) column:1UL];
-  }
-	
-  double x_n[4];
-  
-  [RNGenerator setCurrentGenerator:XNoiseGenID];
+	double *t = [timeSpan doubleElements];
+	double dt = t[i] - t[i-1];
+	double *x = [x_current doubleElements];
+	double *x_n = [next doubleElements];
+	
+	[RNGenerator setCurrentGenerator:XNoiseGenID];
 	double noiseX = gennor(0.0, processNoise);
-  double noiseY = gennor(0.0, processNoise);
-  x_n[0] = x[0] + dt*x[2] + noiseX*dt*dt/2.;
-  x_n[1] = x[1] + dt*x[3] + noiseY*dt*dt/2.;
-  x_n[2] = x[2] + noiseX*dt;
-  x_n[3] = x[3] + noiseY*dt;
-  
-  for (unsigned i = 0; i != 4; ++i) {
-    [next setDoubleValue:x_n[i] atRow:(i+1) column:1UL];
-  }
+	double noiseY = gennor(0.0, processNoise);
+	x_n[0] = x[0] + dt*x[2] + noiseX*dt*dt/2.;
+	x_n[1] = x[1] + dt*x[3] + noiseY*dt*dt/2.;
+	x_n[2] = x[2] + noiseX*dt;
+	x_n[3] = x[3] + noiseY*dt;
 }
 
 - (void) getNextState: (MathMatrix *)next
-               atTime: (double)t
+             fromTime: (double)t0
+               toTime: (double)t1
      withCurrentState: (MathMatrix *)x_current
               control: (MathMatrix *)control
 {
-  double dt = [timeSpan doubleValueAtRow:1UL column:2UL] -
-    [timeSpan doubleValueAtRow:1UL column:1UL];
-  
-	double x[4];
-  for (unsigned i = 0; i != 4; ++i) {
-    x[i] = [x_current doubleValueAtRow:(i+1) column:1UL];
-  }
-	
-  double x_n[4];
-  
-  [RNGenerator setCurrentGenerator:XNoiseGenID];
+	double dt = t1 - t0;
+	double *x = [x_current doubleElements];
+	double *x_n = [next doubleElements];
+	
+	[RNGenerator setCurrentGenerator:XNoiseGenID];
 	double noiseX = gennor(0.0, processNoise);
-  double noiseY = gennor(0.0, processNoise);
-  x_n[0] = x[0] + dt*x[2] + noiseX*dt*dt/2.;
-  x_n[1] = x[1] + dt*x[3] + noiseY*dt*dt/2.;
-  x_n[2] = x[2] + noiseX*dt;
-  x_n[3] = x[3] + noiseY*dt;
-  
-  for (unsigned i = 0; i != 4; ++i) {
-    [next setDoubleValue:x_n[i] atRow:(i+1) column:1UL];
-  }
+	double noiseY = gennor(0.0, processNoise);
+	x_n[0] = x[0] + dt*x[2] + noiseX*dt*dt/2.;
+	x_n[1] = x[1] + dt*x[3] + noiseY*dt*dt/2.;
+	x_n[2] = x[2] + noiseX*dt;
+	x_n[3] = x[3] + noiseY*dt;
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
                      atTimeIndex: (unsigned)i
                 withCurrentState: (MathMatrix *)x_current
 {
-  // generate noise-free measurement
-  double x[4];
-  for (unsigned i = 0; i != 4; ++i) {
-    x[i] = [x_current doubleValueAtRow:(i+1) column:1UL];
-  }
-  
-  double z1 = x[0];
-  double z2 = x[1];
-  
-  [output setDoubleValue:z1 atRow:1UL column:1UL];
-  [output setDoubleValue:z2 atRow:2UL column:1UL];
+	// generate noise-free measurement
+	double *x = [x_current doubleElements];
+	double *z = [output doubleElements];
+	
+	z[0] = x[0];
+	z[1] = x[1];
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
 						  atTime: (double)t
-				withCurrentState: (MathMatrix *)x {
-	// not implemented
+				withCurrentState: (MathMatrix *)x_current {
+	// the same as at a time index: the positions
+	double *x = [x_current doubleElements];
+	double *z = [output doubleElements];
+	
+	z[0] = x[0];
+	z[1] = x[1];
 }
 
 - (double) probabilityOf: (MathMatrix *)output
@@ -193,11 +175,11 @@
              atTimeIndex: (unsigned)ti
           withParameters: (MathMatrix *)params {
 	
-	double y1 = [output doubleValueAtRow:1UL column:1UL];
-  double y2 = [output doubleValueAtRow:2UL column:1UL];
-  
-	double x1 = [state doubleValueAtRow:1UL column:1UL];
-  double x2 = [state doubleValueAtRow:2UL column:1UL];
+	double y1 = [output doubleElements][0];
+	double y2 = [output doubleElements][1];
+	
+	double x1 = [state doubleElements][0];
+	double x2 = [state doubleElements][1];
 	
   y1 -= x1;
   y2 -= x2;
@@ -219,24 +201,161 @@
 - (double) importanceWeightAtTimeIndex: (unsigned)index
               withPredictedMeasurement: (MathMatrix *)pMeasure {
 	
-	double m, pm;
-	MathMatrix* measure = [[MathMatrix alloc] initWithType:@"double"
-                                                   width:1UL
-                                                  height:2UL];
-	
-	[Y getVector:measure atColumn:(index + 1UL)]; // since index is 0-based.
-	m = [measure doubleValueAtRow:1UL column:1UL];
-  double z1 = [measure doubleValueAtRow:1UL column:1UL];
-  double z2 = [measure doubleValueAtRow:2UL column:1UL];
-  
-  double pz1 = [pMeasure doubleValueAtRow:1UL column:1UL];
-  double pz2 = [pMeasure doubleValueAtRow:2UL column:1UL];
-  
-	pm = [pMeasure doubleValueAtRow:1UL column:1UL];
-	[measure release];
+	// the (index + 1)'th column of Y, since index is 0-based.
+	double *measure = [Y doubleColumn:(index + 1UL)];
+	double z1 = measure[0];
+	double z2 = measure[[Y width]];
+	
+	double pz1 = [pMeasure doubleElements][0];
+	double pz2 = [pMeasure doubleElements][1];
 
   return exp(-0.5*(pow(z1-pz1, 2) + pow(z2-pz2,2))/(measurementNoise*measurementNoise))
     /sqrt(4.0*M_PI*M_PI*pow(measurementNoise,4));
 }
 
+// The measurements and the weights only read the parameters, and the
+// propagation draws from a counter-based stream, so all of them can be
+// evaluated concurrently.
+- (BOOL) isWeightingThreadSafe
+{
+	return YES;
+}
+
+- (BOOL) isPropagationThreadSafe
+{
+	return YES;
+}
+
+// Batch versions for the whole population of particles.
+// See GenericSystem.h for the layout of the blocks.
+// The versions driven by time index call the time based versions.
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control
+{
+	double *t = (double *)[timeSpan elements];
+	
+	[self getNextStates: next
+	           fromTime: t[i-1]
+	             toTime: t[i]
+	  withCurrentStates: x
+	              count: n
+	             stride: ld
+	            control: control];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                      atTimeIndex: (unsigned)i
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld
+{
+	[self getNoiseFreeMeasurements: output
+	                        atTime: ((double *)[timeSpan elements])[i]
+	             withCurrentStates: x
+	                         count: n
+	                        stride: ld];
+}
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)index
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld
+{
+	// the index'th column of Y (index is 0-based)
+	[self importanceWeights: w
+	                 atTime: ((double *)[timeSpan elements])[index]
+	         forMeasurement: ((double *)[Y elements]) + index
+	      measurementStride: [Y width]
+	withPredictedMeasurements: pMeasure
+	                  count: n
+	                 stride: ld];
+}
+
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure
+{
+	double w;
+	
+	[self importanceWeights: &w
+	                 atTime: t
+	         forMeasurement: (double *)[y elements]
+	      measurementStride: 1UL
+	withPredictedMeasurements: (double *)[pMeasure elements]
+	                  count: 1UL
+	                 stride: 1UL];
+	return w;
+}
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control
+{
+	double dt = t1 - t0;
+	double dt2 = dt*dt/2.;
+	double noise[2*CONST_NOISE_BLOCK];
+	double noiseX, noiseY;
+	unsigned j, b, m;
+	unsigned offset = [RandomNumberGenerator particleOffset];
+	PhiloxStream stream;
+	
+	[RNGenerator getStream:&stream forSlot:XNoiseGenID atTime:t1];
+	for ( b = 0; b < n; b += m ) {
+		m = ( n - b < CONST_NOISE_BLOCK ) ? n - b : CONST_NOISE_BLOCK;
+		
+		// the two noises of a particle are at 2(offset + j) and the next
+		PhiloxFillNormal(&stream, 2ULL*(offset + b), 2*m, noise);
+		for ( j = 0; j < m; j++ ) {
+			noiseX = processNoise*noise[2*j];
+			noiseY = processNoise*noise[2*j + 1];
+			next[b + j]        = x[b + j]        + dt*x[2*ld + b + j] + noiseX*dt2;
+			next[ld + b + j]   = x[ld + b + j]   + dt*x[3*ld + b + j] + noiseY*dt2;
+			next[2*ld + b + j] = x[2*ld + b + j] + noiseX*dt;
+			next[3*ld + b + j] = x[3*ld + b + j] + noiseY*dt;
+		}
+	}
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld
+{
+	// the measurements are the positions, i.e., the first two rows
+	memcpy(output, x, n*sizeof(double));
+	memcpy(output + ld, x + ld, n*sizeof(double));
+}
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)y
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld
+{
+	unsigned j;
+	double z1 = y[0];
+	double z2 = y[ldy];
+	double c = -0.5/(measurementNoise*measurementNoise);
+	double norm = 1.0/sqrt(4.0*M_PI*M_PI*pow(measurementNoise,4));
+	double d1, d2;
+	
+	for ( j = 0; j < n; j++ ) {
+		d1 = z1 - pMeasure[j];
+		d2 = z2 - pMeasure[ld + j];
+		w[j] = exp(c*(d1*d1 + d2*d2))*norm;
+	}
+}
+
 @end
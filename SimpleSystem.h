@@ -19,6 +19,7 @@
 - (id) init;
 - (id) initWithTimeSpan: (MathMatrix *)span;	// designated initializer
 - (void) dealloc;
+- (id) copyWithZone: (NSZone *)zone;
 
 - (double) sigma;
 - (void) setSigma: (double)var;
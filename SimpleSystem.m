@@ -54,6 +54,13 @@
     [super dealloc];
 }
 
+- (id) copyWithZone: (NSZone *)zone {
+    SimpleSystem *copy = [super copyWithZone:zone];
+    
+    copy -> sigma = sigma;
+    return copy;
+}
+
 
 // *****************************************************************************
 //
@@ -113,17 +120,17 @@
                           control: (MathMatrix *)control {
 //    unsigned i;
     double xx, xm1, yy;
-    [xInit getValue:&xx atRow:1UL column:1UL];
+    xx = [xInit doubleElements][0];
     [X setDoubleValue:xx atRow:1UL column:1UL];
     
     for (unsigned i = 1; i < [timeSpan count]; i++ ) {
         // propagate the system dynamics
         double t = ((double *)[timeSpan elements])[i];
-        [X getValue:&xm1 atRow:1UL column:i];
+        xm1 = [X doubleRow:1UL][i - 1];
         [RNGenerator setCurrentGenerator:XNoiseGenID];
         xx = 1.0 + sin(0.04*M_PI*t)
         + [self phi1]*xm1 + gengam(2.0f, 3.0f);
-        [X setDoubleValue:xx atRow:1UL column:(i + 1UL)];
+        [X doubleRow:1UL][i] = xx;
         
         // generate artificial measurement
         if ( i <= 30 ) {
@@ -133,7 +140,7 @@
         }
         [RNGenerator setCurrentGenerator:YNoiseGenID];
         yy += gennor(0.0, sigma);
-        [Y setDoubleValue:yy atRow:1UL column:(i + 1UL)];
+        [Y doubleRow:1UL][i] = yy;
     }
 }
 
@@ -142,26 +149,27 @@
      withCurrentState: (MathMatrix *)x
               control: (MathMatrix *)control {
     
-    double t = [timeSpan doubleValueAtRow:1UL column:(i + 1UL)];
-    double _x = [x doubleValueAtRow:1UL column:1UL];
+    double t = [timeSpan doubleElements][i];
+    double _x = [x doubleElements][0];
     double xx;
     
     [RNGenerator setCurrentGenerator:XNoiseGenID];
     xx = 1.0 + sin(0.04*M_PI*t) + [self phi1]*_x + gengam(2.0, 3.0);
-    [next setDoubleValue:xx atRow:1UL column:1UL];
+    [next doubleElements][0] = xx;
 }
 
 - (void) getNextState: (MathMatrix *)next
-               atTime: (double)t
+             fromTime: (double)t0
+               toTime: (double)t
      withCurrentState: (MathMatrix *)x
               control: (MathMatrix *)control {
     
-    double _x = [x doubleValueAtRow:1UL column:1UL];
+    double _x = [x doubleElements][0];
     double xx;
     
     [RNGenerator setCurrentGenerator:XNoiseGenID];
     xx = 1.0 + sin(0.04*M_PI*t) + [self phi1]*_x + gengam(2.0, 3.0);
-    [next setDoubleValue:xx atRow:1UL column:1UL];
+    [next doubleElements][0] = xx;
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
@@ -169,7 +177,7 @@
                 withCurrentState: (MathMatrix *)x {
     
     double m;
-    double _x = [x doubleValueAtRow:1UL column:1UL];
+    double _x = [x doubleElements][0];
     
     if ( i <= 30 ) {
         m = [self phi2] * pow(_x, 2.0);
@@ -177,7 +185,7 @@
         m = -2.0 + _x * [self phi3];
     }
     
-    [output setDoubleValue:m atRow:1UL column:1UL];
+    [output doubleElements][0] = m;
 }
 
 - (void) getNextState: (MathMatrix *)next
@@ -186,15 +194,17 @@
            parameters: (MathMatrix *)params
               control: (MathMatrix *)control {
     
-    double t = [timeSpan doubleValueAtRow:1UL column:(i + 1UL)];
-    double _x = [x doubleValueAtRow:1UL column:1UL];
+    double t = [timeSpan doubleElements][i];
+    double _x = [x doubleElements][0];
     double xx;
+    PhiloxStream stream;
     
-    [RNGenerator setCurrentGenerator:XNoiseGenID];
+    // gengam(2.0, 3.0) from the stream at the position of the rollout
+    [RNGenerator getStream:&stream forSlot:XNoiseGenID substream:i];
     xx = 1.0 + sin(0.04*M_PI*t)
-    + [params doubleValueAtRow:1UL column:1UL]*_x
-    + gengam(2.0, 3.0);
-    [next setDoubleValue:xx atRow:1UL column:1UL];
+    + [params doubleElements][0]*_x
+    + PhiloxGammaAt(&stream, [RandomNumberGenerator particleOffset], 3.0, 2.0);
+    [next doubleElements][0] = xx;
 }
 
 - (void) getMeasurement: (MathMatrix *)output
@@ -203,19 +213,21 @@
              parameters: (MathMatrix *)params {
     
     double m;
+    PhiloxStream stream;
     
-    double _x = [x doubleValueAtRow:1UL column:1UL];
+    double _x = [x doubleElements][0];
     
     if ( i <= 30 ) {
-        m = [params doubleValueAtRow:2UL column:1UL] * pow(_x, 2.0);
+        m = [params doubleElements][1] * pow(_x, 2.0);
     } else {
-        m = -2.0 + _x * [params doubleValueAtRow:2UL column:1UL];
+        m = -2.0 + _x * [params doubleElements][1];
     }
     
-    [RNGenerator setCurrentGenerator:YNoiseGenID];
-    m += gennor(0.0, sigma);	// gennor( mean, standard deviation);
+    // gennor(0.0, sigma) from the stream at the position of the rollout
+    [RNGenerator getStream:&stream forSlot:YNoiseGenID substream:i];
+    m += sigma * PhiloxNormalAt(&stream, [RandomNumberGenerator particleOffset]);
     
-    [output setDoubleValue:m atRow:1UL column:1UL];
+    [output doubleElements][0] = m;
 }
 
 - (double) probabilityOf: (MathMatrix *)output
@@ -223,13 +235,13 @@
              atTimeIndex: (unsigned)ti
           withParameters: (MathMatrix *)params {
     
-    double y = [output doubleValueAtRow:1UL column:1UL];
-    double x = [state doubleValueAtRow:1UL column:1UL];
+    double y = [output doubleElements][0];
+    double x = [state doubleElements][0];
     
     if ( ti <= 30 ) {
-        y -= [params doubleValueAtRow:2UL column:1UL] * pow(x, 2.0);
+        y -= [params doubleElements][1] * pow(x, 2.0);
     } else {
-        y -= (-2.0 + x * [params doubleValueAtRow:3UL column:1UL]);
+        y -= (-2.0 + x * [params doubleElements][2]);
     }
     
     return exp(-0.5 * pow(y/sigma, 2.0))/(sigma * sqrt(2.0 * M_PI));
@@ -248,16 +260,227 @@
               withPredictedMeasurement: (MathMatrix *)pMeasure {
     
     double m, pm;
-    MathMatrix* measure = [[MathMatrix alloc] initWithType:@"double"
-                                                     width:1UL
-                                                    height:1UL];
     
-    [Y getVector:measure atColumn:(index + 1UL)]; // since index is 0-based.
-    m = [measure doubleValueAtRow:1UL column:1UL];
-    pm = [pMeasure doubleValueAtRow:1UL column:1UL];
-    [measure release];
+    m = [Y doubleColumn:(index + 1UL)][0]; // since index is 0-based.
+    pm = [pMeasure doubleElements][0];
     
     return exp(-0.5 * pow((m - pm)/sigma, 2.0))/sigma;
 }
 
+// The measurements and the weights only read the parameters, and the
+// propagation and the rollouts draw from counter-based streams, so all of
+// them can be evaluated concurrently.
+- (BOOL) isWeightingThreadSafe {
+    return YES;
+}
+
+- (BOOL) isPropagationThreadSafe {
+    return YES;
+}
+
+- (BOOL) isRolloutThreadSafe {
+    return YES;
+}
+
+// Batch versions for the whole population of particles.
+// See GenericSystem.h for the layout of the blocks.
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+    
+    double *t = (double *)[timeSpan elements];
+    
+    [self getNextStates: next
+               fromTime: t[i-1]
+                 toTime: t[i]
+      withCurrentStates: x
+                  count: n
+                 stride: ld
+                control: control];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                      atTimeIndex: (unsigned)i
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+    
+    unsigned j;
+    
+    if ( i <= 30 ) {
+        double phi2 = [self phi2];
+        for ( j = 0; j < n; j++ ) {
+            output[j] = phi2 * x[j] * x[j];
+        }
+    } else {
+        double phi3 = [self phi3];
+        for ( j = 0; j < n; j++ ) {
+            output[j] = -2.0 + x[j] * phi3;
+        }
+    }
+}
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)index
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+    
+    // the index'th column of Y (index is 0-based)
+    [self importanceWeights: w
+                     atTime: ((double *)[timeSpan elements])[index]
+             forMeasurement: ((double *)[Y elements]) + index
+          measurementStride: [Y width]
+    withPredictedMeasurements: pMeasure
+                      count: n
+                     stride: ld];
+}
+
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure {
+    
+    double w;
+    
+    [self importanceWeights: &w
+                     atTime: t
+             forMeasurement: (double *)[y elements]
+          measurementStride: 1UL
+    withPredictedMeasurements: (double *)[pMeasure elements]
+                      count: 1UL
+                     stride: 1UL];
+    return w;
+}
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+    
+    double drift = 1.0 + sin(0.04*M_PI*t1);
+    double phi1 = [self phi1];
+    unsigned j;
+    unsigned offset = [RandomNumberGenerator particleOffset];
+    PhiloxStream stream;
+    
+    // gengam(2.0, 3.0), i.e., shape 3 and rate 2, from the stream
+    [RNGenerator getStream:&stream forSlot:XNoiseGenID atTime:t1];
+    for ( j = 0; j < n; j++ ) {
+        next[j] = drift + phi1*x[j]
+        + PhiloxGammaAt(&stream, offset + j, 3.0, 2.0);
+    }
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+    
+    // The measurement equation switches after the 30th time step
+    // (see getNoiseFreeMeasurements:atTimeIndex:...).  Here, it is
+    // decided by comparing t with the time of that step.
+    double *ts = (double *)[timeSpan elements];
+    unsigned j;
+    
+    if ( [timeSpan count] <= 30UL || t <= ts[30] ) {
+        double phi2 = [self phi2];
+        for ( j = 0; j < n; j++ ) {
+            output[j] = phi2 * x[j] * x[j];
+        }
+    } else {
+        double phi3 = [self phi3];
+        for ( j = 0; j < n; j++ ) {
+            output[j] = -2.0 + x[j] * phi3;
+        }
+    }
+}
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)y
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+    
+    double m = y[0];
+    double c = -0.5/(sigma*sigma);
+    double d;
+    unsigned j;
+    
+    for ( j = 0; j < n; j++ ) {
+        d = m - pMeasure[j];
+        w[j] = exp(c*d*d)/sigma;
+    }
+}
+
+// The mean of the next state; the gamma noise has mean 3/2.
+- (void) getPointPredictions: (double *)next
+                 atTimeIndex: (unsigned)i
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+    
+    double *t = (double *)[timeSpan elements];
+    
+    [self getPointPredictions: next
+                     fromTime: t[i-1]
+                       toTime: t[i]
+            withCurrentStates: x
+                        count: n
+                       stride: ld];
+}
+
+- (void) getPointPredictions: (double *)next
+                    fromTime: (double)t0
+                      toTime: (double)t1
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+    
+    double drift = 1.0 + sin(0.04*M_PI*t1) + 1.5;
+    double phi1 = [self phi1];
+    unsigned j;
+    
+    for ( j = 0; j < n; j++ ) {
+        next[j] = drift + phi1*x[j];
+    }
+}
+
+// The noise of the transition is Gamma with shape 3 and rate 2, whose
+// density is 4 v^2 exp(-2v) for v > 0.
+- (BOOL) hasTransitionDensity {
+    return YES;
+}
+
+- (void) transitionDensities: (double *)p
+                 atTimeIndex: (unsigned)i
+                 ofNextState: (const double *)next
+           withCurrentStates: (double *)x
+                       count: (unsigned)n
+                      stride: (unsigned)ld {
+    
+    double drift = 1.0 + sin(0.04*M_PI*[timeSpan doubleElements][i]);
+    double phi1 = [self phi1];
+    double v;
+    unsigned j;
+    
+    for ( j = 0; j < n; j++ ) {
+        v = next[0] - drift - phi1*x[j];
+        p[j] = ( v > 0.0 ) ? 4.0*v*v*exp(-2.0*v) : 0.0;
+    }
+}
+
+// the density at the mode of the noise, v = 1
+- (double) transitionDensityBoundAtTimeIndex: (unsigned)i {
+    return 4.0*exp(-2.0);
+}
+
 @end
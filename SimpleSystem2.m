@@ -40,6 +40,13 @@
 	[super dealloc];
 }
 
+- (id) copyWithZone: (NSZone *)zone {
+	SimpleSystem2 *copy = [super copyWithZone:zone];
+	
+	copy -> sigma = sigma;
+	return copy;
+}
+
 - (double)sigma {
 	return sigma;
 }
@@ -59,9 +66,9 @@
 	unsigned i;
 	double xx1, xx2, xm1, xm2, yy;
 	
-	[xInit getValue:&xx1 atRow:1UL column:1UL];
-	[xInit getValue:&xx2 atRow:2UL column:1UL];
-
+	xx1 = [xInit doubleElements][0];
+	xx2 = [xInit doubleElements][1];
+	
 	[X setDoubleValue:xx1 atRow:1UL column:1UL];
 	[X setDoubleValue:xx2 atRow:2UL column:1UL];
 	
@@ -69,16 +76,16 @@
 		// propagate the system dynamics
 		double t = ((double *)[timeSpan elements])[i];
 		
-		[X getValue:&xm1 atRow:1UL column:i];
-		[X getValue:&xm2 atRow:2UL column:i];
+		xm1 = [X doubleRow:1UL][i - 1];
+		xm2 = [X doubleRow:2UL][i - 1];
 		
 		[RNGenerator setCurrentGenerator:XNoiseGenID];
 		
 		xx1 = 1.0 + sin(0.04*M_PI*t) + xm2*xm1 + gengam(2.0, 3.0);
 		xx2 = xm2;
 		
-		[X setDoubleValue:xx1 atRow:1UL column:(i + 1UL)];
-		[X setDoubleValue:xx2 atRow:2UL column:(i + 1UL)];
+		[X doubleRow:1UL][i] = xx1;
+		[X doubleRow:2UL][i] = xx2;
 		
 		// generate artificial measurement
 		if ( i <= 30 ) {
@@ -89,7 +96,7 @@
 		
 		[RNGenerator setCurrentGenerator:YNoiseGenID];
 		yy += gennor(0.0, sigma);
-		[Y setDoubleValue:yy atRow:1UL column:(i + 1UL)];
+		[Y doubleRow:1UL][i] = yy;
 	}
 }
 
@@ -98,27 +105,28 @@
 	 withCurrentState: (MathMatrix *)x
 			  control: (MathMatrix *)control {
 		
-	double t = [timeSpan doubleValueAtRow:1UL column:(i + 1UL)];
-	double _x1 = [x doubleValueAtRow:1UL column:1UL];
-	double _x2 = [x doubleValueAtRow:2UL column:1UL];
+	double t = [timeSpan doubleElements][i];
+	double _x1 = [x doubleElements][0];
+	double _x2 = [x doubleElements][1];
 	double xx1, xx2; 
 	
 	[RNGenerator setCurrentGenerator:XNoiseGenID];
-
+	
 	xx1 = 1.0 + sin(0.04*M_PI*t) + _x2*_x1 + gengam(2.0, 3.0);
 	xx2 = _x2;
-
-	[next setDoubleValue:xx1 atRow:1UL column:1UL];
-	[next setDoubleValue:xx2 atRow:2UL column:1UL];
+	
+	[next doubleElements][0] = xx1;
+	[next doubleElements][1] = xx2;
 }
 
 - (void) getNextState: (MathMatrix *)next
-			   atTime: (double)t
+			 fromTime: (double)t0
+			   toTime: (double)t
 	 withCurrentState: (MathMatrix *)x
 			  control: (MathMatrix *)control {
-
-	double _x1 = [x doubleValueAtRow:1UL column:1UL];
-	double _x2 = [x doubleValueAtRow:2UL column:1UL];
+	
+	double _x1 = [x doubleElements][0];
+	double _x2 = [x doubleElements][1];
 	double xx1, xx2;
 	
 	[RNGenerator setCurrentGenerator:XNoiseGenID];
@@ -126,8 +134,8 @@
 	xx1 = 1.0 + sin(0.04*M_PI*t) + _x2*_x1 + gengam(2.0, 3.0);
 	xx2 = _x2;
 	
-	[next setDoubleValue:xx1 atRow:1UL column:1UL];
-	[next setDoubleValue:xx2 atRow:2UL column:1UL];
+	[next doubleElements][0] = xx1;
+	[next doubleElements][1] = xx2;
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
@@ -135,8 +143,8 @@
 				withCurrentState: (MathMatrix *)x {
 	
 	double m;
-	double _x1 = [x doubleValueAtRow:1UL column:1UL];
-	double _x2 = [x doubleValueAtRow:2UL column:1UL];
+	double _x1 = [x doubleElements][0];
+	double _x2 = [x doubleElements][1];
 	
 	if ( i <= 30 ) {
 		m = 0.2 * pow(_x1, 2.0);
@@ -144,13 +152,27 @@
 		m = -2.0 + _x1/2.0;
 	}
 		
-	[output setDoubleValue:m atRow:1UL column:1UL];
+	[output doubleElements][0] = m;
 }
 
 - (void) getNoiseFreeMeasurement: (MathMatrix *)output
 						  atTime: (double)t
 				withCurrentState: (MathMatrix *)x {
-	// not implemented
+	
+	// The equation switches after the 30th time step, which is found by
+	// comparing t with the time of that step (see
+	// getNoiseFreeMeasurements:atTime:withCurrentStates:count:stride:).
+	double *ts = [timeSpan doubleElements];
+	double _x1 = [x doubleElements][0];
+	double m;
+	
+	if ( [timeSpan count] <= 30UL || t <= ts[30] ) {
+		m = 0.2 * pow(_x1, 2.0);
+	} else {
+		m = -2.0 + _x1/2.0;
+	}
+	
+	[output doubleElements][0] = m;
 }
 
 - (double) probabilityOf: (MathMatrix *)output
@@ -158,8 +180,8 @@
 			 atTimeIndex: (unsigned)ti
 		  withParameters: (MathMatrix *)params {
 	
-	double y = [output doubleValueAtRow:1UL column:1UL];
-	double x = [state doubleValueAtRow:1UL column:1UL];
+	double y = [output doubleElements][0];
+	double x = [state doubleElements][0];
 	
 	if ( ti <= 30 ) {
 		y -= 0.2 * pow(x, 2.0);
@@ -184,16 +206,157 @@
 			 withPredictedMeasurement: (MathMatrix *)pMeasure {
 	
 	double m, pm;
-	MathMatrix* measure = [[MathMatrix alloc] initWithType:@"double" 
-													 width:1UL 
-													height:1UL];
 	
-	[Y getVector:measure atColumn:(index + 1UL)]; // since index is 0-based.
-	m = [measure doubleValueAtRow:1UL column:1UL];
-	pm = [pMeasure doubleValueAtRow:1UL column:1UL];
-	[measure release];
+	m = [Y doubleColumn:(index + 1UL)][0]; // since index is 0-based.
+	pm = [pMeasure doubleElements][0];
 	
 	return exp(-0.5 * pow((m - pm)/sigma, 2.0))/sigma;
 }
 
+// The measurements and the weights only read the parameters, and the
+// propagation draws from a counter-based stream, so all of them can be
+// evaluated concurrently.
+- (BOOL) isWeightingThreadSafe {
+	return YES;
+}
+
+- (BOOL) isPropagationThreadSafe {
+	return YES;
+}
+
+// Batch versions for the whole population of particles.
+// See GenericSystem.h for the layout of the blocks.
+- (void) getNextStates: (double *)next
+           atTimeIndex: (unsigned)i
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	
+	double *t = (double *)[timeSpan elements];
+	
+	[self getNextStates: next
+	           fromTime: t[i-1]
+	             toTime: t[i]
+	  withCurrentStates: x
+	              count: n
+	             stride: ld
+	            control: control];
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+					  atTimeIndex: (unsigned)i
+				withCurrentStates: (double *)x
+							count: (unsigned)n
+						   stride: (unsigned)ld {
+	
+	unsigned j;
+	
+	if ( i <= 30 ) {
+		for ( j = 0; j < n; j++ ) {
+			output[j] = 0.2 * x[j] * x[j];
+		}
+	} else {
+		for ( j = 0; j < n; j++ ) {
+			output[j] = -2.0 + x[j]/2.0;
+		}
+	}
+}
+
+- (void) importanceWeights: (double *)w
+               atTimeIndex: (unsigned)index
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	
+	// the index'th column of Y (index is 0-based)
+	[self importanceWeights: w
+	                 atTime: ((double *)[timeSpan elements])[index]
+	         forMeasurement: ((double *)[Y elements]) + index
+	      measurementStride: [Y width]
+	withPredictedMeasurements: pMeasure
+	                  count: n
+	                 stride: ld];
+}
+
+- (double) importanceWeightAtTime: (double)t
+                   forMeasurement: (MathMatrix *)y
+         withPredictedMeasurement: (MathMatrix *)pMeasure {
+	
+	double w;
+	
+	[self importanceWeights: &w
+	                 atTime: t
+	         forMeasurement: (double *)[y elements]
+	      measurementStride: 1UL
+	withPredictedMeasurements: (double *)[pMeasure elements]
+	                  count: 1UL
+	                 stride: 1UL];
+	return w;
+}
+
+- (void) getNextStates: (double *)next
+              fromTime: (double)t0
+                toTime: (double)t1
+     withCurrentStates: (double *)x
+                 count: (unsigned)n
+                stride: (unsigned)ld
+               control: (MathMatrix *)control {
+	
+	double drift = 1.0 + sin(0.04*M_PI*t1);
+	unsigned j;
+	unsigned offset = [RandomNumberGenerator particleOffset];
+	PhiloxStream stream;
+	
+	// gengam(2.0, 3.0), i.e., shape 3 and rate 2, from the stream
+	[RNGenerator getStream:&stream forSlot:XNoiseGenID atTime:t1];
+	for ( j = 0; j < n; j++ ) {
+		next[j] = drift + x[ld + j]*x[j]
+		+ PhiloxGammaAt(&stream, offset + j, 3.0, 2.0);
+		next[ld + j] = x[ld + j];
+	}
+}
+
+- (void) getNoiseFreeMeasurements: (double *)output
+                           atTime: (double)t
+                withCurrentStates: (double *)x
+                            count: (unsigned)n
+                           stride: (unsigned)ld {
+	
+	// The measurement equation switches after the 30th time step
+	// (see getNoiseFreeMeasurements:atTimeIndex:...).  Here, it is
+	// decided by comparing t with the time of that step.
+	double *ts = (double *)[timeSpan elements];
+	unsigned j;
+	
+	if ( [timeSpan count] <= 30UL || t <= ts[30] ) {
+		for ( j = 0; j < n; j++ ) {
+			output[j] = 0.2 * x[j] * x[j];
+		}
+	} else {
+		for ( j = 0; j < n; j++ ) {
+			output[j] = -2.0 + x[j]/2.0;
+		}
+	}
+}
+
+- (void) importanceWeights: (double *)w
+                    atTime: (double)t
+            forMeasurement: (double *)y
+         measurementStride: (unsigned)ldy
+ withPredictedMeasurements: (double *)pMeasure
+                     count: (unsigned)n
+                    stride: (unsigned)ld {
+	
+	double m = y[0];
+	double c = -0.5/(sigma*sigma);
+	double d;
+	unsigned j;
+	
+	for ( j = 0; j < n; j++ ) {
+		d = m - pMeasure[j];
+		w[j] = exp(c*d*d)/sigma;
+	}
+}
+
 @end
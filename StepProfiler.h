@@ -0,0 +1,136 @@
+//
+//  StepProfiler.h
+//  GenericParticleFilter
+//
+
+#import <Foundation/Foundation.h>
+
+//  Phases of a step of the particle filter
+enum {
+	PF_PHASE_PROPAGATE = 0,		// getNextStates...
+	PF_PHASE_WEIGHT,			// predicted measurements & importance weights
+	PF_PHASE_NORMALIZE,			// normalization of the weights & ESS
+	PF_PHASE_RESAMPLE,			// selection of the particles
+	PF_PHASE_ESTIMATE,			// estimateStatesAtIndex: (mean of particles)
+	PF_PHASE_NOTIFY,			// generation writer & delegate
+	PF_PHASE_COUNT
+};
+
+// What a step of the particle filter did and how long each phase took
+typedef struct {
+	unsigned index;				// (0-based) time index or online step
+	double time;				// time of the step
+	double seconds[PF_PHASE_COUNT];	// wall time of each phase
+	
+	unsigned propagationCalls;	// calls of the batch methods of the system
+	unsigned measurementCalls;
+	unsigned likelihoodCalls;
+	unsigned evaluations;		// particles per call, i.e., count
+	
+	double ess;					// effective sample size
+	BOOL isResampled;
+	unsigned distinctAncestors;	// particles with at least one child
+								// (count if not resampled)
+	unsigned nanWeights;		// likelihoods which are NaN
+	unsigned zeroWeights;		// likelihoods which are exactly 0
+} PFStepRecord;
+
+// seconds since an arbitrary point, from a monotonic clock
+double StepProfilerNow (void);
+
+//
+//  Per-phase instrumentation of the particle filter
+//
+//  ============================================================================
+//
+//  Hand a profiler to the filter with -[GenericParticleFilter setProfiler:]
+//  and the filter appends a PFStepRecord for every step after the initial
+//  one.  Without a profiler, the filter only tests a pointer per phase:
+//  it neither reads the clock nor scans the weights.
+//
+//  The records can be queried after (or during, on the thread of the
+//  filter) the run, or written to a trace file.
+//
+
+@interface StepProfiler : NSObject {
+@private
+	PFStepRecord *records;
+	unsigned stepCount;
+	unsigned capacity;
+}
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init;
+
+// designated initializer
+// n is the number of steps to allocate room for (it grows as needed).
+- (id) initWithCapacity: (unsigned)n;
+
+- (void) dealloc;
+
+
+// *****************************************************************************
+//
+//  RECORDING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Recording
+
+// Appends a zeroed record and returns it.
+// The pointer is valid until the next call or reset.
+- (PFStepRecord *) beginStepAtIndex: (unsigned)index
+                               time: (double)t;
+
+// removes all the records
+- (void) reset;
+
+
+// *****************************************************************************
+//
+//  QUERIES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Queries
+
+- (unsigned) stepCount;
+
+// i is 0-based in the order of the steps; NULL if out of range
+- (const PFStepRecord *) recordAtIndex: (unsigned)i;
+
+// total wall time of a phase over all the steps
+- (double) totalSecondsOfPhase: (unsigned)phase;
+
+// total wall time of all the phases over all the steps
+- (double) totalSeconds;
+
+// e.g., @"propagate"
++ (NSString *) nameOfPhase: (unsigned)phase;
+
+// A summary of the share of each phase and the counters
+- (NSString *) description;
+
+
+// *****************************************************************************
+//
+//  WRITING TO FILES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing to Files
+
+// Writes one tab separated line per step: index, time, the seconds of each
+// phase, the call counts, ESS, the resampling flag, the number of distinct
+// ancestors and the NaN and zero weight counts.  The first line, which
+// starts with '#', names the columns.  The path is used as it is.
+- (BOOL) writeTraceToFile: (NSString *)path;
+
+@end
@@ -0,0 +1,232 @@
+//
+//  StepProfiler.m
+//  GenericParticleFilter
+//
+
+#import "StepProfiler.h"
+
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#ifdef __APPLE__
+#import <mach/mach_time.h>
+#else
+#import <time.h>
+#endif
+
+#define CONST_DEFAULT_STEP_CAPACITY		256
+
+double StepProfilerNow (void) {
+#ifdef __APPLE__
+	static double secondsPerTick = 0.0;
+	mach_timebase_info_data_t info;
+	
+	if ( secondsPerTick == 0.0 ) {
+		mach_timebase_info(&info);
+		secondsPerTick = 1.0e-9 * (double)info.numer / (double)info.denom;
+	}
+	return secondsPerTick * (double)mach_absolute_time();
+#else
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1.0e-9 * (double)ts.tv_nsec;
+#endif
+}
+
+
+@implementation StepProfiler
+
+// *****************************************************************************
+//
+//  INITIALIZATIONS & DEALLOCATION
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Initializations & Deallocation
+
+- (id) init {
+	return [self initWithCapacity:CONST_DEFAULT_STEP_CAPACITY];
+}
+
+// designated initializer
+- (id) initWithCapacity: (unsigned)n {
+	if ( self = [super init] ) {
+		capacity = n ? n : 1UL;
+		records = (PFStepRecord *)malloc(capacity * sizeof(PFStepRecord));
+		if ( !records ) {
+			NSLog(@"Memory for the step profiler cannot be allocated.");
+			[self release];
+			return nil;
+		}
+	}
+	return self;
+}
+
+- (void) dealloc {
+	free(records);
+	[super dealloc];
+}
+
+
+// *****************************************************************************
+//
+//  RECORDING
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Recording
+
+- (PFStepRecord *) beginStepAtIndex: (unsigned)index
+                               time: (double)t {
+
+	PFStepRecord *record, *grown;
+	
+	if ( stepCount == capacity ) {
+		grown = (PFStepRecord *)realloc(records,
+		                                2 * capacity * sizeof(PFStepRecord));
+		if ( !grown ) {
+			NSLog(@"Memory for the step profiler cannot be allocated.");
+			return NULL;
+		}
+		records = grown;
+		capacity *= 2;
+	}
+	
+	record = records + stepCount++;
+	memset(record, 0, sizeof(PFStepRecord));
+	record -> index = index;
+	record -> time = t;
+	return record;
+}
+
+- (void) reset {
+	stepCount = 0UL;
+}
+
+
+// *****************************************************************************
+//
+//  QUERIES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Queries
+
+- (unsigned) stepCount {
+	return stepCount;
+}
+
+- (const PFStepRecord *) recordAtIndex: (unsigned)i {
+	return ( i < stepCount ) ? records + i : NULL;
+}
+
+- (double) totalSecondsOfPhase: (unsigned)phase {
+	double sum = 0.0;
+	unsigned i;
+	
+	if ( phase >= PF_PHASE_COUNT ) {
+		return 0.0;
+	}
+	for ( i = 0; i < stepCount; i++ ) {
+		sum += records[i].seconds[phase];
+	}
+	return sum;
+}
+
+- (double) totalSeconds {
+	double sum = 0.0;
+	unsigned k;
+	
+	for ( k = 0; k < PF_PHASE_COUNT; k++ ) {
+		sum += [self totalSecondsOfPhase:k];
+	}
+	return sum;
+}
+
++ (NSString *) nameOfPhase: (unsigned)phase {
+	switch ( phase ) {
+		case PF_PHASE_PROPAGATE:	return @"propagate";
+		case PF_PHASE_WEIGHT:		return @"weight";
+		case PF_PHASE_NORMALIZE:	return @"normalize";
+		case PF_PHASE_RESAMPLE:		return @"resample";
+		case PF_PHASE_ESTIMATE:		return @"estimate";
+		case PF_PHASE_NOTIFY:		return @"notify";
+	}
+	return @"unknown";
+}
+
+- (NSString *) description {
+	NSMutableString *desc = [NSMutableString string];
+	double total = [self totalSeconds], seconds, essSum = 0.0;
+	unsigned i, k, resampled = 0UL, nans = 0UL, zeros = 0UL;
+	
+	[desc appendFormat:@"%u steps, %g s\n", stepCount, total];
+	for ( k = 0; k < PF_PHASE_COUNT; k++ ) {
+		seconds = [self totalSecondsOfPhase:k];
+		[desc appendFormat:@"  %-10s %12g s  %5.1f %%\n",
+		 [[StepProfiler nameOfPhase:k] UTF8String], seconds,
+		 ( total > 0.0 ) ? 100.0 * seconds / total : 0.0];
+	}
+	
+	for ( i = 0; i < stepCount; i++ ) {
+		essSum += records[i].ess;
+		resampled += records[i].isResampled ? 1UL : 0UL;
+		nans += records[i].nanWeights;
+		zeros += records[i].zeroWeights;
+	}
+	[desc appendFormat:@"  mean ESS %g, %u resampled, %u NaN and %u zero weights",
+	 stepCount ? essSum / (double)stepCount : 0.0, resampled, nans, zeros];
+	
+	return desc;
+}
+
+
+// *****************************************************************************
+//
+//  WRITING TO FILES
+//
+// *****************************************************************************
+#pragma mark -
+#pragma mark Writing to Files
+
+- (BOOL) writeTraceToFile: (NSString *)path {
+	FILE *fp;
+	PFStepRecord *r;
+	unsigned i, k;
+	
+	fp = fopen([path fileSystemRepresentation], "w");
+	if ( !fp ) {
+		NSLog(@"Cannot open %@ for the trace.", path);
+		return NO;
+	}
+	
+	fprintf(fp, "# index\ttime");
+	for ( k = 0; k < PF_PHASE_COUNT; k++ ) {
+		fprintf(fp, "\t%s", [[StepProfiler nameOfPhase:k] UTF8String]);
+	}
+	fprintf(fp, "\tpropagation_calls\tmeasurement_calls\tlikelihood_calls"
+	        "\tevaluations\tess\tresampled\tdistinct_ancestors"
+	        "\tnan_weights\tzero_weights\n");
+	
+	for ( i = 0; i < stepCount; i++ ) {
+		r = records + i;
+		fprintf(fp, "%u\t%.17g", r -> index, r -> time);
+		for ( k = 0; k < PF_PHASE_COUNT; k++ ) {
+			fprintf(fp, "\t%.9f", r -> seconds[k]);
+		}
+		fprintf(fp, "\t%u\t%u\t%u\t%u\t%.17g\t%d\t%u\t%u\t%u\n",
+		        r -> propagationCalls, r -> measurementCalls,
+		        r -> likelihoodCalls, r -> evaluations, r -> ess,
+		        r -> isResampled ? 1 : 0, r -> distinctAncestors,
+		        r -> nanWeights, r -> zeroWeights);
+	}
+	
+	if ( fclose(fp) != 0 ) {
+		NSLog(@"Cannot write the trace to %@.", path);
+		return NO;
+	}
+	return YES;
+}
+
+@end
@@ -0,0 +1,193 @@
+/*
+ *  ThreadPool.c
+ *  GenericParticleFilter
+ *
+ */
+
+#include "ThreadPool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct ThreadPool {
+	unsigned threadCount;		/* including the calling thread */
+	pthread_t *threads;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t start;		/* signaled when a new loop is posted */
+	pthread_cond_t done;		/* signaled when the workers finished */
+	
+	unsigned long generation;	/* incremented for every loop */
+	unsigned pending;			/* workers which have not finished yet */
+	int shutdown;
+	
+	/* the loop being run */
+	ThreadPoolRangeFunction function;
+	void *context;
+	unsigned size;
+	unsigned chunkCount;
+	volatile unsigned nextChunk;
+};
+
+static void
+RunChunks (ThreadPool *pool) {
+	
+	unsigned chunk, begin, end;
+	
+	while ( 1 ) {
+		chunk = __sync_fetch_and_add(&(pool -> nextChunk), 1U);
+		if ( chunk >= pool -> chunkCount ) break;
+		
+		begin = (unsigned)(((unsigned long long)pool -> size * chunk)
+		                   / pool -> chunkCount);
+		end = (unsigned)(((unsigned long long)pool -> size * (chunk + 1))
+		                 / pool -> chunkCount);
+		if ( begin < end ) {
+			(pool -> function)(pool -> context, begin, end, chunk);
+		}
+	}
+}
+
+static void *
+Worker (void *arg) {
+	
+	ThreadPool *pool = (ThreadPool *)arg;
+	unsigned long seen = 0;
+	
+	while ( 1 ) {
+		pthread_mutex_lock(&(pool -> lock));
+		while ( !(pool -> shutdown) && pool -> generation == seen ) {
+			pthread_cond_wait(&(pool -> start), &(pool -> lock));
+		}
+		if ( pool -> shutdown ) {
+			pthread_mutex_unlock(&(pool -> lock));
+			break;
+		}
+		seen = pool -> generation;
+		pthread_mutex_unlock(&(pool -> lock));
+		
+		RunChunks(pool);
+		
+		pthread_mutex_lock(&(pool -> lock));
+		if ( --(pool -> pending) == 0 ) {
+			pthread_cond_signal(&(pool -> done));
+		}
+		pthread_mutex_unlock(&(pool -> lock));
+	}
+	return NULL;
+}
+
+ThreadPool *
+ThreadPoolCreate (unsigned threadCount) {
+	
+	unsigned i;
+	ThreadPool *pool;
+	
+	if ( threadCount < 1 ) threadCount = 1;
+	
+	pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+	if ( !pool ) return NULL;
+	
+	pool -> threads = (pthread_t *)calloc(threadCount, sizeof(pthread_t));
+	if ( !(pool -> threads) ) {
+		free(pool);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&(pool -> lock), NULL);
+	pthread_cond_init(&(pool -> start), NULL);
+	pthread_cond_init(&(pool -> done), NULL);
+	
+	/* the calling thread is the first one */
+	pool -> threadCount = 1;
+	for ( i = 1; i < threadCount; i++ ) {
+		if ( pthread_create(&(pool -> threads[i]), NULL, Worker, pool) != 0 ) {
+			break;
+		}
+		pool -> threadCount++;
+	}
+	
+	return pool;
+}
+
+void
+ThreadPoolDestroy (ThreadPool *pool) {
+	
+	unsigned i;
+	
+	if ( !pool ) return;
+	
+	pthread_mutex_lock(&(pool -> lock));
+	pool -> shutdown = 1;
+	pthread_cond_broadcast(&(pool -> start));
+	pthread_mutex_unlock(&(pool -> lock));
+	
+	for ( i = 1; i < pool -> threadCount; i++ ) {
+		pthread_join(pool -> threads[i], NULL);
+	}
+	
+	pthread_mutex_destroy(&(pool -> lock));
+	pthread_cond_destroy(&(pool -> start));
+	pthread_cond_destroy(&(pool -> done));
+	free(pool -> threads);
+	free(pool);
+}
+
+unsigned
+ThreadPoolThreadCount (ThreadPool *pool) {
+	
+	return pool ? pool -> threadCount : 1;
+}
+
+void
+ThreadPoolParallelFor (ThreadPool *pool,
+                       unsigned size,
+                       unsigned chunkCount,
+                       ThreadPoolRangeFunction function,
+                       void *context
+                       ) {
+	
+	unsigned chunk, begin, end;
+	
+	if ( size == 0 || chunkCount == 0 ) return;
+	
+	if ( !pool || pool -> threadCount == 1 || chunkCount == 1 ) {
+		/* serial: the chunks are run in order */
+		for ( chunk = 0; chunk < chunkCount; chunk++ ) {
+			begin = (unsigned)(((unsigned long long)size * chunk) / chunkCount);
+			end = (unsigned)(((unsigned long long)size * (chunk + 1)) / chunkCount);
+			if ( begin < end ) {
+				function(context, begin, end, chunk);
+			}
+		}
+		return;
+	}
+	
+	pthread_mutex_lock(&(pool -> lock));
+	pool -> function = function;
+	pool -> context = context;
+	pool -> size = size;
+	pool -> chunkCount = chunkCount;
+	pool -> nextChunk = 0;
+	pool -> pending = pool -> threadCount - 1;
+	pool -> generation++;
+	pthread_cond_broadcast(&(pool -> start));
+	pthread_mutex_unlock(&(pool -> lock));
+	
+	RunChunks(pool);
+	
+	pthread_mutex_lock(&(pool -> lock));
+	while ( pool -> pending > 0 ) {
+		pthread_cond_wait(&(pool -> done), &(pool -> lock));
+	}
+	pthread_mutex_unlock(&(pool -> lock));
+}
+
+unsigned
+ThreadPoolChunkCount (unsigned size,
+                      unsigned chunkSize
+                      ) {
+	
+	if ( chunkSize == 0 ) return 1;
+	return ( size + chunkSize - 1 ) / chunkSize;
+}
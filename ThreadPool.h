@@ -0,0 +1,84 @@
+/*
+ *  ThreadPool.h
+ *  GenericParticleFilter
+ *
+ *  A fixed size pool of POSIX threads which runs parallel loops over
+ *  index ranges, e.g., particles.
+ *
+ *  The range [0, size) is split into chunkCount chunks of (nearly) equal
+ *  length.  The chunks are handed out to the threads one at a time, so a
+ *  thread which finishes early takes the next chunk.  The thread calling
+ *  ThreadPoolParallelFor works on the chunks, too, and the function
+ *  returns after all the chunks are done.
+ *
+ *  Since the chunk boundaries depend only on size and chunkCount, not on
+ *  the number of threads, per-chunk results (e.g., partial sums indexed
+ *  by chunk) are reduced in the same order whatever the thread count is.
+ *
+ */
+
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	/* The function run for the chunk'th (0-based) chunk, [begin, end). */
+	typedef void (*ThreadPoolRangeFunction)(void *context,
+	                                        unsigned begin,
+	                                        unsigned end,
+	                                        unsigned chunk);
+	
+	typedef struct ThreadPool ThreadPool;
+	
+	/* threadCount includes the calling thread, i.e., threadCount - 1
+	 * threads are created.  Returns NULL on failure. */
+	ThreadPool *
+	ThreadPoolCreate (unsigned threadCount);
+	
+	void
+	ThreadPoolDestroy (ThreadPool *pool);
+	
+	/* 1 for a NULL pool */
+	unsigned
+	ThreadPoolThreadCount (ThreadPool *pool);
+	
+	/* The chunks are run in order on the calling thread if pool is NULL. */
+	void
+	ThreadPoolParallelFor (ThreadPool *pool,
+	                       unsigned size,
+	                       unsigned chunkCount,
+	                       ThreadPoolRangeFunction function,
+	                       void *context
+	                       );
+	
+	/* The number of chunks of at most chunkSize elements covering size */
+	unsigned
+	ThreadPoolChunkCount (unsigned size,
+	                      unsigned chunkSize
+	                      );
+	
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+
+/* Foundation must know that it is used by several threads before any
+ * other thread runs Objective-C code, e.g., the threads of a pool or a
+ * raw pthread.  Detaching a thread which does nothing switches it to that
+ * mode. */
+static inline void
+ThreadPoolEnterMultiThreadedMode (void) {
+	
+	if ( ![NSThread isMultiThreaded] ) {
+		[NSThread detachNewThreadSelector:@selector(self)
+		                         toTarget:[NSObject class]
+		                       withObject:nil];
+	}
+}
+#endif
+
+#endif